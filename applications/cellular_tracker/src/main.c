@@ -33,6 +33,11 @@
 #include "signalQualityTask.h"
 #include "locationTask.h"
 #include "cellScanTask.h"
+#include "taskProfile.h"
+#include "historyQuery.h"
+#include "driveTest.h"
+#include "backlogUpload.h"
+#include "adaptiveReporting.h"
 
 // Application name and version number is in the config.h file
 
@@ -43,7 +48,20 @@
 #define APP_CONTROL_TOPIC "AppControl"
 static callbackCommand_t callbacks[] = {
     {"SET_DWELL_TIME", setAppDwellTime},
-    {"SET_LOG_LEVEL", setAppLogLevel}
+    {"SET_LOG_LEVEL", setAppLogLevel},
+    {"SET_CONFIG", setAppConfig},
+    {"COMMIT_CONFIG", commitAppConfig},
+    {"CLEAR_CONFIG", clearAppConfig},
+    {"TASK_STATS", publishTaskStats},
+    {"START_TASK_STATS", startTaskStats},
+    {"STOP_TASK_STATS", stopTaskStats},
+    {"QUERY", queryHistory},
+    {"START_DRIVE_TEST", startDriveTest},
+    {"STOP_DRIVE_TEST", stopDriveTest},
+    {"UPLOAD", startBacklogUpload},
+    {"STOP_UPLOAD", stopBacklogUpload},
+    {"DATA_USAGE", publishDataUsage},
+    {"SET_POWER_STATE", setPowerStateCommand}
 };
 
 /// @brief The application function(s) which are run every appDwellTime
@@ -83,6 +101,7 @@ void main(void)
 
     // Set button two to point to the queueCellScan function
     setButtonTwoFunction(buttonTwo);
+    setButtonTwoLongPressFunction(toggleDriveTest);
 
     // Start the application loop with our app function
     runApplicationLoop(appFunction);
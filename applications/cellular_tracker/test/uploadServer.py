@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+#
+# Copyright 2022 u-blox
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+"""
+Local HTTP stand-in server for testing the UPLOAD command.
+
+Each chunk is POSTed to <path>?id=<IMEI>&file=<dir>/<name>&offset=<n>&total=<n>
+and is stored at its offset in <root>/<IMEI>/<dir>/<name>, when the offset is
+not past the end of what the server already has. The reply is always
+{"Offset":<stored size>}, so the device carries on from there.
+
+    python3 uploadServer.py [--port 8080] [--root uploads]
+
+Then set UPLOAD_SERVER to <this PC's address>:8080 on the device.
+"""
+
+import argparse
+import json
+import os
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+
+class UploadHandler(BaseHTTPRequestHandler):
+    root = "uploads"
+
+    def reply(self, status, body):
+        data = body.encode()
+        self.send_response(status)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def get_path(self, device, name):
+        # keep the files under the root, whatever the request says
+        parts = [p for p in f"{device}/{name}".split("/") if p not in ("", ".", "..")]
+        if len(parts) < 2:
+            return None
+        return os.path.join(self.root, *parts)
+
+    def do_POST(self):
+        query = parse_qs(urlparse(self.path).query)
+        length = int(self.headers.get("Content-Length", 0))
+        chunk = self.rfile.read(length)
+
+        try:
+            device = query["id"][0]
+            name = query["file"][0]
+            offset = int(query["offset"][0])
+        except (KeyError, ValueError):
+            self.reply(400, '{"Error":"id, file and offset are needed"}')
+            return
+
+        path = self.get_path(device, name)
+        if path is None:
+            self.reply(400, '{"Error":"Invalid file"}')
+            return
+
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        size = os.path.getsize(path) if os.path.exists(path) else 0
+
+        # a chunk past the end would leave a gap, so it is ignored and the
+        # device is told where to carry on from
+        if offset <= size:
+            with open(path, "r+b" if size > 0 else "wb") as file:
+                file.seek(offset)
+                file.write(chunk)
+            size = max(size, offset + len(chunk))
+
+        print(f"{device} {name}: {len(chunk)} bytes at {offset}, stored {size}")
+        self.reply(200, json.dumps({"Offset": size}, separators=(",", ":")))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="HTTP stand-in server for the UPLOAD command")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--root", default="uploads", help="directory the files are stored in")
+    args = parser.parse_args()
+
+    UploadHandler.root = args.root
+    server = ThreadingHTTPServer(("", args.port), UploadHandler)
+    print(f"Storing uploads in {os.path.abspath(args.root)}, listening on port {args.port}")
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
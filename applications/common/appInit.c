@@ -21,6 +21,14 @@
 #include "ext_fs.h"
 #include "leds.h"
 #include "buttons.h"
+#include "timerWheel.h"
+#include "radioCache.h"
+#include "measurement.h"
+#include "timeSeries.h"
+#include "udpTelemetry.h"
+#include "dataBudget.h"
+#include "mqttTask.h"
+#include "deadband.h"
 
 /* ----------------------------------------------------------------
  * TYPE DEFINITIONS
@@ -40,10 +48,17 @@ typedef enum {
 #define LOG_FILENAME "log.csv"
 #define MQTT_CREDENTIALS_FILENAME "mqttCredentials.txt"
 
+// Configuration set remotely with SET_CONFIG/COMMIT_CONFIG, which overrides
+// the values in the other configuration files
+#define REMOTE_CONFIG_FILENAME "appConfig.txt"
+#define REMOTE_CONFIG_VALUE_SIZE 101
+
 // Dwell time of the main loop activity, pause period until the loop runs again
 #define APP_DWELL_TIME_MS_MINIMUM 5000
 #define APP_DWELL_TIME_MS_DEFAULT APP_DWELL_TIME_MS_MINIMUM;
-#define APP_DWELL_TICK_MS 50
+
+// A button held for this long is a long press
+#define BUTTON_LONG_PRESS_MS 2000
 
 /* ----------------------------------------------------------------
  * STATIC VARIABLES
@@ -56,6 +71,12 @@ static buttonNumber_t pressedButton = NO_BUTTON;
 
 static int32_t appDwellTimeMS = 60000;
 
+// Set by the adaptive reporting, 0 to use appDwellTimeMS
+static atomic_t adaptedAppDwellTimeMS = ATOMIC_INIT(0);
+
+// Given to wake the main loop from its dwell, when exiting or the dwell time changes
+static uPortSemaphoreHandle_t appDwellSemaphore = NULL;
+
 // This flag will pause the main application loop
 static bool pauseMainLoopIndicator = false;
 
@@ -82,6 +103,7 @@ uDeviceHandle_t gDeviceHandle;
 bool gExitApp = false;
 
 void (*buttonTwoFunc)(void) = NULL;
+void (*buttonTwoLongFunc)(void) = NULL;
 
 // reference to our mqtt credentials which are used for the application's publish/subscription
 extern const char *mqttCredentials[];
@@ -91,6 +113,31 @@ extern int32_t mqttCredentialsSize;
  * STATIC FUNCTIONS
  * -------------------------------------------------------------- */
 
+/// @brief Wakes the main application loop from its dwell
+static void wakeAppLoop(void)
+{
+    if (appDwellSemaphore != NULL)
+        uPortSemaphoreGive(appDwellSemaphore);
+}
+
+/// @brief Returns the main loop dwell time, as adapted by the adaptive
+///        reporting if it is on
+static int32_t getAppDwellTimeMs(void)
+{
+    int32_t adapted = (int32_t)atomic_get(&adaptedAppDwellTimeMS);
+
+    return adapted > 0 ? adapted : appDwellTimeMS;
+}
+
+/// @brief Flags the application to exit and wakes all the loops so they
+///        see the flag straight away rather than at the end of their dwell
+static void exitApplication(void)
+{
+    gExitApp = true;
+    wakeAllTasks();
+    wakeAppLoop();
+}
+
 /// @brief Function to check for a held button at start up.
 /// @return The button that was held at start up.
 static buttonNumber_t checkStartButton(void)
@@ -151,12 +198,16 @@ static void button_pressed(int buttonNo, uint32_t holdTime)
             // EXIT APPLICATION 
             case BUTTON_1:
                 writeLog("Exit button pressed, closing down... Please wait for the RED LED to go out...");
-                gExitApp = true;
+                exitApplication();
                 break;
 
-            // BUTTON #2 action is set by the application via setButtonTwoFunction()
+            // BUTTON #2 action is set by the application via setButtonTwoFunction(),
+            // and the long press action via setButtonTwoLongPressFunction()
             case BUTTON_2:                
-                if (buttonTwoFunc != NULL) {
+                if (holdTime >= BUTTON_LONG_PRESS_MS && buttonTwoLongFunc != NULL) {
+                    writeLog("Button #2 long pressed");
+                    buttonTwoLongFunc();
+                } else if (buttonTwoFunc != NULL) {
                     writeLog("Button #2 pressed");
                     buttonTwoFunc();
                 } else {
@@ -302,6 +353,22 @@ static bool initXplrDevice(void)
     return true;
 }
 
+/// @brief Applies the APP_ configuration values, if they are present
+static void applyAppConfig(void)
+{
+    int32_t value;
+
+    if (isConfigPresent("APP_DWELL_TIME") && setIntParamFromConfig("APP_DWELL_TIME", &value)) {
+        appDwellTimeMS = value;
+        writeLog("Setting App Dwell Time from configuration to: %d", value);
+        wakeAppLoop();
+    }
+
+    if (isConfigPresent("APP_LOG_LEVEL") && setIntParamFromConfig("APP_LOG_LEVEL", &value)) {
+        setLogLevel((logLevels_t) value);
+    }
+}
+
 static bool loadConfigFiles(void)
 {
     // Save the mqtt credentials file (if present)
@@ -323,11 +390,18 @@ static bool loadConfigFiles(void)
     loadConfigFile(MQTT_CREDENTIALS_FILENAME);
 
     // Note: More configuration files can be loaded.
-    // Everything is appended to the config list array.
+    // Keys in later files override the same keys in earlier files.
+    if (extFsFileExists(extFsPath(REMOTE_CONFIG_FILENAME))) {
+        printInfo("Loading remote configuration...");
+        loadConfigFile(REMOTE_CONFIG_FILENAME);
+    }
 
     // this will only print if logging is set to DEBUG or higher - security!
     printConfiguration();
 
+    applyAppConfig();
+    registerConfigChangedCallback("APP_", applyAppConfig);
+
     return true;
 }
 
@@ -338,18 +412,25 @@ static void displayAppVersion()
     writeInfo("**************************************************\n");
 }
 
-/// @brief Dwells for appDwellTimeMS time, and exits if this time changes
+/// @brief Dwells until the next (adapted) dwell time boundary, and exits if this
+///        time changes or the application is exiting. Woken by wakeAppLoop().
+///        The boundary is aligned with the periodic task jobs, so the main
+///        loop's radio/GNSS requests happen in the same window as theirs.
 static void dwellAppLoop(void)
 {
-    int32_t tick = 0;
-    int32_t dwellTimeMS = appDwellTimeMS;
-
-    do
-    {
-        uPortTaskBlock(APP_DWELL_TICK_MS);
-        tick = tick + APP_DWELL_TICK_MS;
-    } while((tick < dwellTimeMS) &&
-            (dwellTimeMS == appDwellTimeMS));
+    int32_t appDwellTime = getAppDwellTimeMs();
+    int32_t dwellTimeMS = getAlignedDelayMs(appDwellTime);
+    int32_t startTime = uPortGetTickTimeMs();
+    int32_t remainingMS = dwellTimeMS;
+
+    while (!gExitApp && remainingMS > 0 && appDwellTime == getAppDwellTimeMs()) {
+        if (appDwellSemaphore != NULL)
+            uPortSemaphoreTryTake(appDwellSemaphore, remainingMS);
+        else
+            uPortTaskBlock(remainingMS);
+
+        remainingMS = dwellTimeMS - (uPortGetTickTimeMs() - startTime);
+    }
 
     printDebug("*** Application Tick ***\n");
 }
@@ -372,10 +453,28 @@ int32_t setAppDwellTime(commandParamsList_t *params)
 
     appDwellTimeMS = timeMS;
     writeLog("Setting App Dwell Time to: %d\n", timeMS);
+    wakeAppLoop();
 
     return U_ERROR_COMMON_SUCCESS;
 }
 
+/// @brief Returns the main loop dwell time set by SET_DWELL_TIME or the
+///        APP_DWELL_TIME configuration, before it is adapted
+/// @return The dwell time in milliseconds
+int32_t getBaseAppDwellTime(void)
+{
+    return appDwellTimeMS;
+}
+
+/// @brief Sets the adapted main loop dwell time, and wakes the main loop
+///        so it dwells for the new time
+/// @param timeMS The adapted dwell time, 0 to go back to the base dwell time
+void setAdaptedAppDwellTime(int32_t timeMS)
+{
+    if ((int32_t)atomic_set(&adaptedAppDwellTimeMS, timeMS) != timeMS)
+        wakeAppLoop();
+}
+
 /// @brief Sets the application logging level
 /// @param params The log level parameter for the dwell time
 /// @return 0 if successful, or failure if invalid parameters
@@ -393,6 +492,55 @@ int32_t setAppLogLevel(commandParamsList_t *params)
     return U_ERROR_COMMON_SUCCESS;
 }
 
+/// @brief Stages a configuration key/value to be committed with COMMIT_CONFIG
+/// @param params The configuration key and value parameters
+/// @return 0 if successful, or failure if invalid parameters
+int32_t setAppConfig(commandParamsList_t *params)
+{
+    if (params == NULL || params->pNext == NULL || params->pNext->pNext == NULL) {
+        writeWarn("SET_CONFIG needs a configuration key and value");
+        return U_ERROR_COMMON_INVALID_PARAMETER;
+    }
+
+    const char *key = params->pNext->parameter;
+
+    // The command parser also splits on ':', so join the value
+    // parts back together for values like "host:port"
+    char value[REMOTE_CONFIG_VALUE_SIZE];
+    size_t len = 0;
+    value[0] = 0;
+    for(commandParamsList_t *param = params->pNext->pNext; param != NULL; param = param->pNext) {
+        int count = snprintf(value + len, sizeof(value) - len, "%s%s", len > 0 ? ":" : "", param->parameter);
+        if (count < 0 || count >= sizeof(value) - len) {
+            writeWarn("SET_CONFIG value for '%s' is too long", key);
+            return U_ERROR_COMMON_INVALID_PARAMETER;
+        }
+
+        len += count;
+    }
+
+    return stageConfig(key, value);
+}
+
+/// @brief Writes the staged configuration to the file system and applies it
+/// @param params Not used
+/// @return 0 if successful, negative on failure
+int32_t commitAppConfig(commandParamsList_t *params)
+{
+    return commitConfig(REMOTE_CONFIG_FILENAME);
+}
+
+/// @brief Discards the staged configuration
+/// @param params Not used
+/// @return 0 if successful
+int32_t clearAppConfig(commandParamsList_t *params)
+{
+    clearStagedConfig();
+    writeLog("Staged configuration cleared");
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
 /// @brief Sets the function which handles the Button #2 function
 /// @param func The function pointer for button #2 code
 void setButtonTwoFunction(void (*func)(void))
@@ -400,6 +548,13 @@ void setButtonTwoFunction(void (*func)(void))
     buttonTwoFunc = func;
 }
 
+/// @brief Sets the function which handles a long press of Button #2
+/// @param func The function pointer for the button #2 long press code
+void setButtonTwoLongPressFunction(void (*func)(void))
+{
+    buttonTwoLongFunc = func;
+}
+
 /// @brief Method of pausing the running of the main loop. 
 ///        Useful for when there are other long running activities
 ///        which need to stop the main loop
@@ -430,7 +585,7 @@ void runApplicationLoop(bool (*appFunc)(void))
         }
 
         if (!appFunc()) {
-            gExitApp = true;
+            exitApplication();
             writeInfo("Application function stopped the app loop");
         }
     }
@@ -441,7 +596,7 @@ void runApplicationLoop(bool (*appFunc)(void))
 void finalize(applicationStates_t appState)
 {
     gAppStatus = appState;
-    gExitApp = true;
+    exitApplication();
 
     waitForAllTasksToStop();
 
@@ -449,6 +604,9 @@ void finalize(applicationStates_t appState)
     SET_BLUE_LED;
     stopAndWait(NETWORK_REG_TASK);
 
+    flushTimeSeries();
+    saveDataUsage();
+
     writeLog("Application Finished.");
 
     closeLogFile(true);
@@ -472,9 +630,73 @@ bool startupFramework(void)
 
     displayAppVersion();
 
+    // the configuration is read and changed from several threads
+    errorCode = initConfigUtils();
+    if (errorCode != 0) {
+        printFatal("* Failed to create the configuration mutex (%d)", errorCode);
+        return false;
+    }
+
+    errorCode = uPortSemaphoreCreate(&appDwellSemaphore, 0, 1);
+    if (errorCode != 0) {
+        printFatal("* Failed to create the application dwell semaphore (%d)", errorCode);
+        return false;
+    }
+
     if (!loadConfigFiles())
         return false;
 
+    // the app tasks' jobs and messages run on the worker pool
+    errorCode = initWorkerPool();
+    if (errorCode != 0) {
+        writeFatal("* Failed to start the worker pool - not running application!");
+        return false;
+    }
+
+    // the radio parameters and operator information are shared by the tasks
+    errorCode = initRadioCache();
+    if (errorCode != 0) {
+        writeFatal("* Failed to initialise the radio cache - not running application!");
+        return false;
+    }
+
+    // the uplink data usage is counted, and limited to the data budget
+    errorCode = initDataBudget();
+    if (errorCode != 0)
+        writeError("* Failed to initialise the data budget (%d)", errorCode);
+
+    // the tasks' measurements are published through the registered sinks
+    errorCode = initMeasurements();
+    if (errorCode != 0) {
+        writeFatal("* Failed to initialise the measurement sinks - not running application!");
+        return false;
+    }
+
+    // the tasks subscribe to their topics while they are initialised in
+    // parallel, so the subscription lock is created before them
+    errorCode = initMQTTSubscriptions();
+    if (errorCode != 0) {
+        writeFatal("* Failed to initialise the MQTT subscriptions - not running application!");
+        return false;
+    }
+
+    // the deadband reporters are registered by the tasks in parallel too
+    errorCode = initDeadband();
+    if (errorCode != 0) {
+        writeFatal("* Failed to initialise the deadband reporting - not running application!");
+        return false;
+    }
+
+    // the measurement history is kept on the file system
+    errorCode = initTimeSeries();
+    if (errorCode != 0)
+        writeError("* Failed to initialise the measurement history (%d)", errorCode);
+
+    // the measurements can be sent as UDP telemetry instead of MQTT
+    errorCode = initUdpTelemetry();
+    if (errorCode != 0)
+        writeError("* Failed to initialise the UDP telemetry (%d)", errorCode);
+
     errorCode = initSingleTask(LED_TASK);
     if (errorCode < 0) {
         writeFatal("* Failed to initialise LED task - not running application!");
@@ -21,9 +21,16 @@
 int32_t getSerialNumber(void);
 
 int32_t setAppDwellTime(commandParamsList_t *params);
+int32_t getBaseAppDwellTime(void);
+void setAdaptedAppDwellTime(int32_t timeMS);
 int32_t setAppLogLevel(commandParamsList_t *params);
 
+int32_t setAppConfig(commandParamsList_t *params);
+int32_t commitAppConfig(commandParamsList_t *params);
+int32_t clearAppConfig(commandParamsList_t *params);
+
 void setButtonTwoFunction(void (*func)(void));
+void setButtonTwoLongPressFunction(void (*func)(void));
 void runApplicationLoop(bool (*appFunc)(void));
 void pauseMainLoop(bool state);
 
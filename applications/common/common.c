@@ -31,33 +31,6 @@
 /* ----------------------------------------------------------------
  * PUBLIC FUNCTIONS
  * -------------------------------------------------------------- */
-/// @brief Checks if the mutex is locked/running
-/// @param mutex the mutex to check
-/// @return false if it not locked/running, true if it is locked/running.
-bool isMutexLocked(uPortMutexHandle_t mutex)
-{
-    if(mutex == NULL) {
-        return false;
-    }
-
-    int32_t result = uPortMutexTryLock(mutex, 0);
-    if (result != 0)
-    {
-        return true; // Can't get a lock, so it must be running
-    }
-
-    // we have locked the mutex, so release we need to release it
-    if (uPortMutexUnlock(mutex) != 0) {
-        printFatal("Failed to release mutex from lock check!!!");
-        // now you've done it. You've tested the mutex lock
-        // by locking it and now can't unlock it!!
-        return true;
-    }
-
-    // As we could get a lock, the task is demeed "not running"
-    return false;
-}
-
 /// @brief Duplicates a string via malloc - remember to free()!
 /// @param src the string source
 /// @returns pointer to the duplicated string, or NULL
@@ -141,12 +114,19 @@ void freeParams(commandParamsList_t *item)
     uPortFree(item);
 }
 
+/// @brief Gets a numeric command parameter, within a range
+/// @param params The command and its parameters, the command is index 0
+/// @param index The index of the parameter
+/// @param minValue The value returned for a smaller value
+/// @param maxValue The value returned for a larger value
+/// @param defValue The value returned when there is no such parameter
+/// @return The value of the parameter
 int32_t getParamValue(commandParamsList_t *params, size_t index, int32_t minValue, int32_t maxValue, int32_t defValue)
 {
     char *ptr;
     commandParamsList_t *param = params;
     for(int i=0; i<index && param != NULL; i++)
-        param = params->pNext;
+        param = param->pNext;
 
     if (param == NULL)
         return defValue;
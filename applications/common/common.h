@@ -33,6 +33,7 @@
 #include "ubxlib.h"
 #include "configUtils.h"
 #include "log.h"
+#include "workerPool.h"
 
 #include "kernel.h"
 
@@ -137,7 +138,6 @@ extern int64_t unixNetworkTime;
 /* ----------------------------------------------------------------
  * PUBLIC FUNCTIONS
  * -------------------------------------------------------------- */
-bool isMutexLocked(uPortMutexHandle_t mutex);
 char *uStrDup(const char *src);
 void *uMemDup(const void *data, size_t len);
 
@@ -32,6 +32,15 @@
 // delimiters are ' ' (space) and '\n' (newline)
 #define CONFIG_DELIMITERS " \n"
 
+#define CONFIG_KEY_MAX_LENGTH 32
+#define CONFIG_VALUE_MAX_LENGTH (CONFIG_VALUE_SIZE - 1)
+
+// one or two for each task and common module which is configured at runtime
+#define MAX_CONFIG_CHANGED_CALLBACKS 24
+
+// suffix of the temporary file written before it replaces the real one
+#define CONFIG_TEMP_FILE_SUFFIX ".tmp"
+
 /* ----------------------------------------------------------------
  * TYPE DEFINITIONS
  * -------------------------------------------------------------- */
@@ -41,33 +50,175 @@ typedef struct APP_CONFIG_LIST {
     struct APP_CONFIG_LIST *pNext;
 } appConfigList_t;
 
+typedef enum {
+    CONFIG_TEXT,
+    CONFIG_INT,
+    CONFIG_BOOL
+} configValueType_t;
+
+/// @brief Validation rule for a configuration key (or key prefix)
+typedef struct {
+    const char *key;
+    bool isPrefix;
+    configValueType_t type;
+    int32_t minValue;
+    int32_t maxValue;
+} configRule_t;
+
+typedef struct {
+    const char *keyPrefix;
+    configChangedCallback_t callback;
+} configChangedCallbackInfo_t;
+
 /* ----------------------------------------------------------------
  * STATIC VARIABLES
  * -------------------------------------------------------------- */
 static struct fs_file_t configFile;
+
+// protects the configuration, staged and callback lists, the values are
+// only copied out while it is held, as a commit frees the old values
+static uPortMutexHandle_t configMutex = NULL;
+
 static appConfigList_t *configList;
 
+// key/values received by SET_CONFIG, waiting for COMMIT_CONFIG
+static appConfigList_t *stagedConfigList;
+
+static configChangedCallbackInfo_t configChangedCallbacks[MAX_CONFIG_CHANGED_CALLBACKS];
+static int32_t configChangedCallbackCount = 0;
+
+/// Keys that can be set remotely and how their values are checked.
+/// Keys not listed here can still be changed if they are already
+/// present in the loaded configuration, as free text.
+static const configRule_t configRules[] = {
+    {"MQTT_TYPE",                   false,  CONFIG_TEXT,    0, 0},
+    {"MQTT_BROKER_NAME",            false,  CONFIG_TEXT,    0, 0},
+    {"MQTT_USERNAME",               false,  CONFIG_TEXT,    0, 0},
+    {"MQTT_PASSWORD",               false,  CONFIG_TEXT,    0, 0},
+    {"MQTT_CLIENTID",               false,  CONFIG_TEXT,    0, 0},
+    {"MQTT_KEEPALIVE",              false,  CONFIG_BOOL,    0, 0},
+    {"MQTT_TIMEOUT",                false,  CONFIG_INT,     0, 65535},
+    {"MQTT_SECURITY",               false,  CONFIG_BOOL,    0, 0},
+    {"SECURITY_CERT_VALID_LEVEL",   false,  CONFIG_INT,     0, 3},
+    {"SECURITY_TLS_VERSION",        false,  CONFIG_INT,     0, 3},
+    {"SECURITY_CIPHER_SUITE",       false,  CONFIG_INT,     0, 0xFFFF},
+    {"SECURITY_CLIENT_NAME",        false,  CONFIG_TEXT,    0, 0},
+    {"SECURITY_CLIENT_KEY",         false,  CONFIG_TEXT,    0, 0},
+    {"SECURITY_SERVER_NAME_IND",    false,  CONFIG_TEXT,    0, 0},
+    {"APP_DWELL_TIME",              false,  CONFIG_INT,     5000, 60000},
+    {"APP_LOG_LEVEL",               false,  CONFIG_INT,     0, 5},
+    {"APP_STATS_INTERVAL",          false,  CONFIG_INT,     0, 3600},
+    {"TASK_DWELL_",                 true,   CONFIG_INT,     TASK_DWELL_MIN_SECS, TASK_DWELL_MAX_SECS},
+    {"SIGNAL_REPORT_INTERVAL",      false,  CONFIG_INT,     0, 3600},
+    {"DEADBAND_",                   true,   CONFIG_INT,     0, 100000},
+    {"HEARTBEAT_",                  true,   CONFIG_INT,     0, 86400},
+    {"LOCATION_",                   true,   CONFIG_INT,     0, 86400},
+    {"GEOFENCE_DWELL_TIME",         false,  CONFIG_INT,     0, 86400},
+    {"TRACK_UPLOAD_INTERVAL",       false,  CONFIG_INT,     0, 86400},
+    {"TRACK_TOLERANCE",             false,  CONFIG_INT,     1, 1000},
+    {"VIBRATION_RATE",              false,  CONFIG_INT,     0, 400},
+    {"VIBRATION_SHOCK_THRESHOLD",   false,  CONFIG_INT,     0, 100000},
+    {"HISTORY_MAX_KB",              false,  CONFIG_INT,     0, 2048},
+    {"HISTORY_RETENTION_DAYS",      false,  CONFIG_INT,     0, 3650},
+    {"UPLOAD_SERVER",               false,  CONFIG_TEXT,    0, 0},
+    {"UPLOAD_PATH",                 false,  CONFIG_TEXT,    0, 0},
+    {"UPLOAD_USERNAME",             false,  CONFIG_TEXT,    0, 0},
+    {"UPLOAD_PASSWORD",             false,  CONFIG_TEXT,    0, 0},
+    {"UPLOAD_SECURITY",             false,  CONFIG_BOOL,    0, 0},
+    {"UPLOAD_CHUNK_KB",             false,  CONFIG_INT,     1, 16},
+    {"TELEMETRY_UDP_SERVER",        false,  CONFIG_TEXT,    0, 0},
+    {"TELEMETRY_UDP_BATCH",         false,  CONFIG_INT,     1, 32},
+    {"BUDGET_",                     true,   CONFIG_INT,     0, 10000000},
+    {"ADAPTIVE_REPORTING",          false,  CONFIG_BOOL,    0, 0},
+    {"ADAPTIVE_MIN_SECS",           false,  CONFIG_INT,     1, 3600},
+    {"ADAPTIVE_MAX_SECS",           false,  CONFIG_INT,     1, 86400},
+    {"ADAPTIVE_POOR_RSRP",          false,  CONFIG_INT,     -140, -44},
+    {"ADAPTIVE_LOW_BATTERY",        false,  CONFIG_INT,     1, 99},
+};
+
 /* ----------------------------------------------------------------
  * STATIC PRIVATE FUNCTIONS
  * -------------------------------------------------------------- */
-static appConfigList_t *createConfigKVP(char *key, char *value) {
+static appConfigList_t *createConfigKVP(const char *key, const char *value) {
     appConfigList_t *newKVP = (appConfigList_t *)pUPortMalloc(sizeof(appConfigList_t));
     if (newKVP == NULL) {
         writeError("Failed to allocate memory for new KeyValuePair config parameter");
         return NULL;
     }
 
-    newKVP->key = key;
-    newKVP->value = value;
+    newKVP->key = uStrDup(key);
+    newKVP->value = uStrDup(value);
     newKVP->pNext = NULL;
 
+    if (newKVP->key == NULL || newKVP->value == NULL) {
+        writeError("Failed to allocate memory for new KeyValuePair config parameter");
+        uPortFree(newKVP->key);
+        uPortFree(newKVP->value);
+        uPortFree(newKVP);
+        return NULL;
+    }
+
     return newKVP;
 }
 
+static void freeConfigList(appConfigList_t *kvp)
+{
+    while(kvp != NULL) {
+        appConfigList_t *next = kvp->pNext;
+        uPortFree(kvp->key);
+        uPortFree(kvp->value);
+        uPortFree(kvp);
+        kvp = next;
+    }
+}
+
+static appConfigList_t *findConfigKVP(appConfigList_t *list, const char *key)
+{
+    for(appConfigList_t *kvp = list; kvp != NULL; kvp=kvp->pNext) {
+        if (strcmp(kvp->key, key) == 0)
+            return kvp;
+    }
+
+    return NULL;
+}
+
+/// @brief Sets the key to the value in the list, adding the key if it is not there yet
+/// @return 1 if the value changed, 0 if it was the same, negative on failure
+static int32_t setConfigKVP(appConfigList_t **head, const char *key, const char *value)
+{
+    appConfigList_t *kvp = findConfigKVP(*head, key);
+    if (kvp != NULL) {
+        if (strcmp(kvp->value, value) == 0)
+            return 0;
+
+        char *newValue = uStrDup(value);
+        if (newValue == NULL)
+            return U_ERROR_COMMON_NO_MEMORY;
+
+        uPortFree(kvp->value);
+        kvp->value = newValue;
+        return 1;
+    }
+
+    kvp = createConfigKVP(key, value);
+    if (kvp == NULL)
+        return U_ERROR_COMMON_NO_MEMORY;
+
+    // append, so the list keeps the order of the file(s)
+    appConfigList_t **tail = head;
+    while(*tail != NULL)
+        tail = &(*tail)->pNext;
+    *tail = kvp;
+
+    return 1;
+}
+
+/// @brief Parses the configuration text into the list. Keys which are
+/// already in the list have their value replaced, so later files override
+/// earlier ones.
 static size_t parseConfiguration(char *configText, appConfigList_t **head)
 {
     size_t count = 0;
-    appConfigList_t *current, *newNode;
 
     do {
         char *key = strtok_r(configText, CONFIG_DELIMITERS, &configText);
@@ -76,24 +227,168 @@ static size_t parseConfiguration(char *configText, appConfigList_t **head)
             break;
         }
 
-        newNode = createConfigKVP(key, value);
-        if (newNode == NULL)
+        if (setConfigKVP(head, key, value) < 0)
             break;
 
-        if(count == 0) {
-            *head = newNode;
-            current = *head;
-        } else {
-            current->pNext = newNode;
-            current = current->pNext;
-        }
-
         count++;
     } while(true);
 
     return count;
 }
 
+/// @brief Reads a configuration file into the list
+/// @param path The full path of the configuration file
+/// @param head The list to add the configuration to
+/// @return 0 on success, negative on failure
+static int32_t readConfigFile(const char *path, appConfigList_t **head)
+{
+    int32_t success;
+    int32_t errorCode = U_ERROR_COMMON_SUCCESS;
+    bool fileOpen = false;
+
+    char *configText = NULL;
+
+    size_t fileSize;
+    if (!extFsFileSize(path, &fileSize)) {
+        writeError("Failed to get filesize of configuration file '%s'", path);
+        errorCode = U_ERROR_COMMON_NOT_FOUND;
+        goto cleanUp;
+    }
+
+    // plus one for the null terminator so the text can be tokenised
+    configText = (char *)pUPortMalloc(fileSize + 1);
+    if (configText == NULL) {
+        writeError("Failed to allocate memory for loading in configuration file, size: %d", fileSize);
+        errorCode = U_ERROR_COMMON_NO_MEMORY;
+        goto cleanUp;
+    }
+
+    fs_file_t_init(&configFile);
+    success = fs_open(&configFile, path, FS_O_READ);
+    if (success < 0) {
+        writeError("Failed to open configuration file: %d", success);
+        errorCode = U_ERROR_COMMON_NOT_FOUND;
+        goto cleanUp;
+    }
+    fileOpen = true;
+
+    ssize_t count;
+    size_t total = 0;
+    while(total < fileSize &&
+            (count = fs_read(&configFile, configText + total, MIN(FILE_READ_BUFFER, fileSize - total))) > 0) {
+        total += count;
+    }
+    configText[total] = 0;
+
+    parseConfiguration(configText, head);
+
+cleanUp:
+    if (fileOpen)
+        fs_close(&configFile);
+
+    // the parsed key/values are copies, so the text is no longer needed
+    uPortFree(configText);
+
+    return errorCode;
+}
+
+static bool isValidConfigText(const char *text, size_t maxLength)
+{
+    size_t len = strlen(text);
+    if (len == 0 || len > maxLength)
+        return false;
+
+    for(size_t i=0; i<len; i++) {
+        // no spaces, newlines or control characters as these would
+        // break the configuration file format
+        if (text[i] <= ' ' || text[i] > '~')
+            return false;
+    }
+
+    return true;
+}
+
+static bool isValidConfigKey(const char *key)
+{
+    if (!isValidConfigText(key, CONFIG_KEY_MAX_LENGTH))
+        return false;
+
+    for(const char *c = key; *c != 0; c++) {
+        if (!((*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || *c == '_'))
+            return false;
+    }
+
+    return true;
+}
+
+static const configRule_t *getConfigRule(const char *key)
+{
+    for(int i=0; i<NUM_ELEMENTS(configRules); i++) {
+        const configRule_t *rule = &configRules[i];
+        if (rule->isPrefix) {
+            if (strncmp(key, rule->key, strlen(rule->key)) == 0)
+                return rule;
+        } else {
+            if (strcmp(key, rule->key) == 0)
+                return rule;
+        }
+    }
+
+    return NULL;
+}
+
+static int32_t validateConfig(const char *key, const char *value)
+{
+    if (!isValidConfigKey(key)) {
+        writeWarn("Invalid configuration key '%s'", key);
+        return U_ERROR_COMMON_INVALID_PARAMETER;
+    }
+
+    if (!isValidConfigText(value, CONFIG_VALUE_MAX_LENGTH)) {
+        writeWarn("Invalid configuration value for '%s'", key);
+        return U_ERROR_COMMON_INVALID_PARAMETER;
+    }
+
+    const configRule_t *rule = getConfigRule(key);
+    if (rule == NULL) {
+        if (findConfigKVP(configList, key) == NULL) {
+            writeWarn("Unknown configuration key '%s'", key);
+            return U_ERROR_COMMON_NOT_FOUND;
+        }
+
+        return U_ERROR_COMMON_SUCCESS;
+    }
+
+    // NULL is always allowed, it means "not set"
+    if (strcmp(value, "NULL") == 0)
+        return U_ERROR_COMMON_SUCCESS;
+
+    switch(rule->type) {
+        case CONFIG_INT: {
+            char *end;
+            long intValue = strtol(value, &end, 0);
+            if (*end != 0 || intValue < rule->minValue || intValue > rule->maxValue) {
+                writeWarn("Configuration value for '%s' must be a number from %d to %d",
+                        key, rule->minValue, rule->maxValue);
+                return U_ERROR_COMMON_INVALID_PARAMETER;
+            }
+            break;
+        }
+
+        case CONFIG_BOOL:
+            if (strcmp(value, "TRUE") != 0 && strcmp(value, "FALSE") != 0) {
+                writeWarn("Configuration value for '%s' must be TRUE or FALSE", key);
+                return U_ERROR_COMMON_INVALID_PARAMETER;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
 static bool checkWrittenCount(ssize_t writeCount, int32_t paramSize)
 {
     if (writeCount != paramSize) {
@@ -108,23 +403,92 @@ static bool checkWrittenCount(ssize_t writeCount, int32_t paramSize)
     return true;
 }
 
-static int32_t writeParam(const char *configParams[], int32_t paramIndex)
+static int32_t writeText(const char *text, const char *terminator)
 {
-    int32_t paramSize = strlen(configParams[paramIndex]);
+    int32_t textSize = strlen(text);
 
     // write the parameter
-    ssize_t count = fs_write(&configFile, configParams[paramIndex], paramSize);
-    if (!checkWrittenCount(count, paramSize))
+    ssize_t count = fs_write(&configFile, text, textSize);
+    if (!checkWrittenCount(count, textSize))
         return U_ERROR_COMMON_DEVICE_ERROR;
 
-    // write the new line so that we can parse it later
-    count = fs_write(&configFile, "\n", 1);
+    // write the separator/new line so that we can parse it later
+    count = fs_write(&configFile, terminator, 1);
     if (!checkWrittenCount(count, 1))
         return U_ERROR_COMMON_DEVICE_ERROR;
 
     return U_ERROR_COMMON_SUCCESS;
 }
 
+static int32_t writeParam(const char *configParams[], int32_t paramIndex)
+{
+    return writeText(configParams[paramIndex], "\n");
+}
+
+/// @brief Writes the list to a temporary file and then renames it over the
+/// configuration file, so a power cut never leaves a half written file
+/// @param filename The filename of the configuration file
+/// @param list The key/values to write
+/// @return 0 on success, negative on failure
+static int32_t writeConfigFileAtomic(const char *filename, appConfigList_t *list)
+{
+    int32_t errorCode = U_ERROR_COMMON_SUCCESS;
+    char path[100];
+    char tempPath[100];
+
+    strncpy(path, extFsPath(filename), sizeof(path) - 1);
+    path[sizeof(path) - 1] = 0;
+    snprintf(tempPath, sizeof(tempPath), "%s%s", path, CONFIG_TEMP_FILE_SUFFIX);
+
+    if (extFsFileExists(tempPath))
+        fs_unlink(tempPath);
+
+    fs_file_t_init(&configFile);
+    int32_t success = fs_open(&configFile, tempPath, FS_O_CREATE | FS_O_WRITE);
+    if (success < 0) {
+        writeError("Failed to open temporary configuration file: %d", success);
+        return U_ERROR_COMMON_DEVICE_ERROR;
+    }
+
+    for(appConfigList_t *kvp = list; kvp != NULL && errorCode == U_ERROR_COMMON_SUCCESS; kvp = kvp->pNext) {
+        errorCode = writeText(kvp->key, " ");
+        if (errorCode == U_ERROR_COMMON_SUCCESS)
+            errorCode = writeText(kvp->value, "\n");
+    }
+
+    if (errorCode == U_ERROR_COMMON_SUCCESS && fs_sync(&configFile) != 0)
+        errorCode = U_ERROR_COMMON_DEVICE_ERROR;
+
+    fs_close(&configFile);
+
+    if (errorCode != U_ERROR_COMMON_SUCCESS) {
+        writeError("Failed to write temporary configuration file, keeping old configuration");
+        fs_unlink(tempPath);
+        return errorCode;
+    }
+
+    // LittleFS renames atomically, replacing any existing file
+    success = fs_rename(tempPath, path);
+    if (success != 0) {
+        writeError("Failed to replace configuration file %s: %d", filename, success);
+        fs_unlink(tempPath);
+        return U_ERROR_COMMON_DEVICE_ERROR;
+    }
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+static bool configListHasPrefix(appConfigList_t *list, const char *keyPrefix)
+{
+    size_t len = strlen(keyPrefix);
+    for(appConfigList_t *kvp = list; kvp != NULL; kvp = kvp->pNext) {
+        if (strncmp(kvp->key, keyPrefix, len) == 0)
+            return true;
+    }
+
+    return false;
+}
+
 /* ----------------------------------------------------------------
  * PUBLIC FUNCTIONS
  * -------------------------------------------------------------- */
@@ -169,60 +533,33 @@ int32_t saveConfigFile(const char *filename, const char *configParams[], int32_t
     return errorCode;
 }
 
-/// @brief Loads a configuration file ready for indexing. Can load multiple config files
+/// @brief Loads a configuration file ready for indexing. Can load multiple config files,
+/// keys in later files override the values of the same keys in earlier files.
 /// @param filename The filename of the configuration file
 /// @return 0 on success, negative on failure
 int32_t loadConfigFile(const char *filename)
 {
-    int32_t success;
-    int32_t errorCode = U_ERROR_COMMON_SUCCESS;
-
-    char *configText = NULL;
-
     const char *path = extFsPath(filename);
     if (!extFsFileExists(path)) {
-        writeError("Cconfiguration file not found on file system");
-        errorCode = U_ERROR_COMMON_NOT_FOUND;
-        goto cleanUp;
-    }
-
-    size_t fileSize;
-    success = extFsFileSize(path, &fileSize);
-    if (!success) {
-        writeError("Failed to get filesize of configuration file '%s': %d", filename, success);
-        errorCode =  U_ERROR_COMMON_NOT_FOUND;
-        goto cleanUp;
-    }
-
-    configText = (char *)pUPortMalloc(fileSize);
-    if (configText == NULL) {
-        writeError("Failed to allocate memory for loading in configuration file, size: %d", fileSize);
-        errorCode = U_ERROR_COMMON_NO_MEMORY;
-        goto cleanUp;
-    }
-
-    fs_file_t_init(&configFile);
-    success = fs_open(&configFile, path, FS_O_READ);
-    if (success < 0) {
-        writeError("Failed to open configuration file: %d", success);
-        errorCode = U_ERROR_COMMON_NOT_FOUND;
-        goto cleanUp;
-    }
-
-    size_t count;
-    char *buffer = configText;
-    while((count = fs_read(&configFile, buffer, FILE_READ_BUFFER)) > 0) {
-        buffer = buffer + count;
+        writeError("Configuration file '%s' not found on file system", filename);
+        return U_ERROR_COMMON_NOT_FOUND;
     }
 
-    parseConfiguration(configText, &configList);
+    // the file is read into its own list first, so the lock isn't held
+    // while the file system is read
+    appConfigList_t *fileList = NULL;
+    int32_t errorCode = readConfigFile(path, &fileList);
 
-cleanUp:
-    if (errorCode != 0) {
-        uPortFree(configText);
+    U_PORT_MUTEX_LOCK(configMutex);
+    for(appConfigList_t *kvp = fileList; kvp != NULL; kvp = kvp->pNext) {
+        if (setConfigKVP(&configList, kvp->key, kvp->value) < 0) {
+            errorCode = U_ERROR_COMMON_NO_MEMORY;
+            break;
+        }
     }
+    U_PORT_MUTEX_UNLOCK(configMutex);
 
-    fs_close(&configFile);
+    freeConfigList(fileList);
 
     return errorCode;
 }
@@ -230,37 +567,78 @@ cleanUp:
 void printConfiguration(void)
 {
     size_t count=1;
-    appConfigList_t *kvp = configList;
-    const char *value;
 
-    while(kvp != NULL) {
-        value = getConfig(kvp->key);
-        if (value == NULL) value = "N/A";
-        printDebug("   Key #%d: %s = %s", count, kvp->key, value);
+    U_PORT_MUTEX_LOCK(configMutex);
 
-        kvp = kvp->pNext;
+    for(appConfigList_t *kvp = configList; kvp != NULL; kvp = kvp->pNext) {
+        const char *value = kvp->value;
+        if (strncmp(value, "NULL", 4) == 0) value = "N/A";
+        printDebug("   Key #%d: %s = %s", count, kvp->key, value);
         count++;
     }
 
+    U_PORT_MUTEX_UNLOCK(configMutex);
+
     printDebug("");
 }
 
-/// @brief Returns the specified configuration value
+/// @brief Creates the configuration mutex, before any configuration is
+/// loaded or any callback is registered
+/// @return 0 on success, negative on failure
+int32_t initConfigUtils(void)
+{
+    if (configMutex != NULL)
+        return U_ERROR_COMMON_SUCCESS;
+
+    return uPortMutexCreate(&configMutex);
+}
+
+/// @brief Copies the specified configuration value into the caller's
+/// buffer, as a committed configuration can free the loaded value
 /// @param key The configuration name to return the value of
-/// @return The configuration value on succes, NULL on failure
-const char *getConfig(const char *key)
+/// @param pBuffer The buffer to copy the value to
+/// @param size The size of the buffer, CONFIG_VALUE_SIZE holds any value
+/// @return pBuffer on success, NULL if the key is missing, NULL or too long
+const char *getConfig(const char *key, char *pBuffer, size_t size)
 {
-    for(appConfigList_t *kvp = configList; kvp != NULL; kvp=kvp->pNext) {
-        if (strcmp(kvp->key, key) == 0) {
-            if (strncmp(kvp->value, "NULL", 4) == 0)
-                return NULL;
-            else
-                return kvp->value;
+    const char *result = NULL;
+    bool found = false;
+    bool fits = true;
+
+    U_PORT_MUTEX_LOCK(configMutex);
+
+    appConfigList_t *kvp = findConfigKVP(configList, key);
+    if (kvp != NULL) {
+        found = true;
+        fits = strlen(kvp->value) < size;
+        if (strncmp(kvp->value, "NULL", 4) != 0 && fits) {
+            strcpy(pBuffer, kvp->value);
+            result = pBuffer;
         }
     }
 
-    printWarn("Failed to find '%s' key", key);
-    return NULL;
+    U_PORT_MUTEX_UNLOCK(configMutex);
+
+    if (!found)
+        printWarn("Failed to find '%s' key", key);
+    else if (!fits)
+        writeWarn("Configuration value of '%s' is too long", key);
+
+    return result;
+}
+
+/// @brief Checks if a configuration key is present, without warning if it isn't
+/// @param key The configuration name to look for
+/// @return True if the key is in the configuration, False otherwise
+bool isConfigPresent(const char *key)
+{
+    bool present;
+
+    U_PORT_MUTEX_LOCK(configMutex);
+    present = findConfigKVP(configList, key) != NULL;
+    U_PORT_MUTEX_UNLOCK(configMutex);
+
+    return present;
 }
 
 /// @brief Sets an int value from a configuration key, if present
@@ -269,7 +647,9 @@ const char *getConfig(const char *key)
 /// @return True if the int value was set, False otherwise
 bool setIntParamFromConfig(const char *key, int32_t *param)
 {
-    const char *value = getConfig(key);
+    char buffer[CONFIG_VALUE_SIZE];
+
+    const char *value = getConfig(key, buffer, sizeof(buffer));
     if (value == NULL) return false;
 
     *param = atoi(value);
@@ -284,9 +664,147 @@ bool setIntParamFromConfig(const char *key, int32_t *param)
 /// @return True if the bool value was set, False otherwise
 bool setBoolParamFromConfig(const char *key, const char *compare, bool *param)
 {
-    const char *value = getConfig(key);
+    char buffer[CONFIG_VALUE_SIZE];
+
+    const char *value = getConfig(key, buffer, sizeof(buffer));
     if (value == NULL) return false;
 
     *param = strcmp(value, compare) == 0;
     return true;
+}
+
+/// @brief Stages a configuration key/value, ready for commitConfig()
+/// @param key The configuration name to set
+/// @param value The new value of the configuration
+/// @return 0 on success, negative if the key or value is not valid
+int32_t stageConfig(const char *key, const char *value)
+{
+    int32_t errorCode;
+    int32_t stageResult = U_ERROR_COMMON_SUCCESS;
+
+    U_PORT_MUTEX_LOCK(configMutex);
+    errorCode = validateConfig(key, value);
+    if (errorCode == U_ERROR_COMMON_SUCCESS)
+        stageResult = setConfigKVP(&stagedConfigList, key, value);
+    U_PORT_MUTEX_UNLOCK(configMutex);
+
+    if (errorCode < 0)
+        return errorCode;
+
+    if (stageResult < 0) {
+        writeError("Failed to stage configuration '%s': %d", key, stageResult);
+        return stageResult;
+    }
+
+    writeLog("Staged configuration: %s", key);
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Discards all the staged configuration key/values
+void clearStagedConfig(void)
+{
+    U_PORT_MUTEX_LOCK(configMutex);
+    freeConfigList(stagedConfigList);
+    stagedConfigList = NULL;
+    U_PORT_MUTEX_UNLOCK(configMutex);
+}
+
+/// @brief Writes the staged configuration to the file, then applies it to
+/// the loaded configuration and calls the configuration changed callbacks
+/// @param filename The filename of the configuration file to update
+/// @return 0 on success, negative on failure
+int32_t commitConfig(const char *filename)
+{
+    int32_t errorCode = U_ERROR_COMMON_SUCCESS;
+    appConfigList_t *fileList = NULL;
+    appConfigList_t *changedList = NULL;
+    configChangedCallbackInfo_t callbacks[MAX_CONFIG_CHANGED_CALLBACKS];
+    int32_t callbackCount;
+    bool nothingStaged;
+
+    // the lock is held for the whole commit, so the staged list can't
+    // change while it is written, and no caller is copying a value which
+    // is freed when it is replaced
+    U_PORT_MUTEX_LOCK(configMutex);
+
+    nothingStaged = stagedConfigList == NULL;
+    if (nothingStaged)
+        errorCode = U_ERROR_COMMON_NOT_FOUND;
+
+    // start from what is already in the file, so earlier commits are kept
+    const char *path = extFsPath(filename);
+    if (errorCode == U_ERROR_COMMON_SUCCESS && extFsFileExists(path))
+        errorCode = readConfigFile(path, &fileList);
+
+    for(appConfigList_t *kvp = stagedConfigList; kvp != NULL && errorCode >= 0; kvp = kvp->pNext)
+        errorCode = setConfigKVP(&fileList, kvp->key, kvp->value);
+
+    if (errorCode >= 0)
+        errorCode = writeConfigFileAtomic(filename, fileList);
+
+    // the file is safely written, now hot-reload the loaded configuration
+    for(appConfigList_t *kvp = stagedConfigList; kvp != NULL && errorCode >= 0; kvp = kvp->pNext) {
+        errorCode = setConfigKVP(&configList, kvp->key, kvp->value);
+        if (errorCode > 0)
+            setConfigKVP(&changedList, kvp->key, kvp->value);
+    }
+
+    if (errorCode >= 0) {
+        freeConfigList(stagedConfigList);
+        stagedConfigList = NULL;
+    }
+
+    callbackCount = configChangedCallbackCount;
+    memcpy(callbacks, configChangedCallbacks, callbackCount * sizeof(configChangedCallbackInfo_t));
+
+    U_PORT_MUTEX_UNLOCK(configMutex);
+
+    if (nothingStaged) {
+        writeWarn("No staged configuration to commit");
+        return errorCode;
+    }
+
+    if (errorCode < 0) {
+        writeError("Failed to commit configuration: %d", errorCode);
+    } else {
+        errorCode = U_ERROR_COMMON_SUCCESS;
+        writeLog("Configuration committed to %s", filename);
+
+        // the callbacks read the configuration, so they are called unlocked
+        for(int i=0; i<callbackCount; i++) {
+            if (configListHasPrefix(changedList, callbacks[i].keyPrefix))
+                callbacks[i].callback();
+        }
+    }
+
+    freeConfigList(fileList);
+    freeConfigList(changedList);
+
+    return errorCode;
+}
+
+/// @brief Registers a callback to be called when a committed configuration
+/// changes any key starting with the prefix
+/// @param keyPrefix The start of the configuration keys of interest
+/// @param callback The function to call after the configuration has changed
+/// @return 0 on success, negative on failure
+int32_t registerConfigChangedCallback(const char *keyPrefix, configChangedCallback_t callback)
+{
+    int32_t errorCode = U_ERROR_COMMON_SUCCESS;
+
+    // the tasks are initialised in parallel, so they can register together
+    U_PORT_MUTEX_LOCK(configMutex);
+    if (configChangedCallbackCount == MAX_CONFIG_CHANGED_CALLBACKS) {
+        errorCode = U_ERROR_COMMON_NO_MEMORY;
+    } else {
+        configChangedCallbacks[configChangedCallbackCount].keyPrefix = keyPrefix;
+        configChangedCallbacks[configChangedCallbackCount].callback = callback;
+        configChangedCallbackCount++;
+    }
+    U_PORT_MUTEX_UNLOCK(configMutex);
+
+    if (errorCode != U_ERROR_COMMON_SUCCESS)
+        writeError("registerConfigChangedCallback(): max callback count");
+
+    return errorCode;
 }
\ No newline at end of file
@@ -23,11 +23,35 @@
 #ifndef _CONFIG_UTILS_H_
 #define _CONFIG_UTILS_H_
 
+/* ----------------------------------------------------------------
+ * DEFINITIONS
+ * -------------------------------------------------------------- */
+// A buffer this size holds any configuration value which can be set remotely
+#define CONFIG_VALUE_SIZE 101
+
+// The range of a task loop dwell time, from the TASK_DWELL_<NAME>
+// configuration or the task's START_TASK command
+#define TASK_DWELL_MIN_SECS 1
+#define TASK_DWELL_MAX_SECS 3600
+
+/* ----------------------------------------------------------------
+ * PUBLIC TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+
+/// Callback for when a committed configuration has changed
+typedef void (*configChangedCallback_t)(void);
+
 /* ----------------------------------------------------------------
  * PUBLIC FUNCTIONS
  * -------------------------------------------------------------- */
 
-/// @brief Loads a configuration file ready for indexing
+/// @brief Creates the configuration mutex, before any configuration is
+/// loaded or any callback is registered
+/// @return 0 on success, negative on failure
+int32_t initConfigUtils(void);
+
+/// @brief Loads a configuration file ready for indexing.
+/// Keys already loaded from an earlier file are overridden.
 /// @param filename The filename of the configuration file
 /// @return 0 on success, negative on failure
 int32_t loadConfigFile(const char *filename);
@@ -42,10 +66,13 @@ int32_t saveConfigFile(const char *filename, const char *configParams[], int32_t
 /// @brief Prints the configuration list
 void printConfiguration(void);
 
-/// @brief returns the specified configuration value
+/// @brief Copies the specified configuration value into the caller's
+/// buffer, as a committed configuration can free the loaded value
 /// @param key The configuration name to return the value of
-/// @return The configuration value on succes, NULL on failure
-const char *getConfig(const char *key);
+/// @param pBuffer The buffer to copy the value to
+/// @param size The size of the buffer, CONFIG_VALUE_SIZE holds any value
+/// @return pBuffer on success, NULL if the key is missing, NULL or too long
+const char *getConfig(const char *key, char *pBuffer, size_t size);
 
 /// @brief Sets a int value from a configuration key, if present
 /// @param key The configuration name to return the value of
@@ -59,4 +86,31 @@ bool setIntParamFromConfig(const char *key, int32_t *param);
 /// @return True if the bool value was set, False otherwise
 bool setBoolParamFromConfig(const char *key, const char *value, bool *param);
 
+/// @brief Checks if a configuration key is present, without warning if it isn't
+/// @param key The configuration name to look for
+/// @return True if the key is in the configuration, False otherwise
+bool isConfigPresent(const char *key);
+
+/// @brief Validates and stages a configuration key/value, ready for commitConfig()
+/// @param key The configuration name to set
+/// @param value The new value of the configuration
+/// @return 0 on success, negative if the key or value is not valid
+int32_t stageConfig(const char *key, const char *value);
+
+/// @brief Discards all the staged configuration key/values
+void clearStagedConfig(void);
+
+/// @brief Atomically writes the staged configuration to the file, hot-reloads
+/// the loaded configuration and calls the configuration changed callbacks
+/// @param filename The filename of the configuration file to update
+/// @return 0 on success, negative on failure
+int32_t commitConfig(const char *filename);
+
+/// @brief Registers a callback for when a committed configuration changes
+/// any key starting with the prefix
+/// @param keyPrefix The start of the configuration keys of interest
+/// @param callback The function to call after the configuration has changed
+/// @return 0 on success, negative on failure
+int32_t registerConfigChangedCallback(const char *keyPrefix, configChangedCallback_t callback);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,444 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Uplink data usage accounting and budget.
+ *
+ * The bytes of each uplink message, with an estimate of its protocol
+ * overhead, are counted per topic, per MQTT session, per day and per
+ * month. The daily and monthly totals are saved to the file system every
+ * 10 minutes, and when the application exits, so they carry on after a
+ * restart.
+ *
+ * BUDGET_DAILY_KB sets a token bucket, which fills at the daily budget
+ * spread over the day and holds at most BUDGET_BURST_KB. Each message
+ * takes its bytes from the bucket. Low priority messages, the periodic
+ * telemetry, are dropped when there isn't enough left over a reserve of
+ * a quarter of the bucket, so a runaway reporting rate falls back to
+ * what the budget allows, and the reserve is kept for the high priority
+ * messages, which are always sent. Once BUDGET_MONTHLY_KB is used up all
+ * the low priority messages are dropped until the next month. A message
+ * which is dropped after it took its bytes, eg because the publish queue
+ * is full, gives them back with refundDataBudget().
+ *
+ */
+
+#include <time.h>
+
+#include "common.h"
+#include "ext_fs.h"
+#include "dataBudget.h"
+
+/* ----------------------------------------------------------------
+ * DEFINES
+ * -------------------------------------------------------------- */
+#define MAX_USAGE_TOPICS 24
+#define USAGE_TOPIC_NAME_SIZE 24
+#define OTHER_TOPICS_NAME "Other"
+
+#define BURST_KB_DEFAULT 32
+
+#define SAVE_INTERVAL_MS (10 * 60 * 1000)
+#define SECONDS_PER_DAY 86400
+#define MS_PER_DAY (SECONDS_PER_DAY * 1000LL)
+
+#define USAGE_TEXT_SIZE 100
+
+/* ----------------------------------------------------------------
+ * TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+typedef struct {
+    char name[USAGE_TOPIC_NAME_SIZE];
+    uint32_t bytes;
+} topicUsage_t;
+
+/* ----------------------------------------------------------------
+ * STATIC VARIABLES
+ * -------------------------------------------------------------- */
+static uPortMutexHandle_t budgetMutex = NULL;
+
+/// @brief the usage counters, protected by the budget mutex
+static topicUsage_t topics[MAX_USAGE_TOPICS];
+static int32_t topicCount = 0;
+static uint32_t sessionBytes = 0;
+static uint32_t day = 0;                    // days since 1970
+static uint32_t dayBytes = 0;
+static uint32_t month = 0;                  // months since 1900
+static uint32_t monthBytes = 0;
+static bool usageChanged = false;
+
+/// @brief the token bucket, in bytes
+static int64_t dailyBudget = 0;             // 0 is no budget
+static int64_t monthlyBudget = 0;
+static int64_t bucketSize = BURST_KB_DEFAULT * 1024;
+static int64_t tokens = BURST_KB_DEFAULT * 1024;
+static int64_t lastRefillMs = 0;
+static int64_t refillRemainder = 0;
+static uint32_t droppedCount = 0;
+static bool limiting = false;
+
+static int32_t saveJobId = -1;
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Moves the daily and monthly totals on when the day or month
+/// changes. Until the network time is known the current totals are used.
+/// Called with the budget mutex held.
+static void updatePeriod(void)
+{
+    if (unixNetworkTime == 0)
+        return;
+
+    time_t now = (time_t)(unixNetworkTime + (uPortGetTickTimeMs() / 1000));
+    struct tm tm;
+    gmtime_r(&now, &tm);
+
+    uint32_t today = (uint32_t)(now / SECONDS_PER_DAY);
+    uint32_t thisMonth = (uint32_t)(tm.tm_year * 12 + tm.tm_mon);
+
+    if (today != day) {
+        if (day != 0)
+            writeLog("Uplink data used on day %u: %u bytes", day, dayBytes);
+        day = today;
+        dayBytes = 0;
+        usageChanged = true;
+    }
+
+    if (thisMonth != month) {
+        month = thisMonth;
+        monthBytes = 0;
+        usageChanged = true;
+    }
+}
+
+/// @brief Adds the tokens for the time since the last refill. Called with
+/// the budget mutex held.
+static void refillTokens(void)
+{
+    int64_t nowMs = uPortGetTickTimeMs();
+    int64_t elapsedMs = nowMs - lastRefillMs;
+    lastRefillMs = nowMs;
+
+    // the part of a byte left over is kept, so frequent refills don't lose it
+    refillRemainder += dailyBudget * elapsedMs;
+    tokens = MIN(bucketSize, tokens + refillRemainder / MS_PER_DAY);
+    refillRemainder %= MS_PER_DAY;
+}
+
+static topicUsage_t *getTopicUsage(const char *pName)
+{
+    // "<IMEI>/SignalQuality" is counted as "SignalQuality"
+    size_t serialLength = strlen((const char *)gSerialNumber);
+    if (strncmp(pName, (const char *)gSerialNumber, serialLength) == 0 && pName[serialLength] == '/')
+        pName += serialLength + 1;
+
+    for(int32_t i=0; i<topicCount; i++) {
+        if (strncmp(topics[i].name, pName, USAGE_TOPIC_NAME_SIZE - 1) == 0)
+            return &topics[i];
+    }
+
+    // the last entry counts all the topics which don't fit
+    if (topicCount == MAX_USAGE_TOPICS - 1)
+        pName = OTHER_TOPICS_NAME;
+
+    if (topicCount < MAX_USAGE_TOPICS) {
+        topicUsage_t *pTopic = &topics[topicCount++];
+        strncpy(pTopic->name, pName, USAGE_TOPIC_NAME_SIZE - 1);
+        pTopic->name[USAGE_TOPIC_NAME_SIZE - 1] = 0;
+        pTopic->bytes = 0;
+        return pTopic;
+    }
+
+    return &topics[MAX_USAGE_TOPICS - 1];
+}
+
+/// @brief Loads the saved totals, eg "day 19650 35000\nmonth 645 900000\n"
+static void loadDataUsage(void)
+{
+    struct fs_file_t file;
+    char text[USAGE_TEXT_SIZE];
+
+    fs_file_t_init(&file);
+    if (fs_open(&file, extFsPath(DATA_USAGE_FILENAME), FS_O_READ) < 0)
+        return;
+
+    ssize_t count = fs_read(&file, text, sizeof(text) - 1);
+    fs_close(&file);
+    if (count <= 0)
+        return;
+
+    text[count] = 0;
+
+    char *pSave;
+    for(char *pLine = strtok_r(text, "\n", &pSave); pLine != NULL; pLine = strtok_r(NULL, "\n", &pSave)) {
+        char *pNext;
+        if (strncmp(pLine, "day ", 4) == 0) {
+            day = strtoul(pLine + 4, &pNext, 10);
+            dayBytes = strtoul(pNext, NULL, 10);
+        } else if (strncmp(pLine, "month ", 6) == 0) {
+            month = strtoul(pLine + 6, &pNext, 10);
+            monthBytes = strtoul(pNext, NULL, 10);
+        }
+    }
+
+    writeLog("Uplink data used today %u bytes, this month %u bytes", dayBytes, monthBytes);
+}
+
+static void saveJob(void *pParam, size_t paramLengthBytes)
+{
+    saveDataUsage();
+}
+
+static void applyDataBudgetConfig(void)
+{
+    int32_t dailyKb = 0;
+    int32_t monthlyKb = 0;
+    int32_t burstKb = BURST_KB_DEFAULT;
+
+    setIntParamFromConfig("BUDGET_DAILY_KB", &dailyKb);
+    setIntParamFromConfig("BUDGET_MONTHLY_KB", &monthlyKb);
+    setIntParamFromConfig("BUDGET_BURST_KB", &burstKb);
+
+    U_PORT_MUTEX_LOCK(budgetMutex);
+    refillTokens();
+    dailyBudget = (int64_t)MAX(0, dailyKb) * 1024;
+    monthlyBudget = (int64_t)MAX(0, monthlyKb) * 1024;
+    bucketSize = (int64_t)MAX(1, burstKb) * 1024;
+    tokens = MIN(tokens, bucketSize);
+    U_PORT_MUTEX_UNLOCK(budgetMutex);
+
+    if (dailyKb > 0)
+        writeLog("Uplink data budget %d kB a day, bursts of %d kB", dailyKb, burstKb);
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Loads the daily and monthly totals, and reads the budget from
+/// the configuration
+/// @return 0 on success, negative on failure
+int32_t initDataBudget(void)
+{
+    if (budgetMutex != NULL)
+        return U_ERROR_COMMON_SUCCESS;
+
+    int32_t errorCode = uPortMutexCreate(&budgetMutex);
+    if (errorCode != 0) {
+        writeFatal("Failed to create the data budget mutex (%d)", errorCode);
+        return errorCode;
+    }
+
+    loadDataUsage();
+
+    lastRefillMs = uPortGetTickTimeMs();
+    applyDataBudgetConfig();
+    registerConfigChangedCallback(DATA_BUDGET_CONFIG_PREFIX, applyDataBudgetConfig);
+
+    saveJobId = addPeriodicJob("DataUsageSave", saveJob, SAVE_INTERVAL_MS);
+    if (saveJobId < 0)
+        writeWarn("Failed to start saving the data usage (%d)", saveJobId);
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Takes the bytes of an uplink message from the token bucket
+/// @param bytes The size of the message, with its protocol overhead
+/// @param priority The priority of the message
+/// @return true if the message can be sent, false if it should be dropped
+bool requestDataBudget(size_t bytes, budgetPriority_t priority)
+{
+    bool allowed = true;
+    bool startedLimiting = false;
+
+    if (budgetMutex == NULL)
+        return true;
+
+    U_PORT_MUTEX_LOCK(budgetMutex);
+
+    if (dailyBudget > 0 || monthlyBudget > 0) {
+        refillTokens();
+        updatePeriod();
+
+        if (priority == BUDGET_PRIORITY_LOW) {
+            bool monthUsed = monthlyBudget > 0 && monthBytes >= monthlyBudget;
+            bool bucketLow = dailyBudget > 0 && tokens - (int64_t)bytes < bucketSize / 4;
+            allowed = !monthUsed && !bucketLow;
+        }
+
+        if (allowed) {
+            // high priority messages can take the bucket below zero, and
+            // the low priority messages wait longer for it to fill again
+            if (dailyBudget > 0)
+                tokens = MAX(tokens - (int64_t)bytes, -bucketSize);
+            limiting = false;
+        } else {
+            droppedCount++;
+            startedLimiting = !limiting;
+            limiting = true;
+        }
+    }
+
+    U_PORT_MUTEX_UNLOCK(budgetMutex);
+
+    if (startedLimiting)
+        writeWarn("Uplink data budget low, dropping low priority messages");
+
+    return allowed;
+}
+
+/// @brief Gives back the bytes of a message which was allowed by
+/// requestDataBudget() but then couldn't be sent
+/// @param bytes The bytes taken by requestDataBudget()
+void refundDataBudget(size_t bytes)
+{
+    if (budgetMutex == NULL || bytes == 0)
+        return;
+
+    U_PORT_MUTEX_LOCK(budgetMutex);
+    if (dailyBudget > 0)
+        tokens = MIN(tokens + (int64_t)bytes, bucketSize);
+    U_PORT_MUTEX_UNLOCK(budgetMutex);
+}
+
+/// @brief Returns how much of the data budget is left, for the adaptive
+/// reporting
+/// @return The percentage of the token bucket left, 0 when the monthly
+/// budget is used up, or -1 when there is no budget
+int32_t getDataBudgetLevel(void)
+{
+    int32_t level = -1;
+
+    if (budgetMutex == NULL)
+        return level;
+
+    U_PORT_MUTEX_LOCK(budgetMutex);
+
+    if (dailyBudget > 0 || monthlyBudget > 0) {
+        refillTokens();
+        updatePeriod();
+
+        if (monthlyBudget > 0 && monthBytes >= monthlyBudget)
+            level = 0;
+        else if (dailyBudget > 0)
+            level = (int32_t)(MAX(tokens, 0) * 100 / bucketSize);
+        else
+            level = 100;
+    }
+
+    U_PORT_MUTEX_UNLOCK(budgetMutex);
+
+    return level;
+}
+
+/// @brief Adds the bytes of a sent uplink message to the usage counters
+/// @param pName The topic or transport name, the IMEI prefix is removed
+/// @param bytes The size of the message, with its protocol overhead
+void recordDataUsage(const char *pName, size_t bytes)
+{
+    if (budgetMutex == NULL)
+        return;
+
+    U_PORT_MUTEX_LOCK(budgetMutex);
+
+    updatePeriod();
+
+    getTopicUsage(pName)->bytes += bytes;
+    sessionBytes += bytes;
+    dayBytes += bytes;
+    monthBytes += bytes;
+    usageChanged = true;
+
+    U_PORT_MUTEX_UNLOCK(budgetMutex);
+}
+
+/// @brief Starts counting the bytes of a new MQTT session
+void startDataUsageSession(void)
+{
+    if (budgetMutex == NULL)
+        return;
+
+    U_PORT_MUTEX_LOCK(budgetMutex);
+    if (sessionBytes > 0)
+        writeLog("Uplink data used in the last MQTT session: %u bytes", sessionBytes);
+    sessionBytes = 0;
+    U_PORT_MUTEX_UNLOCK(budgetMutex);
+}
+
+/// @brief Saves the daily and monthly totals to the file system
+void saveDataUsage(void)
+{
+    struct fs_file_t file;
+    char text[USAGE_TEXT_SIZE];
+    int32_t len;
+
+    if (budgetMutex == NULL)
+        return;
+
+    U_PORT_MUTEX_LOCK(budgetMutex);
+    len = usageChanged ? snprintf(text, sizeof(text), "day %u %u\nmonth %u %u\n", day, dayBytes, month, monthBytes) : 0;
+    usageChanged = false;
+    U_PORT_MUTEX_UNLOCK(budgetMutex);
+
+    if (len == 0)
+        return;
+
+    fs_file_t_init(&file);
+    if (fs_open(&file, extFsPath(DATA_USAGE_FILENAME), FS_O_CREATE | FS_O_WRITE) < 0) {
+        writeWarn("Failed to save the data usage");
+        return;
+    }
+
+    fs_write(&file, text, len);
+    fs_truncate(&file, len);
+    fs_close(&file);
+}
+
+/// @brief Formats the data usage as JSON, eg
+/// {"DataUsage":{"Session":1200,"Today":35000,"Month":900000,"Tokens":20000,
+///  "Dropped":0,"Topics":{"SignalQuality":12000,"Sensors":23000}}}
+/// @param pBuffer The buffer to write to
+/// @param size The size of the buffer
+/// @return The length of the JSON, negative if it didn't fit
+int32_t formatDataUsageJson(char *pBuffer, size_t size)
+{
+    int32_t len;
+
+    if (budgetMutex == NULL)
+        return U_ERROR_COMMON_NOT_INITIALISED;
+
+    U_PORT_MUTEX_LOCK(budgetMutex);
+
+    refillTokens();
+    updatePeriod();
+
+    len = snprintf(pBuffer, size,
+                "{\"DataUsage\":{\"Session\":%u,\"Today\":%u,\"Month\":%u,\"Tokens\":%d,\"Dropped\":%u,\"Topics\":{",
+                sessionBytes, dayBytes, monthBytes, (int32_t)(dailyBudget > 0 ? tokens : -1), droppedCount);
+
+    for(int32_t i=0; i<topicCount && len < size; i++)
+        len += snprintf(pBuffer + len, size - len, "%s\"%s\":%u", i > 0 ? "," : "", topics[i].name, topics[i].bytes);
+
+    U_PORT_MUTEX_UNLOCK(budgetMutex);
+
+    if (len < size)
+        len += snprintf(pBuffer + len, size - len, "}}}");
+
+    return (len < size) ? len : -1;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Uplink data usage accounting and budget
+ *
+ */
+
+#ifndef _DATA_BUDGET_H_
+#define _DATA_BUDGET_H_
+
+/* ----------------------------------------------------------------
+ * DEFINITIONS
+ * -------------------------------------------------------------- */
+#define DATA_BUDGET_CONFIG_PREFIX "BUDGET_"
+#define DATA_USAGE_FILENAME "dataUsage.txt"
+
+/* ----------------------------------------------------------------
+ * PUBLIC TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+
+/// The priority of an uplink message. Low priority messages are dropped
+/// when the budget runs low, high priority messages are always sent.
+typedef enum {
+    BUDGET_PRIORITY_LOW,        // periodic telemetry, the next report replaces it
+    BUDGET_PRIORITY_HIGH        // events, command replies and summaries
+} budgetPriority_t;
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Loads the daily and monthly totals, and reads the budget from
+/// the configuration
+/// @return 0 on success, negative on failure
+int32_t initDataBudget(void);
+
+/// @brief Takes the bytes of an uplink message from the token bucket
+/// @param bytes The size of the message, with its protocol overhead
+/// @param priority The priority of the message
+/// @return true if the message can be sent, false if it should be dropped
+bool requestDataBudget(size_t bytes, budgetPriority_t priority);
+
+/// @brief Gives back the bytes of a message which was allowed by
+/// requestDataBudget() but then couldn't be sent
+/// @param bytes The bytes taken by requestDataBudget()
+void refundDataBudget(size_t bytes);
+
+/// @brief Returns how much of the data budget is left, for the adaptive
+/// reporting
+/// @return The percentage of the token bucket left, 0 when the monthly
+/// budget is used up, or -1 when there is no budget
+int32_t getDataBudgetLevel(void);
+
+/// @brief Adds the bytes of a sent uplink message to the usage counters
+/// @param pName The topic or transport name, the IMEI prefix is removed
+/// @param bytes The size of the message, with its protocol overhead
+void recordDataUsage(const char *pName, size_t bytes);
+
+/// @brief Starts counting the bytes of a new MQTT session
+void startDataUsageSession(void);
+
+/// @brief Saves the daily and monthly totals to the file system
+void saveDataUsage(void);
+
+/// @brief Formats the data usage as JSON, eg
+/// {"DataUsage":{"Session":1200,"Today":35000,"Month":900000,"Tokens":20000,
+///  "Dropped":0,"Topics":{"SignalQuality":12000,"Sensors":23000}}}
+/// @param pBuffer The buffer to write to
+/// @param size The size of the buffer
+/// @return The length of the JSON, negative if it didn't fit
+int32_t formatDataUsageJson(char *pBuffer, size_t size);
+
+#endif
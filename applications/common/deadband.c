@@ -0,0 +1,174 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Change driven (deadband) reporting. A report is only made when one of
+ * its values has moved by more than its deadband since the last report,
+ * or when the heartbeat time has passed, so a device which is not moving
+ * or changing still reports that it is alive but sends far less.
+ *
+ * The deadbands are configured with DEADBAND_<NAME> keys and the
+ * heartbeat with HEARTBEAT_<NAME> keys, in seconds.
+ *
+ */
+
+#include "common.h"
+#include "deadband.h"
+
+/* ----------------------------------------------------------------
+ * DEFINES
+ * -------------------------------------------------------------- */
+#define MAX_DEADBAND_REPORTERS 8
+
+/* ----------------------------------------------------------------
+ * STATIC VARIABLES
+ * -------------------------------------------------------------- */
+// the reporters are registered by the task initialisations, which run
+// in parallel, and are re-read by the config changed callback
+static uPortMutexHandle_t reporterMutex = NULL;
+static deadbandReporter_t *reporters[MAX_DEADBAND_REPORTERS];
+static int32_t reporterCount = 0;
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+static void applyReporterConfig(deadbandReporter_t *pReporter)
+{
+    int32_t value = 0;
+    setIntParamFromConfig(pReporter->pHeartbeatKey, &value);
+    pReporter->heartbeatSecs = value;
+
+    for(size_t i=0; i<pReporter->metricCount; i++) {
+        deadbandMetric_t *metric = &pReporter->pMetrics[i];
+
+        value = metric->defaultDeadband;
+        setIntParamFromConfig(metric->pConfigKey, &value);
+        metric->deadband = value / metric->unitsPerValue;
+    }
+}
+
+static void applyDeadbandConfig(void)
+{
+    U_PORT_MUTEX_LOCK(reporterMutex);
+    for(int i=0; i<reporterCount; i++)
+        applyReporterConfig(reporters[i]);
+    U_PORT_MUTEX_UNLOCK(reporterMutex);
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Creates the reporter mutex and registers for the configuration
+/// changes, before any task registers a reporter
+/// @return 0 on success, negative on failure
+int32_t initDeadband(void)
+{
+    if (reporterMutex != NULL)
+        return U_ERROR_COMMON_SUCCESS;
+
+    int32_t errorCode = uPortMutexCreate(&reporterMutex);
+    if (errorCode != 0) {
+        writeFatal("Failed to create the deadband reporter mutex (%d)", errorCode);
+        return errorCode;
+    }
+
+    registerConfigChangedCallback(DEADBAND_CONFIG_PREFIX, applyDeadbandConfig);
+    registerConfigChangedCallback(HEARTBEAT_CONFIG_PREFIX, applyDeadbandConfig);
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Reads the reporter's deadbands and heartbeat from the configuration,
+/// and keeps them updated when the configuration changes
+/// @param pReporter The reporter, which must stay valid
+/// @return 0 on success, negative on failure
+int32_t registerDeadbandReporter(deadbandReporter_t *pReporter)
+{
+    int32_t errorCode = U_ERROR_COMMON_SUCCESS;
+
+    if (reporterMutex == NULL)
+        return U_ERROR_COMMON_NOT_INITIALISED;
+
+    U_PORT_MUTEX_LOCK(reporterMutex);
+    if (reporterCount < MAX_DEADBAND_REPORTERS) {
+        reporters[reporterCount++] = pReporter;
+        applyReporterConfig(pReporter);
+    } else {
+        errorCode = U_ERROR_COMMON_NO_MEMORY;
+    }
+    U_PORT_MUTEX_UNLOCK(reporterMutex);
+
+    if (errorCode != U_ERROR_COMMON_SUCCESS) {
+        writeError("Too many deadband reporters, %s not registered", pReporter->pHeartbeatKey);
+        return errorCode;
+    }
+
+    if (pReporter->heartbeatSecs > 0)
+        writeLog("Change driven reporting on, %s is %d seconds", pReporter->pHeartbeatKey, pReporter->heartbeatSecs);
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Checks if a report should be made: the first report, any value
+/// moved by more than its deadband since the last report, the heartbeat
+/// has expired, or deadband reporting is off
+/// @param pReporter The reporter
+/// @param pValues The values, in the order of the reporter's metrics
+/// @return true if the values should be reported
+bool isReportDue(deadbandReporter_t *pReporter, const float *pValues)
+{
+    if (pReporter->heartbeatSecs <= 0 || !pReporter->reported)
+        return true;
+
+    if (uPortGetTickTimeMs() - pReporter->lastReportMs >= (int64_t)pReporter->heartbeatSecs * 1000)
+        return true;
+
+    for(size_t i=0; i<pReporter->metricCount; i++) {
+        deadbandMetric_t *metric = &pReporter->pMetrics[i];
+        float change = pValues[i] - metric->lastValue;
+
+        if (change > metric->deadband || change < -metric->deadband)
+            return true;
+    }
+
+    return false;
+}
+
+/// @brief Records that the values have been reported
+/// @param pReporter The reporter
+/// @param pValues The values, in the order of the reporter's metrics
+void setReported(deadbandReporter_t *pReporter, const float *pValues)
+{
+    for(size_t i=0; i<pReporter->metricCount; i++)
+        pReporter->pMetrics[i].lastValue = pValues[i];
+
+    if (pReporter->suppressedCount > 0)
+        writeDebug("%s: reporting after %u unchanged reports", pReporter->pHeartbeatKey, pReporter->suppressedCount);
+
+    pReporter->lastReportMs = uPortGetTickTimeMs();
+    pReporter->reported = true;
+    pReporter->suppressedCount = 0;
+}
+
+/// @brief Records that a report has been skipped, for the logs
+/// @param pReporter The reporter
+void setReportSuppressed(deadbandReporter_t *pReporter)
+{
+    pReporter->suppressedCount++;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Change driven (deadband) reporting with a heartbeat
+ *
+ */
+
+#ifndef _DEADBAND_H_
+#define _DEADBAND_H_
+
+/* ----------------------------------------------------------------
+ * DEFINITIONS
+ * -------------------------------------------------------------- */
+#define DEADBAND_CONFIG_PREFIX "DEADBAND_"
+#define HEARTBEAT_CONFIG_PREFIX "HEARTBEAT_"
+
+/// Initialiser for a deadband metric
+/// @param key The configuration key of the deadband, eg "DEADBAND_SIGNAL_RSRP"
+/// @param defaultDeadband The deadband used if the key isn't configured, in config units
+/// @param unitsPerValue Config units per unit of the value, eg 10 for 0.1 degree
+/// steps, or 0.1f for 0.01 steps of a value in thousandths
+#define DEADBAND_METRIC(key, defaultDeadband, unitsPerValue) {key, defaultDeadband, unitsPerValue, 0, 0}
+
+/// Initialiser for a deadband reporter
+/// @param key The configuration key of the heartbeat in seconds, eg "HEARTBEAT_SIGNAL"
+/// @param metrics The deadbandMetric_t array of the values in each report
+#define DEADBAND_REPORTER(key, metrics) {key, metrics, NUM_ELEMENTS(metrics), 0, 0, false, 0}
+
+/* ----------------------------------------------------------------
+ * PUBLIC TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+
+/// One value in a report, with the change needed to report it again
+typedef struct {
+    const char *pConfigKey;
+    int32_t defaultDeadband;
+    float unitsPerValue;
+    float deadband;                 // in the units of the value
+    float lastValue;                // the last reported value
+} deadbandMetric_t;
+
+/// A set of values which are reported together. Deadband reporting is
+/// off while the heartbeat is zero, so every report is made.
+typedef struct {
+    const char *pHeartbeatKey;
+    deadbandMetric_t *pMetrics;
+    size_t metricCount;
+    int32_t heartbeatSecs;
+    int64_t lastReportMs;
+    bool reported;
+    uint32_t suppressedCount;       // reports skipped since the last one
+} deadbandReporter_t;
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Creates the reporter mutex and registers for the configuration
+/// changes, before any task registers a reporter
+/// @return 0 on success, negative on failure
+int32_t initDeadband(void);
+
+/// @brief Reads the reporter's deadbands and heartbeat from the configuration,
+/// and keeps them updated when the configuration changes
+/// @param pReporter The reporter, which must stay valid
+/// @return 0 on success, negative on failure
+int32_t registerDeadbandReporter(deadbandReporter_t *pReporter);
+
+/// @brief Checks if a report should be made: the first report, any value
+/// moved by more than its deadband since the last report, the heartbeat
+/// has expired, or deadband reporting is off
+/// @param pReporter The reporter
+/// @param pValues The values, in the order of the reporter's metrics
+/// @return true if the values should be reported
+bool isReportDue(deadbandReporter_t *pReporter, const float *pValues);
+
+/// @brief Records that the values have been reported
+/// @param pReporter The reporter
+/// @param pValues The values, in the order of the reporter's metrics
+void setReported(deadbandReporter_t *pReporter, const float *pValues);
+
+/// @brief Records that a report has been skipped, for the logs
+/// @param pReporter The reporter
+void setReportSuppressed(deadbandReporter_t *pReporter);
+
+#endif
@@ -54,15 +54,17 @@ unsigned long extFsFree()
     return free;
 }
 
+// the entries are on the caller's stack, as the workers and the long job
+// thread look up files at the same time
 bool extFsFileExists(const char *fileName)
 {
-    static struct fs_dirent dirent;
+    struct fs_dirent dirent;
     return fs_stat(fileName, &dirent) == 0;
 }
 
 bool extFsFileSize(const char *fileName, size_t *size)
 {
-    static struct fs_dirent dirent;
+    struct fs_dirent dirent;
     bool ok = fs_stat(fileName, &dirent) == 0;
     *size = ok ? dirent.size : 0;
     return ok;
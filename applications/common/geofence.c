@@ -0,0 +1,676 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * On-device geofences, so only the zone enter, exit and dwell events need
+ * to be published instead of every location.
+ *
+ * The fences are circles and polygons. All the checks are integer maths on
+ * the ten millionths of a degree coordinates from ubxlib, with a cosine
+ * table to scale the longitude of circles. Fences don't cross the 180
+ * degree meridian.
+ *
+ * A spatial grid of GRID_CELL_SIZE cells is hashed into GRID_BUCKETS
+ * buckets, each with a bitmask of the fences whose bounding box touch
+ * a cell in the bucket, so a position is only checked against the
+ * fences near it.
+ *
+ */
+
+#include <ctype.h>
+
+#include "common.h"
+#include "ext_fs.h"
+#include "geofence.h"
+
+/* ----------------------------------------------------------------
+ * DEFINES
+ * -------------------------------------------------------------- */
+#define TEN_MILLION             10000000
+#define METRES_PER_DEGREE       111320
+
+#define MAX_RADIUS_METRES       1000000
+
+// 0.01 degree grid cells, about 1.1km north to south
+#define GRID_CELL_SIZE          100000
+#define GRID_BUCKETS            64
+
+#define GEOFENCE_DWELL_CONFIG   "GEOFENCE_DWELL_TIME"
+#define DWELL_DEFAULT_SECS      300
+
+#define GEOFENCE_TEMP_SUFFIX    ".tmp"
+#define FILE_READ_BUFFER        50
+#define LINE_DELIMITERS         "\r\n"
+
+/* ----------------------------------------------------------------
+ * TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+typedef enum {
+    FENCE_CIRCLE,
+    FENCE_POLYGON
+} fenceType_t;
+
+typedef struct {
+    char name[GEOFENCE_NAME_SIZE];
+    fenceType_t type;
+
+    // bounding box, in ten millionths of a degree
+    int32_t minLat;
+    int32_t maxLat;
+    int32_t minLon;
+    int32_t maxLon;
+
+    union {
+        struct {
+            int32_t lat;
+            int32_t lon;
+            int32_t radiusMetres;
+            int64_t radiusX1e7;
+            int32_t cosLatQ15;      // scales the longitude to the latitude
+        } circle;
+
+        struct {
+            int32_t count;
+            int32_t lat[MAX_GEOFENCE_VERTICES];
+            int32_t lon[MAX_GEOFENCE_VERTICES];
+        } polygon;
+    } shape;
+
+    bool inside;
+    bool dwellReported;
+    int64_t enteredMs;
+} geofence_t;
+
+/* ----------------------------------------------------------------
+ * STATIC VARIABLES
+ * -------------------------------------------------------------- */
+static geofence_t fences[MAX_GEOFENCES];
+static int32_t fenceCount = 0;
+
+static uint32_t gridBuckets[GRID_BUCKETS];
+
+static int32_t dwellSecs = DWELL_DEFAULT_SECS;
+
+static uPortMutexHandle_t geofenceMutex = NULL;
+
+static struct fs_file_t geofenceFile;
+
+/// cos() of each whole degree from 0 to 90, scaled by 32768
+static const uint16_t cosTableQ15[] = {
+    32768, 32763, 32748, 32723, 32688, 32643, 32588, 32524, 32449, 32365,
+    32270, 32166, 32052, 31928, 31795, 31651, 31499, 31336, 31164, 30983,
+    30792, 30592, 30382, 30163, 29935, 29698, 29452, 29197, 28932, 28660,
+    28378, 28088, 27789, 27482, 27166, 26842, 26510, 26170, 25822, 25466,
+    25102, 24730, 24351, 23965, 23571, 23170, 22763, 22348, 21926, 21498,
+    21063, 20622, 20174, 19720, 19261, 18795, 18324, 17847, 17364, 16877,
+    16384, 15886, 15384, 14876, 14365, 13848, 13328, 12803, 12275, 11743,
+    11207, 10668, 10126,  9580,  9032,  8481,  7927,  7371,  6813,  6252,
+     5690,  5126,  4560,  3993,  3425,  2856,  2286,  1715,  1144,   572,
+        0
+};
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Parses decimal degrees, eg "-1.2345", into ten millionths of a degree
+static bool parseCoordinate(const char *pText, int32_t limitDegrees, int32_t *pX1e7)
+{
+    bool negative = false;
+    int64_t whole = 0;
+    int64_t fraction = 0;
+    int32_t digits = 0;
+
+    if (*pText == '-' || *pText == '+')
+        negative = (*pText++ == '-');
+
+    if (!isdigit((unsigned char)*pText))
+        return false;
+
+    while (isdigit((unsigned char)*pText)) {
+        whole = whole * 10 + (*pText++ - '0');
+        if (whole > limitDegrees)
+            return false;
+    }
+
+    if (*pText == '.') {
+        pText++;
+        for(; isdigit((unsigned char)*pText); pText++) {
+            if (digits < 7) {
+                fraction = fraction * 10 + (*pText - '0');
+                digits++;
+            }
+        }
+    }
+
+    if (*pText != 0)
+        return false;
+
+    for(; digits < 7; digits++)
+        fraction *= 10;
+
+    int64_t value = whole * TEN_MILLION + fraction;
+    if (value > (int64_t)limitDegrees * TEN_MILLION)
+        return false;
+
+    *pX1e7 = (int32_t)(negative ? -value : value);
+
+    return true;
+}
+
+static int32_t formatCoordinate(char *pBuffer, size_t size, int32_t x1e7)
+{
+    const char *sign = x1e7 < 0 ? "-" : "";
+    if (x1e7 < 0)
+        x1e7 = -x1e7;
+
+    return snprintf(pBuffer, size, "%s%d.%07d", sign, x1e7 / TEN_MILLION, x1e7 % TEN_MILLION);
+}
+
+/// @brief The grid cell of a coordinate, rounding down for negative values
+static int32_t getGridCell(int32_t x1e7)
+{
+    int32_t cell = x1e7 / GRID_CELL_SIZE;
+    if (x1e7 % GRID_CELL_SIZE < 0)
+        cell--;
+
+    return cell;
+}
+
+static uint32_t getGridBucket(int32_t latCell, int32_t lonCell)
+{
+    return (((uint32_t)latCell * 73856093U) ^ ((uint32_t)lonCell * 19349663U)) % GRID_BUCKETS;
+}
+
+/// @brief Rebuilds the grid buckets from the fence bounding boxes.
+/// Called with the geofence mutex locked.
+static void rebuildGrid(void)
+{
+    memset(gridBuckets, 0, sizeof(gridBuckets));
+
+    for(int32_t i=0; i<fenceCount; i++) {
+        geofence_t *fence = &fences[i];
+        uint32_t mask = 1U << i;
+
+        int32_t minLatCell = getGridCell(fence->minLat);
+        int32_t maxLatCell = getGridCell(fence->maxLat);
+        int32_t minLonCell = getGridCell(fence->minLon);
+        int32_t maxLonCell = getGridCell(fence->maxLon);
+
+        // a large fence will touch every bucket anyway
+        int64_t cells = (int64_t)(maxLatCell - minLatCell + 1) * (maxLonCell - minLonCell + 1);
+        if (cells >= GRID_BUCKETS) {
+            for(int b=0; b<GRID_BUCKETS; b++)
+                gridBuckets[b] |= mask;
+            continue;
+        }
+
+        for(int32_t latCell = minLatCell; latCell <= maxLatCell; latCell++)
+            for(int32_t lonCell = minLonCell; lonCell <= maxLonCell; lonCell++)
+                gridBuckets[getGridBucket(latCell, lonCell)] |= mask;
+    }
+}
+
+static bool isInsideCircle(geofence_t *fence, int32_t lat, int32_t lon)
+{
+    int64_t dLat = (int64_t)lat - fence->shape.circle.lat;
+    int64_t dLon = (((int64_t)lon - fence->shape.circle.lon) * fence->shape.circle.cosLatQ15) >> 15;
+    int64_t radius = fence->shape.circle.radiusX1e7;
+
+    return dLat * dLat + dLon * dLon <= radius * radius;
+}
+
+/// @brief Ray casting point in polygon test. The products are a longitude
+/// difference times a latitude difference, which can't overflow 64 bits.
+static bool isInsidePolygon(geofence_t *fence, int32_t lat, int32_t lon)
+{
+    bool inside = false;
+    int32_t count = fence->shape.polygon.count;
+    int32_t *lats = fence->shape.polygon.lat;
+    int32_t *lons = fence->shape.polygon.lon;
+
+    for(int32_t i=0, j=count-1; i<count; j=i++) {
+        if ((lats[i] > lat) != (lats[j] > lat)) {
+            int64_t lhs = ((int64_t)lon - lons[i]) * ((int64_t)lats[j] - lats[i]);
+            int64_t rhs = ((int64_t)lons[j] - lons[i]) * ((int64_t)lat - lats[i]);
+
+            if (lats[j] > lats[i] ? lhs < rhs : lhs > rhs)
+                inside = !inside;
+        }
+    }
+
+    return inside;
+}
+
+static bool isInsideFence(geofence_t *fence, int32_t lat, int32_t lon)
+{
+    if (lat < fence->minLat || lat > fence->maxLat || lon < fence->minLon || lon > fence->maxLon)
+        return false;
+
+    if (fence->type == FENCE_CIRCLE)
+        return isInsideCircle(fence, lat, lon);
+
+    return isInsidePolygon(fence, lat, lon);
+}
+
+static int32_t parseCircle(commandParamsList_t *params, geofence_t *fence)
+{
+    int32_t lat, lon;
+
+    if (params == NULL || params->pNext == NULL || params->pNext->pNext == NULL ||
+            !parseCoordinate(params->parameter, 90, &lat) ||
+            !parseCoordinate(params->pNext->parameter, 180, &lon))
+        return U_ERROR_COMMON_INVALID_PARAMETER;
+
+    int32_t radius = atoi(params->pNext->pNext->parameter);
+    if (radius <= 0 || radius > MAX_RADIUS_METRES)
+        return U_ERROR_COMMON_INVALID_PARAMETER;
+
+    fence->type = FENCE_CIRCLE;
+    fence->shape.circle.lat = lat;
+    fence->shape.circle.lon = lon;
+    fence->shape.circle.radiusMetres = radius;
+    fence->shape.circle.radiusX1e7 = (int64_t)radius * TEN_MILLION / METRES_PER_DEGREE;
+    fence->shape.circle.cosLatQ15 = getCosLatitudeQ15(lat);
+
+    int64_t latExtent = fence->shape.circle.radiusX1e7;
+    int64_t lonExtent = (int64_t)180 * TEN_MILLION;
+    if (fence->shape.circle.cosLatQ15 > 0)
+        lonExtent = MIN(lonExtent, (latExtent << 15) / fence->shape.circle.cosLatQ15);
+
+    fence->minLat = (int32_t)MAX(lat - latExtent, (int64_t)-90 * TEN_MILLION);
+    fence->maxLat = (int32_t)MIN(lat + latExtent, (int64_t)90 * TEN_MILLION);
+    fence->minLon = (int32_t)MAX(lon - lonExtent, (int64_t)-180 * TEN_MILLION);
+    fence->maxLon = (int32_t)MIN(lon + lonExtent, (int64_t)180 * TEN_MILLION);
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+static int32_t parsePolygon(commandParamsList_t *params, geofence_t *fence)
+{
+    int32_t count = 0;
+
+    fence->type = FENCE_POLYGON;
+    for(; params != NULL; params = params->pNext->pNext) {
+        int32_t lat, lon;
+
+        if (params->pNext == NULL || count == MAX_GEOFENCE_VERTICES ||
+                !parseCoordinate(params->parameter, 90, &lat) ||
+                !parseCoordinate(params->pNext->parameter, 180, &lon))
+            return U_ERROR_COMMON_INVALID_PARAMETER;
+
+        fence->shape.polygon.lat[count] = lat;
+        fence->shape.polygon.lon[count] = lon;
+
+        if (count == 0 || lat < fence->minLat) fence->minLat = lat;
+        if (count == 0 || lat > fence->maxLat) fence->maxLat = lat;
+        if (count == 0 || lon < fence->minLon) fence->minLon = lon;
+        if (count == 0 || lon > fence->maxLon) fence->maxLon = lon;
+
+        count++;
+    }
+
+    if (count < 3)
+        return U_ERROR_COMMON_INVALID_PARAMETER;
+
+    fence->shape.polygon.count = count;
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Parses and adds a fence, replacing any fence with the same name
+static int32_t parseAndAddGeofence(commandParamsList_t *params)
+{
+    geofence_t fence;
+    int32_t errorCode = U_ERROR_COMMON_INVALID_PARAMETER;
+
+    if (params == NULL || params->pNext == NULL)
+        return U_ERROR_COMMON_INVALID_PARAMETER;
+
+    memset(&fence, 0, sizeof(fence));
+    strncpy(fence.name, params->pNext->parameter, GEOFENCE_NAME_SIZE - 1);
+
+    if (strcmp(params->parameter, "CIRCLE") == 0)
+        errorCode = parseCircle(params->pNext->pNext, &fence);
+    else if (strcmp(params->parameter, "POLYGON") == 0)
+        errorCode = parsePolygon(params->pNext->pNext, &fence);
+
+    if (errorCode != 0) {
+        writeWarn("Invalid geofence '%s'", fence.name);
+        return errorCode;
+    }
+
+    U_PORT_MUTEX_LOCK(geofenceMutex);
+
+    int32_t index = 0;
+    while (index < fenceCount && strcmp(fences[index].name, fence.name) != 0)
+        index++;
+
+    if (index == MAX_GEOFENCES) {
+        errorCode = U_ERROR_COMMON_NO_MEMORY;
+    } else {
+        fences[index] = fence;
+        if (index == fenceCount)
+            fenceCount++;
+
+        rebuildGrid();
+    }
+
+    U_PORT_MUTEX_UNLOCK(geofenceMutex);
+
+    if (errorCode != 0)
+        writeWarn("Too many geofences, '%s' not added", fence.name);
+
+    return errorCode;
+}
+
+static int32_t loadGeofences(void)
+{
+    const char *path = extFsPath(GEOFENCE_FILENAME);
+    size_t fileSize;
+
+    if (!extFsFileExists(path) || !extFsFileSize(path, &fileSize))
+        return U_ERROR_COMMON_NOT_FOUND;
+
+    char *text = (char *)pUPortMalloc(fileSize + 1);
+    if (text == NULL)
+        return U_ERROR_COMMON_NO_MEMORY;
+
+    fs_file_t_init(&geofenceFile);
+    if (fs_open(&geofenceFile, path, FS_O_READ) < 0) {
+        uPortFree(text);
+        return U_ERROR_COMMON_NOT_FOUND;
+    }
+
+    ssize_t count;
+    size_t total = 0;
+    while(total < fileSize &&
+            (count = fs_read(&geofenceFile, text + total, MIN(FILE_READ_BUFFER, fileSize - total))) > 0) {
+        total += count;
+    }
+    text[total] = 0;
+    fs_close(&geofenceFile);
+
+    char *savePtr;
+    for(char *line = strtok_r(text, LINE_DELIMITERS, &savePtr); line != NULL;
+            line = strtok_r(NULL, LINE_DELIMITERS, &savePtr)) {
+        commandParamsList_t *params = NULL;
+        if (getParams(line, &params) > 0)
+            parseAndAddGeofence(params);
+        freeParams(params);
+    }
+
+    uPortFree(text);
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+static int32_t writeGeofence(geofence_t *fence)
+{
+    char line[64];
+    int32_t len;
+
+    if (fence->type == FENCE_CIRCLE) {
+        len = snprintf(line, sizeof(line), "CIRCLE %s ", fence->name);
+        len += formatCoordinate(line + len, sizeof(line) - len, fence->shape.circle.lat);
+        len += snprintf(line + len, sizeof(line) - len, " ");
+        len += formatCoordinate(line + len, sizeof(line) - len, fence->shape.circle.lon);
+        len += snprintf(line + len, sizeof(line) - len, " %d", fence->shape.circle.radiusMetres);
+        if (fs_write(&geofenceFile, line, len) != len)
+            return U_ERROR_COMMON_DEVICE_ERROR;
+    } else {
+        len = snprintf(line, sizeof(line), "POLYGON %s", fence->name);
+        if (fs_write(&geofenceFile, line, len) != len)
+            return U_ERROR_COMMON_DEVICE_ERROR;
+
+        for(int32_t i=0; i<fence->shape.polygon.count; i++) {
+            len = snprintf(line, sizeof(line), " ");
+            len += formatCoordinate(line + len, sizeof(line) - len, fence->shape.polygon.lat[i]);
+            len += snprintf(line + len, sizeof(line) - len, " ");
+            len += formatCoordinate(line + len, sizeof(line) - len, fence->shape.polygon.lon[i]);
+            if (fs_write(&geofenceFile, line, len) != len)
+                return U_ERROR_COMMON_DEVICE_ERROR;
+        }
+    }
+
+    if (fs_write(&geofenceFile, "\n", 1) != 1)
+        return U_ERROR_COMMON_DEVICE_ERROR;
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+static void applyGeofenceConfig(void)
+{
+    dwellSecs = DWELL_DEFAULT_SECS;
+    setIntParamFromConfig(GEOFENCE_DWELL_CONFIG, &dwellSecs);
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Returns cos() of a latitude scaled by 32768, which scales a
+/// longitude difference to the same distance as a latitude difference
+/// @param latitudeX1e7 The latitude in ten millionths of a degree
+int32_t getCosLatitudeQ15(int32_t latitudeX1e7)
+{
+    if (latitudeX1e7 < 0)
+        latitudeX1e7 = -latitudeX1e7;
+
+    int32_t degrees = latitudeX1e7 / TEN_MILLION;
+    int32_t fraction = latitudeX1e7 % TEN_MILLION;
+    if (degrees >= 90)
+        return 0;
+
+    int32_t low = cosTableQ15[degrees];
+    int32_t high = cosTableQ15[degrees + 1];
+
+    return low + (int32_t)((int64_t)(high - low) * fraction / TEN_MILLION);
+}
+
+/// @brief Creates the geofence mutex and loads the fences from the file system
+/// @return 0 on success, negative on failure
+int32_t initGeofences(void)
+{
+    if (geofenceMutex == NULL) {
+        int32_t errorCode = uPortMutexCreate(&geofenceMutex);
+        if (errorCode != 0) {
+            writeFatal("Failed to create the geofence mutex (%d)", errorCode);
+            return errorCode;
+        }
+
+        applyGeofenceConfig();
+        registerConfigChangedCallback(GEOFENCE_DWELL_CONFIG, applyGeofenceConfig);
+    }
+
+    if (loadGeofences() == 0)
+        writeLog("Loaded %d geofences", fenceCount);
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Adds a fence, replacing any fence with the same name. The
+/// parameters are "CIRCLE <name> <lat> <lon> <radius metres>" or
+/// "POLYGON <name> <lat> <lon> <lat> <lon> <lat> <lon> ..." with the
+/// coordinates in decimal degrees.
+/// @param params The fence parameters, starting with the fence type
+/// @return 0 on success, negative on failure
+int32_t addGeofence(commandParamsList_t *params)
+{
+    if (geofenceMutex == NULL)
+        return U_ERROR_COMMON_NOT_INITIALISED;
+
+    return parseAndAddGeofence(params);
+}
+
+/// @brief Removes a fence
+/// @param pName The name of the fence
+/// @return 0 on success, U_ERROR_COMMON_NOT_FOUND if there is no such fence
+int32_t removeGeofence(const char *pName)
+{
+    int32_t errorCode = U_ERROR_COMMON_NOT_FOUND;
+
+    if (geofenceMutex == NULL)
+        return U_ERROR_COMMON_NOT_INITIALISED;
+
+    U_PORT_MUTEX_LOCK(geofenceMutex);
+
+    for(int32_t i=0; i<fenceCount; i++) {
+        if (strcmp(fences[i].name, pName) == 0) {
+            memmove(&fences[i], &fences[i + 1], (fenceCount - i - 1) * sizeof(geofence_t));
+            fenceCount--;
+            rebuildGrid();
+            errorCode = U_ERROR_COMMON_SUCCESS;
+            break;
+        }
+    }
+
+    U_PORT_MUTEX_UNLOCK(geofenceMutex);
+
+    return errorCode;
+}
+
+/// @brief Removes all the fences
+void clearGeofences(void)
+{
+    if (geofenceMutex == NULL)
+        return;
+
+    U_PORT_MUTEX_LOCK(geofenceMutex);
+    fenceCount = 0;
+    rebuildGrid();
+    U_PORT_MUTEX_UNLOCK(geofenceMutex);
+}
+
+/// @brief Writes the fences to the geofence file on the file system
+/// @return 0 on success, negative on failure
+int32_t saveGeofences(void)
+{
+    int32_t errorCode = U_ERROR_COMMON_SUCCESS;
+    char path[100];
+    char tempPath[100];
+
+    if (geofenceMutex == NULL)
+        return U_ERROR_COMMON_NOT_INITIALISED;
+
+    strncpy(path, extFsPath(GEOFENCE_FILENAME), sizeof(path) - 1);
+    path[sizeof(path) - 1] = 0;
+    snprintf(tempPath, sizeof(tempPath), "%s%s", path, GEOFENCE_TEMP_SUFFIX);
+
+    if (extFsFileExists(tempPath))
+        fs_unlink(tempPath);
+
+    fs_file_t_init(&geofenceFile);
+    if (fs_open(&geofenceFile, tempPath, FS_O_CREATE | FS_O_WRITE) < 0) {
+        writeError("Failed to open the temporary geofence file");
+        return U_ERROR_COMMON_DEVICE_ERROR;
+    }
+
+    U_PORT_MUTEX_LOCK(geofenceMutex);
+    for(int32_t i=0; i<fenceCount && errorCode == U_ERROR_COMMON_SUCCESS; i++)
+        errorCode = writeGeofence(&fences[i]);
+    U_PORT_MUTEX_UNLOCK(geofenceMutex);
+
+    if (errorCode == U_ERROR_COMMON_SUCCESS && fs_sync(&geofenceFile) != 0)
+        errorCode = U_ERROR_COMMON_DEVICE_ERROR;
+
+    fs_close(&geofenceFile);
+
+    // the rename replaces the old file in one step, like the config file
+    if (errorCode == U_ERROR_COMMON_SUCCESS && fs_rename(tempPath, path) != 0)
+        errorCode = U_ERROR_COMMON_DEVICE_ERROR;
+
+    if (errorCode != U_ERROR_COMMON_SUCCESS) {
+        writeError("Failed to write the geofence file, keeping the old file");
+        fs_unlink(tempPath);
+    }
+
+    return errorCode;
+}
+
+/// @brief Returns the number of fences
+int32_t getGeofenceCount(void)
+{
+    return fenceCount;
+}
+
+/// @brief Checks a position against the fences, and returns the enter,
+/// exit and dwell events since the last check
+/// @param latitudeX1e7 The latitude in ten millionths of a degree
+/// @param longitudeX1e7 The longitude in ten millionths of a degree
+/// @param pEvents The events array, at least MAX_GEOFENCES entries
+/// @return The number of events
+int32_t checkGeofences(int32_t latitudeX1e7, int32_t longitudeX1e7, geofenceEvent_t *pEvents)
+{
+    int32_t count = 0;
+
+    if (geofenceMutex == NULL)
+        return 0;
+
+    U_PORT_MUTEX_LOCK(geofenceMutex);
+
+    int64_t now = uPortGetTickTimeMs();
+    uint32_t bucket = getGridBucket(getGridCell(latitudeX1e7), getGridCell(longitudeX1e7));
+
+    // the fences near the position, and the fences we were inside which
+    // need checking for an exit
+    uint32_t candidates = gridBuckets[bucket];
+    for(int32_t i=0; i<fenceCount; i++)
+        if (fences[i].inside)
+            candidates |= 1U << i;
+
+    for(int32_t i=0; i<fenceCount; i++) {
+        geofence_t *fence = &fences[i];
+        bool inside = (candidates & (1U << i)) != 0 &&
+                        isInsideFence(fence, latitudeX1e7, longitudeX1e7);
+        geofenceEventType_t event;
+
+        if (inside && !fence->inside) {
+            event = GEOFENCE_ENTER;
+            fence->enteredMs = now;
+            fence->dwellReported = false;
+        } else if (!inside && fence->inside) {
+            event = GEOFENCE_EXIT;
+        } else if (inside && !fence->dwellReported && dwellSecs > 0 &&
+                        now - fence->enteredMs >= (int64_t)dwellSecs * 1000) {
+            event = GEOFENCE_DWELL;
+            fence->dwellReported = true;
+        } else {
+            continue;
+        }
+
+        fence->inside = inside;
+        strncpy(pEvents[count].name, fence->name, GEOFENCE_NAME_SIZE);
+        pEvents[count].event = event;
+        count++;
+    }
+
+    U_PORT_MUTEX_UNLOCK(geofenceMutex);
+
+    return count;
+}
+
+/// @brief Returns the name of a geofence event
+const char *getGeofenceEventName(geofenceEventType_t event)
+{
+    switch(event) {
+        case GEOFENCE_ENTER:    return "ENTER";
+        case GEOFENCE_EXIT:     return "EXIT";
+        case GEOFENCE_DWELL:    return "DWELL";
+        default:                return "UNKNOWN";
+    }
+}
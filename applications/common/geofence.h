@@ -0,0 +1,99 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * On-device geofences
+ *
+ */
+
+#ifndef _GEOFENCE_H_
+#define _GEOFENCE_H_
+
+/* ----------------------------------------------------------------
+ * DEFINITIONS
+ * -------------------------------------------------------------- */
+#define GEOFENCE_FILENAME "geofences.txt"
+
+// The fences which are inside each grid bucket are a bitmask, so
+// there can't be more than 32 fences
+#define MAX_GEOFENCES 32
+#define MAX_GEOFENCE_VERTICES 12
+#define GEOFENCE_NAME_SIZE 16
+
+/* ----------------------------------------------------------------
+ * PUBLIC TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+typedef enum {
+    GEOFENCE_ENTER,
+    GEOFENCE_EXIT,
+    GEOFENCE_DWELL
+} geofenceEventType_t;
+
+/// An event from checking a position against the fences
+typedef struct {
+    char name[GEOFENCE_NAME_SIZE];
+    geofenceEventType_t event;
+} geofenceEvent_t;
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Creates the geofence mutex and loads the fences from the file system
+/// @return 0 on success, negative on failure
+int32_t initGeofences(void);
+
+/// @brief Adds a fence, replacing any fence with the same name. The
+/// parameters are "CIRCLE <name> <lat> <lon> <radius metres>" or
+/// "POLYGON <name> <lat> <lon> <lat> <lon> <lat> <lon> ..." with the
+/// coordinates in decimal degrees.
+/// @param params The fence parameters, starting with the fence type
+/// @return 0 on success, negative on failure
+int32_t addGeofence(commandParamsList_t *params);
+
+/// @brief Removes a fence
+/// @param pName The name of the fence
+/// @return 0 on success, U_ERROR_COMMON_NOT_FOUND if there is no such fence
+int32_t removeGeofence(const char *pName);
+
+/// @brief Removes all the fences
+void clearGeofences(void);
+
+/// @brief Writes the fences to the geofence file on the file system
+/// @return 0 on success, negative on failure
+int32_t saveGeofences(void);
+
+/// @brief Returns the number of fences
+int32_t getGeofenceCount(void);
+
+/// @brief Checks a position against the fences, and returns the enter,
+/// exit and dwell events since the last check
+/// @param latitudeX1e7 The latitude in ten millionths of a degree
+/// @param longitudeX1e7 The longitude in ten millionths of a degree
+/// @param pEvents The events array, at least MAX_GEOFENCES entries
+/// @return The number of events
+int32_t checkGeofences(int32_t latitudeX1e7, int32_t longitudeX1e7, geofenceEvent_t *pEvents);
+
+/// @brief Returns cos() of a latitude scaled by 32768, which scales a
+/// longitude difference to the same distance as a latitude difference
+/// @param latitudeX1e7 The latitude in ten millionths of a degree
+int32_t getCosLatitudeQ15(int32_t latitudeX1e7);
+
+/// @brief Returns the name of a geofence event
+const char *getGeofenceEventName(geofenceEventType_t event);
+
+#endif
@@ -0,0 +1,313 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Measurement records, published through sinks.
+ *
+ * A task makes a measurement record once, with typed integer values, and
+ * publishMeasurement() gives it to each registered sink. Each sink
+ * formats it once for its own output: the MQTT task as JSON, the log as
+ * text, and so on. A new output is a new sink, and the tasks which make
+ * the measurements don't change.
+ *
+ */
+
+#include <sys/crc.h>
+
+#include "common.h"
+#include "measurement.h"
+#include "sensors.h"        // MILLI_FORMAT
+
+/* ----------------------------------------------------------------
+ * DEFINES
+ * -------------------------------------------------------------- */
+#define LOG_TEXT_SIZE 320
+
+/* ----------------------------------------------------------------
+ * TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+typedef struct {
+    const char *pName;
+    measurementSink_t sink;
+} sinkEntry_t;
+
+/* ----------------------------------------------------------------
+ * STATIC VARIABLES
+ * -------------------------------------------------------------- */
+static sinkEntry_t sinks[MAX_MEASUREMENT_SINKS];
+static int32_t sinkCount = 0;
+
+// Held while the sinks are called, so they are called one at a time
+static uPortMutexHandle_t sinkMutex = NULL;
+
+// the transport of the measurements which aren't events
+static atomic_t telemetryTransport = ATOMIC_INIT(TRANSPORT_MQTT);
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+static bool isSameGroup(const char *pGroup1, const char *pGroup2)
+{
+    if (pGroup1 == NULL || pGroup2 == NULL)
+        return pGroup1 == pGroup2;
+
+    return strcmp(pGroup1, pGroup2) == 0;
+}
+
+static int32_t formatValue(char *pBuffer, size_t size, const measurementField_t *pField)
+{
+    int32_t v = pField->value;
+
+    switch(pField->format) {
+        case FIELD_MILLI:
+            return snprintf(pBuffer, size, MILLI_FORMAT, MILLI_ARGS(v));
+
+        case FIELD_INT_TEXT:
+            return snprintf(pBuffer, size, "\"%d\"", v);
+
+        case FIELD_MILLI_TEXT:
+            return snprintf(pBuffer, size, "\"" MILLI_FORMAT "\"", MILLI_ARGS(v));
+
+        default:
+            return snprintf(pBuffer, size, "%d", v);
+    }
+}
+
+/// @brief The log sink, which writes each measurement as one line of
+/// text, eg "Sensors: Temperature.Pressure=1013.25 Temperature.Humidity=45.20"
+static void logSink(const measurement_t *pMeasurement)
+{
+    static char text[LOG_TEXT_SIZE];
+
+    int32_t len = snprintf(text, sizeof(text), "%s:", pMeasurement->pSource);
+    for(int32_t i=0; i<pMeasurement->fieldCount && len < LOG_TEXT_SIZE; i++) {
+        const measurementField_t *pField = &pMeasurement->fields[i];
+        int32_t v = pField->value;
+
+        if (pField->pGroup != NULL)
+            len += snprintf(text + len, LOG_TEXT_SIZE - len, " %s.%s=", pField->pGroup, pField->pName);
+        else
+            len += snprintf(text + len, LOG_TEXT_SIZE - len, " %s=", pField->pName);
+
+        if (len >= LOG_TEXT_SIZE)
+            break;
+
+        if (pField->format == FIELD_MILLI || pField->format == FIELD_MILLI_TEXT)
+            len += snprintf(text + len, LOG_TEXT_SIZE - len, MILLI_FORMAT, MILLI_ARGS(v));
+        else
+            len += snprintf(text + len, LOG_TEXT_SIZE - len, "%d", v);
+    }
+
+    writeAlways("%s", text);
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Creates the measurement mutex and registers the log sink
+/// @return 0 on success, negative on failure
+int32_t initMeasurements(void)
+{
+    if (sinkMutex != NULL)
+        return U_ERROR_COMMON_SUCCESS;
+
+    int32_t errorCode = uPortMutexCreate(&sinkMutex);
+    if (errorCode != 0) {
+        writeFatal("Failed to create the measurement sink mutex (%d)", errorCode);
+        return errorCode;
+    }
+
+    return registerMeasurementSink("Log", logSink);
+}
+
+/// @brief Adds a sink, which every measurement is given to
+/// @param pName The name of the sink, for logging
+/// @param sink The sink function
+/// @return 0 on success, negative on failure
+int32_t registerMeasurementSink(const char *pName, measurementSink_t sink)
+{
+    if (sinkMutex == NULL)
+        return U_ERROR_COMMON_NOT_INITIALISED;
+
+    int32_t errorCode = U_ERROR_COMMON_SUCCESS;
+
+    U_PORT_MUTEX_LOCK(sinkMutex);
+    if (sinkCount < MAX_MEASUREMENT_SINKS) {
+        sinks[sinkCount].pName = pName;
+        sinks[sinkCount].sink = sink;
+        sinkCount++;
+    } else {
+        errorCode = U_ERROR_COMMON_NO_MEMORY;
+    }
+    U_PORT_MUTEX_UNLOCK(sinkMutex);
+
+    if (errorCode == 0)
+        writeDebug("Measurement sink %s registered", pName);
+    else
+        writeError("Too many measurement sinks, %s not registered", pName);
+
+    return errorCode;
+}
+
+/// @brief Starts a new measurement, with the current time
+/// @param pMeasurement The measurement to start
+/// @param pSource The name of the task which made it
+/// @param pTopicName The MQTT topic it is published on
+/// @param pName The top level JSON object name, or NULL
+void startMeasurement(measurement_t *pMeasurement, const char *pSource, const char *pTopicName, const char *pName)
+{
+    pMeasurement->pSource = pSource;
+    pMeasurement->pTopicName = pTopicName;
+    pMeasurement->pName = pName;
+    pMeasurement->timestamp = unixNetworkTime + (uPortGetTickTimeMs() / 1000);
+    pMeasurement->reliable = false;
+    pMeasurement->fieldCount = 0;
+}
+
+/// @brief Adds a value to a measurement
+/// @param pMeasurement The measurement
+/// @param pGroup The JSON object the value is in, or NULL
+/// @param pName The name of the value
+/// @param value The value, in thousandths for the milli formats
+/// @param format How the value is formatted
+void addMeasurementField(measurement_t *pMeasurement, const char *pGroup, const char *pName,
+                            int32_t value, measurementFormat_t format)
+{
+    if (pMeasurement->fieldCount >= MAX_MEASUREMENT_FIELDS) {
+        writeError("Too many fields in the %s measurement, %s not added", pMeasurement->pSource, pName);
+        return;
+    }
+
+    measurementField_t *pField = &pMeasurement->fields[pMeasurement->fieldCount++];
+    pField->pGroup = pGroup;
+    pField->pName = pName;
+    pField->value = value;
+    pField->format = format;
+}
+
+/// @brief Gives a measurement to every sink
+/// @param pMeasurement The measurement
+void publishMeasurement(const measurement_t *pMeasurement)
+{
+    if (sinkMutex == NULL)
+        return;
+
+    U_PORT_MUTEX_LOCK(sinkMutex);
+    for(int32_t i=0; i<sinkCount; i++)
+        sinks[i].sink(pMeasurement);
+    U_PORT_MUTEX_UNLOCK(sinkMutex);
+}
+
+/// @brief Formats a measurement as JSON, eg
+/// {"Temperature": {"Temperature":"21.50", "Pressure":"1013.25"}}
+/// @param pMeasurement The measurement
+/// @param pBuffer The buffer to write to
+/// @param size The size of the buffer
+/// @return The length of the JSON, negative if it didn't fit
+int32_t formatMeasurementJson(const measurement_t *pMeasurement, char *pBuffer, size_t size)
+{
+    const char *pGroup = NULL;
+    int32_t len;
+
+    if (pMeasurement->pName != NULL)
+        len = snprintf(pBuffer, size, "{\"%s\":{", pMeasurement->pName);
+    else
+        len = snprintf(pBuffer, size, "{");
+
+    for(int32_t i=0; i<pMeasurement->fieldCount && len < size; i++) {
+        const measurementField_t *pField = &pMeasurement->fields[i];
+        const char *pSeparator = (i > 0) ? ", " : "";
+
+        // close the last group, and open this one
+        if (!isSameGroup(pField->pGroup, pGroup)) {
+            if (pGroup != NULL) {
+                len += snprintf(pBuffer + len, size - len, "}");
+                if (len >= size)
+                    break;
+            }
+
+            if (pField->pGroup != NULL)
+                len += snprintf(pBuffer + len, size - len, "%s\"%s\": {", pSeparator, pField->pGroup);
+
+            pSeparator = (pField->pGroup != NULL) ? "" : pSeparator;
+            pGroup = pField->pGroup;
+            if (len >= size)
+                break;
+        }
+
+        len += snprintf(pBuffer + len, size - len, "%s\"%s\":", pSeparator, pField->pName);
+        if (len >= size)
+            break;
+
+        len += formatValue(pBuffer + len, size - len, pField);
+    }
+
+    if (len < size && pGroup != NULL)
+        len += snprintf(pBuffer + len, size - len, "}");
+    if (len < size && pMeasurement->pName != NULL)
+        len += snprintf(pBuffer + len, size - len, "}");
+    if (len < size)
+        len += snprintf(pBuffer + len, size - len, "}");
+
+    return (len < size) ? len : -1;
+}
+
+/// @brief Formats the metric name of a measurement field, the JSON object
+/// names joined with dots, eg "Temperature.Pressure" or "Vibration.RMS.X"
+/// @param pMeasurement The measurement
+/// @param pField The field of the measurement
+/// @param pBuffer The buffer to write to
+/// @param size The size of the buffer
+void formatMetricName(const measurement_t *pMeasurement, const measurementField_t *pField,
+                        char *pBuffer, size_t size)
+{
+    snprintf(pBuffer, size, "%s%s%s%s%s",
+                pMeasurement->pName != NULL ? pMeasurement->pName : "",
+                pMeasurement->pName != NULL ? "." : "",
+                pField->pGroup != NULL ? pField->pGroup : "",
+                pField->pGroup != NULL ? "." : "",
+                pField->pName);
+}
+
+/// @brief Returns the ID of a metric, the CRC32 of its name
+/// @param pMetric The metric name, eg "Temperature.Pressure"
+/// @return The metric ID
+uint32_t getMetricId(const char *pMetric)
+{
+    return crc32_ieee((const uint8_t *)pMetric, strlen(pMetric));
+}
+
+/// @brief Sets the transport of the measurements which aren't events
+/// @param transport The transport
+void setTelemetryTransport(measurementTransport_t transport)
+{
+    atomic_set(&telemetryTransport, transport);
+}
+
+/// @brief Returns the transport a measurement is published on. Events
+/// which must not be lost are always published on MQTT.
+/// @param pMeasurement The measurement
+/// @return The transport
+measurementTransport_t getMeasurementTransport(const measurement_t *pMeasurement)
+{
+    if (pMeasurement->reliable)
+        return TRANSPORT_MQTT;
+
+    return (measurementTransport_t)atomic_get(&telemetryTransport);
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Measurement records and the sinks which publish them
+ *
+ */
+
+#ifndef _MEASUREMENT_H_
+#define _MEASUREMENT_H_
+
+/* ----------------------------------------------------------------
+ * DEFINITIONS
+ * -------------------------------------------------------------- */
+#define MAX_MEASUREMENT_FIELDS 16
+#define MAX_MEASUREMENT_SINKS 6
+
+/* ----------------------------------------------------------------
+ * PUBLIC TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+typedef enum {
+    FIELD_INT,                  // an integer, eg 42
+    FIELD_MILLI,                // thousandths, with two decimal places, eg 0.45
+    FIELD_INT_TEXT,             // as FIELD_INT, but a JSON string, eg "42"
+    FIELD_MILLI_TEXT            // as FIELD_MILLI, but a JSON string, eg "0.45"
+} measurementFormat_t;
+
+/// One value of a measurement. Fields with the same group next to each
+/// other are in the same JSON object.
+typedef struct {
+    const char *pGroup;         // NULL if the field isn't in a group
+    const char *pName;
+    int32_t value;
+    measurementFormat_t format;
+} measurementField_t;
+
+/// A measurement, made once and given to every sink to publish in its
+/// own format
+typedef struct {
+    const char *pSource;        // the name of the task which made it
+    const char *pTopicName;     // the MQTT topic it is published on
+    const char *pName;          // the top level JSON object, or NULL
+    int64_t timestamp;          // unix time
+    bool reliable;              // an event which must not be lost
+    int32_t fieldCount;
+    measurementField_t fields[MAX_MEASUREMENT_FIELDS];
+} measurement_t;
+
+/// The transport a measurement is published on
+typedef enum {
+    TRANSPORT_MQTT,
+    TRANSPORT_UDP               // fire and forget binary telemetry
+} measurementTransport_t;
+
+/// A sink, which publishes each measurement. Sinks are called one at
+/// a time, so they can use their own static buffers.
+typedef void (*measurementSink_t)(const measurement_t *pMeasurement);
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Creates the measurement mutex and registers the log sink
+/// @return 0 on success, negative on failure
+int32_t initMeasurements(void);
+
+/// @brief Adds a sink, which every measurement is given to
+/// @param pName The name of the sink, for logging
+/// @param sink The sink function
+/// @return 0 on success, negative on failure
+int32_t registerMeasurementSink(const char *pName, measurementSink_t sink);
+
+/// @brief Starts a new measurement, with the current time
+/// @param pMeasurement The measurement to start
+/// @param pSource The name of the task which made it
+/// @param pTopicName The MQTT topic it is published on
+/// @param pName The top level JSON object name, or NULL
+void startMeasurement(measurement_t *pMeasurement, const char *pSource, const char *pTopicName, const char *pName);
+
+/// @brief Adds a value to a measurement
+/// @param pMeasurement The measurement
+/// @param pGroup The JSON object the value is in, or NULL
+/// @param pName The name of the value
+/// @param value The value, in thousandths for the milli formats
+/// @param format How the value is formatted
+void addMeasurementField(measurement_t *pMeasurement, const char *pGroup, const char *pName,
+                            int32_t value, measurementFormat_t format);
+
+/// @brief Gives a measurement to every sink
+/// @param pMeasurement The measurement
+void publishMeasurement(const measurement_t *pMeasurement);
+
+/// @brief Formats a measurement as JSON, eg
+/// {"Temperature": {"Temperature":"21.50", "Pressure":"1013.25"}}
+/// @param pMeasurement The measurement
+/// @param pBuffer The buffer to write to
+/// @param size The size of the buffer
+/// @return The length of the JSON, negative if it didn't fit
+int32_t formatMeasurementJson(const measurement_t *pMeasurement, char *pBuffer, size_t size);
+
+/// @brief Formats the metric name of a measurement field, the JSON object
+/// names joined with dots, eg "Temperature.Pressure" or "Vibration.RMS.X"
+/// @param pMeasurement The measurement
+/// @param pField The field of the measurement
+/// @param pBuffer The buffer to write to
+/// @param size The size of the buffer
+void formatMetricName(const measurement_t *pMeasurement, const measurementField_t *pField,
+                        char *pBuffer, size_t size);
+
+/// @brief Returns the ID of a metric, the CRC32 of its name
+/// @param pMetric The metric name, eg "Temperature.Pressure"
+/// @return The metric ID
+uint32_t getMetricId(const char *pMetric);
+
+/// @brief Sets the transport of the measurements which aren't events
+/// @param transport The transport
+void setTelemetryTransport(measurementTransport_t transport);
+
+/// @brief Returns the transport a measurement is published on. Events
+/// which must not be lost are always published on MQTT.
+/// @param pMeasurement The measurement
+/// @return The transport
+measurementTransport_t getMeasurementTransport(const measurement_t *pMeasurement);
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Cached snapshot of the cellular radio state. The AT interface to the
+ * module is the slowest resource in the application, so the radio
+ * parameters are read once and shared by every task which needs them,
+ * and the operator information is only read when the network registers.
+ *
+ */
+
+#include "common.h"
+#include "radioCache.h"
+
+/* ----------------------------------------------------------------
+ * STATIC VARIABLES
+ * -------------------------------------------------------------- */
+static radioSnapshot_t snapshot;
+
+// Held while reading from the module, so only one read is made at a time
+static uPortMutexHandle_t refreshMutex = NULL;
+
+// Held while the snapshot is copied or updated
+static uPortMutexHandle_t snapshotMutex = NULL;
+
+// Set while the modem is busy with a long running command, so callers
+// get the cached snapshot instead of waiting for the modem
+static atomic_t refreshHeld = ATOMIC_INIT(0);
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+static bool isSnapshotFresh(int32_t maxAgeMs)
+{
+    bool fresh;
+
+    U_PORT_MUTEX_LOCK(snapshotMutex);
+    fresh = snapshot.timestampMs > 0 && (uPortGetTickTimeMs() - snapshot.timestampMs) <= maxAgeMs;
+    U_PORT_MUTEX_UNLOCK(snapshotMutex);
+
+    return fresh;
+}
+
+static int32_t refreshRadioParameters(void)
+{
+    radioSnapshot_t radio;
+
+    int32_t errorCode = uCellInfoRefreshRadioParameters(gDeviceHandle);
+    if (errorCode == 0) {
+        radio.rsrp = uCellInfoGetRsrpDbm(gDeviceHandle);
+        radio.rsrq = uCellInfoGetRsrqDb(gDeviceHandle);
+        radio.rssi = uCellInfoGetRssiDbm(gDeviceHandle);
+        radio.rxQual = uCellInfoGetRxQual(gDeviceHandle);
+        uCellInfoGetSnrDb(gDeviceHandle, &radio.snr);
+        radio.cellId = uCellInfoGetCellId(gDeviceHandle);
+        radio.earfcn = uCellInfoGetEarfcn(gDeviceHandle);
+    }
+
+    U_PORT_MUTEX_LOCK(snapshotMutex);
+    snapshot.timestampMs = uPortGetTickTimeMs();
+    snapshot.radioValid = (errorCode == 0);
+    if (errorCode == 0) {
+        snapshot.rsrp = radio.rsrp;
+        snapshot.rsrq = radio.rsrq;
+        snapshot.rssi = radio.rssi;
+        snapshot.snr = radio.snr;
+        snapshot.rxQual = radio.rxQual;
+        snapshot.cellId = radio.cellId;
+        snapshot.earfcn = radio.earfcn;
+    }
+    U_PORT_MUTEX_UNLOCK(snapshotMutex);
+
+    return errorCode;
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Creates the radio cache mutexes
+/// @return 0 on success, negative on failure
+int32_t initRadioCache(void)
+{
+    int32_t errorCode = U_ERROR_COMMON_SUCCESS;
+
+    if (snapshotMutex == NULL) {
+        errorCode = uPortMutexCreate(&snapshotMutex);
+        if (errorCode != 0) {
+            writeFatal("Failed to create the radio snapshot mutex (%d)", errorCode);
+            return errorCode;
+        }
+    }
+
+    if (refreshMutex == NULL) {
+        errorCode = uPortMutexCreate(&refreshMutex);
+        if (errorCode != 0) {
+            writeFatal("Failed to create the radio refresh mutex (%d)", errorCode);
+            return errorCode;
+        }
+    }
+
+    clearRadioSnapshot();
+
+    return errorCode;
+}
+
+/// @brief Gets a copy of the radio snapshot. The radio parameters are only
+/// read from the module if the snapshot is older than maxAgeMs, and only
+/// one caller reads them at a time, so concurrent callers share the read.
+/// @param pSnapshot Where to copy the snapshot to
+/// @param maxAgeMs The maximum age of the radio parameters in milliseconds,
+/// or RADIO_SNAPSHOT_CACHED_ONLY to never read them from the module
+/// @return 0 on success, or the error of reading the radio parameters
+int32_t getRadioSnapshot(radioSnapshot_t *pSnapshot, int32_t maxAgeMs)
+{
+    int32_t errorCode = U_ERROR_COMMON_SUCCESS;
+
+    if (snapshotMutex == NULL)
+        return U_ERROR_COMMON_NOT_INITIALISED;
+
+    if (maxAgeMs >= 0 && !isSnapshotFresh(maxAgeMs) && atomic_get(&refreshHeld)) {
+        errorCode = U_ERROR_COMMON_BUSY;
+    } else if (maxAgeMs >= 0 && !isSnapshotFresh(maxAgeMs)) {
+        U_PORT_MUTEX_LOCK(refreshMutex);
+        // another caller may have refreshed it while we waited
+        if (!isSnapshotFresh(maxAgeMs))
+            errorCode = refreshRadioParameters();
+        U_PORT_MUTEX_UNLOCK(refreshMutex);
+    }
+
+    U_PORT_MUTEX_LOCK(snapshotMutex);
+    *pSnapshot = snapshot;
+    if (errorCode == 0 && !snapshot.radioValid)
+        errorCode = U_ERROR_COMMON_NOT_FOUND;
+    U_PORT_MUTEX_UNLOCK(snapshotMutex);
+
+    return errorCode;
+}
+
+/// @brief Stops the radio parameters being read from the module, while
+/// it is busy with a long running command like a network scan. Callers get
+/// the cached snapshot, and U_ERROR_COMMON_BUSY if it is older than they want.
+/// @param hold true to stop reading the radio parameters, false to allow it
+void holdRadioRefresh(bool hold)
+{
+    atomic_set(&refreshHeld, hold ? 1 : 0);
+}
+
+/// @brief Reads the operator name and MCC/MNC from the module, if they
+/// are not already cached. Called when the network registers.
+/// @param force Read them even if they are already cached
+/// @return 0 on success, negative on failure
+int32_t refreshOperatorInfo(bool force)
+{
+    char operatorName[OPERATOR_NAME_SIZE];
+    int32_t mcc = 0;
+    int32_t mnc = 0;
+    bool cached;
+
+    if (snapshotMutex == NULL)
+        return U_ERROR_COMMON_NOT_INITIALISED;
+
+    U_PORT_MUTEX_LOCK(snapshotMutex);
+    cached = snapshot.operatorValid;
+    U_PORT_MUTEX_UNLOCK(snapshotMutex);
+
+    if (cached && !force)
+        return U_ERROR_COMMON_SUCCESS;
+
+    // request the PLMN / network operator information
+    int32_t errorCode = uCellNetGetOperatorStr(gDeviceHandle, operatorName, OPERATOR_NAME_SIZE);
+    if (errorCode < 0) {
+        writeWarn("Failed to get operator name: %d", errorCode);
+        return errorCode;
+    }
+
+    errorCode = uCellNetGetMccMnc(gDeviceHandle, &mcc, &mnc);
+    if (errorCode < 0) {
+        writeWarn("Failed to get MCC/MNC: %d", errorCode);
+        return errorCode;
+    }
+
+    U_PORT_MUTEX_LOCK(snapshotMutex);
+    strncpy(snapshot.operatorName, operatorName, OPERATOR_NAME_SIZE);
+    snapshot.operatorName[OPERATOR_NAME_SIZE - 1] = 0;
+    snapshot.mcc = mcc;
+    snapshot.mnc = mnc;
+    snapshot.operatorValid = true;
+    U_PORT_MUTEX_UNLOCK(snapshotMutex);
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Clears the cached operator and radio information, when the
+/// network is lost
+void clearRadioSnapshot(void)
+{
+    if (snapshotMutex == NULL)
+        return;
+
+    U_PORT_MUTEX_LOCK(snapshotMutex);
+    memset(&snapshot, 0, sizeof(snapshot));
+    strncpy(snapshot.operatorName, "Unknown", OPERATOR_NAME_SIZE);
+    U_PORT_MUTEX_UNLOCK(snapshotMutex);
+}
+
+/// @brief Formats the cached PLMN as MCC and MNC digits, eg "23410"
+/// @param pBuffer The buffer to write to
+/// @param size The size of the buffer
+/// @return true if the operator information is valid
+bool getCachedPlmn(char *pBuffer, size_t size)
+{
+    bool valid;
+
+    if (snapshotMutex == NULL)
+        return false;
+
+    U_PORT_MUTEX_LOCK(snapshotMutex);
+    valid = snapshot.operatorValid;
+    snprintf(pBuffer, size, "%03d%02d", snapshot.mcc, snapshot.mnc);
+    U_PORT_MUTEX_UNLOCK(snapshotMutex);
+
+    return valid;
+}
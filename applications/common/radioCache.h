@@ -0,0 +1,94 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Cached snapshot of the cellular radio state, shared by the tasks
+ *
+ */
+
+#ifndef _RADIO_CACHE_H_
+#define _RADIO_CACHE_H_
+
+/* ----------------------------------------------------------------
+ * DEFINITIONS
+ * -------------------------------------------------------------- */
+// Pass as the maximum age to only read the cached snapshot, never refresh it
+#define RADIO_SNAPSHOT_CACHED_ONLY -1
+
+/* ----------------------------------------------------------------
+ * PUBLIC TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+
+/// The cellular radio state. The radio parameters and the operator
+/// information are read separately, so each has its own valid flag.
+typedef struct {
+    int64_t timestampMs;            // tick time of the last radio refresh, 0 if never
+    bool radioValid;                // the last radio refresh succeeded
+    int32_t rsrp;
+    int32_t rsrq;
+    int32_t rssi;
+    int32_t snr;
+    int32_t rxQual;
+    int32_t cellId;
+    int32_t earfcn;
+
+    bool operatorValid;             // read when the network registers
+    char operatorName[OPERATOR_NAME_SIZE];
+    int32_t mcc;
+    int32_t mnc;
+} radioSnapshot_t;
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Creates the radio cache mutexes
+/// @return 0 on success, negative on failure
+int32_t initRadioCache(void);
+
+/// @brief Gets a copy of the radio snapshot. The radio parameters are only
+/// read from the module if the snapshot is older than maxAgeMs, and only
+/// one caller reads them at a time, so concurrent callers share the read.
+/// @param pSnapshot Where to copy the snapshot to
+/// @param maxAgeMs The maximum age of the radio parameters in milliseconds,
+/// or RADIO_SNAPSHOT_CACHED_ONLY to never read them from the module
+/// @return 0 on success, or the error of reading the radio parameters
+int32_t getRadioSnapshot(radioSnapshot_t *pSnapshot, int32_t maxAgeMs);
+
+/// @brief Stops the radio parameters being read from the module, while
+/// it is busy with a long running command like a network scan. Callers get
+/// the cached snapshot, and U_ERROR_COMMON_BUSY if it is older than they want.
+/// @param hold true to stop reading the radio parameters, false to allow it
+void holdRadioRefresh(bool hold);
+
+/// @brief Reads the operator name and MCC/MNC from the module, if they
+/// are not already cached. Called when the network registers.
+/// @param force Read them even if they are already cached
+/// @return 0 on success, negative on failure
+int32_t refreshOperatorInfo(bool force);
+
+/// @brief Clears the cached operator and radio information, when the
+/// network is lost
+void clearRadioSnapshot(void);
+
+/// @brief Formats the cached PLMN as MCC and MNC digits, eg "23410"
+/// @param pBuffer The buffer to write to
+/// @param size The size of the buffer
+/// @return true if the operator information is valid
+bool getCachedPlmn(char *pBuffer, size_t size);
+
+#endif
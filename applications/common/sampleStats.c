@@ -0,0 +1,185 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Running statistics of integer samples in fixed memory. The mean and
+ * standard deviation come from the running sum and sum of squares, and
+ * the percentiles from a histogram with one bin per unit, so the memory
+ * used doesn't depend on the number of samples. Everything is integer
+ * maths so no floating point printf support is needed.
+ *
+ */
+
+#include "common.h"
+#include "sampleStats.h"
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+static uint64_t squareRoot(uint64_t value)
+{
+    uint64_t result = 0;
+    uint64_t bit = (uint64_t)1 << 62;
+
+    while (bit > value)
+        bit >>= 2;
+
+    while (bit != 0) {
+        if (value >= result + bit) {
+            value -= result + bit;
+            result = (result >> 1) + bit;
+        } else {
+            result >>= 1;
+        }
+        bit >>= 2;
+    }
+
+    return result;
+}
+
+/// @brief Formats a value multiplied by 10 with one decimal place
+static int32_t formatX10(char *pBuffer, size_t size, int32_t valueX10)
+{
+    const char *sign = valueX10 < 0 ? "-" : "";
+    if (valueX10 < 0)
+        valueX10 = -valueX10;
+
+    return snprintf(pBuffer, size, "%s%d.%d", sign, valueX10 / 10, valueX10 % 10);
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Clears the statistics
+/// @param pStats The statistics to clear
+/// @param histogramMin The lowest value which has its own histogram bin,
+/// the histogram covers histogramMin to histogramMin + SAMPLE_STATS_BINS - 1
+void resetSampleStats(sampleStats_t *pStats, int32_t histogramMin)
+{
+    memset(pStats, 0, sizeof(sampleStats_t));
+    pStats->histogramMin = histogramMin;
+}
+
+/// @brief Adds a sample to the statistics
+/// @param pStats The statistics
+/// @param value The sample value
+void addSampleToStats(sampleStats_t *pStats, int32_t value)
+{
+    if (pStats->count == 0 || value < pStats->min)
+        pStats->min = value;
+    if (pStats->count == 0 || value > pStats->max)
+        pStats->max = value;
+
+    pStats->count++;
+    pStats->sum += value;
+    pStats->sumSquares += (int64_t)value * value;
+
+    int32_t bin = value - pStats->histogramMin;
+    if (bin < 0)
+        bin = 0;
+    else if (bin >= SAMPLE_STATS_BINS)
+        bin = SAMPLE_STATS_BINS - 1;
+
+    if (pStats->bins[bin] < UINT16_MAX)
+        pStats->bins[bin]++;
+}
+
+/// @brief Returns the mean of the samples multiplied by 10
+int32_t getStatsMeanX10(const sampleStats_t *pStats)
+{
+    if (pStats->count == 0)
+        return 0;
+
+    // round to the nearest, away from zero
+    int64_t sumX10 = pStats->sum * 10;
+    int64_t half = pStats->count / 2;
+
+    return (int32_t)((sumX10 + (sumX10 < 0 ? -half : half)) / (int64_t)pStats->count);
+}
+
+/// @brief Returns the standard deviation of the samples multiplied by 10
+int32_t getStatsStdDevX10(const sampleStats_t *pStats)
+{
+    if (pStats->count < 2)
+        return 0;
+
+    // variance * n^2 = n * sum(x^2) - sum(x)^2, which is exact in integers
+    int64_t n = pStats->count;
+    int64_t varianceN2 = n * pStats->sumSquares - pStats->sum * pStats->sum;
+    if (varianceN2 <= 0)
+        return 0;
+
+    return (int32_t)(squareRoot((uint64_t)varianceN2 * 100) / n);
+}
+
+/// @brief Returns an approximate percentile of the samples, to the
+/// nearest unit within the histogram range
+/// @param pStats The statistics
+/// @param percent The percentile, 0 to 100
+int32_t getStatsPercentile(const sampleStats_t *pStats, int32_t percent)
+{
+    if (pStats->count == 0)
+        return 0;
+
+    uint32_t total = 0;
+    for(int i=0; i<SAMPLE_STATS_BINS; i++)
+        total += pStats->bins[i];
+
+    // the rank of the sample, rounded up, so P0 is the lowest sample
+    uint32_t rank = (total * percent + 99) / 100;
+    if (rank == 0)
+        rank = 1;
+
+    uint32_t seen = 0;
+    for(int i=0; i<SAMPLE_STATS_BINS; i++) {
+        seen += pStats->bins[i];
+        if (seen >= rank) {
+            // the end bins also hold the samples outside of the range
+            int32_t value = pStats->histogramMin + i;
+            if (value < pStats->min) value = pStats->min;
+            if (value > pStats->max) value = pStats->max;
+            return value;
+        }
+    }
+
+    return pStats->max;
+}
+
+/// @brief Writes the statistics as a JSON object, eg
+/// "RSRP":{"Min":-101,"Max":-95,"Mean":-97.4,"StdDev":1.2,"P10":-100,"P50":-97,"P90":-96}
+/// @param pBuffer The buffer to write to
+/// @param size The size of the buffer
+/// @param pName The name of the JSON object
+/// @param pStats The statistics
+/// @return The number of characters written, as snprintf()
+int32_t formatSampleStats(char *pBuffer, size_t size, const char *pName, const sampleStats_t *pStats)
+{
+    char mean[16];
+    char stdDev[16];
+
+    formatX10(mean, sizeof(mean), getStatsMeanX10(pStats));
+    formatX10(stdDev, sizeof(stdDev), getStatsStdDevX10(pStats));
+
+    return snprintf(pBuffer, size,
+                "\"%s\":{\"Min\":%d,\"Max\":%d,\"Mean\":%s,\"StdDev\":%s,\"P10\":%d,\"P50\":%d,\"P90\":%d}",
+                pName, pStats->min, pStats->max, mean, stdDev,
+                getStatsPercentile(pStats, 10),
+                getStatsPercentile(pStats, 50),
+                getStatsPercentile(pStats, 90));
+}
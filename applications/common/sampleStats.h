@@ -0,0 +1,84 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Running statistics of integer samples in fixed memory
+ *
+ */
+
+#ifndef _SAMPLE_STATS_H_
+#define _SAMPLE_STATS_H_
+
+/* ----------------------------------------------------------------
+ * DEFINITIONS
+ * -------------------------------------------------------------- */
+// Number of histogram bins, one per unit, used for the percentiles.
+// Samples outside of the histogram range are counted in the end bins.
+#define SAMPLE_STATS_BINS 128
+
+/* ----------------------------------------------------------------
+ * PUBLIC TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+
+/// Running min/max/sum/sum of squares, and a histogram of the samples
+typedef struct {
+    int32_t histogramMin;           // the value of the first histogram bin
+    uint32_t count;
+    int32_t min;
+    int32_t max;
+    int64_t sum;
+    int64_t sumSquares;
+    uint16_t bins[SAMPLE_STATS_BINS];
+} sampleStats_t;
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Clears the statistics
+/// @param pStats The statistics to clear
+/// @param histogramMin The lowest value which has its own histogram bin,
+/// the histogram covers histogramMin to histogramMin + SAMPLE_STATS_BINS - 1
+void resetSampleStats(sampleStats_t *pStats, int32_t histogramMin);
+
+/// @brief Adds a sample to the statistics
+/// @param pStats The statistics
+/// @param value The sample value
+void addSampleToStats(sampleStats_t *pStats, int32_t value);
+
+/// @brief Returns the mean of the samples multiplied by 10
+int32_t getStatsMeanX10(const sampleStats_t *pStats);
+
+/// @brief Returns the standard deviation of the samples multiplied by 10
+int32_t getStatsStdDevX10(const sampleStats_t *pStats);
+
+/// @brief Returns an approximate percentile of the samples, to the
+/// nearest unit within the histogram range
+/// @param pStats The statistics
+/// @param percent The percentile, 0 to 100
+int32_t getStatsPercentile(const sampleStats_t *pStats, int32_t percent);
+
+/// @brief Writes the statistics as a JSON object, eg
+/// "RSRP":{"Min":-101,"Max":-95,"Mean":-97.4,"StdDev":1.2,"P10":-100,"P50":-97,"P90":-96}
+/// @param pBuffer The buffer to write to
+/// @param size The size of the buffer
+/// @param pName The name of the JSON object
+/// @param pStats The statistics
+/// @return The number of characters written, as snprintf()
+int32_t formatSampleStats(char *pBuffer, size_t size, const char *pName, const sampleStats_t *pStats);
+
+#endif
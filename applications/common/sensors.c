@@ -24,9 +24,21 @@
 //#include <math.h>
 #include <zephyr.h>
 
+#include "sensors.h"
+
 const struct device *gpBme280Dev;
 const struct device *gpLis2dhDev;
 const struct device *gLtr303Dev;
+const struct device *gpBq274xxDev;
+
+/// @brief Held around each fetch and read of a sensor. The sampling jobs,
+/// the motion job and the data ready trigger thread all read the sensors,
+/// and a fetch from one thread would overwrite the sample another thread
+/// hasn't read yet.
+static K_MUTEX_DEFINE(bme280Mutex);
+static K_MUTEX_DEFINE(lis2dhMutex);
+static K_MUTEX_DEFINE(ltr303Mutex);
+static K_MUTEX_DEFINE(bq274xxMutex);
 
 #define INIT_SENSOR(sensor_name, p)                                                                           \
   {                                                                                                           \
@@ -36,27 +48,118 @@ const struct device *gLtr303Dev;
     }                                                                                                         \
   }
 
-static float decodeVal(struct sensor_value *sensVal)
+/// @brief Converts a sensor value to thousandths of its unit, without
+/// floating point. val2 is in millionths and has the same sign as val1.
+static int32_t toMilli(struct sensor_value *sensVal)
 {
-    return (float)(sensVal->val1 + sensVal->val2 / 1000000.0);
+    return sensVal->val1 * 1000 + sensVal->val2 / 1000;
 }
 
+/// @brief the accelerometer data ready stream, see startAccelerometerStream()
+static bool accelStreaming = false;
+static accelSampleCallback_t streamCallback = NULL;
+
+/// @brief the latest reading of each sensor, double buffered. The reading
+/// is written to the buffer which isn't current, then the sequence number
+/// is incremented to make it current, so readers never wait for a sensor.
+static sensorReading_t readings[SENSOR_COUNT][2];
+static atomic_t readingSeq[SENSOR_COUNT];
+static atomic_t readingWriter[SENSOR_COUNT];
+
 static char temp_buffer[100];
 static char acc_buffer[100];
 static char light_buffer[25];
 
-int32_t getTempSensor(float *temp, float *pressure, float *humidity)
+/// @brief Stores a new reading of a sensor. If another thread is storing
+/// a reading of the same sensor at the same time, this one is dropped.
+static void storeReading(sensorId_t id, int32_t value0, int32_t value1, int32_t value2)
+{
+    if (!atomic_cas(&readingWriter[id], 0, 1))
+        return;
+
+    atomic_val_t seq = atomic_get(&readingSeq[id]);
+    sensorReading_t *pReading = &readings[id][(seq + 1) & 1];
+
+    pReading->timestampMs = k_uptime_get();
+    pReading->values[0] = value0;
+    pReading->values[1] = value1;
+    pReading->values[2] = value2;
+
+    atomic_set(&readingSeq[id], seq + 1);
+    atomic_set(&readingWriter[id], 0);
+}
+
+/// @brief Reads each new sample when the accelerometer data ready
+/// interrupt fires. This runs on the sensor driver's trigger thread.
+static void accelDataReady(const struct device *dev, const struct sensor_trigger *trig)
+{
+    struct sensor_value accel[3];
+    int errorCode = -1;
+
+    k_mutex_lock(&lis2dhMutex, K_FOREVER);
+    if (sensor_sample_fetch(dev) >= 0)
+        errorCode = sensor_channel_get(dev, SENSOR_CHAN_ACCEL_XYZ, accel);
+    k_mutex_unlock(&lis2dhMutex);
+
+    if (errorCode != 0)
+        return;
+
+    int32_t x = toMilli(&accel[0]);
+    int32_t y = toMilli(&accel[1]);
+    int32_t z = toMilli(&accel[2]);
+
+    storeReading(SENSOR_ACCEL, x, y, z);
+
+    accelSampleCallback_t callback = streamCallback;
+    if (callback != NULL)
+        callback(x, y, z);
+}
+
+/// @brief Integer square root, rounded down
+uint32_t integerSqrt(uint64_t value)
 {
-    if (gpBme280Dev && sensor_sample_fetch(gpBme280Dev) == 0) {
-        struct sensor_value tempVal, pressVal, humidityVal;
+    uint64_t root = 0;
+    uint64_t bit = 1ULL << 62;
+
+    while (bit > value)
+        bit >>= 2;
+
+    while (bit != 0) {
+        if (value >= root + bit) {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+
+    return (uint32_t)root;
+}
+
+int32_t getTempSensor(int32_t *milliC, int32_t *pressurePa, int32_t *milliPercent)
+{
+    struct sensor_value tempVal, pressVal, humidityVal;
+    bool fetched = false;
+
+    if (gpBme280Dev == NULL)
+        return -1;
+
+    k_mutex_lock(&bme280Mutex, K_FOREVER);
+    if (sensor_sample_fetch(gpBme280Dev) == 0) {
         sensor_channel_get(gpBme280Dev, SENSOR_CHAN_AMBIENT_TEMP, &tempVal);
         sensor_channel_get(gpBme280Dev, SENSOR_CHAN_PRESS, &pressVal);
         sensor_channel_get(gpBme280Dev, SENSOR_CHAN_HUMIDITY, &humidityVal);
+        fetched = true;
+    }
+    k_mutex_unlock(&bme280Mutex);
 
-        *temp = decodeVal(&tempVal);
-        *pressure = decodeVal(&pressVal) * 10;
-        *humidity = decodeVal(&humidityVal);
+    if (fetched) {
+        *milliC = toMilli(&tempVal);
+        *pressurePa = toMilli(&pressVal);     // the driver gives kPa, so this is Pa
+        *milliPercent = toMilli(&humidityVal);
 
+        storeReading(SENSOR_ENVIRONMENT, *milliC, *pressurePa, *milliPercent);
         return 0;
     }
 
@@ -66,58 +169,171 @@ int32_t getTempSensor(float *temp, float *pressure, float *humidity)
 const char *pollTempSensor(void)
 {
     temp_buffer[0] = 0;
-    float temp, pressure, humidity;
+    int32_t temp, pressure, humidity;
 
     if (getTempSensor(&temp, &pressure, &humidity) == 0) {
         snprintf(temp_buffer, sizeof(temp_buffer),
-                 "Temp: %.2f C, Press: %.2f hPa, Humidity: %.2f %%",
-                 temp, pressure, humidity);
+                 "Temp: " MILLI_FORMAT " C, Press: " MILLI_FORMAT " hPa, Humidity: " MILLI_FORMAT " %%",
+                 MILLI_ARGS(temp), MILLI_ARGS(pressure * 10), MILLI_ARGS(humidity));
     }
 
     return temp_buffer;
 }
 
-int32_t getAccelerometer(float *x, float *y, float *z)
+int32_t getAccelerometer(int32_t *x, int32_t *y, int32_t *z)
 {
-    if (gpLis2dhDev && sensor_sample_fetch(gpLis2dhDev) >= 0) {
-        struct sensor_value accel[3];
-        if (sensor_channel_get(gpLis2dhDev, SENSOR_CHAN_ACCEL_XYZ, accel) == 0) {
-            *x = decodeVal(&accel[0]) / 10;
-            *y = decodeVal(&accel[1]) / 10;
-            *z = decodeVal(&accel[2]) / 10;
+    // the driver is reading the samples itself, so use the latest one
+    sensorReading_t reading;
+    if (accelStreaming && getSensorReading(SENSOR_ACCEL, &reading)) {
+        *x = reading.values[0];
+        *y = reading.values[1];
+        *z = reading.values[2];
 
-            return 0;
-        }
+        return 0;
     }
 
-    return -1;
+    if (gpLis2dhDev == NULL)
+        return -1;
+
+    struct sensor_value accel[3];
+    int errorCode = -1;
+
+    k_mutex_lock(&lis2dhMutex, K_FOREVER);
+    if (sensor_sample_fetch(gpLis2dhDev) >= 0)
+        errorCode = sensor_channel_get(gpLis2dhDev, SENSOR_CHAN_ACCEL_XYZ, accel);
+    k_mutex_unlock(&lis2dhMutex);
+
+    if (errorCode != 0)
+        return -1;
+
+    *x = toMilli(&accel[0]);
+    *y = toMilli(&accel[1]);
+    *z = toMilli(&accel[2]);
+
+    storeReading(SENSOR_ACCEL, *x, *y, *z);
+    return 0;
 }
 
-/*
-void getPosition(float ax, float ay, float az, float *px, float *py, float *pz)
+/// @brief Integer approximation of atan2(), within 0.15 degrees.
+/// atan(t) for 0 <= t <= 1 is about 45t + t(1 - t)(14.02 + 3.80t) degrees.
+int32_t atan2MilliDegrees(int32_t y, int32_t x)
 {
-    double xAngle = atan( (double)(ax / (sqrt(ay*ay + az*az))));
-    double yAngle = atan( (double)(ay / (sqrt(ax*ax + az*az))));
-    double zAngle = atan( (double)(sqrt(ax*ax + ay*ay) / az));
+    uint32_t ay = (uint32_t)abs(y);
+    uint32_t ax = (uint32_t)abs(x);
 
-    xAngle *= 180.00; yAngle *= 180.00; zAngle *= 180.00;
-    xAngle /= 3.141592; yAngle /= 3.141592; zAngle /= 3.141592;
+    if (ax == 0 && ay == 0)
+        return 0;
+
+    // the ratio of the smaller to the larger side, 0 to 1 in Q15
+    bool steep = ay > ax;
+    int32_t t = (int32_t)(((uint64_t)(steep ? ax : ay) << 15) / (steep ? ay : ax));
+
+    // in hundredths of a degree
+    int32_t angle = (4500 * t) >> 15;
+    angle += (int32_t)(((((int64_t)t * (32768 - t)) >> 15) * (1402 + ((380 * t) >> 15))) >> 15);
 
-    *px = xAngle;
-    *py = yAngle;
-    *pz = zAngle;
+    if (steep)
+        angle = 9000 - angle;
+    if (x < 0)
+        angle = 18000 - angle;
+    if (y < 0)
+        angle = -angle;
+
+    return angle * 10;
+}
+
+/// @brief Gets the angles of the X and Y axes from the horizontal, and of
+/// the Z axis from the vertical, from the acceleration of gravity
+void getPosition(int32_t ax, int32_t ay, int32_t az, int32_t *px, int32_t *py, int32_t *pz)
+{
+    uint64_t xx = (int64_t)ax * ax;
+    uint64_t yy = (int64_t)ay * ay;
+    uint64_t zz = (int64_t)az * az;
+
+    *px = atan2MilliDegrees(ax, (int32_t)integerSqrt(yy + zz));
+    *py = atan2MilliDegrees(ay, (int32_t)integerSqrt(xx + zz));
+    *pz = atan2MilliDegrees((int32_t)integerSqrt(xx + yy), az);
+}
+
+/// @brief Sets the accelerometer output data rate, and calls the callback
+/// with every sample from the data ready interrupt
+int32_t startAccelerometerStream(int32_t rateHz, accelSampleCallback_t callback)
+{
+    if (gpLis2dhDev == NULL || !device_is_ready(gpLis2dhDev))
+        return -1;
+
+    struct sensor_value odr = {rateHz, 0};
+    k_mutex_lock(&lis2dhMutex, K_FOREVER);
+    int errorCode = sensor_attr_set(gpLis2dhDev, SENSOR_CHAN_ACCEL_XYZ, SENSOR_ATTR_SAMPLING_FREQUENCY, &odr);
+    k_mutex_unlock(&lis2dhMutex);
+
+    if (errorCode != 0) {
+        printf("Failed to set the accelerometer rate to %d Hz\n", rateHz);
+        return -1;
+    }
+
+    streamCallback = callback;
+
+    struct sensor_trigger trig = {
+        .type = SENSOR_TRIG_DATA_READY,
+        .chan = SENSOR_CHAN_ACCEL_XYZ
+    };
+
+    if (sensor_trigger_set(gpLis2dhDev, &trig, accelDataReady) != 0) {
+        printf("Failed to set the accelerometer data ready trigger\n");
+        streamCallback = NULL;
+        return -1;
+    }
+
+    accelStreaming = true;
+    return 0;
+}
+
+/// @brief Stops the data ready interrupt
+void stopAccelerometerStream(void)
+{
+    if (gpLis2dhDev == NULL || !accelStreaming)
+        return;
+
+    struct sensor_trigger trig = {
+        .type = SENSOR_TRIG_DATA_READY,
+        .chan = SENSOR_CHAN_ACCEL_XYZ
+    };
+
+    sensor_trigger_set(gpLis2dhDev, &trig, NULL);
+    accelStreaming = false;
+    streamCallback = NULL;
+}
+
+/// @brief Returns true while the accelerometer data ready stream is running
+bool isAccelerometerStreaming(void)
+{
+    return accelStreaming;
+}
+
+/// @brief Gets the latest reading of a sensor, without reading the sensor
+bool getSensorReading(sensorId_t id, sensorReading_t *pReading)
+{
+    atomic_val_t seq;
+
+    // read again if a new reading was stored while copying this one
+    do {
+        seq = atomic_get(&readingSeq[id]);
+        *pReading = readings[id][seq & 1];
+    } while (seq != atomic_get(&readingSeq[id]));
+
+    return seq != 0;
 }
-*/
 
 const char *pollAccelerometer(void)
 {
-    float x, y, z;
+    int32_t x, y, z;
 
     acc_buffer[0] = 0;
     if (getAccelerometer(&x, &y, &z) == 0)  {
         snprintf(acc_buffer, sizeof(acc_buffer),
-                    "Accel: X = %.3f g, Y = %.3f g, Z = %.3f g",
-                    x, y, z);
+                    "Accel: X = " MILLI_FORMAT " g, Y = " MILLI_FORMAT " g, Z = " MILLI_FORMAT " g",
+                    MILLI_ARGS(MILLI_G(x)), MILLI_ARGS(MILLI_G(y)), MILLI_ARGS(MILLI_G(z)));
     }
 
     return acc_buffer;
@@ -125,47 +341,91 @@ const char *pollAccelerometer(void)
 
 #define ALS_GAIN 1
 #define ALS_INT 2
-#define pFfactor .16
+
+// the channel coefficients are in ten thousandths, and the package
+// factor of 0.16 is in hundredths
+#define ALS_DIVISOR (ALS_GAIN * ALS_INT * 16 * 10000 / 100)
 
 static int32_t convToLux(struct sensor_value *adc_val)
 {
-    int32_t newval, ch0, ch1;
+    int64_t newval;
+    int32_t ch0, ch1;
     int32_t r1, r2, r3;
 
     ch0 = adc_val->val1;
     ch1 = adc_val->val2;
     r1 = (ch1 * 100);
     r2 = (ch0 + ch1);
-    if ((r1 != 0) || (r2 != 0)) {
+    if (r2 != 0) {
         r3 = r1 / r2;
     } else {
         r3 = 0;
     }
     if (r3 < 45) {
-        newval = (1.7743 * ch0 + 1.1059 * ch1) / ALS_GAIN / ALS_INT / pFfactor;
+        newval = (17743LL * ch0 + 11059LL * ch1) / ALS_DIVISOR;
     } else if ((r3 < 64) && (r3 >= 45)) {
-        newval = (4.2785 * ch0 - 1.9548 * ch1) / ALS_GAIN / ALS_INT / pFfactor;
+        newval = (42785LL * ch0 - 19548LL * ch1) / ALS_DIVISOR;
     } else if ((r3 < 85) && (r3 >= 64)) {
-        newval = (.5926 * ch0 + .1185 * ch1) / ALS_GAIN / ALS_INT / pFfactor;
+        newval = (5926LL * ch0 + 1185LL * ch1) / ALS_DIVISOR;
     } else {
         newval = 0;
     }
 
-    return newval;
+    return newval < 0 ? 0 : (int32_t)newval;
 }
 
 int32_t getLightSensor()
 {
     struct sensor_value adc;
     int32_t luxVal = 0;
-    if (gLtr303Dev && sensor_sample_fetch(gLtr303Dev) >= 0) {
+    bool fetched = false;
+
+    if (gLtr303Dev == NULL)
+        return 0;
+
+    k_mutex_lock(&ltr303Mutex, K_FOREVER);
+    if (sensor_sample_fetch(gLtr303Dev) >= 0) {
         sensor_channel_get(gLtr303Dev, SENSOR_CHAN_LIGHT, &adc);
+        fetched = true;
+    }
+    k_mutex_unlock(&ltr303Mutex);
+
+    if (fetched) {
         luxVal = convToLux(&adc);
+        storeReading(SENSOR_LIGHT, luxVal, 0, 0);
     }
 
     return luxVal;
 }
 
+int32_t getBatteryGauge(int32_t *pStateOfCharge, int32_t *pAvgCurrentMa, int32_t *pVoltageMv)
+{
+    struct sensor_value soc, current, voltage;
+    bool fetched = false;
+
+    if (gpBq274xxDev == NULL || !device_is_ready(gpBq274xxDev))
+        return -1;
+
+    k_mutex_lock(&bq274xxMutex, K_FOREVER);
+    if (sensor_sample_fetch(gpBq274xxDev) >= 0) {
+        fetched = sensor_channel_get(gpBq274xxDev, SENSOR_CHAN_GAUGE_STATE_OF_CHARGE, &soc) == 0 &&
+                    sensor_channel_get(gpBq274xxDev, SENSOR_CHAN_GAUGE_AVG_CURRENT, &current) == 0 &&
+                    sensor_channel_get(gpBq274xxDev, SENSOR_CHAN_GAUGE_VOLTAGE, &voltage) == 0;
+    }
+    k_mutex_unlock(&bq274xxMutex);
+
+    if (!fetched)
+        return -1;
+
+    // the state of charge is in whole %, the current in A and the voltage in V
+    *pStateOfCharge = soc.val1;
+    *pAvgCurrentMa = toMilli(&current);
+    *pVoltageMv = toMilli(&voltage);
+
+    storeReading(SENSOR_BATTERY, *pStateOfCharge, *pAvgCurrentMa, *pVoltageMv);
+    return 0;
+}
+
 const char *pollLightSensor()
 {
     snprintf(light_buffer, sizeof(light_buffer), "Light = %d lux", getLightSensor());
@@ -177,4 +437,5 @@ void sensorsInit()
     INIT_SENSOR(bosch_bme280, gpBme280Dev);
     INIT_SENSOR(st_lis2dh, gpLis2dhDev);
     INIT_SENSOR(ltr_303als, gLtr303Dev);
+    INIT_SENSOR(ti_bq274xx, gpBq274xxDev);
 }
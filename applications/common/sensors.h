@@ -14,20 +14,90 @@
  * limitations under the License.
  */
 
+#ifndef _SENSORS_H_
+#define _SENSORS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* ----------------------------------------------------------------
+ * DEFINITIONS
+ * -------------------------------------------------------------- */
+// The sensor values are integers in thousandths of their unit, these
+// format them with two decimal places, eg "T:" MILLI_FORMAT, MILLI_ARGS(t)
+#define MILLI_FORMAT "%s%d.%02d"
+#define MILLI_ARGS(v) ((v) < 0 ? "-" : ""), (int32_t)(abs(v) / 1000), (int32_t)((abs(v) % 1000) / 10)
+
+// milli m/s2 to milli g
+#define MILLI_G(v) ((v) * 1000 / 9807)
+
+/// Called with each accelerometer sample, in milli m/s2
+typedef void (*accelSampleCallback_t)(int32_t x, int32_t y, int32_t z);
+
+typedef enum {
+    SENSOR_ACCEL,               // X, Y, Z in milli m/s2
+    SENSOR_ENVIRONMENT,         // milli C, Pa, milli %
+    SENSOR_LIGHT,               // lux
+    SENSOR_BATTERY,             // state of charge %, average current mA, voltage mV
+    SENSOR_COUNT
+} sensorId_t;
+
+/// The latest reading of a sensor
+typedef struct {
+    int64_t timestampMs;        // uptime when the sensor was read
+    int32_t values[3];
+} sensorReading_t;
+
 /**
  * Initiate environment sensor and accelerometer
  */
 void sensorsInit();
 
-/// @brief Gets the X, Y, Z acceleration.
+/// @brief Gets the X, Y, Z acceleration, in milli m/s2
+/// @return 0 on success, -1 on failure
+int32_t getAccelerometer(int32_t *x, int32_t *y, int32_t *z);
+
+/// @brief Gets the angles of the X and Y axes from the horizontal, and of
+/// the Z axis from the vertical, from the acceleration of gravity
+/// @param ax, ay, az The acceleration in any units
+/// @param px, py, pz The angles in milli degrees
+void getPosition(int32_t ax, int32_t ay, int32_t az, int32_t *px, int32_t *py, int32_t *pz);
+
+/// @brief Integer approximation of atan2(), within 0.15 degrees
+/// @return The angle in milli degrees, -180000 to 180000
+int32_t atan2MilliDegrees(int32_t y, int32_t x);
+
+/// @brief Sets the accelerometer output data rate, and calls the callback
+/// with every sample from the data ready interrupt. getAccelerometer()
+/// returns the latest sample while the stream is running.
+/// @param rateHz The output data rate, one of the LIS2DH rates 1, 10,
+/// 25, 50, 100, 200 or 400Hz
+/// @param callback The function to call on the sensor driver's thread
 /// @return 0 on success, -1 on failure
-int32_t getAccelerometer(float *x, float *y, float *z);
+int32_t startAccelerometerStream(int32_t rateHz, accelSampleCallback_t callback);
+
+/// @brief Stops the data ready interrupt
+void stopAccelerometerStream(void);
 
-// void getPosition(float ax, float ay, float az, float *px, float *py, float *pz);
+/// @brief Returns true while the accelerometer data ready stream is running
+bool isAccelerometerStreaming(void);
 
-/// @brief Gets the temperature, pressure and humidity
+/// @brief Gets the latest reading of a sensor, without reading the sensor.
+/// The readings are stored by getAccelerometer(), getTempSensor(),
+/// getLightSensor() and the accelerometer stream.
+/// @param id The sensor
+/// @param pReading Where to copy the reading to
+/// @return true if the sensor has been read
+bool getSensorReading(sensorId_t id, sensorReading_t *pReading);
+
+/// @brief Integer square root, rounded down
+uint32_t integerSqrt(uint64_t value);
+
+/// @brief Gets the temperature in milli C, the pressure in Pa and the
+/// humidity in milli %
 /// @return 0 on success, -1 on failure
-int32_t getTempSensor(float *temp, float *pressure, float *humidity);
+int32_t getTempSensor(int32_t *milliC, int32_t *pressurePa, int32_t *milliPercent);
 
 /**
  * Get a string with environment sensor values
@@ -47,4 +117,14 @@ const char *pollLightSensor();
 /**
  * Get light sensor value in lux
  */
-int32_t getLightSensor();
\ No newline at end of file
+int32_t getLightSensor();
+
+/// @brief Reads the battery fuel gauge
+/// @param pStateOfCharge The state of charge in %
+/// @param pAvgCurrentMa The average battery current in mA, positive
+/// while charging and negative while discharging
+/// @param pVoltageMv The battery voltage in mV
+/// @return 0 on success, -1 if there is no gauge or it can't be read
+int32_t getBatteryGauge(int32_t *pStateOfCharge, int32_t *pAvgCurrentMa, int32_t *pVoltageMv);
+
+#endif
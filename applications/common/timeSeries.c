@@ -0,0 +1,519 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Measurement history, stored as a time series on the file system.
+ *
+ * The time series is a measurement sink. Each measurement field is stored
+ * as a fixed size binary record: the time, the metric ID (the CRC32 of
+ * the metric name, eg "Temperature.Pressure"), the value and a CRC16 of
+ * the record. The records are appended to segment files of 1024 records
+ * in the history directory, and a new segment is started when one is
+ * full. The oldest segments are removed by age and by the total size.
+ *
+ * The index of the segments, with the first and last time of each, is
+ * kept in RAM so a query only reads the segments in its time range, and
+ * as the records are in time order and of a fixed size, the start of the
+ * range in a segment is found with a binary search.
+ *
+ * Records are buffered in RAM and written a block at a time, at least
+ * every minute, to save flash wear. A record which was only half written
+ * when the power went is cut off, or fails its CRC and is skipped.
+ *
+ */
+
+#include <sys/crc.h>
+
+#include "common.h"
+#include "ext_fs.h"
+#include "measurement.h"
+#include "timeSeries.h"
+
+/* ----------------------------------------------------------------
+ * DEFINES
+ * -------------------------------------------------------------- */
+#define SEGMENT_SUFFIX ".ts"
+#define PATH_SIZE 100
+
+#define SEGMENT_RECORDS 1024
+#define SEGMENT_KB (SEGMENT_RECORDS * sizeof(tsRecord_t) / 1024)
+#define MAX_SEGMENTS 128
+
+#define WRITE_BUFFER_RECORDS 32
+#define FLUSH_INTERVAL_MS 60000
+
+#define READ_BLOCK_RECORDS 16
+
+// values from before the network time is known (1st Jan 2020) aren't stored
+#define MIN_VALID_TIME 1577836800
+
+#define SECONDS_PER_DAY 86400
+
+#define RECORD_FLAG_MILLI 0x01
+
+/* ----------------------------------------------------------------
+ * TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+typedef struct {
+    uint32_t timestamp;
+    uint32_t metricId;
+    int32_t value;
+    uint8_t flags;
+    uint8_t reserved;
+    uint16_t crc;               // of the bytes before
+} tsRecord_t;
+
+typedef struct {
+    uint32_t number;
+    uint32_t firstTime;
+    uint32_t lastTime;
+    uint32_t count;
+} segment_t;
+
+/* ----------------------------------------------------------------
+ * STATIC VARIABLES
+ * -------------------------------------------------------------- */
+
+/// @brief the segment index, oldest first
+static segment_t segments[MAX_SEGMENTS];
+static int32_t segmentCount = 0;
+
+/// @brief the records waiting to be written
+static tsRecord_t writeBuffer[WRITE_BUFFER_RECORDS];
+static int32_t bufferCount = 0;
+
+/// @brief HISTORY_MAX_KB in segments, 0 is off
+static int32_t maxSegments = TIME_SERIES_MAX_KB_DEFAULT / SEGMENT_KB;
+static int32_t retentionDays = TIME_SERIES_RETENTION_DAYS_DEFAULT;
+
+static uPortMutexHandle_t storeMutex = NULL;
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+static uint16_t getRecordCrc(const tsRecord_t *pRecord)
+{
+    return crc16_ccitt(0xFFFF, (const uint8_t *)pRecord, offsetof(tsRecord_t, crc));
+}
+
+static uint32_t getUnixTime(void)
+{
+    return (uint32_t)(unixNetworkTime + (uPortGetTickTimeMs() / 1000));
+}
+
+static void getSegmentPath(char *pPath, uint32_t number)
+{
+    snprintf(pPath, PATH_SIZE, "%s/%s/%08u%s", extFsMountPoint()->mnt_point,
+                TIME_SERIES_DIR, number, SEGMENT_SUFFIX);
+}
+
+static bool readRecords(struct fs_file_t *pFile, uint32_t index, tsRecord_t *pRecords, uint32_t count)
+{
+    size_t size = count * sizeof(tsRecord_t);
+
+    if (fs_seek(pFile, index * sizeof(tsRecord_t), FS_SEEK_SET) != 0)
+        return false;
+
+    return fs_read(pFile, pRecords, size) == size;
+}
+
+/// @brief Finds the first record of a segment at or after a time
+static uint32_t findFirstRecord(struct fs_file_t *pFile, uint32_t count, uint32_t from)
+{
+    uint32_t low = 0;
+    uint32_t high = count;
+    tsRecord_t record;
+
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (!readRecords(pFile, middle, &record, 1))
+            return 0;
+
+        if (record.timestamp < from)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+/// @brief Reads the size and time range of a segment file, and cuts off
+/// a record which was only half written
+static bool loadSegment(uint32_t number, segment_t *pSegment)
+{
+    char path[PATH_SIZE];
+    struct fs_file_t file;
+    size_t size;
+    tsRecord_t first, last;
+
+    getSegmentPath(path, number);
+    if (!extFsFileSize(path, &size))
+        return false;
+
+    fs_file_t_init(&file);
+    if (fs_open(&file, path, FS_O_RDWR) < 0)
+        return false;
+
+    uint32_t count = size / sizeof(tsRecord_t);
+    if (size % sizeof(tsRecord_t) != 0) {
+        writeWarn("Time series segment %u has a partial record, removing it", number);
+        fs_truncate(&file, count * sizeof(tsRecord_t));
+    }
+
+    bool ok = count > 0 && readRecords(&file, 0, &first, 1) && readRecords(&file, count - 1, &last, 1);
+    fs_close(&file);
+
+    if (!ok) {
+        fs_unlink(path);
+        return false;
+    }
+
+    pSegment->number = number;
+    pSegment->firstTime = first.timestamp;
+    pSegment->lastTime = last.timestamp;
+    pSegment->count = count;
+
+    return true;
+}
+
+/// @brief Adds a segment to the index, keeping it in number order
+static void addToIndex(segment_t *pSegment)
+{
+    int32_t i = segmentCount;
+    while (i > 0 && segments[i - 1].number > pSegment->number) {
+        segments[i] = segments[i - 1];
+        i--;
+    }
+
+    segments[i] = *pSegment;
+    segmentCount++;
+}
+
+static void loadIndex(const char *pDirPath)
+{
+    struct fs_dir_t dir;
+    static struct fs_dirent entry;
+    segment_t segment;
+
+    fs_dir_t_init(&dir);
+    if (fs_opendir(&dir, pDirPath) != 0) {
+        writeError("Failed to open the time series directory");
+        return;
+    }
+
+    while (fs_readdir(&dir, &entry) == 0 && entry.name[0] != 0) {
+        char *pEnd;
+        uint32_t number = strtoul(entry.name, &pEnd, 10);
+        if (strcmp(pEnd, SEGMENT_SUFFIX) != 0)
+            continue;
+
+        if (segmentCount == MAX_SEGMENTS) {
+            writeWarn("Too many time series segments, %s not loaded", entry.name);
+            continue;
+        }
+
+        if (loadSegment(number, &segment))
+            addToIndex(&segment);
+    }
+
+    fs_closedir(&dir);
+}
+
+/// @brief Removes the oldest segment, called with the store mutex held
+static void removeOldestSegment(void)
+{
+    char path[PATH_SIZE];
+
+    getSegmentPath(path, segments[0].number);
+    if (fs_unlink(path) != 0)
+        writeWarn("Failed to remove time series segment %u", segments[0].number);
+
+    segmentCount--;
+    memmove(&segments[0], &segments[1], segmentCount * sizeof(segment_t));
+}
+
+/// @brief Removes the segments which are too old, or over the size
+/// limit. The segment being written is never removed.
+static void removeOldSegments(void)
+{
+    uint32_t now = getUnixTime();
+    uint32_t oldest = 0;
+
+    uint32_t retentionSecs = (uint32_t)retentionDays * SECONDS_PER_DAY;
+
+    if (retentionDays > 0 && now > MIN_VALID_TIME + retentionSecs)
+        oldest = now - retentionSecs;
+
+    while (segmentCount > 1 && (segmentCount > maxSegments || segments[0].lastTime < oldest))
+        removeOldestSegment();
+}
+
+/// @brief Starts a new segment, called with the store mutex held
+static segment_t *addSegment(void)
+{
+    if (segmentCount == MAX_SEGMENTS)
+        removeOldestSegment();
+
+    segment_t *pSegment = &segments[segmentCount];
+    pSegment->number = (segmentCount > 0) ? segments[segmentCount - 1].number + 1 : 1;
+    pSegment->firstTime = 0;
+    pSegment->lastTime = 0;
+    pSegment->count = 0;
+    segmentCount++;
+
+    removeOldSegments();
+
+    return &segments[segmentCount - 1];
+}
+
+static int32_t appendRecords(segment_t *pSegment, const tsRecord_t *pRecords, uint32_t count)
+{
+    char path[PATH_SIZE];
+    struct fs_file_t file;
+    size_t size = count * sizeof(tsRecord_t);
+
+    getSegmentPath(path, pSegment->number);
+    fs_file_t_init(&file);
+    if (fs_open(&file, path, FS_O_CREATE | FS_O_APPEND | FS_O_WRITE) < 0)
+        return U_ERROR_COMMON_DEVICE_ERROR;
+
+    bool ok = fs_write(&file, pRecords, size) == size;
+    fs_close(&file);
+
+    if (!ok)
+        return U_ERROR_COMMON_DEVICE_ERROR;
+
+    if (pSegment->count == 0)
+        pSegment->firstTime = pRecords[0].timestamp;
+    pSegment->lastTime = pRecords[count - 1].timestamp;
+    pSegment->count += count;
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Writes the buffered records to the segments, called with the
+/// store mutex held. If the write fails the records are dropped, so a
+/// failing file system doesn't hold up the measurements.
+static void writeBufferedRecords(void)
+{
+    int32_t written = 0;
+
+    while (written < bufferCount) {
+        segment_t *pSegment = (segmentCount > 0) ? &segments[segmentCount - 1] : NULL;
+        if (pSegment == NULL || pSegment->count >= SEGMENT_RECORDS)
+            pSegment = addSegment();
+
+        int32_t count = MIN(bufferCount - written, (int32_t)(SEGMENT_RECORDS - pSegment->count));
+        if (appendRecords(pSegment, &writeBuffer[written], count) != 0) {
+            writeError("Failed to write %d time series records", bufferCount - written);
+            break;
+        }
+
+        written += count;
+    }
+
+    bufferCount = 0;
+}
+
+static void flushJob(void *pParam, size_t paramLengthBytes)
+{
+    flushTimeSeries();
+}
+
+/// @brief The time series measurement sink, which buffers a record for
+/// each field of a measurement
+static void timeSeriesSink(const measurement_t *pMeasurement)
+{
+    char metric[TIME_SERIES_METRIC_SIZE];
+
+    if (maxSegments == 0 || pMeasurement->timestamp < MIN_VALID_TIME)
+        return;
+
+    U_PORT_MUTEX_LOCK(storeMutex);
+
+    for(int32_t i=0; i<pMeasurement->fieldCount; i++) {
+        const measurementField_t *pField = &pMeasurement->fields[i];
+
+        // eg "Temperature.Pressure", or "Vibration.RMS.X"
+        formatMetricName(pMeasurement, pField, metric, sizeof(metric));
+
+        tsRecord_t *pRecord = &writeBuffer[bufferCount++];
+        pRecord->timestamp = (uint32_t)pMeasurement->timestamp;
+        pRecord->metricId = getMetricId(metric);
+        pRecord->value = pField->value;
+        pRecord->flags = (pField->format == FIELD_MILLI || pField->format == FIELD_MILLI_TEXT) ? RECORD_FLAG_MILLI : 0;
+        pRecord->reserved = 0;
+        pRecord->crc = getRecordCrc(pRecord);
+
+        if (bufferCount == WRITE_BUFFER_RECORDS)
+            writeBufferedRecords();
+    }
+
+    U_PORT_MUTEX_UNLOCK(storeMutex);
+}
+
+static void applyTimeSeriesConfig(void)
+{
+    int32_t maxKb = TIME_SERIES_MAX_KB_DEFAULT;
+    int32_t days = TIME_SERIES_RETENTION_DAYS_DEFAULT;
+
+    setIntParamFromConfig("HISTORY_MAX_KB", &maxKb);
+    setIntParamFromConfig("HISTORY_RETENTION_DAYS", &days);
+
+    U_PORT_MUTEX_LOCK(storeMutex);
+    maxSegments = (maxKb == 0) ? 0 : MAX(2, MIN(MAX_SEGMENTS, maxKb / (int32_t)SEGMENT_KB));
+    retentionDays = days;
+    if (maxSegments > 0)
+        removeOldSegments();
+    U_PORT_MUTEX_UNLOCK(storeMutex);
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Loads the index of the stored segments, and registers the
+/// time series as a measurement sink
+/// @return 0 on success, negative on failure
+int32_t initTimeSeries(void)
+{
+    char dirPath[PATH_SIZE];
+
+    if (storeMutex != NULL)
+        return U_ERROR_COMMON_SUCCESS;
+
+    int32_t errorCode = uPortMutexCreate(&storeMutex);
+    if (errorCode != 0) {
+        writeFatal("Failed to create the time series mutex (%d)", errorCode);
+        return errorCode;
+    }
+
+    snprintf(dirPath, sizeof(dirPath), "%s/%s", extFsMountPoint()->mnt_point, TIME_SERIES_DIR);
+    if (!extFsFileExists(dirPath) && fs_mkdir(dirPath) != 0) {
+        writeError("Failed to create the time series directory");
+        return U_ERROR_COMMON_DEVICE_ERROR;
+    }
+
+    loadIndex(dirPath);
+    applyTimeSeriesConfig();
+    registerConfigChangedCallback("HISTORY_", applyTimeSeriesConfig);
+
+    writeLog("Time series has %d segments", segmentCount);
+
+    errorCode = addPeriodicJob("TimeSeriesFlush", flushJob, FLUSH_INTERVAL_MS);
+    if (errorCode < 0)
+        return errorCode;
+
+    return registerMeasurementSink("TimeSeries", timeSeriesSink);
+}
+
+/// @brief Writes the buffered values to the file system
+void flushTimeSeries(void)
+{
+    if (storeMutex == NULL)
+        return;
+
+    U_PORT_MUTEX_LOCK(storeMutex);
+    if (bufferCount > 0)
+        writeBufferedRecords();
+    U_PORT_MUTEX_UNLOCK(storeMutex);
+}
+
+/// @brief Reads the stored values of a metric, oldest first
+/// @param pMetric The metric name, eg "Temperature.Pressure"
+/// @param from The unix time of the first value
+/// @param to The unix time of the last value
+/// @param callback Called for each value, without the store locked
+/// @param pContext Passed to the callback
+/// @return The number of values read, or negative on failure
+int32_t readTimeSeries(const char *pMetric, uint32_t from, uint32_t to,
+                        timeSeriesCallback_t callback, void *pContext)
+{
+    tsRecord_t block[READ_BLOCK_RECORDS];
+    char path[PATH_SIZE];
+    struct fs_file_t file;
+
+    if (storeMutex == NULL)
+        return U_ERROR_COMMON_NOT_INITIALISED;
+
+    flushTimeSeries();
+
+    uint32_t metricId = getMetricId(pMetric);
+    uint32_t segmentNumber = 0;
+    uint32_t recordIndex = 0;
+    int32_t found = 0;
+    bool reading = true;
+
+    while (reading) {
+        uint32_t count = 0;
+
+        // read the next block of records, only locking the store while
+        // reading so the callback can take its time
+        U_PORT_MUTEX_LOCK(storeMutex);
+
+        int32_t i = 0;
+        while (i < segmentCount && (segments[i].number < segmentNumber || segments[i].count == 0 ||
+                    segments[i].lastTime < from || segments[i].firstTime > to))
+            i++;
+
+        if (i < segmentCount) {
+            segment_t *pSegment = &segments[i];
+            getSegmentPath(path, pSegment->number);
+            fs_file_t_init(&file);
+
+            if (fs_open(&file, path, FS_O_READ) < 0) {
+                writeError("Failed to open time series segment %u", pSegment->number);
+            } else {
+                if (pSegment->number != segmentNumber) {
+                    segmentNumber = pSegment->number;
+                    recordIndex = (pSegment->firstTime < from) ? findFirstRecord(&file, pSegment->count, from) : 0;
+                }
+
+                count = MIN(READ_BLOCK_RECORDS, pSegment->count - recordIndex);
+                if (count > 0 && !readRecords(&file, recordIndex, block, count))
+                    count = 0;
+
+                fs_close(&file);
+            }
+
+            recordIndex += count;
+            if (count == 0 || recordIndex >= pSegment->count) {
+                segmentNumber = pSegment->number + 1;
+                recordIndex = 0;
+            }
+        } else {
+            reading = false;
+        }
+
+        U_PORT_MUTEX_UNLOCK(storeMutex);
+
+        for(uint32_t j=0; j<count && reading; j++) {
+            tsRecord_t *pRecord = &block[j];
+            if (pRecord->crc != getRecordCrc(pRecord) || pRecord->metricId != metricId ||
+                    pRecord->timestamp < from || pRecord->timestamp > to)
+                continue;
+
+            found++;
+            reading = callback(pRecord->timestamp, pRecord->value,
+                                (pRecord->flags & RECORD_FLAG_MILLI) != 0, pContext);
+        }
+    }
+
+    return found;
+}
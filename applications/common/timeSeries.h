@@ -0,0 +1,68 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Measurement history on the file system
+ *
+ */
+
+#ifndef _TIME_SERIES_H_
+#define _TIME_SERIES_H_
+
+/* ----------------------------------------------------------------
+ * DEFINITIONS
+ * -------------------------------------------------------------- */
+#define TIME_SERIES_DIR "history"
+#define TIME_SERIES_METRIC_SIZE 48
+#define TIME_SERIES_MAX_KB_DEFAULT 1024
+#define TIME_SERIES_RETENTION_DAYS_DEFAULT 30
+
+/* ----------------------------------------------------------------
+ * PUBLIC TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+
+/// Called for each stored value of a metric read by readTimeSeries()
+/// @param timestamp The unix time of the value
+/// @param value The value, in thousandths if milli is set
+/// @param milli The value is in thousandths
+/// @param pContext The context given to readTimeSeries()
+/// @return true to carry on reading, false to stop
+typedef bool (*timeSeriesCallback_t)(uint32_t timestamp, int32_t value, bool milli, void *pContext);
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Loads the index of the stored segments, and registers the
+/// time series as a measurement sink
+/// @return 0 on success, negative on failure
+int32_t initTimeSeries(void);
+
+/// @brief Writes the buffered values to the file system
+void flushTimeSeries(void);
+
+/// @brief Reads the stored values of a metric, oldest first
+/// @param pMetric The metric name, eg "Temperature.Pressure"
+/// @param from The unix time of the first value
+/// @param to The unix time of the last value
+/// @param callback Called for each value, without the store locked
+/// @param pContext Passed to the callback
+/// @return The number of values read, or negative on failure
+int32_t readTimeSeries(const char *pMetric, uint32_t from, uint32_t to,
+                        timeSeriesCallback_t callback, void *pContext);
+
+#endif
@@ -0,0 +1,391 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Hierarchical timer wheel. Every periodic job registers here, instead
+ * of having its own timer, and one timer is armed for the next expiry.
+ *
+ * Expiries are aligned to multiples of the period from a common epoch
+ * (the wheel's tick zero), so jobs with compatible periods (e.g. 30s and
+ * 60s) fire on the same tick and the radio/GNSS work happens in bursts.
+ *
+ * Level 0 has one slot per tick, level 1 one slot per 64 ticks and
+ * level 2 one slot per 4096 ticks. Entries cascade down a level as the
+ * wheel turns. The timer is one-shot and armed for the next expiry, so
+ * there is no wake-up while nothing is due.
+ *
+ */
+
+#include "common.h"
+#include "timerWheel.h"
+
+/* ----------------------------------------------------------------
+ * DEFINES
+ * -------------------------------------------------------------- */
+#define TIMER_WHEEL_LEVELS 3
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// Ticks covered by the whole wheel, longer delays are capped to this
+#define TIMER_WHEEL_MAX_DELAY ((1 << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+// Maximum number of callbacks which are collected for one timer expiry
+#define TIMER_WHEEL_MAX_EXPIRED 16
+
+#define LEVEL_SHIFT(level) ((level) * TIMER_WHEEL_SLOT_BITS)
+
+/* ----------------------------------------------------------------
+ * TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+typedef struct {
+    timerWheelCallback_t callback;
+    void *pParam;
+} expiredEntry_t;
+
+/* ----------------------------------------------------------------
+ * STATIC VARIABLES
+ * -------------------------------------------------------------- */
+static timerWheelEntry_t *wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+
+// The tick the wheel has been processed up to
+static uint32_t currentTick = 0;
+static int32_t entryCount = 0;
+
+static uPortMutexHandle_t wheelMutex = NULL;
+static uPortTimerHandle_t wheelTimer = NULL;
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Returns the current tick, from the 64 bit millisecond counter so
+/// the ticks don't wrap after 49.7 days of milliseconds
+static uint32_t getNowTick(void)
+{
+    return (uint32_t)(uPortGetTickTimeMs() / TIMER_WHEEL_TICK_MS);
+}
+
+static uint32_t msToTicks(int32_t periodMs)
+{
+    uint32_t ticks = (periodMs + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+    if (ticks == 0)
+        ticks = 1;
+
+    if (ticks > TIMER_WHEEL_MAX_DELAY)
+        ticks = TIMER_WHEEL_MAX_DELAY;
+
+    return ticks;
+}
+
+/// @brief Returns the next multiple of the period after the tick
+static uint32_t alignedExpiry(uint32_t tick, uint32_t periodTicks)
+{
+    return ((tick / periodTicks) + 1) * periodTicks;
+}
+
+static void insertEntry(timerWheelEntry_t *pEntry)
+{
+    uint32_t delta = pEntry->expiryTick - currentTick;
+    int8_t level = 0;
+
+    if (delta > TIMER_WHEEL_MAX_DELAY) {
+        // overdue, put it in the next slot to be processed
+        pEntry->expiryTick = currentTick + 1;
+        delta = 1;
+    }
+
+    // a delta of 0 is an entry cascaded on the tick it expires, it goes
+    // into the level 0 slot of the current tick, which advanceWheel()
+    // processes straight after the cascade
+
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1 << LEVEL_SHIFT(level + 1)))
+        level++;
+
+    pEntry->level = level;
+    pEntry->slot = (pEntry->expiryTick >> LEVEL_SHIFT(level)) & TIMER_WHEEL_SLOT_MASK;
+    pEntry->pNext = wheel[level][pEntry->slot];
+    wheel[level][pEntry->slot] = pEntry;
+}
+
+static void unlinkEntry(timerWheelEntry_t *pEntry)
+{
+    if (pEntry->level < 0)
+        return;
+
+    timerWheelEntry_t **ppNode = &wheel[pEntry->level][pEntry->slot];
+    while (*ppNode != NULL) {
+        if (*ppNode == pEntry) {
+            *ppNode = pEntry->pNext;
+            break;
+        }
+
+        ppNode = &(*ppNode)->pNext;
+    }
+
+    pEntry->pNext = NULL;
+    pEntry->level = -1;
+}
+
+/// @brief Moves the entries of a higher level slot down the wheel
+static void cascade(int8_t level, uint8_t slot)
+{
+    timerWheelEntry_t *pEntry = wheel[level][slot];
+    wheel[level][slot] = NULL;
+
+    while (pEntry != NULL) {
+        timerWheelEntry_t *pNext = pEntry->pNext;
+        insertEntry(pEntry);
+        pEntry = pNext;
+    }
+}
+
+/// @brief Turns the wheel up to the current tick, collecting the expired
+/// entries and re-inserting them for their next period
+static int32_t advanceWheel(uint32_t nowTick, expiredEntry_t *expired)
+{
+    int32_t count = 0;
+
+    while ((int32_t)(nowTick - currentTick) > 0) {
+        currentTick++;
+
+        // cascade the higher levels when the lower level wraps around
+        for(int8_t level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if ((currentTick & ((1 << LEVEL_SHIFT(level)) - 1)) != 0)
+                break;
+
+            cascade(level, (currentTick >> LEVEL_SHIFT(level)) & TIMER_WHEEL_SLOT_MASK);
+        }
+
+        uint8_t slot = currentTick & TIMER_WHEEL_SLOT_MASK;
+        timerWheelEntry_t *pEntry = wheel[0][slot];
+        wheel[0][slot] = NULL;
+
+        while (pEntry != NULL) {
+            timerWheelEntry_t *pNext = pEntry->pNext;
+
+            if (pEntry->expiryTick == currentTick) {
+                if (count < TIMER_WHEEL_MAX_EXPIRED) {
+                    expired[count].callback = pEntry->callback;
+                    expired[count].pParam = pEntry->pParam;
+                    count++;
+                }
+
+                // keep the next expiry aligned, skipping any missed periods
+                pEntry->expiryTick = alignedExpiry(nowTick, pEntry->periodTicks);
+            }
+
+            insertEntry(pEntry);
+            pEntry = pNext;
+        }
+    }
+
+    return count;
+}
+
+/// @brief Returns the number of ticks until the next expiry
+static uint32_t ticksToNextExpiry(void)
+{
+    uint32_t nextTicks = TIMER_WHEEL_MAX_DELAY;
+
+    // level 0 slots are in expiry order from the current tick
+    for(uint32_t i = 1; i < TIMER_WHEEL_SLOTS; i++) {
+        if (wheel[0][(currentTick + i) & TIMER_WHEEL_SLOT_MASK] != NULL) {
+            nextTicks = i;
+            break;
+        }
+    }
+
+    // entries in the higher levels can still expire before these,
+    // as they were added earlier, so check them too
+    for(int8_t level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        for(int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            for(timerWheelEntry_t *pEntry = wheel[level][slot]; pEntry != NULL; pEntry = pEntry->pNext) {
+                uint32_t ticks = pEntry->expiryTick - currentTick;
+                if (ticks < nextTicks)
+                    nextTicks = ticks;
+            }
+        }
+    }
+
+    return nextTicks;
+}
+
+/// @brief Arms the wheel timer for the next expiry. Called with the mutex locked.
+static void armTimer(void)
+{
+    uPortTimerStop(wheelTimer);
+    if (entryCount == 0)
+        return;
+
+    int64_t nowMs = uPortGetTickTimeMs();
+    uint32_t nextTick = currentTick + ticksToNextExpiry();
+    int32_t delayMs = (int32_t)((int64_t)nextTick * TIMER_WHEEL_TICK_MS - nowMs);
+    if (delayMs < 1)
+        delayMs = 1;
+
+    uPortTimerChange(wheelTimer, delayMs);
+    uPortTimerStart(wheelTimer);
+}
+
+static void wheelTimerCallback(const uPortTimerHandle_t timerHandle, void *pParameter)
+{
+    expiredEntry_t expired[TIMER_WHEEL_MAX_EXPIRED];
+    int32_t count;
+
+    U_PORT_MUTEX_LOCK(wheelMutex);
+    count = advanceWheel(getNowTick(), expired);
+    armTimer();
+    U_PORT_MUTEX_UNLOCK(wheelMutex);
+
+    // run the callbacks outside of the lock, they can add/remove entries
+    for(int i=0; i<count; i++)
+        expired[i].callback(expired[i].pParam);
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Initialises the timer wheel and its timer
+/// @return 0 on success, negative on failure
+int32_t initTimerWheel(void)
+{
+    if (wheelTimer != NULL)
+        return U_ERROR_COMMON_SUCCESS;
+
+    int32_t errorCode = uPortMutexCreate(&wheelMutex);
+    if (errorCode != 0) {
+        writeFatal("Failed to create the timer wheel mutex (%d)", errorCode);
+        return errorCode;
+    }
+
+    errorCode = uPortTimerCreate(&wheelTimer, "TimerWheel", wheelTimerCallback,
+                                    NULL, TIMER_WHEEL_TICK_MS, false);
+    if (errorCode != 0) {
+        writeFatal("Failed to create the timer wheel timer (%d)", errorCode);
+        wheelTimer = NULL;
+        return errorCode;
+    }
+
+    currentTick = getNowTick();
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Adds a periodic entry to the wheel. The first expiry is aligned
+/// to a multiple of the period, so entries with periods which are
+/// multiples of each other expire on the same tick.
+/// @param pEntry The entry to add, which must stay valid until removed
+/// @param periodMs The period in milliseconds
+/// @param callback The function to call when the entry expires
+/// @param pParam The parameter for the callback
+/// @return 0 on success, negative on failure
+int32_t timerWheelAdd(timerWheelEntry_t *pEntry, int32_t periodMs, timerWheelCallback_t callback, void *pParam)
+{
+    if (wheelTimer == NULL)
+        return U_ERROR_COMMON_NOT_INITIALISED;
+
+    if (pEntry == NULL || callback == NULL || periodMs <= 0)
+        return U_ERROR_COMMON_INVALID_PARAMETER;
+
+    U_PORT_MUTEX_LOCK(wheelMutex);
+
+    // the wheel doesn't turn while it is empty, so catch it up
+    if (entryCount == 0)
+        currentTick = getNowTick();
+
+    pEntry->callback = callback;
+    pEntry->pParam = pParam;
+    pEntry->periodTicks = msToTicks(periodMs);
+    pEntry->expiryTick = alignedExpiry(getNowTick(), pEntry->periodTicks);
+    insertEntry(pEntry);
+    entryCount++;
+
+    armTimer();
+
+    U_PORT_MUTEX_UNLOCK(wheelMutex);
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Changes the period of an entry, re-aligning its next expiry
+/// @param pEntry The entry to change
+/// @param periodMs The new period in milliseconds
+/// @return 0 on success, negative on failure
+int32_t timerWheelChange(timerWheelEntry_t *pEntry, int32_t periodMs)
+{
+    int32_t errorCode = U_ERROR_COMMON_NOT_FOUND;
+
+    if (pEntry == NULL || periodMs <= 0)
+        return U_ERROR_COMMON_INVALID_PARAMETER;
+
+    U_PORT_MUTEX_LOCK(wheelMutex);
+
+    if (pEntry->level >= 0) {
+        unlinkEntry(pEntry);
+        pEntry->periodTicks = msToTicks(periodMs);
+        pEntry->expiryTick = alignedExpiry(getNowTick(), pEntry->periodTicks);
+        insertEntry(pEntry);
+        armTimer();
+        errorCode = U_ERROR_COMMON_SUCCESS;
+    }
+
+    U_PORT_MUTEX_UNLOCK(wheelMutex);
+
+    return errorCode;
+}
+
+/// @brief Removes an entry from the wheel
+/// @param pEntry The entry to remove
+/// @return 0 on success, negative on failure
+int32_t timerWheelRemove(timerWheelEntry_t *pEntry)
+{
+    int32_t errorCode = U_ERROR_COMMON_NOT_FOUND;
+
+    if (pEntry == NULL)
+        return U_ERROR_COMMON_INVALID_PARAMETER;
+
+    U_PORT_MUTEX_LOCK(wheelMutex);
+
+    if (pEntry->level >= 0) {
+        unlinkEntry(pEntry);
+        entryCount--;
+        armTimer();
+        errorCode = U_ERROR_COMMON_SUCCESS;
+    }
+
+    U_PORT_MUTEX_UNLOCK(wheelMutex);
+
+    return errorCode;
+}
+
+/// @brief Returns the time until the next aligned boundary of a period,
+/// for loops outside of the wheel to wake up in the same window
+/// @param periodMs The period in milliseconds
+/// @return The delay in milliseconds until the next boundary
+int32_t getAlignedDelayMs(int32_t periodMs)
+{
+    if (periodMs <= 0)
+        return 0;
+
+    uint32_t periodTicks = msToTicks(periodMs);
+    int64_t nowMs = uPortGetTickTimeMs();
+    uint32_t nextTick = alignedExpiry((uint32_t)(nowMs / TIMER_WHEEL_TICK_MS), periodTicks);
+
+    return (int32_t)((int64_t)nextTick * TIMER_WHEEL_TICK_MS - nowMs);
+}
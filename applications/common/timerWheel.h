@@ -0,0 +1,86 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Hierarchical timer wheel for the periodic jobs
+ *
+ */
+
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+/* ----------------------------------------------------------------
+ * DEFINITIONS
+ * -------------------------------------------------------------- */
+// Resolution of the timer wheel. Periods are rounded up to this.
+#define TIMER_WHEEL_TICK_MS 1000
+
+/* ----------------------------------------------------------------
+ * PUBLIC TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+
+/// Callback for when a timer wheel entry expires. This is called
+/// from the timer context so it must not block, just queue the work.
+typedef void (*timerWheelCallback_t)(void *pParam);
+
+/// A timer wheel entry, owned by the caller and linked into the wheel
+typedef struct TIMER_WHEEL_ENTRY {
+    struct TIMER_WHEEL_ENTRY *pNext;
+    uint32_t expiryTick;
+    uint32_t periodTicks;
+    int8_t level;                   // -1 when not in the wheel
+    uint8_t slot;
+    timerWheelCallback_t callback;
+    void *pParam;
+} timerWheelEntry_t;
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Initialises the timer wheel and its timer
+/// @return 0 on success, negative on failure
+int32_t initTimerWheel(void);
+
+/// @brief Adds a periodic entry to the wheel. The first expiry is aligned
+/// to a multiple of the period, so entries with periods which are
+/// multiples of each other expire on the same tick.
+/// @param pEntry The entry to add, which must stay valid until removed
+/// @param periodMs The period in milliseconds
+/// @param callback The function to call when the entry expires
+/// @param pParam The parameter for the callback
+/// @return 0 on success, negative on failure
+int32_t timerWheelAdd(timerWheelEntry_t *pEntry, int32_t periodMs, timerWheelCallback_t callback, void *pParam);
+
+/// @brief Changes the period of an entry, re-aligning its next expiry
+/// @param pEntry The entry to change
+/// @param periodMs The new period in milliseconds
+/// @return 0 on success, negative on failure
+int32_t timerWheelChange(timerWheelEntry_t *pEntry, int32_t periodMs);
+
+/// @brief Removes an entry from the wheel
+/// @param pEntry The entry to remove
+/// @return 0 on success, negative on failure
+int32_t timerWheelRemove(timerWheelEntry_t *pEntry);
+
+/// @brief Returns the time until the next aligned boundary of a period,
+/// for loops outside of the wheel to wake up in the same window
+/// @param periodMs The period in milliseconds
+/// @return The delay in milliseconds until the next boundary
+int32_t getAlignedDelayMs(int32_t periodMs);
+
+#endif
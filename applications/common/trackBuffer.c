@@ -0,0 +1,347 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Compressed location history, for publishing a track in a few messages
+ * instead of one message per fix.
+ *
+ * The fixes are simplified online with a sliding window: the fixes since
+ * the last stored point are kept in a window, and while they are all
+ * within the tolerance of the line from the last stored point to the
+ * newest fix, none of them are needed. When one isn't, the fix before
+ * the newest is stored and starts the next line.
+ *
+ * The stored points are the time and the latitude/longitude differences
+ * from the point before, in millionths of a degree (about 0.1m), as
+ * zigzag varints, so most points take 4-6 bytes.
+ *
+ */
+
+#include "common.h"
+#include "geofence.h"
+#include "trackBuffer.h"
+
+/* ----------------------------------------------------------------
+ * DEFINES
+ * -------------------------------------------------------------- */
+#define TRACK_WINDOW_SIZE       16
+
+// metres per ten millionth of a degree of latitude
+#define METRES_PER_X1E7         0.011132f
+
+// the most bytes in one encoded point, three 32 bit varints
+#define MAX_POINT_BYTES         15
+
+// room for the last delta and the end of the JSON message
+#define SEGMENT_END_SPACE       48
+
+/* ----------------------------------------------------------------
+ * TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+typedef struct {
+    int64_t timestamp;
+    int32_t lat;
+    int32_t lon;
+} trackPoint_t;
+
+/* ----------------------------------------------------------------
+ * STATIC VARIABLES
+ * -------------------------------------------------------------- */
+static float trackTolerance = TRACK_TOLERANCE_DEFAULT_METRES;
+
+/// @brief the simplification window, of the fixes since the anchor
+static trackPoint_t anchor;
+static bool anchorValid = false;
+static trackPoint_t window[TRACK_WINDOW_SIZE];
+static int32_t windowCount = 0;
+
+/// @brief the stored points, in millionths of a degree. The first point
+/// is absolute and the rest are deltas in the data buffer.
+static uint8_t trackData[TRACK_BUFFER_SIZE];
+static size_t trackLength = 0;
+static int32_t storedCount = 0;
+static trackPoint_t firstStored;
+static trackPoint_t lastStored;
+
+// the first point was the end of the last segment, so it isn't a segment
+// on its own but the next segment starts from it to join up the track
+static bool firstUploaded = false;
+
+/// @brief the end of the last formatted segment, until it is committed
+static size_t segmentBytes = 0;
+static int32_t segmentPoints = 0;
+static trackPoint_t segmentEnd;
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+static size_t encodeVarint(uint8_t *pBuffer, int32_t value)
+{
+    // zigzag so small negative values are small too
+    uint32_t v = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+    size_t count = 0;
+
+    while (v >= 0x80) {
+        pBuffer[count++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    pBuffer[count++] = (uint8_t)v;
+
+    return count;
+}
+
+static size_t decodeVarint(const uint8_t *pBuffer, int32_t *pValue)
+{
+    uint32_t v = 0;
+    size_t count = 0;
+
+    do {
+        v |= (uint32_t)(pBuffer[count] & 0x7F) << (7 * count);
+    } while (pBuffer[count++] & 0x80);
+
+    *pValue = (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+
+    return count;
+}
+
+/// @brief Decodes the point at an offset in the data, from the point before
+static size_t decodePoint(size_t offset, trackPoint_t *pPoint)
+{
+    int32_t dt, dLat, dLon;
+    size_t start = offset;
+
+    offset += decodeVarint(trackData + offset, &dt);
+    offset += decodeVarint(trackData + offset, &dLat);
+    offset += decodeVarint(trackData + offset, &dLon);
+
+    pPoint->timestamp += dt;
+    pPoint->lat += dLat;
+    pPoint->lon += dLon;
+
+    return offset - start;
+}
+
+/// @brief Removes the first bytes of the data, and moves the first
+/// point on to the point at the end of them
+static void removeStoredBytes(size_t bytes, int32_t points, trackPoint_t *pNewFirst)
+{
+    memmove(trackData, trackData + bytes, trackLength - bytes);
+    trackLength -= bytes;
+    storedCount -= points;
+    firstStored = *pNewFirst;
+}
+
+static void dropOldestPoint(void)
+{
+    if (storedCount <= 1) {
+        trackLength = 0;
+        storedCount = 0;
+        return;
+    }
+
+    trackPoint_t next = firstStored;
+    size_t bytes = decodePoint(0, &next);
+    removeStoredBytes(bytes, 1, &next);
+    firstUploaded = false;
+}
+
+static void storePoint(trackPoint_t *pPoint)
+{
+    trackPoint_t point = {
+        .timestamp = pPoint->timestamp,
+        .lat = (pPoint->lat + (pPoint->lat < 0 ? -5 : 5)) / 10,
+        .lon = (pPoint->lon + (pPoint->lon < 0 ? -5 : 5)) / 10
+    };
+
+    if (storedCount == 0) {
+        firstStored = point;
+        lastStored = point;
+        storedCount = 1;
+        firstUploaded = false;
+        return;
+    }
+
+    uint8_t encoded[MAX_POINT_BYTES];
+    size_t count = encodeVarint(encoded, (int32_t)(point.timestamp - lastStored.timestamp));
+    count += encodeVarint(encoded + count, point.lat - lastStored.lat);
+    count += encodeVarint(encoded + count, point.lon - lastStored.lon);
+
+    // when the track hasn't been uploaded the oldest points are lost
+    if (trackLength + count > TRACK_BUFFER_SIZE)
+        writeDebug("Track buffer full, dropping the oldest points");
+    while (storedCount > 1 && trackLength + count > TRACK_BUFFER_SIZE)
+        dropOldestPoint();
+
+    memcpy(trackData + trackLength, encoded, count);
+    trackLength += count;
+    storedCount++;
+    lastStored = point;
+}
+
+/// @brief Returns true if a point is further than the tolerance from the
+/// line segment between two other points
+static bool isOutsideTolerance(trackPoint_t *pStart, trackPoint_t *pEnd, trackPoint_t *pPoint)
+{
+    // local flat coordinates in metres, the longitude scaled by the latitude
+    float lonScale = METRES_PER_X1E7 * getCosLatitudeQ15(pStart->lat) / 32768.0f;
+    float ex = (pEnd->lon - pStart->lon) * lonScale;
+    float ey = (pEnd->lat - pStart->lat) * METRES_PER_X1E7;
+    float px = (pPoint->lon - pStart->lon) * lonScale;
+    float py = (pPoint->lat - pStart->lat) * METRES_PER_X1E7;
+
+    // the nearest point on the segment, so turning back is not lost
+    float lengthSquared = ex * ex + ey * ey;
+    float t = 0;
+    if (lengthSquared > 0) {
+        t = (px * ex + py * ey) / lengthSquared;
+        t = MAX(0.0f, MIN(1.0f, t));
+    }
+
+    float dx = px - t * ex;
+    float dy = py - t * ey;
+
+    return dx * dx + dy * dy > trackTolerance * trackTolerance;
+}
+
+/// @brief Stores the newest fix in the window and starts a new line from it
+static void flushWindow(void)
+{
+    if (windowCount == 0)
+        return;
+
+    anchor = window[windowCount - 1];
+    storePoint(&anchor);
+    windowCount = 0;
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Clears the track, and sets the simplification tolerance.
+/// The track functions are not thread safe, the caller must serialise them.
+/// @param metres The furthest a dropped fix can be from the track
+void resetTrack(int32_t metres)
+{
+    anchorValid = false;
+    windowCount = 0;
+    trackLength = 0;
+    storedCount = 0;
+    segmentPoints = 0;
+
+    setTrackTolerance(metres);
+}
+
+/// @brief Sets the simplification tolerance
+/// @param metres The furthest a dropped fix can be from the track
+void setTrackTolerance(int32_t metres)
+{
+    trackTolerance = metres;
+}
+
+/// @brief Adds a fix to the track. Fixes which are within the tolerance
+/// of the line between the fixes either side of them are dropped.
+/// @param timestamp The unix time of the fix
+/// @param latitudeX1e7 The latitude in ten millionths of a degree
+/// @param longitudeX1e7 The longitude in ten millionths of a degree
+void addTrackPoint(int64_t timestamp, int32_t latitudeX1e7, int32_t longitudeX1e7)
+{
+    trackPoint_t point = {timestamp, latitudeX1e7, longitudeX1e7};
+
+    if (!anchorValid) {
+        anchor = point;
+        anchorValid = true;
+        storePoint(&anchor);
+        return;
+    }
+
+    for(int32_t i=0; i<windowCount; i++) {
+        if (isOutsideTolerance(&anchor, &point, &window[i])) {
+            // the fix before this one is needed to keep the shape
+            flushWindow();
+            break;
+        }
+    }
+
+    window[windowCount++] = point;
+    if (windowCount == TRACK_WINDOW_SIZE)
+        flushWindow();
+}
+
+/// @brief Returns how full the track buffer is, 0 to 100 percent
+int32_t getTrackBufferPercent(void)
+{
+    return (int32_t)(trackLength * 100 / TRACK_BUFFER_SIZE);
+}
+
+/// @brief Formats the oldest stored points as a JSON track segment, eg
+/// {"Track":{"Start":1660000000,"Lat":52205300,"Lon":121800,"Deltas":[30,-120,85,...],"Points":3}}
+/// The start is absolute, in seconds and millionths of a degree, and each
+/// point after it is the time, latitude and longitude difference from the
+/// point before. The points stay in the track until commitTrackSegment().
+/// @param pBuffer The buffer to write to
+/// @param size The size of the buffer
+/// @return The number of points in the segment, zero if the track is empty
+int32_t formatTrackSegment(char *pBuffer, size_t size)
+{
+    // the segment ends at the latest fix
+    flushWindow();
+
+    segmentPoints = 0;
+    if (storedCount == 0 || (storedCount == 1 && firstUploaded))
+        return 0;
+
+    int32_t len = snprintf(pBuffer, size, "{\"Track\":{\"Start\":%" PRId64 ",\"Lat\":%d,\"Lon\":%d,\"Deltas\":[",
+                            firstStored.timestamp, firstStored.lat, firstStored.lon);
+
+    size_t offset = 0;
+    trackPoint_t point = firstStored;
+    segmentPoints = 1;
+
+    while (offset < trackLength && len + SEGMENT_END_SPACE < size) {
+        trackPoint_t before = point;
+        offset += decodePoint(offset, &point);
+
+        len += snprintf(pBuffer + len, size - len, "%s%d,%d,%d", segmentPoints > 1 ? "," : "",
+                        (int32_t)(point.timestamp - before.timestamp),
+                        point.lat - before.lat, point.lon - before.lon);
+        segmentPoints++;
+    }
+
+    snprintf(pBuffer + len, size - len, "],\"Points\":%d}}", segmentPoints);
+
+    segmentBytes = offset;
+    segmentEnd = point;
+
+    return segmentPoints;
+}
+
+/// @brief Removes the points of the last formatted segment from the track,
+/// once it has been sent
+void commitTrackSegment(void)
+{
+    if (segmentPoints == 0)
+        return;
+
+    // the next segment starts from the last point of this one, so the
+    // segments join up
+    removeStoredBytes(segmentBytes, segmentPoints - 1, &segmentEnd);
+    firstUploaded = true;
+
+    segmentPoints = 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Compressed location history
+ *
+ */
+
+#ifndef _TRACK_BUFFER_H_
+#define _TRACK_BUFFER_H_
+
+/* ----------------------------------------------------------------
+ * DEFINITIONS
+ * -------------------------------------------------------------- */
+// Bytes of delta encoded points, about 4-6 bytes per stored point
+#define TRACK_BUFFER_SIZE 2048
+
+#define TRACK_TOLERANCE_DEFAULT_METRES 5
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Clears the track, and sets the simplification tolerance.
+/// The track functions are not thread safe, the caller must serialise them.
+/// @param metres The furthest a dropped fix can be from the track
+void resetTrack(int32_t metres);
+
+/// @brief Sets the simplification tolerance
+/// @param metres The furthest a dropped fix can be from the track
+void setTrackTolerance(int32_t metres);
+
+/// @brief Adds a fix to the track. Fixes which are within the tolerance
+/// of the line between the fixes either side of them are dropped.
+/// @param timestamp The unix time of the fix
+/// @param latitudeX1e7 The latitude in ten millionths of a degree
+/// @param longitudeX1e7 The longitude in ten millionths of a degree
+void addTrackPoint(int64_t timestamp, int32_t latitudeX1e7, int32_t longitudeX1e7);
+
+/// @brief Returns how full the track buffer is, 0 to 100 percent
+int32_t getTrackBufferPercent(void);
+
+/// @brief Formats the oldest stored points as a JSON track segment, eg
+/// {"Track":{"Start":1660000000,"Lat":52205300,"Lon":121800,"Deltas":[30,-120,85,...],"Points":3}}
+/// The start is absolute, in seconds and millionths of a degree, and each
+/// point after it is the time, latitude and longitude difference from the
+/// point before. The points stay in the track until commitTrackSegment().
+/// @param pBuffer The buffer to write to
+/// @param size The size of the buffer
+/// @return The number of points in the segment, zero if the track is empty
+int32_t formatTrackSegment(char *pBuffer, size_t size);
+
+/// @brief Removes the points of the last formatted segment from the track,
+/// once it has been sent
+void commitTrackSegment(void);
+
+#endif
@@ -0,0 +1,387 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Binary measurement telemetry over UDP.
+ *
+ * The UDP telemetry is a measurement sink. When TELEMETRY_UDP_SERVER is
+ * set, the measurements which aren't events are sent as compact binary
+ * records in UDP datagrams instead of MQTT messages, with no session and
+ * no acknowledgement. Events are still published on MQTT.
+ *
+ * Each datagram has a sequence number, so the server can count the lost
+ * datagrams, and can batch up to TELEMETRY_UDP_BATCH measurements. The
+ * sink only builds the datagram, it is sent on the worker pool, so the
+ * tasks making the measurements never wait for the network. Datagrams
+ * made while one is being sent wait in a small send queue, and are only
+ * dropped when it is full, or when the data budget runs low. Like the MQTT
+ * publishes, the datagrams are held in the queue while a cell scan has
+ * the modem.
+ *
+ * All the values are big endian. The datagram header is 16 bytes:
+ *      magic (uint16, "UT"), version (uint8), record count (uint8),
+ *      sequence (uint32), IMEI (uint64)
+ * then each record is an 8 byte header:
+ *      unix time (uint32), field count (uint8), reserved (uint8),
+ *      milli mask (uint16, bit n set if field n is in thousandths)
+ * followed by 8 bytes for each field:
+ *      metric ID (uint32, the CRC32 of the metric name), value (int32)
+ *
+ */
+
+#include "common.h"
+#include "measurement.h"
+#include "udpTelemetry.h"
+#include "dataBudget.h"
+#include "taskControl.h"
+#include "cellScanTask.h"
+#include "zephyr/sys/byteorder.h"
+
+/* ----------------------------------------------------------------
+ * DEFINES
+ * -------------------------------------------------------------- */
+#define DATAGRAM_SIZE 512
+#define HEADER_SIZE 16
+#define RECORD_HEADER_SIZE 8
+#define FIELD_SIZE 8
+
+#define BATCH_DEFAULT 1
+#define BATCH_MAX 32
+
+// a part filled batch is sent at least this often
+#define FLUSH_INTERVAL_MS 2000
+
+#define SERVER_NAME_SIZE 64
+#define METRIC_NAME_SIZE 48
+
+// the IP and UDP headers, for the data usage
+#define UDP_IP_HEADER_SIZE 28
+
+// datagrams waiting to be sent, a sensor publish makes 4 back to back
+#define SEND_QUEUE_LENGTH 4
+
+/* ----------------------------------------------------------------
+ * STATIC VARIABLES
+ * -------------------------------------------------------------- */
+static uPortMutexHandle_t telemetryMutex = NULL;
+
+/// @brief the datagram being batched, protected by the telemetry mutex
+static uint8_t pending[DATAGRAM_SIZE];
+static size_t pendingLength = HEADER_SIZE;
+static int32_t pendingCount = 0;
+static uint32_t sequence = 0;
+static uint32_t droppedCount = 0;
+static int32_t batchSize = BATCH_DEFAULT;
+static char serverName[SERVER_NAME_SIZE];
+static uint16_t serverPort = 0;
+static int32_t flushJobId = -1;
+
+/// @brief the datagrams waiting to be sent, protected by the telemetry
+/// mutex. The send job owns the datagram at the head while it sends it.
+static uint8_t sendQueue[SEND_QUEUE_LENGTH][DATAGRAM_SIZE];
+static size_t sendLength[SEND_QUEUE_LENGTH];
+static int32_t sendHead = 0;
+static int32_t sendCount = 0;
+static bool sending = false;
+
+/// @brief the socket, only used by the send job
+static uSockDescriptor_t sock = -1;
+static uSockAddress_t serverAddress;
+static bool addressValid = false;
+static atomic_t reconnect = ATOMIC_INIT(0);
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+static void closeSocket(void)
+{
+    if (sock >= 0) {
+        uSockClose(sock);
+        sock = -1;
+    }
+
+    addressValid = false;
+}
+
+/// @brief Creates the socket and looks up the server address, if they
+/// aren't already
+/// @return 0 on success, negative on failure
+static int32_t openSocket(void)
+{
+    char name[SERVER_NAME_SIZE];
+    uint16_t port;
+
+    // the server has been changed
+    if (atomic_cas(&reconnect, 1, 0))
+        closeSocket();
+
+    if (sock < 0) {
+        sock = uSockCreate(gDeviceHandle, U_SOCK_TYPE_DGRAM, U_SOCK_PROTOCOL_UDP);
+        if (sock < 0) {
+            writeDebug("Failed to create the UDP telemetry socket: %d", sock);
+            return sock;
+        }
+    }
+
+    if (!addressValid) {
+        U_PORT_MUTEX_LOCK(telemetryMutex);
+        strcpy(name, serverName);
+        port = serverPort;
+        U_PORT_MUTEX_UNLOCK(telemetryMutex);
+
+        int32_t errorCode = uSockGetHostByName(gDeviceHandle, name, &(serverAddress.ipAddress));
+        if (errorCode != 0) {
+            writeDebug("Failed to look up the UDP telemetry server %s: %d", name, errorCode);
+            return errorCode;
+        }
+
+        serverAddress.port = port;
+        addressValid = true;
+    }
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Sends the queued datagrams one after the other, on the worker
+/// pool, until the send queue is empty
+static void sendJob(void *pParam, size_t paramLengthBytes)
+{
+    while (true) {
+        uint8_t *pDatagram = NULL;
+        size_t length = 0;
+
+        U_PORT_MUTEX_LOCK(telemetryMutex);
+        // the flush job starts the send job again after the cell scan
+        if (sendCount > 0 && !isCellScanRunning()) {
+            pDatagram = sendQueue[sendHead];
+            length = sendLength[sendHead];
+        } else {
+            sending = false;
+        }
+        U_PORT_MUTEX_UNLOCK(telemetryMutex);
+
+        if (pDatagram == NULL)
+            break;
+
+        bool sent = false;
+        if (IS_NETWORK_AVAILABLE && openSocket() == 0) {
+            int32_t result = uSockSendTo(sock, &serverAddress, pDatagram, length);
+            if (result < 0) {
+                writeDebug("Failed to send the UDP telemetry: %d", result);
+                closeSocket();
+            } else {
+                recordDataUsage("UDP", length + UDP_IP_HEADER_SIZE);
+                sent = true;
+            }
+        }
+
+        if (!sent)
+            refundDataBudget(length + UDP_IP_HEADER_SIZE);
+
+        U_PORT_MUTEX_LOCK(telemetryMutex);
+        sendHead = (sendHead + 1) % SEND_QUEUE_LENGTH;
+        sendCount--;
+        U_PORT_MUTEX_UNLOCK(telemetryMutex);
+    }
+}
+
+/// @brief Starts the send job if there are datagrams queued and it isn't
+/// running. If the run queue is full, or a cell scan is running, they are
+/// left for the next datagram, or the flush job, to start it. Called with
+/// the telemetry mutex held.
+static void startSendJob(void)
+{
+    if (sending || sendCount == 0 || isCellScanRunning())
+        return;
+
+    if (submitJob("UdpTelemetry", sendJob, NULL, 0) == 0)
+        sending = true;
+}
+
+/// @brief Puts the batched datagram on the send queue, and starts the send
+/// job if it isn't running. The datagram is dropped if the send queue is
+/// full. Called with the telemetry mutex held.
+static void sendPending(void)
+{
+    if (pendingCount == 0)
+        return;
+
+    // the budget is only taken for a datagram which has room in the queue
+    if (sendCount == SEND_QUEUE_LENGTH) {
+        // the sequence number still moves on, so the loss is counted
+        sequence++;
+        droppedCount += pendingCount;
+        writeDebug("UDP telemetry send queue full, %d measurements dropped (%u in total)", pendingCount, droppedCount);
+    } else if (!requestDataBudget(pendingLength + UDP_IP_HEADER_SIZE, BUDGET_PRIORITY_LOW)) {
+        sequence++;
+        droppedCount += pendingCount;
+    } else {
+        int32_t tail = (sendHead + sendCount) % SEND_QUEUE_LENGTH;
+
+        sys_put_be16(UDP_TELEMETRY_MAGIC, &pending[0]);
+        pending[2] = UDP_TELEMETRY_VERSION;
+        pending[3] = (uint8_t)pendingCount;
+        sys_put_be32(sequence++, &pending[4]);
+        sys_put_be64(strtoull((const char *)gSerialNumber, NULL, 10), &pending[8]);
+
+        memcpy(sendQueue[tail], pending, pendingLength);
+        sendLength[tail] = pendingLength;
+        sendCount++;
+
+        startSendJob();
+    }
+
+    pendingLength = HEADER_SIZE;
+    pendingCount = 0;
+}
+
+/// @brief Adds a measurement to the batched datagram. Called with the
+/// telemetry mutex held.
+static void addRecord(const measurement_t *pMeasurement)
+{
+    char metric[METRIC_NAME_SIZE];
+    uint8_t *pRecord = &pending[pendingLength];
+    uint16_t milliMask = 0;
+
+    sys_put_be32((uint32_t)pMeasurement->timestamp, &pRecord[0]);
+    pRecord[4] = (uint8_t)pMeasurement->fieldCount;
+    pRecord[5] = 0;
+
+    for(int32_t i=0; i<pMeasurement->fieldCount; i++) {
+        const measurementField_t *pField = &pMeasurement->fields[i];
+        uint8_t *pValue = &pRecord[RECORD_HEADER_SIZE + i * FIELD_SIZE];
+
+        formatMetricName(pMeasurement, pField, metric, sizeof(metric));
+        sys_put_be32(getMetricId(metric), &pValue[0]);
+        sys_put_be32((uint32_t)pField->value, &pValue[4]);
+
+        if (pField->format == FIELD_MILLI || pField->format == FIELD_MILLI_TEXT)
+            milliMask |= 1 << i;
+    }
+
+    sys_put_be16(milliMask, &pRecord[6]);
+
+    pendingLength += RECORD_HEADER_SIZE + pMeasurement->fieldCount * FIELD_SIZE;
+    pendingCount++;
+}
+
+/// @brief The UDP telemetry measurement sink
+static void udpTelemetrySink(const measurement_t *pMeasurement)
+{
+    if (getMeasurementTransport(pMeasurement) != TRANSPORT_UDP)
+        return;
+
+    size_t recordLength = RECORD_HEADER_SIZE + pMeasurement->fieldCount * FIELD_SIZE;
+
+    U_PORT_MUTEX_LOCK(telemetryMutex);
+
+    if (pendingLength + recordLength > DATAGRAM_SIZE)
+        sendPending();
+
+    addRecord(pMeasurement);
+
+    if (pendingCount >= batchSize)
+        sendPending();
+
+    U_PORT_MUTEX_UNLOCK(telemetryMutex);
+}
+
+static void flushJob(void *pParam, size_t paramLengthBytes)
+{
+    U_PORT_MUTEX_LOCK(telemetryMutex);
+    sendPending();
+    startSendJob();
+    U_PORT_MUTEX_UNLOCK(telemetryMutex);
+}
+
+/// @brief Reads the server, eg "telemetry.example.com:5000", and the batch
+/// size, and turns the UDP telemetry on or off
+static void applyUdpTelemetryConfig(void)
+{
+    char server[CONFIG_VALUE_SIZE];
+    const char *pServer = getConfig("TELEMETRY_UDP_SERVER", server, sizeof(server));
+    int32_t batch = BATCH_DEFAULT;
+    int32_t port = 0;
+    size_t nameLength = 0;
+
+    setIntParamFromConfig("TELEMETRY_UDP_BATCH", &batch);
+
+    if (pServer != NULL) {
+        const char *pPort = strrchr(pServer, ':');
+        if (pPort != NULL) {
+            nameLength = pPort - pServer;
+            port = atoi(pPort + 1);
+        }
+
+        if (port <= 0 || port > UINT16_MAX || nameLength == 0 || nameLength >= SERVER_NAME_SIZE) {
+            writeWarn("TELEMETRY_UDP_SERVER must be <host>:<port>, UDP telemetry is off");
+            pServer = NULL;
+        }
+    }
+
+    U_PORT_MUTEX_LOCK(telemetryMutex);
+
+    // the batch is sent to the old server
+    sendPending();
+
+    batchSize = MAX(1, MIN(batch, BATCH_MAX));
+    if (pServer != NULL) {
+        memcpy(serverName, pServer, nameLength);
+        serverName[nameLength] = 0;
+        serverPort = (uint16_t)port;
+    }
+
+    if (pServer != NULL && flushJobId < 0)
+        flushJobId = addPeriodicJob("UdpTelemetryFlush", flushJob, FLUSH_INTERVAL_MS);
+    else if (pServer == NULL && flushJobId >= 0) {
+        removePeriodicJob(flushJobId);
+        flushJobId = -1;
+    }
+
+    U_PORT_MUTEX_UNLOCK(telemetryMutex);
+
+    atomic_set(&reconnect, 1);
+    setTelemetryTransport(pServer != NULL ? TRANSPORT_UDP : TRANSPORT_MQTT);
+
+    if (pServer != NULL)
+        writeLog("UDP telemetry to %s:%d, %d measurements per datagram", serverName, port, batchSize);
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Registers the UDP telemetry as a measurement sink, and turns
+/// it on if the TELEMETRY_UDP_SERVER is configured
+/// @return 0 on success, negative on failure
+int32_t initUdpTelemetry(void)
+{
+    if (telemetryMutex != NULL)
+        return U_ERROR_COMMON_SUCCESS;
+
+    int32_t errorCode = uPortMutexCreate(&telemetryMutex);
+    if (errorCode != 0) {
+        writeFatal("Failed to create the UDP telemetry mutex (%d)", errorCode);
+        return errorCode;
+    }
+
+    applyUdpTelemetryConfig();
+    registerConfigChangedCallback("TELEMETRY_", applyUdpTelemetryConfig);
+
+    return registerMeasurementSink("UDP", udpTelemetrySink);
+}
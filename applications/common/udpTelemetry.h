@@ -0,0 +1,41 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Binary measurement telemetry over UDP
+ *
+ */
+
+#ifndef _UDP_TELEMETRY_H_
+#define _UDP_TELEMETRY_H_
+
+/* ----------------------------------------------------------------
+ * DEFINITIONS
+ * -------------------------------------------------------------- */
+#define UDP_TELEMETRY_MAGIC 0x5554          // "UT"
+#define UDP_TELEMETRY_VERSION 1
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Registers the UDP telemetry as a measurement sink, and turns
+/// it on if the TELEMETRY_UDP_SERVER is configured
+/// @return 0 on success, negative on failure
+int32_t initUdpTelemetry(void);
+
+#endif
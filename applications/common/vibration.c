@@ -0,0 +1,320 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * High rate accelerometer capture, for vibration monitoring.
+ *
+ * The accelerometer data ready interrupt puts each sample in a ring
+ * buffer, and when a batch of samples is waiting a job on the worker pool
+ * takes them out and adds them to the vibration features: the RMS, peak
+ * and zero crossings of each axis, and the shocks. Only the features are
+ * published, never the samples.
+ *
+ * Gravity is removed from each axis with a slow moving average, so the
+ * features are of the vibration only.
+ *
+ */
+
+#include "common.h"
+#include "sensors.h"
+#include "vibration.h"
+
+/* ----------------------------------------------------------------
+ * DEFINES
+ * -------------------------------------------------------------- */
+// a power of two, so the indexes can wrap
+#define SAMPLE_RING_SIZE 128
+
+// the samples are processed in batches of this many
+#define SAMPLE_BATCH_SIZE 32
+
+// the moving average which is gravity is over about 2^6 samples
+#define GRAVITY_SHIFT 6
+
+// changes of sign within this band of zero are noise, milli m/s2
+#define ZERO_CROSSING_BAND 50
+
+// a shock within this time of the last one is the same shock
+#define SHOCK_HOLDOFF_MS 100
+
+// shocks are counted, but the callback is not called more often than this
+#define SHOCK_CALLBACK_MIN_MS 5000
+
+/* ----------------------------------------------------------------
+ * TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+typedef struct {
+    int32_t axis[3];
+} accelSample_t;
+
+typedef struct {
+    uint32_t samples;
+    uint32_t dropped;
+    int64_t sumSquares[3];
+    int32_t peak[3];
+    uint32_t zeroCrossings[3];
+    uint32_t shocks;
+    int32_t maxShock;
+} featureTotals_t;
+
+/* ----------------------------------------------------------------
+ * STATIC VARIABLES
+ * -------------------------------------------------------------- */
+static bool running = false;
+static int32_t captureRateHz = 0;
+static shockCallback_t shockCallback = NULL;
+
+// the squared shock threshold, so no square root is needed per sample
+static int64_t shockThresholdSquared = 0;
+
+/// @brief the ring of samples, written by the data ready interrupt and
+/// read by the batch job
+static accelSample_t ring[SAMPLE_RING_SIZE];
+static atomic_t ringHead = ATOMIC_INIT(0);
+static atomic_t ringTail = ATOMIC_INIT(0);
+static atomic_t ringDropped = ATOMIC_INIT(0);
+static atomic_t batchQueued = ATOMIC_INIT(0);
+
+/// @brief the per axis state of the batch job
+static int32_t gravityX16[3];
+static int8_t lastSign[3];
+static bool gravityValid = false;
+static int32_t shockHoldoffSamples = 0;
+static int32_t shockHoldoff = 0;
+static int64_t lastShockCallbackMs = 0;
+
+/// @brief the features since they were last read
+static featureTotals_t totals;
+static uPortMutexHandle_t featureMutex = NULL;
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Adds a sample to the features, called with the feature mutex held
+/// @return The shock magnitude if this sample is a new shock, otherwise 0
+static int32_t addSample(accelSample_t *pSample)
+{
+    int32_t dynamic[3];
+    int64_t magnitudeSquared = 0;
+
+    if (!gravityValid) {
+        for(int i=0; i<3; i++)
+            gravityX16[i] = pSample->axis[i] * 16;
+        gravityValid = true;
+    }
+
+    for(int i=0; i<3; i++) {
+        gravityX16[i] += (pSample->axis[i] * 16 - gravityX16[i]) >> GRAVITY_SHIFT;
+        int32_t d = pSample->axis[i] - gravityX16[i] / 16;
+        dynamic[i] = d;
+
+        totals.sumSquares[i] += (int64_t)d * d;
+        magnitudeSquared += (int64_t)d * d;
+
+        int32_t magnitude = abs(d);
+        if (magnitude > totals.peak[i])
+            totals.peak[i] = magnitude;
+
+        int8_t sign = d > ZERO_CROSSING_BAND ? 1 : d < -ZERO_CROSSING_BAND ? -1 : 0;
+        if (sign != 0) {
+            if (lastSign[i] != 0 && sign != lastSign[i])
+                totals.zeroCrossings[i]++;
+            lastSign[i] = sign;
+        }
+    }
+
+    totals.samples++;
+
+    if (shockHoldoff > 0)
+        shockHoldoff--;
+
+    if (shockThresholdSquared <= 0 || magnitudeSquared < shockThresholdSquared)
+        return 0;
+
+    int32_t shock = (int32_t)integerSqrt((uint64_t)magnitudeSquared);
+    if (shock > totals.maxShock)
+        totals.maxShock = shock;
+
+    bool newShock = (shockHoldoff == 0);
+    shockHoldoff = shockHoldoffSamples;
+    if (!newShock)
+        return 0;
+
+    totals.shocks++;
+    return shock;
+}
+
+/// @brief Takes the waiting samples out of the ring and adds them to
+/// the features. Run on the worker pool.
+static void processBatch(void *pParam, size_t paramLengthBytes)
+{
+    int32_t shock = 0;
+
+    U_PORT_MUTEX_LOCK(featureMutex);
+
+    uint32_t tail = (uint32_t)atomic_get(&ringTail);
+    while (tail != (uint32_t)atomic_get(&ringHead)) {
+        int32_t sampleShock = addSample(&ring[tail % SAMPLE_RING_SIZE]);
+        if (sampleShock > shock)
+            shock = sampleShock;
+
+        tail++;
+        atomic_set(&ringTail, (atomic_val_t)tail);
+    }
+
+    totals.dropped += (uint32_t)atomic_set(&ringDropped, 0);
+
+    U_PORT_MUTEX_UNLOCK(featureMutex);
+
+    atomic_set(&batchQueued, 0);
+
+    int64_t now = uPortGetTickTimeMs();
+    if (shock > 0 && shockCallback != NULL && now - lastShockCallbackMs >= SHOCK_CALLBACK_MIN_MS) {
+        lastShockCallbackMs = now;
+        shockCallback(shock);
+    }
+}
+
+/// @brief Puts a sample in the ring, and queues the batch job when a
+/// batch is waiting. Called on the sensor driver's thread.
+static void sampleReady(int32_t x, int32_t y, int32_t z)
+{
+    uint32_t head = (uint32_t)atomic_get(&ringHead);
+    uint32_t waiting = head - (uint32_t)atomic_get(&ringTail);
+
+    if (waiting >= SAMPLE_RING_SIZE) {
+        atomic_inc(&ringDropped);
+    } else {
+        accelSample_t *pSample = &ring[head % SAMPLE_RING_SIZE];
+        pSample->axis[0] = x;
+        pSample->axis[1] = y;
+        pSample->axis[2] = z;
+        atomic_set(&ringHead, (atomic_val_t)(head + 1));
+        waiting++;
+    }
+
+    if (waiting >= SAMPLE_BATCH_SIZE && atomic_cas(&batchQueued, 0, 1)) {
+        if (submitJob("Vibration", processBatch, NULL, 0) != 0)
+            atomic_set(&batchQueued, 0);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Creates the vibration features mutex
+/// @return 0 on success, negative on failure
+int32_t initVibration(void)
+{
+    if (featureMutex != NULL)
+        return U_ERROR_COMMON_SUCCESS;
+
+    int32_t errorCode = uPortMutexCreate(&featureMutex);
+    if (errorCode != 0) {
+        writeFatal("Failed to create the vibration features mutex (%d)", errorCode);
+    }
+
+    return errorCode;
+}
+
+/// @brief Starts capturing the accelerometer at a high rate
+/// @param rateHz The accelerometer output data rate
+/// @param shockThreshold The magnitude of a shock, in 0.01 m/s2
+/// @param callback Called when a shock is detected, can be NULL
+/// @return 0 on success, negative on failure
+int32_t startVibrationCapture(int32_t rateHz, int32_t shockThreshold, shockCallback_t callback)
+{
+    if (featureMutex == NULL)
+        return U_ERROR_COMMON_NOT_INITIALISED;
+
+    stopVibrationCapture();
+
+    U_PORT_MUTEX_LOCK(featureMutex);
+    memset(&totals, 0, sizeof(totals));
+    memset(lastSign, 0, sizeof(lastSign));
+    gravityValid = false;
+    shockHoldoff = 0;
+    shockHoldoffSamples = MAX(1, rateHz * SHOCK_HOLDOFF_MS / 1000);
+    shockThresholdSquared = (int64_t)shockThreshold * 10 * shockThreshold * 10;
+    shockCallback = callback;
+    atomic_set(&ringTail, atomic_get(&ringHead));
+    atomic_set(&ringDropped, 0);
+    U_PORT_MUTEX_UNLOCK(featureMutex);
+
+    if (startAccelerometerStream(rateHz, sampleReady) != 0) {
+        writeWarn("Failed to start the vibration capture at %d Hz", rateHz);
+        return U_ERROR_COMMON_NOT_SUPPORTED;
+    }
+
+    captureRateHz = rateHz;
+    running = true;
+    writeLog("Vibration capture started at %d Hz", rateHz);
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Stops capturing the accelerometer
+void stopVibrationCapture(void)
+{
+    if (!running)
+        return;
+
+    stopAccelerometerStream();
+    running = false;
+    writeLog("Vibration capture stopped");
+}
+
+/// @brief Returns true while the accelerometer is being captured
+bool isVibrationCaptureRunning(void)
+{
+    return running;
+}
+
+/// @brief Gets the vibration features since the last call, and starts
+/// collecting them again
+/// @param pFeatures Where to copy the features to
+/// @return The number of samples, zero if none have been captured
+uint32_t getVibrationFeatures(vibrationFeatures_t *pFeatures)
+{
+    featureTotals_t copy;
+
+    memset(pFeatures, 0, sizeof(vibrationFeatures_t));
+    if (featureMutex == NULL)
+        return 0;
+
+    U_PORT_MUTEX_LOCK(featureMutex);
+    copy = totals;
+    memset(&totals, 0, sizeof(totals));
+    U_PORT_MUTEX_UNLOCK(featureMutex);
+
+    pFeatures->rateHz = captureRateHz;
+    pFeatures->samples = copy.samples;
+    pFeatures->dropped = copy.dropped;
+    pFeatures->shocks = copy.shocks;
+    pFeatures->maxShock = copy.maxShock;
+
+    for(int i=0; i<3; i++) {
+        if (copy.samples > 0)
+            pFeatures->rms[i] = (int32_t)integerSqrt((uint64_t)(copy.sumSquares[i] / copy.samples));
+        pFeatures->peak[i] = copy.peak[i];
+        pFeatures->zeroCrossings[i] = copy.zeroCrossings[i];
+    }
+
+    return copy.samples;
+}
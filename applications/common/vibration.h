@@ -0,0 +1,79 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * High rate accelerometer capture and vibration features
+ *
+ */
+
+#ifndef _VIBRATION_H_
+#define _VIBRATION_H_
+
+/* ----------------------------------------------------------------
+ * DEFINITIONS
+ * -------------------------------------------------------------- */
+#define VIBRATION_SHOCK_THRESHOLD_DEFAULT 1000      // 0.01 m/s2
+
+/* ----------------------------------------------------------------
+ * PUBLIC TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+
+/// The vibration features since the last time they were read. The
+/// accelerations are in milli m/s2, with gravity removed.
+typedef struct {
+    int32_t rateHz;
+    uint32_t samples;
+    uint32_t dropped;               // samples lost as they weren't read in time
+    int32_t rms[3];
+    int32_t peak[3];
+    uint32_t zeroCrossings[3];
+    uint32_t shocks;
+    int32_t maxShock;               // the largest shock magnitude
+} vibrationFeatures_t;
+
+/// Called when a shock is detected, at most every few seconds
+/// @param magnitude The magnitude of the shock in milli m/s2
+typedef void (*shockCallback_t)(int32_t magnitude);
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Creates the vibration features mutex
+/// @return 0 on success, negative on failure
+int32_t initVibration(void);
+
+/// @brief Starts capturing the accelerometer at a high rate
+/// @param rateHz The accelerometer output data rate
+/// @param shockThreshold The magnitude of a shock, in 0.01 m/s2
+/// @param callback Called when a shock is detected, can be NULL
+/// @return 0 on success, negative on failure
+int32_t startVibrationCapture(int32_t rateHz, int32_t shockThreshold, shockCallback_t callback);
+
+/// @brief Stops capturing the accelerometer
+void stopVibrationCapture(void);
+
+/// @brief Returns true while the accelerometer is being captured
+bool isVibrationCaptureRunning(void);
+
+/// @brief Gets the vibration features since the last call, and starts
+/// collecting them again
+/// @param pFeatures Where to copy the features to
+/// @return The number of samples, zero if none have been captured
+uint32_t getVibrationFeatures(vibrationFeatures_t *pFeatures);
+
+#endif
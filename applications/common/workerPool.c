@@ -0,0 +1,483 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Shared worker pool. A small, fixed number of worker threads take jobs
+ * off a single run queue. App task message handlers, RUN_FUNC() functions
+ * and the periodic task jobs all run here, instead of each app task having
+ * its own loop thread and event queue thread.
+ *
+ * A job occupies its worker for its whole duration, so three blocking
+ * jobs (e.g. a DNS lookup and two modem queries) can still hold up the
+ * messages until one of them finishes. The jobs which run for a minute
+ * or more (location fix, cell scan, backlog upload, history query) are submitted
+ * as long jobs instead, which have their own queue and thread, so they
+ * never take a pool worker.
+ *
+ */
+
+#include "common.h"
+#include "workerPool.h"
+#include "timerWheel.h"
+
+/* ----------------------------------------------------------------
+ * DEFINES
+ * -------------------------------------------------------------- */
+#define WORKER_POOL_THREADS 3
+#define WORKER_POOL_STACK_SIZE (3 * 1024)
+#define WORKER_POOL_PRIORITY 5
+#define WORKER_POOL_QUEUE_LENGTH 16
+
+#define LONG_WORKER_STACK_SIZE (3 * 1024)
+#define LONG_WORKER_QUEUE_LENGTH 4
+
+// the periodic jobs which can all be running together:
+//  - the Signal Quality, Location, Sensor and Example task jobs (4)
+//  - the AccelSample, EnvSample and LightSample sensor sampling jobs (3)
+//  - the Location task's Motion and Track jobs (2)
+//  - the TaskStats and TimeSeriesFlush jobs (2)
+//  - the Upload, DataUsageSave, UdpTelemetryFlush and Adaptive jobs (4)
+// which is 15, with a few to spare
+#define MAX_PERIODIC_JOBS 20
+
+/* ----------------------------------------------------------------
+ * TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+typedef struct {
+    const char *name;
+    workerJobFunc_t func;
+    uint32_t queuedCycles;
+    size_t paramLengthBytes;
+    union {
+        uint8_t bytes[WORKER_JOB_PARAM_SIZE];
+        int64_t align;
+    } param;
+} workerJob_t;
+
+typedef struct {
+    const char *name;
+    workerJobFunc_t func;
+    int32_t periodMs;
+    timerWheelEntry_t timer;
+    uint32_t generation;        // changes each time the slot is reused
+    bool active;
+    bool queued;                // a run is queued or in progress
+    bool isLong;                // runs on the long job thread
+} periodicJob_t;
+
+/// Parameter of a queued periodic job run
+typedef struct {
+    int32_t jobId;
+    uint32_t generation;
+} periodicJobRun_t;
+
+/* ----------------------------------------------------------------
+ * STATIC VARIABLES
+ * -------------------------------------------------------------- */
+static uPortQueueHandle_t runQueue = NULL;
+static uPortTaskHandle_t workers[WORKER_POOL_THREADS];
+
+static uPortQueueHandle_t longRunQueue = NULL;
+static uPortTaskHandle_t longWorker = NULL;
+
+static uPortMutexHandle_t periodicJobMutex = NULL;
+static periodicJob_t periodicJobs[MAX_PERIODIC_JOBS];
+
+static workerJobStatsCallback_t jobStatsCallback = NULL;
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Runs the jobs of a queue, the pool workers and the long job
+/// thread share this loop
+/// @param pParameters The queue to take the jobs from
+static void workerLoop(void *pParameters)
+{
+    uPortQueueHandle_t queue = (uPortQueueHandle_t)pParameters;
+    workerJob_t job;
+
+    while(true) {
+        if (uPortQueueReceive(queue, &job) != 0 || job.func == NULL)
+            continue;
+
+        workerJobStatsCallback_t statsCallback = jobStatsCallback;
+        uint32_t startCycles = k_cycle_get_32();
+        uint64_t startThreadCycles = statsCallback != NULL ? getThreadCycles() : 0;
+
+        job.func(job.param.bytes, job.paramLengthBytes);
+
+        if (statsCallback != NULL) {
+            uint32_t endCycles = k_cycle_get_32();
+            statsCallback(job.name,
+                    (uint32_t)k_cyc_to_us_floor64(startCycles - job.queuedCycles),
+                    (uint32_t)k_cyc_to_us_floor64(endCycles - startCycles),
+                    (uint32_t)k_cyc_to_us_floor64(getThreadCycles() - startThreadCycles));
+        }
+    }
+}
+
+static void callFunctionJob(void *pParam, size_t paramLengthBytes)
+{
+    void (*func)(void *);
+    memcpy(&func, pParam, sizeof(func));
+    func(NULL);
+}
+
+static bool isValidPeriodicJob(int32_t jobId)
+{
+    return jobId >= 0 && jobId < MAX_PERIODIC_JOBS && periodicJobs[jobId].active;
+}
+
+/// @brief Runs a periodic job, if it hasn't been removed since it was queued
+static void runPeriodicJob(void *pParam, size_t paramLengthBytes)
+{
+    periodicJobRun_t *run = (periodicJobRun_t *)pParam;
+    periodicJob_t *job = &periodicJobs[run->jobId];
+    workerJobFunc_t func = NULL;
+
+    U_PORT_MUTEX_LOCK(periodicJobMutex);
+    if (job->active && job->generation == run->generation)
+        func = job->func;
+    U_PORT_MUTEX_UNLOCK(periodicJobMutex);
+
+    if (func != NULL)
+        func(NULL, 0);
+
+    U_PORT_MUTEX_LOCK(periodicJobMutex);
+    if (job->generation == run->generation)
+        job->queued = false;
+    U_PORT_MUTEX_UNLOCK(periodicJobMutex);
+}
+
+/// @brief Queues a run of the periodic job, unless one is already queued
+/// or running. Must be called with the periodicJobMutex locked.
+static void queuePeriodicJob(int32_t jobId)
+{
+    periodicJob_t *job = &periodicJobs[jobId];
+    if (!job->active || job->queued)
+        return;
+
+    workerJob_t qJob;
+    periodicJobRun_t run = {jobId, job->generation};
+
+    qJob.name = job->name;
+    qJob.func = runPeriodicJob;
+    qJob.queuedCycles = k_cycle_get_32();
+    qJob.paramLengthBytes = sizeof(run);
+    memcpy(qJob.param.bytes, &run, sizeof(run));
+
+    if (uPortQueueSendIrq(job->isLong ? longRunQueue : runQueue, &qJob) == 0)
+        job->queued = true;
+}
+
+static void periodicJobTimerCallback(void *pParameter)
+{
+    int32_t jobId = (int32_t)(intptr_t)pParameter;
+
+    U_PORT_MUTEX_LOCK(periodicJobMutex);
+    queuePeriodicJob(jobId);
+    U_PORT_MUTEX_UNLOCK(periodicJobMutex);
+}
+
+static int32_t queueJob(uPortQueueHandle_t queue, const char *name, workerJobFunc_t func,
+                        const void *pParam, size_t paramLengthBytes)
+{
+    if (queue == NULL)
+        return U_ERROR_COMMON_NOT_INITIALISED;
+
+    if (func == NULL || paramLengthBytes > WORKER_JOB_PARAM_SIZE) {
+        writeError("Invalid %s job, parameter size %d", name, paramLengthBytes);
+        return U_ERROR_COMMON_INVALID_PARAMETER;
+    }
+
+    workerJob_t job;
+    job.name = name;
+    job.func = func;
+    job.queuedCycles = k_cycle_get_32();
+    job.paramLengthBytes = paramLengthBytes;
+    if (pParam != NULL && paramLengthBytes > 0)
+        memcpy(job.param.bytes, pParam, paramLengthBytes);
+
+    int32_t errorCode = uPortQueueSendIrq(queue, &job);
+    if (errorCode != 0) {
+        writeDebug("Worker pool %s queue is full, %s job not queued",
+                queue == longRunQueue ? "long job" : "run", name);
+    }
+
+    return errorCode;
+}
+
+static int32_t addPeriodicJobOnQueue(const char *name, workerJobFunc_t func, int32_t periodMs, bool isLong)
+{
+    if (runQueue == NULL)
+        return U_ERROR_COMMON_NOT_INITIALISED;
+
+    int32_t jobId = U_ERROR_COMMON_NO_MEMORY;
+
+    U_PORT_MUTEX_LOCK(periodicJobMutex);
+
+    for(int i=0; i<MAX_PERIODIC_JOBS; i++) {
+        if (!periodicJobs[i].active) {
+            jobId = i;
+            break;
+        }
+    }
+
+    if (jobId >= 0) {
+        periodicJob_t *job = &periodicJobs[jobId];
+
+        job->name = name;
+        job->func = func;
+        job->periodMs = periodMs;
+        job->generation++;
+        job->queued = false;
+        job->isLong = isLong;
+        job->active = true;
+
+        // the timer wheel aligns the job with the other periodic jobs
+        int32_t errorCode = timerWheelAdd(&job->timer, periodMs, periodicJobTimerCallback,
+                                            (void *)(intptr_t)jobId);
+        if (errorCode != 0) {
+            writeError("Failed to start the %s periodic job timer (%d)", name, errorCode);
+            job->active = false;
+            jobId = errorCode;
+        } else {
+            queuePeriodicJob(jobId);
+        }
+    } else {
+        writeError("No free periodic job slots for %s", name);
+    }
+
+    U_PORT_MUTEX_UNLOCK(periodicJobMutex);
+
+    return jobId;
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Creates the run queue and starts the worker threads
+/// @return 0 on success, negative on failure
+int32_t initWorkerPool(void)
+{
+    if (runQueue != NULL)
+        return U_ERROR_COMMON_SUCCESS;
+
+    for(int i=0; i<MAX_PERIODIC_JOBS; i++)
+        periodicJobs[i].timer.level = -1;
+
+    int32_t errorCode = initTimerWheel();
+    if (errorCode != 0)
+        return errorCode;
+
+    errorCode = uPortMutexCreate(&periodicJobMutex);
+    if (errorCode != 0) {
+        writeFatal("Failed to create the worker pool mutex (%d)", errorCode);
+        return errorCode;
+    }
+
+    errorCode = uPortQueueCreate(LONG_WORKER_QUEUE_LENGTH, sizeof(workerJob_t), &longRunQueue);
+    if (errorCode != 0) {
+        writeFatal("Failed to create the worker pool long job queue (%d)", errorCode);
+        longRunQueue = NULL;
+        return errorCode;
+    }
+
+    errorCode = uPortQueueCreate(WORKER_POOL_QUEUE_LENGTH, sizeof(workerJob_t), &runQueue);
+    if (errorCode != 0) {
+        writeFatal("Failed to create the worker pool run queue (%d)", errorCode);
+        runQueue = NULL;
+        return errorCode;
+    }
+
+    for(int i=0; i<WORKER_POOL_THREADS; i++) {
+        errorCode = uPortTaskCreate(workerLoop, "Worker", WORKER_POOL_STACK_SIZE,
+                                    runQueue, WORKER_POOL_PRIORITY, &workers[i]);
+        if (errorCode != 0) {
+            writeFatal("Failed to start worker pool thread #%d (%d)", i, errorCode);
+            return errorCode;
+        }
+    }
+
+    errorCode = uPortTaskCreate(workerLoop, "LongWorker", LONG_WORKER_STACK_SIZE,
+                                longRunQueue, WORKER_POOL_PRIORITY, &longWorker);
+    if (errorCode != 0) {
+        writeFatal("Failed to start the long job thread (%d)", errorCode);
+        return errorCode;
+    }
+
+    writeLog("Worker pool started with %d threads and a long job thread", WORKER_POOL_THREADS);
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Puts a job on the run queue. The parameter is copied.
+/// @param name The name of the job, for logging
+/// @param func The job function to run
+/// @param pParam The parameter to copy for the job, can be NULL
+/// @param paramLengthBytes The size of the parameter, max WORKER_JOB_PARAM_SIZE
+/// @return 0 on success, negative on failure (run queue full)
+int32_t submitJob(const char *name, workerJobFunc_t func, const void *pParam, size_t paramLengthBytes)
+{
+    return queueJob(runQueue, name, func, pParam, paramLengthBytes);
+}
+
+/// @brief Puts a job which runs for a long time (a minute or more) on the
+/// long job thread, so it doesn't hold up a pool worker. The long jobs run
+/// one after the other.
+/// @param name The name of the job, for logging
+/// @param func The job function to run
+/// @param pParam The parameter to copy for the job, can be NULL
+/// @param paramLengthBytes The size of the parameter, max WORKER_JOB_PARAM_SIZE
+/// @return 0 on success, negative on failure (long job queue full)
+int32_t submitLongJob(const char *name, workerJobFunc_t func, const void *pParam, size_t paramLengthBytes)
+{
+    return queueJob(longRunQueue, name, func, pParam, paramLengthBytes);
+}
+
+/// @brief Runs a one-off function on the pool, used by RUN_FUNC
+/// @param name The name of the job, for logging
+/// @param func The function to run, which is called with a NULL parameter
+/// @return 0 on success, negative on failure
+int32_t runFunctionJob(const char *name, void (*func)(void *))
+{
+    return submitJob(name, callFunctionJob, &func, sizeof(func));
+}
+
+/// @brief Runs a one-off function which takes a long time on the long
+/// job thread, used by RUN_LONG_FUNC
+/// @param name The name of the job, for logging
+/// @param func The function to run, which is called with a NULL parameter
+/// @return 0 on success, negative on failure
+int32_t runLongFunctionJob(const char *name, void (*func)(void *))
+{
+    return submitLongJob(name, callFunctionJob, &func, sizeof(func));
+}
+
+/// @brief Adds a job which is run every periodMs. The job is run straight
+/// away, and a period is skipped if the previous run hasn't finished yet.
+/// @param name The name of the job, for logging
+/// @param func The job function to run, called with a NULL parameter
+/// @param periodMs The period between each run in milliseconds
+/// @return The periodic job ID (zero or positive), or negative on failure
+int32_t addPeriodicJob(const char *name, workerJobFunc_t func, int32_t periodMs)
+{
+    return addPeriodicJobOnQueue(name, func, periodMs, false);
+}
+
+/// @brief Adds a periodic job which runs on the long job thread, for
+/// jobs which can block for a long time on each run
+/// @param name The name of the job, for logging
+/// @param func The job function to run, called with a NULL parameter
+/// @param periodMs The period between each run in milliseconds
+/// @return The periodic job ID (zero or positive), or negative on failure
+int32_t addLongPeriodicJob(const char *name, workerJobFunc_t func, int32_t periodMs)
+{
+    return addPeriodicJobOnQueue(name, func, periodMs, true);
+}
+
+/// @brief Changes the period of a periodic job
+/// @param jobId The periodic job ID
+/// @param periodMs The new period in milliseconds
+/// @return 0 on success, negative on failure
+int32_t setPeriodicJobPeriod(int32_t jobId, int32_t periodMs)
+{
+    int32_t errorCode = U_ERROR_COMMON_INVALID_PARAMETER;
+
+    U_PORT_MUTEX_LOCK(periodicJobMutex);
+
+    if (isValidPeriodicJob(jobId)) {
+        periodicJob_t *job = &periodicJobs[jobId];
+        errorCode = timerWheelChange(&job->timer, periodMs);
+        if (errorCode == 0)
+            job->periodMs = periodMs;
+    }
+
+    U_PORT_MUTEX_UNLOCK(periodicJobMutex);
+
+    return errorCode;
+}
+
+/// @brief Returns the CPU time of the current thread in cycles, used to
+/// measure the CPU time of a job or a message handler
+/// @return The execution cycles of the current thread, 0 if not available
+uint64_t getThreadCycles(void)
+{
+    k_thread_runtime_stats_t stats;
+    if (k_thread_runtime_stats_get(k_current_get(), &stats) != 0)
+        return 0;
+
+    return stats.execution_cycles;
+}
+
+/// @brief Sets the callback which receives the timings of each job
+/// @param callback The callback function, NULL to stop
+void setWorkerJobStatsCallback(workerJobStatsCallback_t callback)
+{
+    jobStatsCallback = callback;
+}
+
+/// @brief Returns the lowest free stack of the worker threads, including
+/// the long job thread
+/// @return The minimum free stack in bytes, or negative on failure
+int32_t getWorkerPoolStackMinFree(void)
+{
+    int32_t minFree = U_ERROR_COMMON_NOT_INITIALISED;
+
+    for(int i=0; i<WORKER_POOL_THREADS; i++) {
+        if (workers[i] == NULL)
+            continue;
+
+        int32_t stackFree = uPortTaskStackMinFree(workers[i]);
+        if (stackFree >= 0 && (minFree < 0 || stackFree < minFree))
+            minFree = stackFree;
+    }
+
+    if (longWorker != NULL) {
+        int32_t stackFree = uPortTaskStackMinFree(longWorker);
+        if (stackFree >= 0 && (minFree < 0 || stackFree < minFree))
+            minFree = stackFree;
+    }
+
+    return minFree;
+}
+
+/// @brief Removes a periodic job. A run which is queued but not
+/// started yet is discarded, a run in progress is left to finish.
+/// @param jobId The periodic job ID
+/// @return 0 on success, negative on failure
+int32_t removePeriodicJob(int32_t jobId)
+{
+    int32_t errorCode = U_ERROR_COMMON_INVALID_PARAMETER;
+
+    U_PORT_MUTEX_LOCK(periodicJobMutex);
+
+    if (isValidPeriodicJob(jobId)) {
+        periodicJob_t *job = &periodicJobs[jobId];
+        timerWheelRemove(&job->timer);
+        job->active = false;
+        job->queued = false;
+        job->generation++;
+        errorCode = U_ERROR_COMMON_SUCCESS;
+    }
+
+    U_PORT_MUTEX_UNLOCK(periodicJobMutex);
+
+    return errorCode;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Shared worker pool which runs the app task jobs and message handlers
+ *
+ */
+
+#ifndef _WORKER_POOL_H_
+#define _WORKER_POOL_H_
+
+/* ----------------------------------------------------------------
+ * DEFINITIONS
+ * -------------------------------------------------------------- */
+// Maximum size of the parameter which is copied with a job,
+// this must be big enough for the largest app task message
+#define WORKER_JOB_PARAM_SIZE 32
+
+/* ----------------------------------------------------------------
+ * PUBLIC TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+
+/// A job function. Same signature as an event queue handler so
+/// task message handlers can be run on the pool directly.
+typedef void (*workerJobFunc_t)(void *pParam, size_t paramLengthBytes);
+
+/// Called after each job has run, with the job timings for profiling
+/// @param name The name the job was submitted with
+/// @param latencyUs Time from the job being queued to it starting
+/// @param runUs Wall clock time the job took to run
+/// @param cpuUs CPU time the worker thread used while running the job
+typedef void (*workerJobStatsCallback_t)(const char *name, uint32_t latencyUs, uint32_t runUs, uint32_t cpuUs);
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Creates the run queue and starts the worker threads
+/// @return 0 on success, negative on failure
+int32_t initWorkerPool(void);
+
+/// @brief Puts a job on the run queue. The parameter is copied.
+/// @param name The name of the job, for logging
+/// @param func The job function to run
+/// @param pParam The parameter to copy for the job, can be NULL
+/// @param paramLengthBytes The size of the parameter, max WORKER_JOB_PARAM_SIZE
+/// @return 0 on success, negative on failure (run queue full)
+int32_t submitJob(const char *name, workerJobFunc_t func, const void *pParam, size_t paramLengthBytes);
+
+/// @brief Puts a job which runs for a long time (a minute or more) on the
+/// long job thread, so it doesn't hold up a pool worker. The long jobs run
+/// one after the other.
+/// @param name The name of the job, for logging
+/// @param func The job function to run
+/// @param pParam The parameter to copy for the job, can be NULL
+/// @param paramLengthBytes The size of the parameter, max WORKER_JOB_PARAM_SIZE
+/// @return 0 on success, negative on failure (long job queue full)
+int32_t submitLongJob(const char *name, workerJobFunc_t func, const void *pParam, size_t paramLengthBytes);
+
+/// @brief Runs a one-off function on the pool, used by RUN_FUNC
+/// @param name The name of the job, for logging
+/// @param func The function to run, which is called with a NULL parameter
+/// @return 0 on success, negative on failure
+int32_t runFunctionJob(const char *name, void (*func)(void *));
+
+/// @brief Runs a one-off function which takes a long time on the long
+/// job thread, used by RUN_LONG_FUNC
+/// @param name The name of the job, for logging
+/// @param func The function to run, which is called with a NULL parameter
+/// @return 0 on success, negative on failure
+int32_t runLongFunctionJob(const char *name, void (*func)(void *));
+
+/// @brief Adds a job which is run every periodMs. The job is run straight
+/// away, and a period is skipped if the previous run hasn't finished yet.
+/// @param name The name of the job, for logging
+/// @param func The job function to run, called with a NULL parameter
+/// @param periodMs The period between each run in milliseconds
+/// @return The periodic job ID (zero or positive), or negative on failure
+int32_t addPeriodicJob(const char *name, workerJobFunc_t func, int32_t periodMs);
+
+/// @brief Adds a periodic job which runs on the long job thread, for
+/// jobs which can block for a long time on each run
+/// @param name The name of the job, for logging
+/// @param func The job function to run, called with a NULL parameter
+/// @param periodMs The period between each run in milliseconds
+/// @return The periodic job ID (zero or positive), or negative on failure
+int32_t addLongPeriodicJob(const char *name, workerJobFunc_t func, int32_t periodMs);
+
+/// @brief Changes the period of a periodic job
+/// @param jobId The periodic job ID
+/// @param periodMs The new period in milliseconds
+/// @return 0 on success, negative on failure
+int32_t setPeriodicJobPeriod(int32_t jobId, int32_t periodMs);
+
+/// @brief Returns the CPU time of the current thread in cycles, used to
+/// measure the CPU time of a job or a message handler
+/// @return The execution cycles of the current thread, 0 if not available
+uint64_t getThreadCycles(void);
+
+/// @brief Sets the callback which receives the timings of each job
+/// @param callback The callback function, NULL to stop
+void setWorkerJobStatsCallback(workerJobStatsCallback_t callback);
+
+/// @brief Returns the lowest free stack of the worker threads, including
+/// the long job thread
+/// @return The minimum free stack in bytes, or negative on failure
+int32_t getWorkerPoolStackMinFree(void);
+
+/// @brief Removes a periodic job. A run which is queued but not
+/// started yet is discarded, a run in progress is left to finish.
+/// @param jobId The periodic job ID
+/// @return 0 on success, negative on failure
+int32_t removePeriodicJob(int32_t jobId);
+
+#endif
@@ -141,20 +141,10 @@ static void taskLoop(void *pParameters)
 
 static int32_t initQueue()
 {
-    int32_t eventQueueHandle = uPortEventQueueOpen(&queueHandler,
-                    TASK_NAME,
-                    sizeof(LEDConfigMsg_t),
-                    LED_TASK_STACK_SIZE,
-                    1,
-                    1);
-
-    if (eventQueueHandle < 0) {
-        writeLog("Failed to create %s event queue %d", TASK_NAME, eventQueueHandle);
-    }
-
-    TASK_QUEUE = eventQueueHandle;
+    // task messages are handled on the shared worker pool
+    TASK_MSG_HANDLER = queueHandler;
 
-    return eventQueueHandle;
+    return U_ERROR_COMMON_SUCCESS;
 }
 
 static int32_t initMutex()
@@ -0,0 +1,516 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Adaptive reporting interval controller.
+ *
+ * With ADAPTIVE_REPORTING set to TRUE, a job every 30 seconds works out
+ * a factor from the state of the device, and scales the main loop dwell
+ * time and the dwell times of the reporting tasks by it:
+ *      moving              x1/2    (only when the location fixes are motion gated)
+ *      stationary          x4
+ *      poor signal         x2      RSRP below ADAPTIVE_POOR_RSRP, as each
+ *                                  transmission costs more energy
+ *      bad signal          x4      RSRP 10 dB below that
+ *      on battery          x2      from the battery gauge, discharging
+ *      low battery         x4      discharging and the state of charge below
+ *                                  ADAPTIVE_LOW_BATTERY
+ *      budget low          x2      less than half of the data budget bucket left
+ *      budget critical     x4      less than a quarter left
+ *      budget used         x16     the monthly budget is used up
+ *
+ * The factors multiply. A shorter interval is never below ADAPTIVE_MIN_SECS
+ * and a longer one is never above ADAPTIVE_MAX_SECS, but the controller
+ * never moves an interval which is already outside these bounds further
+ * out. Each decision is logged when it changes, and the last one is in
+ * the task stats.
+ *
+ * The power state is read from the BQ274XX fuel gauge at each decision.
+ * The gauge's average current is positive while charging and zero while a
+ * full battery is held up by the external supply, so the device is only
+ * on battery while it is negative. setPowerState() and SET_POWER_STATE
+ * override the gauge, until SET_POWER_STATE AUTO.
+ *
+ */
+
+#include "common.h"
+#include "taskControl.h"
+#include "appInit.h"
+#include "adaptiveReporting.h"
+#include "locationTask.h"
+#include "radioCache.h"
+#include "dataBudget.h"
+#include "sensors.h"
+
+/* ----------------------------------------------------------------
+ * DEFINES
+ * -------------------------------------------------------------- */
+#define CONTROL_PERIOD_MS 30000
+
+// the factors are in percent
+#define FACTOR_UNITY 100
+
+#define MIN_SECS_DEFAULT 10
+#define MAX_SECS_DEFAULT 900
+#define POOR_RSRP_DEFAULT -110
+#define BAD_RSRP_MARGIN 10
+#define LOW_BATTERY_DEFAULT 20
+
+// the power state is measured by the battery gauge
+#define POWER_OVERRIDE_NONE -1
+
+#define REASONS_TEXT_SIZE 100
+
+/* ----------------------------------------------------------------
+ * TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+typedef struct {
+    const char *name;
+    int32_t factor;
+} adaptiveReason_t;
+
+/// The reasons for a decision, as bits of the reasons mask
+typedef enum {
+    REASON_MOVING,
+    REASON_STATIONARY,
+    REASON_POOR_SIGNAL,
+    REASON_BAD_SIGNAL,
+    REASON_BATTERY,
+    REASON_LOW_BATTERY,
+    REASON_BUDGET_LOW,
+    REASON_BUDGET_CRITICAL,
+    REASON_BUDGET_USED,
+    MAX_REASONS
+} adaptiveReasonId_t;
+
+typedef struct {
+    int32_t factor;
+    uint32_t reasons;
+    int32_t rsrp;               // 0 if not known
+    int32_t budgetLevel;        // -1 if there is no budget
+    int32_t appDwellMs;
+    uint32_t changes;
+} adaptiveDecision_t;
+
+/* ----------------------------------------------------------------
+ * STATIC VARIABLES
+ * -------------------------------------------------------------- */
+static const adaptiveReason_t reasonTable[MAX_REASONS] = {
+    {"Moving",          FACTOR_UNITY / 2},
+    {"Stationary",      FACTOR_UNITY * 4},
+    {"PoorSignal",      FACTOR_UNITY * 2},
+    {"BadSignal",       FACTOR_UNITY * 4},
+    {"Battery",         FACTOR_UNITY * 2},
+    {"LowBattery",      FACTOR_UNITY * 4},
+    {"BudgetLow",       FACTOR_UNITY * 2},
+    {"BudgetCritical",  FACTOR_UNITY * 4},
+    {"BudgetUsed",      FACTOR_UNITY * 16}
+};
+
+static const char *powerStateNames[] = {"External", "Battery", "Low"};
+
+/// @brief the reporting tasks whose dwell times are adapted
+static const taskTypeId_t adaptedTasks[] = {
+    SIGNAL_QUALITY_TASK,
+    LOCATION_TASK,
+    SENSOR_TASK,
+    EXAMPLE_TASK
+};
+
+static uPortMutexHandle_t adaptiveMutex = NULL;
+
+/// @brief the configuration and last decision, protected by the adaptive mutex
+static bool enabled = false;
+static int32_t minSecs = MIN_SECS_DEFAULT;
+static int32_t maxSecs = MAX_SECS_DEFAULT;
+static int32_t poorRsrp = POOR_RSRP_DEFAULT;
+static int32_t lowBatteryPercent = LOW_BATTERY_DEFAULT;
+static adaptiveDecision_t decision = {FACTOR_UNITY, 0, 0, -1, 0, 0};
+
+static int32_t controlJobId = -1;
+
+/// @brief the power state from the battery gauge, and the one set by
+/// setPowerState() which overrides it
+static atomic_t measuredPowerState = ATOMIC_INIT(POWER_STATE_EXTERNAL);
+static atomic_t powerOverride = ATOMIC_INIT(POWER_OVERRIDE_NONE);
+
+/// @brief the last state of charge read from the gauge, -1 if not known
+static atomic_t batteryPercent = ATOMIC_INIT(-1);
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+static void formatReasons(uint32_t reasons, char *pBuffer, size_t size)
+{
+    size_t len = 0;
+
+    pBuffer[0] = 0;
+    for(int32_t i=0; i<MAX_REASONS && len < size; i++) {
+        if ((reasons & (1 << i)) != 0)
+            len += snprintf(pBuffer + len, size - len, "%s%s", len > 0 ? "," : "", reasonTable[i].name);
+    }
+}
+
+/// @brief Gets the power state the intervals are adapted to
+static powerState_t getPowerState(void)
+{
+    atomic_val_t override = atomic_get(&powerOverride);
+    if (override != POWER_OVERRIDE_NONE)
+        return (powerState_t)override;
+
+    return (powerState_t)atomic_get(&measuredPowerState);
+}
+
+/// @brief Reads the power state from the battery gauge. The state is left
+/// as it was if there is no gauge or it can't be read.
+/// @param lowPercent The state of charge below which the battery is low
+static void readBatteryGauge(int32_t lowPercent)
+{
+    int32_t stateOfCharge, currentMa, voltageMv;
+
+    if (getBatteryGauge(&stateOfCharge, &currentMa, &voltageMv) != 0)
+        return;
+
+    powerState_t state = POWER_STATE_EXTERNAL;
+    if (currentMa < 0)
+        state = stateOfCharge < lowPercent ? POWER_STATE_LOW_BATTERY : POWER_STATE_BATTERY;
+
+    atomic_set(&batteryPercent, stateOfCharge);
+    if ((powerState_t)atomic_set(&measuredPowerState, state) != state &&
+            atomic_get(&powerOverride) == POWER_OVERRIDE_NONE) {
+        writeLog("Power state: %s (battery %d%%, %d mA, %d mV)",
+                    powerStateNames[state], stateOfCharge, currentMa, voltageMv);
+    }
+}
+
+/// @brief Scales an interval by the factor, within the min and max bounds.
+/// Called with the adaptive mutex held.
+/// @param baseMs The interval the task or main loop is set to
+/// @param factor The factor in percent
+/// @return The adapted interval in milliseconds
+static int64_t adaptInterval(int64_t baseMs, int32_t factor)
+{
+    int64_t adaptedMs = baseMs * factor / FACTOR_UNITY;
+
+    if (factor < FACTOR_UNITY)
+        return MAX(adaptedMs, MIN((int64_t)minSecs * 1000, baseMs));
+
+    return MIN(adaptedMs, MAX((int64_t)maxSecs * 1000, baseMs));
+}
+
+/// @brief Sets the adapted dwell times from the decision factor, or back
+/// to their own when the factor is unity. Called with the adaptive mutex held.
+static void applyDecision(int32_t factor)
+{
+    for(size_t i=0; i<NUM_ELEMENTS(adaptedTasks); i++) {
+        taskConfig_t *taskConfig = getTaskConfig(adaptedTasks[i]);
+        if (taskConfig == NULL || taskConfig->taskLoopDwellTime <= 0)
+            continue;
+
+        int32_t seconds = 0;
+        if (factor != FACTOR_UNITY)
+            seconds = (int32_t)(adaptInterval((int64_t)taskConfig->taskLoopDwellTime * 1000, factor) / 1000);
+
+        setAdaptedTaskDwellTime(adaptedTasks[i], seconds);
+    }
+
+    int32_t appDwellMs = 0;
+    if (factor != FACTOR_UNITY)
+        appDwellMs = (int32_t)adaptInterval(getBaseAppDwellTime(), factor);
+
+    setAdaptedAppDwellTime(appDwellMs);
+    decision.appDwellMs = appDwellMs > 0 ? appDwellMs : getBaseAppDwellTime();
+}
+
+/// @brief Works out the reasons for adapting the intervals from the state
+/// of the device
+static uint32_t getReasons(int32_t *pRsrp, int32_t *pBudgetLevel, int32_t poorRsrpLimit)
+{
+    uint32_t reasons = 0;
+    radioSnapshot_t radio;
+
+    switch(getMotionState()) {
+        case MOTION_MOVING:     reasons |= 1 << REASON_MOVING; break;
+        case MOTION_STATIONARY: reasons |= 1 << REASON_STATIONARY; break;
+        default: break;
+    }
+
+    // only the cached radio parameters are used, so the controller never
+    // makes the module do any extra work
+    *pRsrp = 0;
+    if (IS_NETWORK_AVAILABLE && getRadioSnapshot(&radio, RADIO_SNAPSHOT_CACHED_ONLY) == 0 &&
+            radio.radioValid && radio.rsrp < 0) {
+        *pRsrp = radio.rsrp;
+        if (radio.rsrp < poorRsrpLimit - BAD_RSRP_MARGIN)
+            reasons |= 1 << REASON_BAD_SIGNAL;
+        else if (radio.rsrp < poorRsrpLimit)
+            reasons |= 1 << REASON_POOR_SIGNAL;
+    }
+
+    powerState_t power = getPowerState();
+    if (power == POWER_STATE_BATTERY)
+        reasons |= 1 << REASON_BATTERY;
+    else if (power == POWER_STATE_LOW_BATTERY)
+        reasons |= 1 << REASON_LOW_BATTERY;
+
+    *pBudgetLevel = getDataBudgetLevel();
+    if (*pBudgetLevel == 0)
+        reasons |= 1 << REASON_BUDGET_USED;
+    else if (*pBudgetLevel >= 0 && *pBudgetLevel < 25)
+        reasons |= 1 << REASON_BUDGET_CRITICAL;
+    else if (*pBudgetLevel >= 0 && *pBudgetLevel < 50)
+        reasons |= 1 << REASON_BUDGET_LOW;
+
+    return reasons;
+}
+
+/// @brief Decides the reporting intervals, on the worker pool
+static void controlJob(void *pParam, size_t paramLengthBytes)
+{
+    char reasonsText[REASONS_TEXT_SIZE];
+    int32_t rsrp, budgetLevel, poorRsrpLimit, lowPercent, appDwellMs;
+    bool running;
+    bool changed = false;
+
+    U_PORT_MUTEX_LOCK(adaptiveMutex);
+    poorRsrpLimit = poorRsrp;
+    lowPercent = lowBatteryPercent;
+    running = enabled;
+    U_PORT_MUTEX_UNLOCK(adaptiveMutex);
+
+    if (!running || gExitApp)
+        return;
+
+    readBatteryGauge(lowPercent);
+    uint32_t reasons = getReasons(&rsrp, &budgetLevel, poorRsrpLimit);
+
+    int32_t factor = FACTOR_UNITY;
+    for(int32_t i=0; i<MAX_REASONS; i++) {
+        if ((reasons & (1 << i)) != 0)
+            factor = factor * reasonTable[i].factor / FACTOR_UNITY;
+    }
+
+    U_PORT_MUTEX_LOCK(adaptiveMutex);
+
+    // not applied if it was turned off while the state was being read
+    if (enabled) {
+        changed = factor != decision.factor || reasons != decision.reasons;
+        decision.factor = factor;
+        decision.reasons = reasons;
+        decision.rsrp = rsrp;
+        decision.budgetLevel = budgetLevel;
+        if (changed)
+            decision.changes++;
+
+        // always applied, as the base dwell times may have been changed
+        applyDecision(factor);
+    }
+    appDwellMs = decision.appDwellMs;
+
+    U_PORT_MUTEX_UNLOCK(adaptiveMutex);
+
+    if (changed) {
+        formatReasons(reasons, reasonsText, sizeof(reasonsText));
+        writeLog("Adaptive reporting: factor %d%% (%s), main loop every %d ms",
+                    factor, reasons != 0 ? reasonsText : "None", appDwellMs);
+    }
+}
+
+/// @brief Sets or clears the power state override
+static void setPowerOverride(atomic_val_t override)
+{
+    if (atomic_set(&powerOverride, override) == override)
+        return;
+
+    if (override == POWER_OVERRIDE_NONE)
+        writeLog("Power state from the battery gauge");
+    else
+        writeLog("Power state set to %s", powerStateNames[override]);
+
+    // decide straight away rather than at the next control period, the
+    // job does nothing if the controller is off
+    if (adaptiveMutex != NULL)
+        submitJob("Adaptive", controlJob, NULL, 0);
+}
+
+/// @brief Reads the ADAPTIVE_ configuration, and starts or stops the controller
+static void applyAdaptiveConfig(void)
+{
+    bool enable = false;
+    int32_t min = MIN_SECS_DEFAULT;
+    int32_t max = MAX_SECS_DEFAULT;
+    int32_t rsrp = POOR_RSRP_DEFAULT;
+    int32_t lowBattery = LOW_BATTERY_DEFAULT;
+    bool restarted = false;
+
+    setBoolParamFromConfig("ADAPTIVE_REPORTING", "TRUE", &enable);
+    setIntParamFromConfig("ADAPTIVE_MIN_SECS", &min);
+    setIntParamFromConfig("ADAPTIVE_MAX_SECS", &max);
+    setIntParamFromConfig("ADAPTIVE_POOR_RSRP", &rsrp);
+    setIntParamFromConfig("ADAPTIVE_LOW_BATTERY", &lowBattery);
+
+    if (min > max) {
+        writeWarn("ADAPTIVE_MIN_SECS is more than ADAPTIVE_MAX_SECS, using the defaults");
+        min = MIN_SECS_DEFAULT;
+        max = MAX_SECS_DEFAULT;
+    }
+
+    U_PORT_MUTEX_LOCK(adaptiveMutex);
+
+    minSecs = min;
+    maxSecs = max;
+    poorRsrp = rsrp;
+    lowBatteryPercent = lowBattery;
+    enabled = enable;
+
+    if (enable && controlJobId >= 0) {
+        restarted = true;
+    } else if (enable) {
+        controlJobId = addPeriodicJob("Adaptive", controlJob, CONTROL_PERIOD_MS);
+        if (controlJobId < 0) {
+            writeWarn("Failed to start the adaptive reporting (%d)", controlJobId);
+            enabled = false;
+        }
+    } else if (!enable && controlJobId >= 0) {
+        removePeriodicJob(controlJobId);
+        controlJobId = -1;
+
+        decision.factor = FACTOR_UNITY;
+        decision.reasons = 0;
+        applyDecision(FACTOR_UNITY);
+    }
+
+    U_PORT_MUTEX_UNLOCK(adaptiveMutex);
+
+    if (enable)
+        writeLog("Adaptive reporting on, intervals kept within %d and %d seconds", min, max);
+    else
+        writeLog("Adaptive reporting off");
+
+    // the running controller applies the new bounds straight away, a new
+    // periodic job runs when it is added
+    if (restarted)
+        submitJob("Adaptive", controlJob, NULL, 0);
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Reads the ADAPTIVE_ configuration, and starts the controller
+/// if ADAPTIVE_REPORTING is TRUE
+/// @return 0 on success, negative on failure
+int32_t initAdaptiveReporting(void)
+{
+    if (adaptiveMutex != NULL)
+        return U_ERROR_COMMON_SUCCESS;
+
+    int32_t errorCode = uPortMutexCreate(&adaptiveMutex);
+    if (errorCode != 0) {
+        writeFatal("Failed to create the adaptive reporting mutex (%d)", errorCode);
+        return errorCode;
+    }
+
+    decision.appDwellMs = getBaseAppDwellTime();
+
+    // the gauge is found here too, as the sensor and location tasks which
+    // also find it may not be running
+    sensorsInit();
+
+    if (isConfigPresent("ADAPTIVE_REPORTING"))
+        applyAdaptiveConfig();
+
+    registerConfigChangedCallback(ADAPTIVE_CONFIG_PREFIX, applyAdaptiveConfig);
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Overrides the power state read from the battery gauge
+/// @param state The power state
+void setPowerState(powerState_t state)
+{
+    setPowerOverride(state);
+}
+
+/// @brief Goes back to the power state read from the battery gauge
+void clearPowerStateOverride(void)
+{
+    setPowerOverride(POWER_OVERRIDE_NONE);
+}
+
+/// @brief Overrides the power state from a remote command
+/// @param params <EXTERNAL|BATTERY|LOW|AUTO>
+/// @return 0 on success, negative on failure
+int32_t setPowerStateCommand(commandParamsList_t *params)
+{
+    static const char *commandNames[] = {"EXTERNAL", "BATTERY", "LOW"};
+
+    if (params == NULL || params->pNext == NULL) {
+        writeWarn("SET_POWER_STATE needs EXTERNAL, BATTERY, LOW or AUTO");
+        return U_ERROR_COMMON_INVALID_PARAMETER;
+    }
+
+    if (strcmp(params->pNext->parameter, "AUTO") == 0) {
+        clearPowerStateOverride();
+        return U_ERROR_COMMON_SUCCESS;
+    }
+
+    for(int32_t i=0; i<NUM_ELEMENTS(commandNames); i++) {
+        if (strcmp(params->pNext->parameter, commandNames[i]) == 0) {
+            setPowerState((powerState_t)i);
+            return U_ERROR_COMMON_SUCCESS;
+        }
+    }
+
+    writeWarn("Unknown power state '%s'", params->pNext->parameter);
+
+    return U_ERROR_COMMON_INVALID_PARAMETER;
+}
+
+/// @brief Formats the last decision of the controller as a JSON member
+/// for the task stats
+/// @param pBuffer The buffer to write to
+/// @param size The size of the buffer
+/// @return The length of the JSON, negative if it didn't fit
+int32_t formatAdaptiveReportingJson(char *pBuffer, size_t size)
+{
+    char reasonsText[REASONS_TEXT_SIZE];
+    adaptiveDecision_t last;
+    bool on;
+
+    if (adaptiveMutex == NULL)
+        return U_ERROR_COMMON_NOT_INITIALISED;
+
+    U_PORT_MUTEX_LOCK(adaptiveMutex);
+    last = decision;
+    on = enabled;
+    U_PORT_MUTEX_UNLOCK(adaptiveMutex);
+
+    formatReasons(last.reasons, reasonsText, sizeof(reasonsText));
+
+    int32_t len = snprintf(pBuffer, size,
+                "\"Adaptive\":{\"On\":%s,\"Factor\":%d,\"Reasons\":\"%s\",\"Rsrp\":%d,"
+                "\"Budget\":%d,\"Power\":\"%s\",\"PowerSet\":%s,\"Battery\":%d,"
+                "\"AppDwellMs\":%d,\"Changes\":%u}",
+                on ? "true" : "false", last.factor, reasonsText, last.rsrp,
+                last.budgetLevel, powerStateNames[getPowerState()],
+                atomic_get(&powerOverride) != POWER_OVERRIDE_NONE ? "true" : "false",
+                (int32_t)atomic_get(&batteryPercent), last.appDwellMs, last.changes);
+
+    return (len < size) ? len : -1;
+}
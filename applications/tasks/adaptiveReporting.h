@@ -0,0 +1,74 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Adaptive reporting interval controller
+ *
+ */
+
+#ifndef _ADAPTIVE_REPORTING_H_
+#define _ADAPTIVE_REPORTING_H_
+
+/* ----------------------------------------------------------------
+ * DEFINITIONS
+ * -------------------------------------------------------------- */
+#define ADAPTIVE_CONFIG_PREFIX "ADAPTIVE_"
+
+/* ----------------------------------------------------------------
+ * PUBLIC TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+
+/// The power supply of the device, read from the battery gauge or set by
+/// the SET_POWER_STATE command
+typedef enum {
+    POWER_STATE_EXTERNAL,       // external power, no need to save energy
+    POWER_STATE_BATTERY,
+    POWER_STATE_LOW_BATTERY
+} powerState_t;
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Reads the ADAPTIVE_ configuration, and starts the controller
+/// if ADAPTIVE_REPORTING is TRUE
+/// @return 0 on success, negative on failure
+int32_t initAdaptiveReporting(void);
+
+/// @brief Overrides the power state read from the battery gauge
+/// @param state The power state
+void setPowerState(powerState_t state);
+
+/// @brief Goes back to the power state read from the battery gauge
+void clearPowerStateOverride(void);
+
+/// @brief Overrides the power state from a remote command
+/// @param params <EXTERNAL|BATTERY|LOW|AUTO>
+/// @return 0 on success, negative on failure
+int32_t setPowerStateCommand(commandParamsList_t *params);
+
+/// @brief Formats the last decision of the controller as a JSON member
+/// for the task stats, eg
+/// "Adaptive":{"Factor":400,"Reasons":"Stationary,PoorSignal","Rsrp":-118,
+///  "Budget":-1,"Power":"External","PowerSet":false,"Battery":85,
+///  "AppDwellMs":240000,"Changes":3}
+/// @param pBuffer The buffer to write to
+/// @param size The size of the buffer
+/// @return The length of the JSON, negative if it didn't fit
+int32_t formatAdaptiveReportingJson(char *pBuffer, size_t size);
+
+#endif
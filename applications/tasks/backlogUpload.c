@@ -0,0 +1,560 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Bulk upload of the file system archives over HTTP.
+ *
+ * Hours of stored measurements or drive test records are sent as the
+ * raw files, in large chunks, with one HTTP POST each, instead of one
+ * small MQTT message per value. Each POST says which file and the byte
+ * offset of the chunk, and the server replies with the offset it has
+ * stored up to, so an upload which is cut off carries on from there.
+ *
+ * The archive files are numbered, and only ever appended to, so the
+ * progress of each archive is the file number and offset it has been
+ * uploaded to. This is saved in the upload.txt file after each chunk,
+ * and the next upload only sends what has been added since.
+ *
+ */
+
+#include "common.h"
+#include "taskControl.h"
+#include "backlogUpload.h"
+#include "mqttTask.h"
+#include "timeSeries.h"
+#include "driveTest.h"
+#include "ext_fs.h"
+#include "dataBudget.h"
+#include "cellScanTask.h"
+
+/* ----------------------------------------------------------------
+ * DEFINES
+ * -------------------------------------------------------------- */
+#define UPLOAD_TOPIC "Upload"
+#define UPLOAD_PATH_DEFAULT "/upload"
+#define UPLOAD_CONTENT_TYPE "application/octet-stream"
+
+#define PATH_SIZE 100
+#define REQUEST_PATH_SIZE 200
+#define RESPONSE_SIZE 100
+#define STATE_TEXT_SIZE 100
+
+#define CHUNK_KB_DEFAULT 4
+#define CHUNK_KB_MIN 1
+#define CHUNK_KB_MAX 16
+
+// how often the upload job runs. Each run sends chunks back to back for
+// up to UPLOAD_RUN_MAX_MS, then returns so a stop request or another long
+// job isn't held up for the whole upload.
+#define UPLOAD_JOB_PERIOD_MS 1000
+#define UPLOAD_RUN_MAX_MS 10000
+
+// the retry delay after a failed chunk doubles from 2 seconds up to a
+// minute, and the upload stops after 8 failures in a row
+#define RETRY_DELAY_MS 2000
+#define RETRY_DELAY_MAX_MS 60000
+#define MAX_FAILURES 8
+
+// the estimated size of the HTTP request headers and the TCP/IP and TLS
+// overhead of a chunk, for the data usage
+#define REQUEST_OVERHEAD 300
+
+// the bit of the history in the archives mask, it is sources[0]
+#define HISTORY_SOURCE_MASK 0x01
+
+/* ----------------------------------------------------------------
+ * TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+typedef struct {
+    const char *pName;
+    const char *pDir;
+} uploadSource_t;
+
+/// How far an archive has been uploaded
+typedef struct {
+    uint32_t fileNumber;
+    uint32_t offset;
+} uploadCursor_t;
+
+/// What the upload does after sending the next chunk
+typedef enum {
+    UPLOAD_NEXT_CHUNK,          // the chunk was sent, send the next straight away
+    UPLOAD_WAIT,                // the chunk failed, try again later
+    UPLOAD_FINISHED
+} uploadStep_t;
+
+/* ----------------------------------------------------------------
+ * STATIC VARIABLES
+ * -------------------------------------------------------------- */
+static const uploadSource_t sources[] = {
+    {"history",     TIME_SERIES_DIR},
+    {"drivetest",   DRIVE_TEST_DIR}
+};
+
+static uploadCursor_t cursors[NUM_ELEMENTS(sources)];
+
+static char topicName[MAX_TOPIC_NAME_SIZE];
+
+static atomic_t uploadRunning = ATOMIC_INIT(0);
+static atomic_t stopRequested = ATOMIC_INIT(0);
+
+/// @brief the running upload, only used by the upload job once started
+static int32_t uploadJobId = -1;
+static uHttpClientContext_t *pHttpContext = NULL;
+static char *pChunk = NULL;
+static size_t chunkSize;
+static uint32_t sourceMask;
+static int32_t sourceIndex;
+static int32_t failures;
+static int64_t retryAtMs;
+static int64_t startMs;
+static uint32_t bytesSent;
+static int32_t requestCount;
+
+/// @brief copies of the configuration, only used by the upload job
+static char serverName[CONFIG_VALUE_SIZE];
+static char userName[CONFIG_VALUE_SIZE];
+static char password[CONFIG_VALUE_SIZE];
+static char uploadPath[CONFIG_VALUE_SIZE];
+
+static char requestPath[REQUEST_PATH_SIZE];
+static char responseBody[RESPONSE_SIZE];
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+static void getDirPath(const uploadSource_t *pSource, char *pPath, size_t size)
+{
+    snprintf(pPath, size, "%s/%s", extFsMountPoint()->mnt_point, pSource->pDir);
+}
+
+static void getFilePath(const uploadSource_t *pSource, const char *pName, char *pPath, size_t size)
+{
+    snprintf(pPath, size, "%s/%s/%s", extFsMountPoint()->mnt_point, pSource->pDir, pName);
+}
+
+/// @brief Finds the lowest numbered archive file from a number on, as
+/// the oldest files may have been removed
+/// @param pSource The archive
+/// @param from The lowest file number to look for
+/// @param pNumber Where to put the file number
+/// @param pName Where to put the file name, of FS name size
+/// @return true if a file was found
+static bool findFile(const uploadSource_t *pSource, uint32_t from, uint32_t *pNumber, char *pName)
+{
+    char dirPath[PATH_SIZE];
+    struct fs_dir_t dir;
+    static struct fs_dirent entry;
+    bool found = false;
+
+    getDirPath(pSource, dirPath, sizeof(dirPath));
+
+    fs_dir_t_init(&dir);
+    if (fs_opendir(&dir, dirPath) != 0)
+        return false;
+
+    while (fs_readdir(&dir, &entry) == 0 && entry.name[0] != 0) {
+        char *pEnd;
+        uint32_t number = strtoul(entry.name, &pEnd, 10);
+        if (pEnd == entry.name || *pEnd != '.' || number < from)
+            continue;
+
+        if (!found || number < *pNumber) {
+            *pNumber = number;
+            strcpy(pName, entry.name);
+            found = true;
+        }
+    }
+
+    fs_closedir(&dir);
+
+    return found;
+}
+
+/// @brief Loads how far each archive has been uploaded, eg "history 12 8192"
+static void loadCursors(void)
+{
+    struct fs_file_t file;
+    char text[STATE_TEXT_SIZE];
+
+    memset(cursors, 0, sizeof(cursors));
+
+    fs_file_t_init(&file);
+    if (fs_open(&file, extFsPath(UPLOAD_STATE_FILENAME), FS_O_READ) < 0)
+        return;
+
+    ssize_t count = fs_read(&file, text, sizeof(text) - 1);
+    fs_close(&file);
+    if (count <= 0)
+        return;
+
+    text[count] = 0;
+
+    char *pSave;
+    for(char *pLine = strtok_r(text, "\n", &pSave); pLine != NULL; pLine = strtok_r(NULL, "\n", &pSave)) {
+        for(int i=0; i<NUM_ELEMENTS(sources); i++) {
+            size_t len = strlen(sources[i].pName);
+            if (strncmp(pLine, sources[i].pName, len) == 0 && pLine[len] == ' ') {
+                char *pNext;
+                cursors[i].fileNumber = strtoul(pLine + len, &pNext, 10);
+                cursors[i].offset = strtoul(pNext, NULL, 10);
+            }
+        }
+    }
+}
+
+static void saveCursors(void)
+{
+    struct fs_file_t file;
+    char text[STATE_TEXT_SIZE];
+    int32_t len = 0;
+
+    for(int i=0; i<NUM_ELEMENTS(sources) && len < sizeof(text); i++)
+        len += snprintf(text + len, sizeof(text) - len, "%s %u %u\n",
+                        sources[i].pName, cursors[i].fileNumber, cursors[i].offset);
+
+    if (len >= sizeof(text))
+        return;
+
+    fs_file_t_init(&file);
+    if (fs_open(&file, extFsPath(UPLOAD_STATE_FILENAME), FS_O_CREATE | FS_O_WRITE) < 0) {
+        writeWarn("Failed to save the upload progress");
+        return;
+    }
+
+    fs_write(&file, text, len);
+    fs_truncate(&file, len);
+    fs_close(&file);
+}
+
+/// @brief Reads the offset the server has stored up to from its reply,
+/// eg {"Offset":8192}
+/// @return The offset, or -1 if it isn't in the reply
+static int64_t getAcknowledgedOffset(size_t responseSize)
+{
+    responseBody[MIN(responseSize, RESPONSE_SIZE - 1)] = 0;
+
+    const char *pOffset = strstr(responseBody, "\"Offset\":");
+    if (pOffset == NULL)
+        return -1;
+
+    return strtoul(pOffset + strlen("\"Offset\":"), NULL, 10);
+}
+
+static int32_t openHttpClient(void)
+{
+    uHttpClientConnection_t connection = U_HTTP_CLIENT_CONNECTION_DEFAULT;
+    connection.pServerName = getConfig("UPLOAD_SERVER", serverName, sizeof(serverName));
+    connection.pUserName = getConfig("UPLOAD_USERNAME", userName, sizeof(userName));
+    connection.pPassword = getConfig("UPLOAD_PASSWORD", password, sizeof(password));
+
+    bool security = false;
+    setBoolParamFromConfig("UPLOAD_SECURITY", "TRUE", &security);
+
+    uSecurityTlsSettings_t tlsSettings = U_SECURITY_TLS_SETTINGS_DEFAULT;
+    pHttpContext = pUHttpClientOpen(gDeviceHandle, &connection, security ? &tlsSettings : NULL);
+    if (pHttpContext == NULL) {
+        writeWarn("Failed to open the HTTP client to %s", connection.pServerName);
+        return U_ERROR_COMMON_NOT_RESPONDING;
+    }
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+static void closeHttpClient(void)
+{
+    if (pHttpContext != NULL) {
+        uHttpClientClose(pHttpContext);
+        pHttpContext = NULL;
+    }
+}
+
+/// @brief Waits longer after each failure in a row, and closes the HTTP
+/// client so the next chunk opens it again
+/// @return true if the upload should carry on
+static bool retryLater(int32_t errorCode)
+{
+    closeHttpClient();
+
+    if (++failures >= MAX_FAILURES) {
+        writeWarn("Upload failed %d times (%d), stopping", failures, errorCode);
+        return false;
+    }
+
+    int32_t delayMs = MIN(RETRY_DELAY_MS << (failures - 1), RETRY_DELAY_MAX_MS);
+    retryAtMs = uPortGetTickTimeMs() + delayMs;
+    writeDebug("Upload chunk failed (%d), trying again in %d ms", errorCode, delayMs);
+
+    return true;
+}
+
+/// @brief Sends the next chunk of an archive file, and moves the cursor
+/// on to the offset the server has stored up to
+/// @return true if the upload should carry on
+static bool uploadChunk(const uploadSource_t *pSource, uploadCursor_t *pCursor,
+                        const char *pName, const char *pPath, size_t fileSize)
+{
+    struct fs_file_t file;
+    ssize_t count = -1;
+
+    fs_file_t_init(&file);
+    if (fs_open(&file, pPath, FS_O_READ) == 0) {
+        if (fs_seek(&file, pCursor->offset, FS_SEEK_SET) == 0)
+            count = fs_read(&file, pChunk, MIN(chunkSize, fileSize - pCursor->offset));
+        fs_close(&file);
+    }
+
+    if (count <= 0) {
+        writeError("Failed to read %s for the upload", pPath);
+        return false;
+    }
+
+    if (pHttpContext == NULL && openHttpClient() != 0)
+        return retryLater(U_ERROR_COMMON_NOT_RESPONDING);
+
+    const char *pUploadPath = getConfig("UPLOAD_PATH", uploadPath, sizeof(uploadPath));
+    snprintf(requestPath, sizeof(requestPath), "%s?id=%s&file=%s/%s&offset=%u&total=%u",
+                pUploadPath != NULL ? pUploadPath : UPLOAD_PATH_DEFAULT,
+                (const char *)gSerialNumber, pSource->pDir, pName, pCursor->offset, (uint32_t)fileSize);
+
+    size_t responseSize = RESPONSE_SIZE - 1;
+    int32_t status = uHttpClientPostRequest(pHttpContext, requestPath, pChunk, count, UPLOAD_CONTENT_TYPE,
+                                            responseBody, &responseSize, NULL);
+    requestCount++;
+    recordDataUsage(UPLOAD_TOPIC, count + REQUEST_OVERHEAD);
+
+    if (status != U_HTTP_CLIENT_RESPONSE_CODE_OK)
+        return retryLater(status);
+
+    // the server says where it is up to, which is further on if it
+    // already had the chunk, or back if it lost some
+    int64_t offset = getAcknowledgedOffset(responseSize);
+    if (offset < 0)
+        offset = pCursor->offset + count;
+
+    if (offset > pCursor->offset)
+        bytesSent += offset - pCursor->offset;
+
+    pCursor->offset = MIN(offset, fileSize);
+    failures = 0;
+    saveCursors();
+
+    return true;
+}
+
+/// @brief Publishes how the upload went, eg
+/// {"Upload":{"Result":"Complete","Bytes":262144,"Requests":64,"Seconds":150}}
+static void finishUpload(const char *pResult)
+{
+    char message[150];
+
+    removePeriodicJob(uploadJobId);
+    uploadJobId = -1;
+
+    closeHttpClient();
+    uPortFree(pChunk);
+    pChunk = NULL;
+
+    int32_t seconds = (int32_t)((uPortGetTickTimeMs() - startMs) / 1000);
+    snprintf(message, sizeof(message),
+                "{\"Upload\":{\"Result\":\"%s\",\"Bytes\":%u,\"Requests\":%d,\"Seconds\":%d}}",
+                pResult, bytesSent, requestCount, seconds);
+
+    writeLog("Upload finished: %s", message);
+    sendMQTTMessage(topicName, message, U_MQTT_QOS_AT_LEAST_ONCE, false);
+
+    atomic_set(&stopRequested, 0);
+    atomic_set(&uploadRunning, 0);
+}
+
+/// @brief Sends the next chunk of the archives, or finishes the upload
+/// when they are all sent
+static uploadStep_t uploadNextChunk(void)
+{
+    static char name[MAX_FILE_NAME + 1];
+
+    for(; sourceIndex < NUM_ELEMENTS(sources); sourceIndex++) {
+        if ((sourceMask & (1 << sourceIndex)) == 0)
+            continue;
+
+        const uploadSource_t *pSource = &sources[sourceIndex];
+        uploadCursor_t *pCursor = &cursors[sourceIndex];
+        uint32_t number;
+
+        while (findFile(pSource, pCursor->fileNumber, &number, name)) {
+            char path[PATH_SIZE];
+            size_t fileSize = 0;
+
+            // a newer file, the one the cursor was on has been removed
+            if (number != pCursor->fileNumber) {
+                pCursor->fileNumber = number;
+                pCursor->offset = 0;
+            }
+
+            getFilePath(pSource, name, path, sizeof(path));
+            extFsFileSize(path, &fileSize);
+
+            // the file has been replaced by a smaller one of the same number
+            if (pCursor->offset > fileSize)
+                pCursor->offset = 0;
+
+            if (pCursor->offset < fileSize) {
+                if (!uploadChunk(pSource, pCursor, name, path, fileSize)) {
+                    finishUpload("Failed");
+                    return UPLOAD_FINISHED;
+                }
+
+                return failures == 0 ? UPLOAD_NEXT_CHUNK : UPLOAD_WAIT;
+            }
+
+            // the file is uploaded, the newest file is still being written
+            // to so its cursor is left at the end of it
+            uint32_t newer;
+            if (!findFile(pSource, number + 1, &newer, name))
+                break;
+
+            pCursor->fileNumber = newer;
+            pCursor->offset = 0;
+        }
+    }
+
+    saveCursors();
+    finishUpload("Complete");
+
+    return UPLOAD_FINISHED;
+}
+
+/// @brief Sends the chunks of the archives back to back, for up to
+/// UPLOAD_RUN_MAX_MS each run
+static void uploadJob(void *pParam, size_t paramLengthBytes)
+{
+    int64_t runStartMs = uPortGetTickTimeMs();
+    uploadStep_t step = UPLOAD_NEXT_CHUNK;
+
+    // the first run can start before the job ID is known
+    if (uploadJobId < 0 || pChunk == NULL)
+        return;
+
+    while (step == UPLOAD_NEXT_CHUNK && uPortGetTickTimeMs() - runStartMs < UPLOAD_RUN_MAX_MS) {
+        if (atomic_get(&stopRequested) || gExitApp) {
+            finishUpload("Stopped");
+            return;
+        }
+
+        // wait for the network to come back, or a cell scan to finish with
+        // the modem, without counting it as a failure
+        if (!IS_NETWORK_AVAILABLE || isCellScanRunning() || uPortGetTickTimeMs() < retryAtMs)
+            return;
+
+        step = uploadNextChunk();
+    }
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Starts uploading the archives which haven't been uploaded yet
+/// to the UPLOAD_SERVER, from where the last upload got to
+/// @param params [history|drivetest], default both
+/// @return 0 if the upload was started, negative on failure
+int32_t startBacklogUpload(commandParamsList_t *params)
+{
+    char server[CONFIG_VALUE_SIZE];
+
+    if (getConfig("UPLOAD_SERVER", server, sizeof(server)) == NULL) {
+        writeWarn("UPLOAD needs the UPLOAD_SERVER configuration");
+        return U_ERROR_COMMON_INVALID_PARAMETER;
+    }
+
+    uint32_t mask = (1 << NUM_ELEMENTS(sources)) - 1;
+    if (params != NULL && params->pNext != NULL) {
+        mask = 0;
+        for(int i=0; i<NUM_ELEMENTS(sources); i++) {
+            if (strcmp(params->pNext->parameter, sources[i].pName) == 0)
+                mask = 1 << i;
+        }
+
+        if (mask == 0) {
+            writeWarn("Unknown upload archive '%s'", params->pNext->parameter);
+            return U_ERROR_COMMON_INVALID_PARAMETER;
+        }
+    }
+
+    if (!atomic_cas(&uploadRunning, 0, 1)) {
+        writeWarn("An upload is already running");
+        return U_ERROR_COMMON_BUSY;
+    }
+
+    int32_t chunkKb = CHUNK_KB_DEFAULT;
+    setIntParamFromConfig("UPLOAD_CHUNK_KB", &chunkKb);
+    chunkSize = MAX(CHUNK_KB_MIN, MIN(chunkKb, CHUNK_KB_MAX)) * 1024;
+
+    pChunk = pUPortMalloc(chunkSize);
+    if (pChunk == NULL) {
+        writeError("Failed to allocate the %u byte upload chunk", chunkSize);
+        atomic_set(&uploadRunning, 0);
+        return U_ERROR_COMMON_NO_MEMORY;
+    }
+
+    // the stored measurements still in RAM are written out first
+    if (mask & HISTORY_SOURCE_MASK)
+        flushTimeSeries();
+
+    loadCursors();
+    snprintf(topicName, MAX_TOPIC_NAME_SIZE, "%s/%s", (const char *)gSerialNumber, UPLOAD_TOPIC);
+    sourceMask = mask;
+    sourceIndex = 0;
+    failures = 0;
+    retryAtMs = 0;
+    bytesSent = 0;
+    requestCount = 0;
+    startMs = uPortGetTickTimeMs();
+    atomic_set(&stopRequested, 0);
+
+    uploadJobId = addLongPeriodicJob("Upload", uploadJob, UPLOAD_JOB_PERIOD_MS);
+    if (uploadJobId < 0) {
+        writeError("Failed to start the upload (%d)", uploadJobId);
+        uPortFree(pChunk);
+        pChunk = NULL;
+        atomic_set(&uploadRunning, 0);
+        return uploadJobId;
+    }
+
+    writeLog("Upload started to %s in %u byte chunks", server, chunkSize);
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Stops the upload after the chunk being sent, the next upload
+/// carries on from there
+/// @param params not used
+/// @return 0 on success, negative on failure
+int32_t stopBacklogUpload(commandParamsList_t *params)
+{
+    if (atomic_get(&uploadRunning))
+        atomic_set(&stopRequested, 1);
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Returns true while an upload is running
+bool isBacklogUploadRunning(void)
+{
+    return atomic_get(&uploadRunning) != 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Bulk upload of the file system archives over HTTP header
+ *
+ */
+
+#ifndef _BACKLOG_UPLOAD_H_
+#define _BACKLOG_UPLOAD_H_
+
+/* ----------------------------------------------------------------
+ * DEFINITIONS
+ * -------------------------------------------------------------- */
+#define UPLOAD_STATE_FILENAME "upload.txt"
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Starts uploading the archives which haven't been uploaded yet
+/// to the UPLOAD_SERVER, from where the last upload got to
+/// @param params [history|drivetest], default both
+/// @return 0 if the upload was started, negative on failure
+int32_t startBacklogUpload(commandParamsList_t *params);
+
+/// @brief Stops the upload after the chunk being sent, the next upload
+/// carries on from there
+/// @param params not used
+/// @return 0 on success, negative on failure
+int32_t stopBacklogUpload(commandParamsList_t *params);
+
+/// @brief Returns true while an upload is running
+bool isBacklogUploadRunning(void);
+
+#endif
@@ -18,24 +18,42 @@
  *
  * Cell Scan Task to run the +COPS=? Query and publish the results
  *
+ * The scan runs in the background on the worker pool, and the rest of the
+ * application keeps running. While the modem is scanning it can't publish
+ * or read the radio parameters, so MQTT messages are held and published
+ * when the scan has finished, and the radio cache isn't refreshed.
+ *
  */
 
 #include "common.h"
 #include "taskControl.h"
 #include "cellScanTask.h"
 #include "mqttTask.h"
+#include "radioCache.h"
 
 /* ----------------------------------------------------------------
  * DEFINES
  * -------------------------------------------------------------- */
 #define NETWORK_SCAN_TOPIC "NetworkScan"
 
-#define CELL_SCAN_TASK_STACK_SIZE (3*1024)
-#define CELL_SCAN_TASK_PRIORITY 5
+#define MAX_SCAN_RESULTS 32
+#define SCAN_NAME_SIZE 64
+
+// The results are published in chunks of up to this size
+#define SCAN_MESSAGE_SIZE 512
 
-#define CELL_SCAN_QUEUE_STACK_SIZE QUEUE_STACK_SIZE_DEFAULT
-#define CELL_SCAN_QUEUE_PRIORITY 5
-#define CELL_SCAN_QUEUE_SIZE 2
+// How often the scan progress is logged
+#define SCAN_PROGRESS_LOG_MS 10000
+
+/* ----------------------------------------------------------------
+ * TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+typedef struct {
+    char name[SCAN_NAME_SIZE];
+    char mccMnc[U_CELL_NET_MCC_MNC_LENGTH_BYTES];
+    uCellNetRat_t rat;
+    bool serving;
+} cellScanResult_t;
 
 /* ----------------------------------------------------------------
  * COMMON TASK VARIABLES
@@ -48,18 +66,33 @@ static taskConfig_t *taskConfig = NULL;
  * -------------------------------------------------------------- */
 static bool stopCellScan = false;
 
+/// @brief set while a scan is running, and when it started
+static atomic_t scanRunning = ATOMIC_INIT(0);
+static int64_t scanStartMs = 0;
+static int64_t lastProgressLogMs = 0;
+
+/// @brief the last successful scan, which is published again instead of
+/// scanning if it is recent enough
+static bool lastScanValid = false;
+static int64_t lastScanMs = 0;
+static int64_t lastScanTimestamp = 0;
+static int32_t lastScanDurationMs = 0;
+static int32_t lastScanFound = 0;
+
 static char topicName[MAX_TOPIC_NAME_SIZE];
 
+/// @brief the results of the scan, published together when it finishes
+static cellScanResult_t results[MAX_SCAN_RESULTS];
+
+/// @brief buffer for the cell scan MQTT JSON message
+static char payload[SCAN_MESSAGE_SIZE];
+
 /// callback commands for incoming MQTT control messages
 static callbackCommand_t callbacks[] = {
-    {"START_CELL_SCAN", queueNetworkScan}
+    {"START_CELL_SCAN", queueNetworkScan},
+    {"STOP_CELL_SCAN", cancelNetworkScan}
 };
 
-/* ----------------------------------------------------------------
- * EXTERNAL FUNCTIONS
- * -------------------------------------------------------------- */
-extern void pauseMainLoop(bool state);
-
 /* ----------------------------------------------------------------
  * STATIC FUNCTIONS
  * -------------------------------------------------------------- */
@@ -75,7 +108,12 @@ static bool keepGoing(void *pParam)
     bool kg = isNotExiting();
     if (kg) {
         gAppStatus = COPS_QUERY;
-        printDebug("Still scanning for networks...");
+
+        int64_t now = uPortGetTickTimeMs();
+        if (now - lastProgressLogMs >= SCAN_PROGRESS_LOG_MS) {
+            writeDebug("Still scanning for networks, %d seconds...", (int32_t)((now - scanStartMs) / 1000));
+            lastProgressLogMs = now;
+        }
     } else {
         writeInfo("Scanning for networks cancelled");
     }
@@ -83,31 +121,92 @@ static bool keepGoing(void *pParam)
     return kg;
 }
 
+static int32_t formatResult(char *pBuffer, size_t size, cellScanResult_t *result, bool first)
+{
+    return snprintf(pBuffer, size, "%s{\"Name\":\"%s\",\"ubxlibRAT\":%d,\"MCCMNC\":\"%s\",\"Serving\":%s}",
+                    first ? "" : ",", result->name, result->rat, result->mccMnc,
+                    result->serving ? "true" : "false");
+}
+
+/// @brief Publishes the scan results in as few messages as possible, each
+/// with the scan header and as many results as fit
+/// @param timestamp The time the scan started
+/// @param durationMs How long the scan took
+/// @param found The number of results
+static void publishScanResults(int64_t timestamp, int32_t durationMs, int32_t found)
+{
+    char header[128];
+    const char *footer = "]}}";
+    int32_t chunks = 0;
+    int32_t chunkStart[MAX_SCAN_RESULTS + 1];
+
+    // measure the results to split them in to chunks before writing them,
+    // so each chunk can say how many chunks there are
+    int32_t headerLength = snprintf(NULL, 0,
+                    "{\"Timestamp\":%" PRId64 ",\"CellScan\":{\"Duration\":%d,\"Count\":%d,"
+                    "\"Chunk\":%d,\"Chunks\":%d,\"Networks\":[",
+                    timestamp, durationMs, found, MAX_SCAN_RESULTS, MAX_SCAN_RESULTS);
+    int32_t length = SCAN_MESSAGE_SIZE;
+    for(int32_t i=0; i<found; i++) {
+        int32_t resultLength = formatResult(NULL, 0, &results[i], false);
+        if (length + resultLength + strlen(footer) >= SCAN_MESSAGE_SIZE) {
+            chunkStart[chunks++] = i;
+            length = headerLength;
+        }
+        length += resultLength;
+    }
+    chunkStart[chunks] = found;
+
+    // an empty scan is still published, so the result is known
+    if (chunks == 0) {
+        chunkStart[1] = 0;
+        chunks = 1;
+    }
+
+    for(int32_t chunk=0; chunk<chunks; chunk++) {
+        snprintf(header, sizeof(header),
+                    "{\"Timestamp\":%" PRId64 ",\"CellScan\":{\"Duration\":%d,\"Count\":%d,"
+                    "\"Chunk\":%d,\"Chunks\":%d,\"Networks\":[",
+                    timestamp, durationMs, found, chunk + 1, chunks);
+
+        int32_t len = snprintf(payload, SCAN_MESSAGE_SIZE, "%s", header);
+        for(int32_t i=chunkStart[chunk]; i<chunkStart[chunk + 1]; i++)
+            len += formatResult(payload + len, SCAN_MESSAGE_SIZE - len, &results[i], i == chunkStart[chunk]);
+        snprintf(payload + len, SCAN_MESSAGE_SIZE - len, "%s", footer);
+
+        writeAlways(payload);
+        sendMQTTMessage(topicName, payload, U_MQTT_QOS_AT_MOST_ONCE, false);
+    }
+}
+
 static void doCellScan(void *pParams)
 {
     int32_t found = 0;
     int32_t count = 0;
-    char internalBuffer[64];
-    char payload[100];
+    char internalBuffer[SCAN_NAME_SIZE];
     char mccMnc[U_CELL_NET_MCC_MNC_LENGTH_BYTES];
+    char servingMccMnc[U_CELL_NET_MCC_MNC_LENGTH_BYTES];
     uCellNetRat_t rat = U_CELL_NET_RAT_UNKNOWN_OR_NOT_USED;
 
     U_PORT_MUTEX_LOCK(TASK_MUTEX);
+    beginTaskWork(taskConfig);
     applicationStates_t tempStatus = gAppStatus;
     gAppStatus = COPS_QUERY;
-    
-    pauseMainLoop(true);
 
-    char timestamp[TIMESTAMP_MAX_LENTH_BYTES];
-    getTimeStamp(timestamp);
+    int64_t timestamp = unixNetworkTime + (uPortGetTickTimeMs() / 1000);
+    int64_t startMs = uPortGetTickTimeMs();
+    scanStartMs = startMs;
+    lastProgressLogMs = startMs;
+    atomic_set(&scanRunning, 1);
+
+    // the modem can't do anything else until the scan has finished, so
+    // hold the messages and the radio reads rather than let them wait
+    setMQTTPublishDeferred(true);
+    holdRadioRefresh(true);
 
-    char format[] = "{"                      \
-            "\"Timestamp\":%" PRId64 ","     \
-            "\"CellSCan\":{"                 \
-                "\"Name\":\"%s\","           \
-                "\"ubxlibRAT\":\"%d\","      \
-                "\"MCCMNC\":\"%s\"}"         \
-        "}";
+    // the network we are registered on, from the radio cache, so
+    // it can be marked in the scan results without another AT command
+    bool haveServing = getCachedPlmn(servingMccMnc, sizeof(servingMccMnc));
 
     writeLog("Scanning for networks...");
     for (count = uCellNetScanGetFirst(gDeviceHandle, internalBuffer,
@@ -116,39 +215,78 @@ static void doCellScan(void *pParams)
             count > 0;
             count = uCellNetScanGetNext(gDeviceHandle, internalBuffer, sizeof(internalBuffer), mccMnc, &rat)) {
 
-        found++;
-        snprintf(payload, sizeof(payload), format, (unixNetworkTime + (uPortGetTickTimeMs() / 1000)), internalBuffer, rat, mccMnc);
-        writeAlways(payload);
-        sendMQTTMessage(topicName, payload, U_MQTT_QOS_AT_MOST_ONCE, false);
+        if (found == MAX_SCAN_RESULTS) {
+            writeWarn("More than %d networks found, ignoring %s", MAX_SCAN_RESULTS, mccMnc);
+            continue;
+        }
+
+        cellScanResult_t *result = &results[found++];
+        strncpy(result->name, internalBuffer, SCAN_NAME_SIZE - 1);
+        result->name[SCAN_NAME_SIZE - 1] = 0;
+        strncpy(result->mccMnc, mccMnc, sizeof(result->mccMnc) - 1);
+        result->mccMnc[sizeof(result->mccMnc) - 1] = 0;
+        result->rat = rat;
+        result->serving = haveServing && strcmp(mccMnc, servingMccMnc) == 0;
     }
 
-    if (!gExitApp) {
-        if(count < 0 && count != U_CELL_ERROR_NOT_FOUND) {
-            snprintf(payload, sizeof(payload), "Cell Scan Result: Error %d", count);
-        } else {
-            if (found == 0) {
-                snprintf(payload, sizeof(payload), "Cell Scan Result: No network operators found.");
-            } else {
-                snprintf(payload, sizeof(payload), "Cell Scan Result: %d network(s) found in total.", found);
-            }
-        }
+    int32_t durationMs = (int32_t)(uPortGetTickTimeMs() - startMs);
+    bool cancelled = !isNotExiting();
+
+    holdRadioRefresh(false);
+    setMQTTPublishDeferred(false);
+
+    if (cancelled) {
+        writeInfo("Cell Scan Result: Cancelled.");
+    } else if(count < 0 && count != U_CELL_ERROR_NOT_FOUND) {
+        writeInfo("Cell Scan Result: Error %d", count);
     } else {
-        snprintf(payload, sizeof(payload), "Cell Scan Result: Cancelled.");
+        writeInfo("Cell Scan Result: %d network(s) found in %d ms.", found, durationMs);
+        publishScanResults(timestamp, durationMs, found);
+
+        lastScanValid = true;
+        lastScanMs = uPortGetTickTimeMs();
+        lastScanTimestamp = timestamp;
+        lastScanDurationMs = durationMs;
+        lastScanFound = found;
     }
 
-    writeInfo(payload);
-
     // reset the flags etc
     stopCellScan = false;
-    gAppStatus = tempStatus;
-    pauseMainLoop(false);
+    atomic_set(&scanRunning, 0);
+
+    // only put the status back if nothing has changed it during the scan
+    if (gAppStatus == COPS_QUERY)
+        gAppStatus = tempStatus;
+
+    endTaskWork(taskConfig);
+    U_PORT_MUTEX_UNLOCK(TASK_MUTEX);
+}
+
+/// @brief Publishes the last scan results again, instead of scanning
+static void publishLastScan(void *pParams)
+{
+    U_PORT_MUTEX_LOCK(TASK_MUTEX);
+    beginTaskWork(taskConfig);
+
+    writeInfo("Cell Scan Result: publishing the scan from %d seconds ago",
+                    (int32_t)((uPortGetTickTimeMs() - lastScanMs) / 1000));
+    publishScanResults(lastScanTimestamp, lastScanDurationMs, lastScanFound);
 
+    endTaskWork(taskConfig);
     U_PORT_MUTEX_UNLOCK(TASK_MUTEX);
 }
 
-static void startCellScan(void)
+/// @brief Starts a scan, or publishes the last one if it is recent enough
+/// @param maxAgeSecs The oldest scan which can be used instead, zero to
+/// always scan
+static void startCellScan(int32_t maxAgeSecs)
 {
-    RUN_FUNC(doCellScan, CELL_SCAN_TASK_STACK_SIZE, CELL_SCAN_TASK_PRIORITY);
+    if (maxAgeSecs > 0 && lastScanValid &&
+            uPortGetTickTimeMs() - lastScanMs <= (int64_t)maxAgeSecs * 1000) {
+        RUN_FUNC(publishLastScan);
+    } else {
+        RUN_LONG_FUNC(doCellScan);
+    }
 }
 
 static void queueHandler(void *pParam, size_t paramLengthBytes)
@@ -157,7 +295,7 @@ static void queueHandler(void *pParam, size_t paramLengthBytes)
 
     switch(qMsg->msgType) {
         case START_CELL_SCAN:
-            startCellScan();
+            startCellScan(qMsg->msg.maxAgeSecs);
             break;
 
         case STOP_CELL_SCAN:
@@ -181,42 +319,67 @@ static int32_t initMutex()
 
 static int32_t initQueue()
 {
-    int32_t eventQueueHandle = uPortEventQueueOpen(&queueHandler,
-                    TASK_NAME,
-                    sizeof(cellScanMsg_t),
-                    CELL_SCAN_QUEUE_STACK_SIZE,
-                    CELL_SCAN_QUEUE_PRIORITY,
-                    CELL_SCAN_QUEUE_SIZE);
+    // task messages are handled on the shared worker pool
+    TASK_MSG_HANDLER = queueHandler;
 
-    if (eventQueueHandle < 0) {
-        writeFatal("Failed to create %s event queue %d", TASK_NAME, eventQueueHandle);
-    }
-
-    TASK_QUEUE = eventQueueHandle;
-
-    return eventQueueHandle;
+    return U_ERROR_COMMON_SUCCESS;
 }
 
 /* ----------------------------------------------------------------
  * PUBLIC FUNCTIONS
  * -------------------------------------------------------------- */
-/// @brief Places a Start Network Scan message on the queue
+/// @brief Places a Start Network Scan message on the queue, or cancels
+/// the scan if one is already running. The optional parameter is the age
+/// in seconds of a previous scan which can be published instead.
 /// @param params The parameters for this command
 /// @return zero if successful, a negative value otherwise
 int32_t queueNetworkScan(commandParamsList_t *params)
 {
+    if (isCellScanRunning())
+        return cancelNetworkScan(params);
+
     cellScanMsg_t qMsg;
-    if (isMutexLocked(TASK_MUTEX)) {
-        writeLog("Cell Scan is already in progress, cancelling...");
-        qMsg.msgType = STOP_CELL_SCAN;
-    } else {
-        writeLog("Starting cell scan...");
-        qMsg.msgType = START_CELL_SCAN;
-    }
+    writeLog("Starting cell scan...");
+    qMsg.msgType = START_CELL_SCAN;
+    qMsg.msg.maxAgeSecs = getParamValue(params, 1, 0, 86400, 0);
 
     return sendAppTaskMessage(TASK_ID, &qMsg, sizeof(cellScanMsg_t));
 }
 
+/// @brief Cancels the running network scan
+/// @param params The parameters for this command
+/// @return zero if successful, a negative value otherwise
+int32_t cancelNetworkScan(commandParamsList_t *params)
+{
+    if (!isCellScanRunning()) {
+        writeLog("No cell scan is running");
+        return U_ERROR_COMMON_SUCCESS;
+    }
+
+    // set directly, as the scan's keepGoing() checks it while the
+    // worker pool is busy running the scan
+    writeLog("Cell Scan is in progress, cancelling...");
+    stopCellScan = true;
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Returns true while a network scan is running
+bool isCellScanRunning(void)
+{
+    return atomic_get(&scanRunning) != 0;
+}
+
+/// @brief Returns how long the running network scan has taken so far
+/// @return The time in milliseconds, or -1 if no scan is running
+int32_t getCellScanElapsedMs(void)
+{
+    if (!isCellScanRunning())
+        return -1;
+
+    return (int32_t)(uPortGetTickTimeMs() - scanStartMs);
+}
+
 /// @brief Initialises the network scanning task(s)
 /// @param config The task configuration structure
 /// @return zero if successful, a negative number otherwise
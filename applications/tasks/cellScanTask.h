@@ -34,6 +34,10 @@ int32_t stopCellScanTask(commandParamsList_t *params);
  * PUBLIC TASK FUNCTIONS
  * -------------------------------------------------------------- */
 int32_t queueNetworkScan(commandParamsList_t *params);
+int32_t cancelNetworkScan(commandParamsList_t *params);
+
+bool isCellScanRunning(void);
+int32_t getCellScanElapsedMs(void);
 
 /* ----------------------------------------------------------------
  * QUEUE MESSAGE TYPE DEFINITIONS
@@ -50,6 +54,7 @@ typedef struct {
 
     union {
         const char *topicName;
+        int32_t maxAgeSecs;     // START_CELL_SCAN: publish a scan this recent instead
     } msg;
 } cellScanMsg_t;
 
@@ -0,0 +1,470 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Drive test capture. On each tick the radio snapshot, the latest GNSS
+ * fix and the latest accelerometer reading are captured together into
+ * one binary record, with a millisecond timestamp and the age of each
+ * part, so they can be correlated afterwards.
+ *
+ * Each drive test is written to its own file in the drivetest directory,
+ * a 16 byte header followed by fixed size 60 byte records, each with a
+ * CRC16. The records are buffered and written 16 at a time. While the
+ * drive test runs the GNSS makes fixes back to back instead of every
+ * location task dwell period.
+ *
+ * The ticks are timed by their own periodic timer, not the timer wheel of
+ * the periodic jobs, as that only has 1 second resolution and the period
+ * can be as short as 200ms.
+ *
+ */
+
+#include <sys/crc.h>
+
+#include "common.h"
+#include "taskControl.h"
+#include "driveTest.h"
+#include "mqttTask.h"
+#include "locationTask.h"
+#include "radioCache.h"
+#include "sensors.h"
+#include "ext_fs.h"
+
+/* ----------------------------------------------------------------
+ * DEFINES
+ * -------------------------------------------------------------- */
+#define DRIVE_TEST_TOPIC "DriveTest"
+#define DRIVE_TEST_SUFFIX ".dt"
+#define PATH_SIZE 100
+
+#define DRIVE_TEST_MAGIC 0x31525444         // "DTR1"
+#define DRIVE_TEST_VERSION 1
+
+#define TICK_PERIOD_MS_DEFAULT 1000
+#define TICK_PERIOD_MS_MIN 200
+#define TICK_PERIOD_MS_MAX 10000
+
+#define RECORD_BUFFER_SIZE 16
+
+// the drive test stops when the file system has less free space than
+// this, so the log and config files can still be written
+#define MIN_FREE_KB 256
+
+// the record flags, of the parts which are valid
+#define RECORD_TIME_VALID   0x01            // the network time is known
+#define RECORD_RADIO_VALID  0x02
+#define RECORD_FIX_VALID    0x04
+#define RECORD_ACCEL_VALID  0x08
+
+/* ----------------------------------------------------------------
+ * TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t recordSize;
+    uint32_t periodMs;
+    uint32_t startTime;                     // unix time
+} driveTestHeader_t;
+
+/// One drive test record, little endian
+typedef struct {
+    uint32_t timestamp;                     // unix time, or uptime if not RECORD_TIME_VALID
+    uint32_t sequence;
+    int32_t latitudeX1e7;
+    int32_t longitudeX1e7;
+    int32_t altitudeMm;
+    int32_t cellId;
+    int32_t earfcn;
+    int16_t rsrp;
+    int16_t rsrq;
+    int16_t rssi;
+    int16_t snr;
+    int16_t accel[3];                       // 0.01 m/s2
+    uint16_t milliseconds;                  // of the timestamp
+    uint16_t speedCmPerSec;
+    uint16_t radioAgeMs;                    // the age of each part at the tick
+    uint16_t fixAgeMs;
+    uint16_t accelAgeMs;
+    uint8_t svs;
+    uint8_t rxQual;
+    uint8_t flags;
+    uint8_t reserved[3];
+    uint16_t crc;                           // of the bytes before
+} driveTestRecord_t;
+
+/* ----------------------------------------------------------------
+ * STATIC VARIABLES
+ * -------------------------------------------------------------- */
+static char topicName[MAX_TOPIC_NAME_SIZE];
+
+static uPortMutexHandle_t driveTestMutex = NULL;
+
+/// @brief the running drive test, protected by the drive test mutex
+static bool running = false;
+static int32_t tickPeriodMs = TICK_PERIOD_MS_DEFAULT;
+static char filePath[PATH_SIZE];
+static uint32_t recordCount = 0;
+static int64_t startMs = 0;
+
+static driveTestRecord_t recordBuffer[RECORD_BUFFER_SIZE];
+static int32_t bufferCount = 0;
+
+static uPortTimerHandle_t tickTimer = NULL;
+
+/// @brief set while a tick job is queued or running, a tick is skipped
+/// if the last one hasn't finished
+static atomic_t tickQueued = ATOMIC_INIT(0);
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+static uint16_t getAgeMs(int64_t nowMs, int64_t thenMs)
+{
+    int64_t age = nowMs - thenMs;
+
+    return (uint16_t)MAX(0, MIN(age, UINT16_MAX));
+}
+
+static int16_t toInt16(int32_t value)
+{
+    return (int16_t)MAX(INT16_MIN, MIN(value, INT16_MAX));
+}
+
+/// @brief Finds the number of the next drive test file, one more than
+/// the highest numbered file in the drive test directory
+static uint32_t getNextFileNumber(const char *pDirPath)
+{
+    struct fs_dir_t dir;
+    static struct fs_dirent entry;
+    uint32_t next = 1;
+
+    fs_dir_t_init(&dir);
+    if (fs_opendir(&dir, pDirPath) != 0)
+        return next;
+
+    while (fs_readdir(&dir, &entry) == 0 && entry.name[0] != 0) {
+        char *pEnd;
+        uint32_t number = strtoul(entry.name, &pEnd, 10);
+        if (strcmp(pEnd, DRIVE_TEST_SUFFIX) == 0 && number >= next)
+            next = number + 1;
+    }
+
+    fs_closedir(&dir);
+
+    return next;
+}
+
+/// @brief Creates the drive test file and writes its header
+static int32_t createFile(void)
+{
+    char dirPath[PATH_SIZE];
+    struct fs_file_t file;
+
+    snprintf(dirPath, sizeof(dirPath), "%s/%s", extFsMountPoint()->mnt_point, DRIVE_TEST_DIR);
+    if (!extFsFileExists(dirPath) && fs_mkdir(dirPath) != 0) {
+        writeError("Failed to create the drive test directory");
+        return U_ERROR_COMMON_DEVICE_ERROR;
+    }
+
+    snprintf(filePath, sizeof(filePath), "%s/%08u%s", dirPath, getNextFileNumber(dirPath), DRIVE_TEST_SUFFIX);
+
+    driveTestHeader_t header = {
+        .magic = DRIVE_TEST_MAGIC,
+        .version = DRIVE_TEST_VERSION,
+        .recordSize = sizeof(driveTestRecord_t),
+        .periodMs = tickPeriodMs,
+        .startTime = (uint32_t)(unixNetworkTime + (uPortGetTickTimeMs() / 1000))
+    };
+
+    fs_file_t_init(&file);
+    if (fs_open(&file, filePath, FS_O_CREATE | FS_O_WRITE) < 0) {
+        writeError("Failed to create the drive test file %s", filePath);
+        return U_ERROR_COMMON_DEVICE_ERROR;
+    }
+
+    bool ok = fs_write(&file, &header, sizeof(header)) == sizeof(header);
+    fs_close(&file);
+
+    return ok ? U_ERROR_COMMON_SUCCESS : U_ERROR_COMMON_DEVICE_ERROR;
+}
+
+/// @brief Appends the buffered records to the file, called with the drive
+/// test mutex held
+static int32_t writeBufferedRecords(void)
+{
+    struct fs_file_t file;
+    size_t size = bufferCount * sizeof(driveTestRecord_t);
+
+    if (bufferCount == 0)
+        return U_ERROR_COMMON_SUCCESS;
+
+    bufferCount = 0;
+
+    fs_file_t_init(&file);
+    if (fs_open(&file, filePath, FS_O_APPEND | FS_O_WRITE) < 0)
+        return U_ERROR_COMMON_DEVICE_ERROR;
+
+    bool ok = fs_write(&file, recordBuffer, size) == size;
+    fs_close(&file);
+
+    return ok ? U_ERROR_COMMON_SUCCESS : U_ERROR_COMMON_DEVICE_ERROR;
+}
+
+/// @brief Publishes a summary of the drive test file, eg
+/// {"DriveTest":{"File":"drivetest/00000003.dt","Records":3600,"Bytes":216016,"Seconds":3600,"Period":1000}}
+static void publishSummary(void)
+{
+    char message[200];
+    size_t bytes = 0;
+
+    extFsFileSize(filePath, &bytes);
+    snprintf(message, sizeof(message),
+                "{\"DriveTest\":{\"File\":\"%s\",\"Records\":%u,\"Bytes\":%u,\"Seconds\":%d,\"Period\":%d}}",
+                filePath + strlen(extFsMountPoint()->mnt_point) + 1, recordCount, (uint32_t)bytes,
+                (int32_t)((uPortGetTickTimeMs() - startMs) / 1000), tickPeriodMs);
+
+    writeLog("Drive test finished: %s", message);
+    sendMQTTMessage(topicName, message, U_MQTT_QOS_AT_LEAST_ONCE, false);
+}
+
+/// @brief Stops the capture and writes the last records, called with the
+/// drive test mutex held
+static void finishDriveTest(void)
+{
+    uPortTimerStop(tickTimer);
+    running = false;
+
+    stopLocationStream();
+
+    if (writeBufferedRecords() != 0)
+        writeError("Failed to write the last drive test records");
+
+    publishSummary();
+}
+
+/// @brief Captures the radio, GNSS and accelerometer into one record
+static void tickJob(void *pParam, size_t paramLengthBytes)
+{
+    radioSnapshot_t radio;
+    uLocation_t location;
+    int64_t fixMs;
+    sensorReading_t accel;
+
+    int64_t nowMs = uPortGetTickTimeMs();
+    int64_t timeMs = unixNetworkTime * 1000 + nowMs;
+
+    // the radio is only read from the module once per tick, and shared
+    // with the signal quality task
+    getRadioSnapshot(&radio, tickPeriodMs);
+    bool fixValid = pollLocationStream(&location, &fixMs);
+    bool accelValid = getSensorReading(SENSOR_ACCEL, &accel);
+
+    U_PORT_MUTEX_LOCK(driveTestMutex);
+
+    if (running) {
+        driveTestRecord_t *pRecord = &recordBuffer[bufferCount++];
+        memset(pRecord, 0, sizeof(driveTestRecord_t));
+
+        pRecord->timestamp = (uint32_t)(timeMs / 1000);
+        pRecord->milliseconds = (uint16_t)(timeMs % 1000);
+        pRecord->sequence = recordCount++;
+        if (unixNetworkTime != 0)
+            pRecord->flags |= RECORD_TIME_VALID;
+
+        if (radio.radioValid) {
+            pRecord->flags |= RECORD_RADIO_VALID;
+            pRecord->radioAgeMs = getAgeMs(nowMs, radio.timestampMs);
+            pRecord->rsrp = toInt16(radio.rsrp);
+            pRecord->rsrq = toInt16(radio.rsrq);
+            pRecord->rssi = toInt16(radio.rssi);
+            pRecord->snr = toInt16(radio.snr);
+            pRecord->rxQual = (uint8_t)radio.rxQual;
+            pRecord->cellId = radio.cellId;
+            pRecord->earfcn = radio.earfcn;
+        }
+
+        if (fixValid) {
+            pRecord->flags |= RECORD_FIX_VALID;
+            pRecord->fixAgeMs = getAgeMs(nowMs, fixMs);
+            pRecord->latitudeX1e7 = location.latitudeX1e7;
+            pRecord->longitudeX1e7 = location.longitudeX1e7;
+            pRecord->altitudeMm = location.altitudeMillimetres;
+            pRecord->speedCmPerSec = (uint16_t)MIN(location.speedMillimetresPerSecond / 10, UINT16_MAX);
+            pRecord->svs = (uint8_t)location.svs;
+        }
+
+        if (accelValid) {
+            pRecord->flags |= RECORD_ACCEL_VALID;
+            pRecord->accelAgeMs = getAgeMs(nowMs, accel.timestampMs);
+            for(int i=0; i<3; i++)
+                pRecord->accel[i] = toInt16(accel.values[i] / 10);
+        }
+
+        pRecord->crc = crc16_ccitt(0xFFFF, (const uint8_t *)pRecord, offsetof(driveTestRecord_t, crc));
+
+        if (bufferCount == RECORD_BUFFER_SIZE) {
+            if (writeBufferedRecords() != 0) {
+                writeError("Failed to write the drive test records, stopping the drive test");
+                finishDriveTest();
+            } else if (extFsFree() < MIN_FREE_KB) {
+                writeWarn("File system nearly full, stopping the drive test");
+                finishDriveTest();
+            }
+        }
+    }
+
+    U_PORT_MUTEX_UNLOCK(driveTestMutex);
+
+    atomic_set(&tickQueued, 0);
+}
+
+/// @brief Queues a tick on the worker pool, unless the last one is still
+/// queued or running
+static void tickTimerCallback(const uPortTimerHandle_t timerHandle, void *pParameter)
+{
+    if (!atomic_cas(&tickQueued, 0, 1))
+        return;
+
+    if (submitJob("DriveTest", tickJob, NULL, 0) != 0)
+        atomic_set(&tickQueued, 0);
+}
+
+/// @brief Starts or stops the drive test for the button, on the worker pool
+static void toggleJob(void *pParam, size_t paramLengthBytes)
+{
+    if (isDriveTestRunning())
+        stopDriveTest(NULL);
+    else
+        startDriveTest(NULL);
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Creates the drive test mutex and tick timer
+/// @return 0 on success, negative on failure
+int32_t initDriveTest(void)
+{
+    if (driveTestMutex != NULL)
+        return U_ERROR_COMMON_SUCCESS;
+
+    int32_t errorCode = uPortTimerCreate(&tickTimer, "DriveTest", tickTimerCallback,
+                                            NULL, TICK_PERIOD_MS_DEFAULT, true);
+    if (errorCode != 0) {
+        writeFatal("Failed to create the drive test timer (%d)", errorCode);
+        tickTimer = NULL;
+        return errorCode;
+    }
+
+    errorCode = uPortMutexCreate(&driveTestMutex);
+    if (errorCode != 0) {
+        writeFatal("Failed to create the drive test mutex (%d)", errorCode);
+    }
+
+    return errorCode;
+}
+
+/// @brief Starts capturing the radio, GNSS and accelerometer together
+/// into a new drive test file
+/// @param params [period milliseconds], default 1000
+/// @return 0 on success, negative on failure
+int32_t startDriveTest(commandParamsList_t *params)
+{
+    int32_t errorCode = U_ERROR_COMMON_SUCCESS;
+
+    if (driveTestMutex == NULL)
+        return U_ERROR_COMMON_NOT_INITIALISED;
+
+    U_PORT_MUTEX_LOCK(driveTestMutex);
+
+    if (running) {
+        writeWarn("The drive test is already running");
+        errorCode = U_ERROR_COMMON_BUSY;
+    } else {
+        tickPeriodMs = TICK_PERIOD_MS_DEFAULT;
+        if (params != NULL)
+            tickPeriodMs = getParamValue(params, 1, TICK_PERIOD_MS_MIN, TICK_PERIOD_MS_MAX, TICK_PERIOD_MS_DEFAULT);
+
+        snprintf(topicName, MAX_TOPIC_NAME_SIZE, "%s/%s", (const char *)gSerialNumber, DRIVE_TEST_TOPIC);
+        recordCount = 0;
+        bufferCount = 0;
+        startMs = uPortGetTickTimeMs();
+
+        errorCode = createFile();
+    }
+
+    if (errorCode == 0) {
+        startLocationStream();
+
+        running = true;
+        errorCode = uPortTimerChange(tickTimer, tickPeriodMs);
+        if (errorCode == 0)
+            errorCode = uPortTimerStart(tickTimer);
+
+        if (errorCode != 0) {
+            running = false;
+            stopLocationStream();
+        } else {
+            // the first record is captured straight away
+            tickTimerCallback(tickTimer, NULL);
+        }
+    }
+
+    U_PORT_MUTEX_UNLOCK(driveTestMutex);
+
+    if (errorCode == 0)
+        writeLog("Drive test started every %d ms, writing to %s", tickPeriodMs, filePath);
+    else if (errorCode != U_ERROR_COMMON_BUSY)
+        writeError("Failed to start the drive test (%d)", errorCode);
+
+    return errorCode;
+}
+
+/// @brief Stops the drive test, and publishes a summary of the file
+/// @param params not used
+/// @return 0 on success, negative on failure
+int32_t stopDriveTest(commandParamsList_t *params)
+{
+    if (driveTestMutex == NULL)
+        return U_ERROR_COMMON_NOT_INITIALISED;
+
+    U_PORT_MUTEX_LOCK(driveTestMutex);
+    if (running)
+        finishDriveTest();
+    U_PORT_MUTEX_UNLOCK(driveTestMutex);
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Starts the drive test if it isn't running, otherwise stops it.
+/// This is called on the button thread, which has a small stack, so the
+/// file system and MQTT work is done on the worker pool.
+void toggleDriveTest(void)
+{
+    int32_t errorCode = submitJob("DriveTest", toggleJob, NULL, 0);
+    if (errorCode != 0)
+        printWarn("Failed to queue the drive test toggle (%d)", errorCode);
+}
+
+/// @brief Returns true while a drive test is being captured
+bool isDriveTestRunning(void)
+{
+    return running;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Drive test capture header
+ *
+ */
+
+#ifndef _DRIVE_TEST_H_
+#define _DRIVE_TEST_H_
+
+/* ----------------------------------------------------------------
+ * DEFINITIONS
+ * -------------------------------------------------------------- */
+#define DRIVE_TEST_DIR "drivetest"
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Creates the drive test mutex
+/// @return 0 on success, negative on failure
+int32_t initDriveTest(void);
+
+/// @brief Starts capturing the radio, GNSS and accelerometer together
+/// into a new drive test file
+/// @param params [period milliseconds], default 1000
+/// @return 0 on success, negative on failure
+int32_t startDriveTest(commandParamsList_t *params);
+
+/// @brief Stops the drive test, and publishes a summary of the file
+/// @param params not used
+/// @return 0 on success, negative on failure
+int32_t stopDriveTest(commandParamsList_t *params);
+
+/// @brief Starts the drive test if it isn't running, otherwise stops it,
+/// on the worker pool. Used by the button two long press.
+void toggleDriveTest(void);
+
+/// @brief Returns true while a drive test is being captured
+bool isDriveTestRunning(void);
+
+#endif
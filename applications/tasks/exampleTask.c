@@ -30,13 +30,6 @@
 /* ----------------------------------------------------------------
  * DEFINES
  * -------------------------------------------------------------- */
-// not all tasks will have a task loop if it only uses a queue
-#define EXAMPLE_TASK_STACK_SIZE (1 * 1024)
-#define EXAMPLE_TASK_PRIORITY 5
-
-#define EXAMPLE_QUEUE_STACK_SIZE QUEUE_STACK_SIZE_DEFAULT
-#define EXAMPLE_QUEUE_PRIORITY 5
-#define EXAMPLE_QUEUE_SIZE 1
 
 /* ----------------------------------------------------------------
  * TASK COMMON VARIABLES
@@ -73,7 +66,7 @@ static void doExampleThing(void *pParams)
 
 static void startExampleThing(void)
 {
-    RUN_FUNC(doExampleThing, EXAMPLE_TASK_STACK_SIZE, EXAMPLE_TASK_PRIORITY);
+    RUN_FUNC(doExampleThing);
 }
 
 static void queueHandler(void *pParam, size_t paramLengthBytes)
@@ -93,33 +86,19 @@ static void queueHandler(void *pParam, size_t paramLengthBytes)
     }
 }
 
-// Task loop where the activity is made and the dwell time is taken
-static void taskLoop(void *pParameters)
+// Task job where the activity is made, run every dwell period on the worker pool
+static void taskJob(void *pParam, size_t paramLengthBytes)
 {
-    while(isNotExiting()) {
+    if (isNotExiting())
         doExampleThing(NULL);
-        dwellTask(taskConfig, isNotExiting);
-    }
-
-    FINALIZE_TASK;
 }
 
 static int32_t initQueue()
 {
-    int32_t eventQueueHandle = uPortEventQueueOpen(&queueHandler,
-                    TASK_NAME,
-                    sizeof(exampleMsg_t),
-                    EXAMPLE_QUEUE_STACK_SIZE,
-                    EXAMPLE_QUEUE_PRIORITY,
-                    EXAMPLE_QUEUE_SIZE);
-
-    if (eventQueueHandle < 0) {
-        writeFatal("Failed to create %s event queue %d", TASK_NAME, eventQueueHandle);
-    }
-
-    TASK_QUEUE = eventQueueHandle;
+    // task messages are handled on the shared worker pool
+    TASK_MSG_HANDLER = queueHandler;
 
-    return eventQueueHandle;
+    return U_ERROR_COMMON_SUCCESS;
 }
 
 static int32_t initMutex()
@@ -174,7 +153,7 @@ int32_t startExampleTaskLoop(commandParamsList_t *params)
     if (params != NULL)
         taskConfig->taskLoopDwellTime = getParamValue(params, 1, 5, 60, 30);
 
-    START_TASK_LOOP(EXAMPLE_TASK_STACK_SIZE, EXAMPLE_TASK_PRIORITY);
+    START_TASK_JOB(taskJob);
 }
 
 int32_t stopExampleTaskLoop(commandParamsList_t *params)
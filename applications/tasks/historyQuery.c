@@ -0,0 +1,197 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Remote queries of the measurement history, so the back end can fill
+ * in the gaps when the device was out of coverage.
+ *
+ * The query is read from the time series on the long job thread, and the
+ * values are published in chunks of 32, so no message is too large. The
+ * MQTT queue doesn't block a full publish, so each chunk waits for room in
+ * the queue first. A query publishes at most 16 chunks, and the last chunk
+ * says if there are more values, so the back end asks again from the time
+ * of the last value it was sent. If a chunk can't be published the query
+ * stops there, and the last chunk carries its values with "More":true.
+ *
+ */
+
+#include "common.h"
+#include "taskControl.h"
+#include "historyQuery.h"
+#include "mqttTask.h"
+#include "timeSeries.h"
+
+/* ----------------------------------------------------------------
+ * DEFINES
+ * -------------------------------------------------------------- */
+#define HISTORY_TOPIC "History"
+#define HISTORY_JSON_SIZE 1024
+
+#define CHUNK_SAMPLES 32
+#define MAX_CHUNKS 16
+
+// longest wait for room in the MQTT queue for each chunk
+#define CHUNK_WAIT_MS 30000
+
+/* ----------------------------------------------------------------
+ * TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+typedef struct {
+    char metric[TIME_SERIES_METRIC_SIZE];
+    uint32_t from;
+    uint32_t to;
+    int32_t chunk;
+    int32_t total;
+    bool more;
+    bool milli;
+    int32_t count;
+    uint32_t timestamps[CHUNK_SAMPLES];
+    int32_t values[CHUNK_SAMPLES];
+} historyQuery_t;
+
+/* ----------------------------------------------------------------
+ * STATIC VARIABLES
+ * -------------------------------------------------------------- */
+static char topicName[MAX_TOPIC_NAME_SIZE];
+static char jsonBuffer[HISTORY_JSON_SIZE];
+
+/// @brief the query being run, only one query runs at a time
+static historyQuery_t query;
+static atomic_t queryRunning = ATOMIC_INIT(0);
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Publishes the values collected so far as one chunk, eg
+/// {"History":{"Metric":"Temperature.Pressure","Chunk":1,"Scale":1000,
+///  "Samples":[[1660000000,1013250],...],"Last":false}}
+/// The values are kept if the chunk isn't published.
+static int32_t publishChunk(bool last)
+{
+    int32_t len = snprintf(jsonBuffer, HISTORY_JSON_SIZE,
+                    "{\"History\":{\"Metric\":\"%s\",\"Chunk\":%d,\"Scale\":%d,\"Samples\":[",
+                    query.metric, query.chunk + 1, query.milli ? 1000 : 1);
+
+    for(int32_t i=0; i<query.count && len < HISTORY_JSON_SIZE; i++)
+        len += snprintf(jsonBuffer + len, HISTORY_JSON_SIZE - len, "%s[%u,%d]",
+                        i > 0 ? "," : "", query.timestamps[i], query.values[i]);
+
+    if (len < HISTORY_JSON_SIZE) {
+        if (last)
+            len += snprintf(jsonBuffer + len, HISTORY_JSON_SIZE - len,
+                            "],\"Last\":true,\"Total\":%d,\"More\":%s}}",
+                            query.total, query.more ? "true" : "false");
+        else
+            len += snprintf(jsonBuffer + len, HISTORY_JSON_SIZE - len, "],\"Last\":false}}");
+    }
+
+    if (len >= HISTORY_JSON_SIZE) {
+        writeError("History chunk too large for the message buffer");
+        return U_ERROR_COMMON_NO_MEMORY;
+    }
+
+    if (!waitForMQTTQueueSpace(CHUNK_WAIT_MS))
+        return U_ERROR_COMMON_TIMEOUT;
+
+    int32_t errorCode = sendMQTTMessage(topicName, jsonBuffer, U_MQTT_QOS_AT_LEAST_ONCE, false);
+    if (errorCode == 0) {
+        query.chunk++;
+        query.count = 0;
+    }
+
+    return errorCode;
+}
+
+/// @brief Adds a value to the chunk, and publishes the chunk when full
+static bool addSample(uint32_t timestamp, int32_t value, bool milli, void *pContext)
+{
+    if (query.count == CHUNK_SAMPLES) {
+        if (query.chunk == MAX_CHUNKS - 1) {
+            // the rest are left for the next query
+            query.more = true;
+            return false;
+        }
+
+        // the back end is told there are more values, from the first one
+        // in this chunk
+        int32_t errorCode = publishChunk(false);
+        if (errorCode != 0) {
+            writeWarn("Failed to publish history chunk %d (%d)", query.chunk + 1, errorCode);
+            query.more = true;
+            return false;
+        }
+    }
+
+    query.timestamps[query.count] = timestamp;
+    query.values[query.count] = value;
+    query.milli = milli;
+    query.count++;
+    query.total++;
+
+    return true;
+}
+
+static void queryJob(void *pParam, size_t paramLengthBytes)
+{
+    writeLog("History query of %s from %u to %u", query.metric, query.from, query.to);
+
+    int32_t found = readTimeSeries(query.metric, query.from, query.to, addSample, NULL);
+    if (found < 0)
+        writeWarn("History query failed (%d)", found);
+    else if (publishChunk(true) != 0)
+        writeWarn("Failed to publish the last history chunk");
+
+    writeLog("History query published %d values in %d chunks", query.total, query.chunk);
+    atomic_set(&queryRunning, 0);
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Publishes the stored values of a metric in a time range, in
+/// chunks, on the <IMEI>/History topic
+/// @param params <metric> [from unix time] [to unix time]
+/// @return 0 if the query was started, negative on failure
+int32_t queryHistory(commandParamsList_t *params)
+{
+    if (params == NULL || params->pNext == NULL) {
+        writeWarn("QUERY needs a metric name, eg QUERY Temperature.Pressure");
+        return U_ERROR_COMMON_INVALID_PARAMETER;
+    }
+
+    if (!atomic_cas(&queryRunning, 0, 1)) {
+        writeWarn("A history query is already running");
+        return U_ERROR_COMMON_BUSY;
+    }
+
+    memset(&query, 0, sizeof(query));
+    strncpy(query.metric, params->pNext->parameter, sizeof(query.metric) - 1);
+    query.from = getParamValue(params, 2, 0, INT32_MAX, 0);
+    query.to = getParamValue(params, 3, 0, INT32_MAX, INT32_MAX);
+
+    snprintf(topicName, MAX_TOPIC_NAME_SIZE, "%s/%s", (const char *)gSerialNumber, HISTORY_TOPIC);
+
+    int32_t errorCode = submitLongJob("HistoryQuery", queryJob, NULL, 0);
+    if (errorCode != 0) {
+        writeWarn("Failed to start the history query (%d)", errorCode);
+        atomic_set(&queryRunning, 0);
+    }
+
+    return errorCode;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Remote queries of the measurement history header
+ *
+ */
+
+#ifndef _HISTORY_QUERY_H_
+#define _HISTORY_QUERY_H_
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Publishes the stored values of a metric in a time range, in
+/// chunks, on the <IMEI>/History topic
+/// @param params <metric> [from unix time] [to unix time]
+/// @return 0 if the query was started, negative on failure
+int32_t queryHistory(commandParamsList_t *params);
+
+#endif
@@ -26,26 +26,58 @@
 #include "taskControl.h"
 #include "locationTask.h"
 #include "mqttTask.h"
+#include "radioCache.h"
+#include "sensors.h"
+#include "geofence.h"
+#include "trackBuffer.h"
 
 /* ----------------------------------------------------------------
  * DEFINES
  * -------------------------------------------------------------- */
-#define LOCATION_TASK_STACK_SIZE    (3 * 1024)
-#define LOCATION_TASK_PRIORITY      5
-
-#define LOCATION_QUEUE_STACK_SIZE QUEUE_STACK_SIZE_DEFAULT
-#define LOCATION_QUEUE_PRIORITY 5
-#define LOCATION_QUEUE_SIZE     5
-
 #define JSON_STRING_LENGTH      300
 
 #define TEN_MILLIONTH           10000000
 
 #define FRACTION_FORMAT(v, d)   fractionConvert(v,&whole, &fraction, d), whole, fraction
 
+#define LOCATION_CONFIG_PREFIX  "LOCATION_"
+
+#define GEOFENCE_TOPIC          "Geofence"
+
+// The geofence events which are kept until they can be published, the
+// oldest is dropped when a new one doesn't fit
+#define MAX_PENDING_GEOFENCE_EVENTS 8
+#define TRACK_TOPIC             "Track"
+
+#define TRACK_CONFIG_PREFIX     "TRACK_"
+#define TRACK_MESSAGE_SIZE      512
+
+// The track is uploaded early when the buffer is this full
+#define TRACK_UPLOAD_PERCENT    75
+
+// How often the accelerometer is read to check for motion
+#define MOTION_CHECK_MS         2000
+
+// Motion gating defaults, the threshold is in 0.01 m/s2 and 0 turns gating off
+#define MOTION_THRESHOLD_DEFAULT        30
+#define STILL_TIME_DEFAULT_SECS         120
+#define STATIONARY_MAX_DEFAULT_SECS     1800
+
+// The GNSS is only powered down if the next fix is at least this far
+// away, as a hot start after a short time off costs more than it saves
+#define GNSS_POWER_OFF_MIN_SECS         60
+
 /* ----------------------------------------------------------------
  * TYPE DEFINITIONS
  * -------------------------------------------------------------- */
+/// @brief A geofence event which hasn't been published yet
+typedef struct {
+    geofenceEvent_t event;
+    int64_t timestamp;
+    int32_t latitudeX1e7;
+    int32_t longitudeX1e7;
+} pendingGeofenceEvent_t;
+
 uNetworkCfgGnss_t gNetworkGNSSCfg = {
     .type = U_NETWORK_TYPE_GNSS
 };
@@ -63,13 +95,23 @@ static uDeviceCfg_t gDeviceGNSSCfg;
 static uDeviceHandle_t gnssHandle;
 
 static bool stopLocation = false;
-static bool gettingLocation = false;
+
+/// @brief set while a location fix is queued or running on the long job thread
+static atomic_t gettingLocation = ATOMIC_INIT(0);
 
 static char topicName[MAX_TOPIC_NAME_SIZE];
+static char geofenceTopicName[MAX_TOPIC_NAME_SIZE];
+static char trackTopicName[MAX_TOPIC_NAME_SIZE];
+
+/// @brief publish the next location, even if there are geofences
+static bool publishRequested = false;
 
 /// callback commands for incoming MQTT control messages
 static callbackCommand_t callbacks[] = {
     {"LOCATION_NOW", queueLocationNow},
+    {"ADD_GEOFENCE", addGeofenceCommand},
+    {"REMOVE_GEOFENCE", removeGeofenceCommand},
+    {"CLEAR_GEOFENCES", clearGeofencesCommand},
     {"START_TASK", startLocationTaskLoop},
     {"STOP_TASK", stopLocationTaskLoop}
 };
@@ -77,6 +119,42 @@ static callbackCommand_t callbacks[] = {
 /// @brief buffer for the location MQTT JSON message
 static char jsonBuffer[JSON_STRING_LENGTH];
 
+/// @brief the geofence events waiting to be published, oldest first,
+/// protected by the task mutex
+static pendingGeofenceEvent_t pendingEvents[MAX_PENDING_GEOFENCE_EVENTS];
+static int32_t pendingEventCount = 0;
+
+/// @brief motion gating configuration, from the LOCATION_xxx config keys
+static int32_t motionThreshold = MOTION_THRESHOLD_DEFAULT;
+static int32_t stillTimeSecs = STILL_TIME_DEFAULT_SECS;
+static int32_t stationaryMaxSecs = STATIONARY_MAX_DEFAULT_SECS;
+
+/// @brief motion state, only written by the motion check job
+static int32_t motionJobId = -1;
+static bool accelValid = false;
+static int32_t lastAccel[3];
+static int64_t lastMotionMs = 0;
+static atomic_t deviceMoving = ATOMIC_INIT(1);
+
+/// @brief fix scheduling, protected by the task mutex
+static int64_t lastFixMs = 0;
+static int32_t stationaryIntervalSecs = 0;
+static bool gnssPoweredOn = true;
+
+/// @brief track recording, on while the upload interval is set
+static int32_t trackUploadSecs = 0;
+static int32_t trackJobId = -1;
+static bool trackUploadDue = false;
+static char trackBuffer[TRACK_MESSAGE_SIZE];
+
+/// @brief the location stream, for the drive test. While it is on the
+/// periodic fixes are skipped, and the fixes are requested back to back.
+static atomic_t streaming = ATOMIC_INIT(0);
+static atomic_t streamFixPending = ATOMIC_INIT(0);
+static uPortMutexHandle_t streamMutex = NULL;
+static uLocation_t streamLocation;
+static int64_t streamFixMs = 0;
+
 /* ----------------------------------------------------------------
  * STATIC FUNCTIONS
  * -------------------------------------------------------------- */
@@ -140,8 +218,7 @@ static void publishLocation(uLocation_t location)
                 "\"Longitude\":%c%d.%07d,"                      \
                 "\"Accuracy\":%d,"                              \
                 "\"Speed\":%d,"                                 \
-                "\"GNSSTimestamp\":%" PRId64 "}"                \
-        "}";
+                "\"GNSSTimestamp\":%" PRId64 "}";
 
     //struct tm *t = gmtime(&location.timeUtc);
 
@@ -153,27 +230,185 @@ static void publishLocation(uLocation_t location)
             location.speedMillimetresPerSecond,
             location.timeUtc);
 
+    // tag the location with the serving cell from the radio cache, this
+    // doesn't send any AT commands to the cellular module
+    radioSnapshot_t radio;
+    size_t len = strlen(jsonBuffer);
+    if (getRadioSnapshot(&radio, RADIO_SNAPSHOT_CACHED_ONLY) == 0 && radio.operatorValid)
+        snprintf(jsonBuffer + len, JSON_STRING_LENGTH - len,
+                ",\"Cell\":{\"CellID\":\"%d\",\"PLMN\":\"%03d%02d\",\"RSRP\":%d}}",
+                radio.cellId, radio.mcc, radio.mnc, radio.rsrp);
+    else
+        snprintf(jsonBuffer + len, JSON_STRING_LENGTH - len, "}");
+
     sendMQTTMessage(topicName, jsonBuffer, U_MQTT_QOS_AT_MOST_ONCE, false);
     writeAlways(jsonBuffer);
 }
 
-static void getLocation(void *pParams)
+/// @brief Motion gating is on when the accelerometer can be read and
+/// the motion threshold is set
+static bool isMotionGated(void)
 {
-    if (gettingLocation) {
-        printDebug("getLocation(): Already trying to get location...");
-        return;
+    return accelValid && motionThreshold > 0;
+}
+
+/// @brief Returns the seconds between fixes, the task dwell time while
+/// moving, or the backed off interval while stationary
+static int32_t getNextFixSecs(void)
+{
+    if (!isMotionGated() || atomic_get(&deviceMoving))
+        return getTaskDwellTime(taskConfig);
+
+    return MAX(stationaryIntervalSecs, getTaskDwellTime(taskConfig));
+}
+
+static void powerOnGNSS(void)
+{
+    int32_t errorCode = uGnssPwrOn(gnssHandle);
+    if (errorCode == 0) {
+        gnssPoweredOn = true;
+        writeDebug("GNSS powered on");
+    } else {
+        writeWarn("Failed to power on the GNSS: %d", errorCode);
     }
+}
+
+static void powerOffGNSS(void)
+{
+    int32_t errorCode = uGnssPwrOff(gnssHandle);
+    if (errorCode == 0) {
+        gnssPoweredOn = false;
+        writeDebug("GNSS powered off, next fix in %d seconds", getNextFixSecs());
+    } else {
+        writeWarn("Failed to power off the GNSS: %d", errorCode);
+    }
+}
+
+/// @brief Checks if the periodic fix is due, which is skipped while the
+/// device is stationary until the backed off interval has passed
+static bool isFixDue(void)
+{
+    bool due;
 
     U_PORT_MUTEX_LOCK(TASK_MUTEX);
+    due = lastFixMs == 0 || (uPortGetTickTimeMs() - lastFixMs) >= (int64_t)getNextFixSecs() * 1000;
+    U_PORT_MUTEX_UNLOCK(TASK_MUTEX);
+
+    if (!due)
+        printDebug("Stationary, skipping the location fix");
+
+    return due;
+}
+
+/// @brief Publishes the pending geofence events in order, and keeps the
+/// ones which can't be published yet. Called with the task mutex locked.
+static void publishPendingGeofenceEvents(void)
+{
+    int32_t whole;
+    int32_t fraction;
+    int32_t sent = 0;
+
+    while (sent < pendingEventCount && IS_NETWORK_AVAILABLE) {
+        pendingGeofenceEvent_t *pending = &pendingEvents[sent];
+
+        snprintf(jsonBuffer, JSON_STRING_LENGTH,
+                "{\"Timestamp\":%" PRId64 ",\"Geofence\":{\"Name\":\"%s\",\"Event\":\"%s\","
+                "\"Latitude\":%c%d.%07d,\"Longitude\":%c%d.%07d}}",
+                pending->timestamp, pending->event.name, getGeofenceEventName(pending->event.event),
+                FRACTION_FORMAT(pending->latitudeX1e7,  TEN_MILLIONTH),
+                FRACTION_FORMAT(pending->longitudeX1e7, TEN_MILLIONTH));
+
+        if (sendMQTTMessage(geofenceTopicName, jsonBuffer, U_MQTT_QOS_AT_LEAST_ONCE, false) != 0)
+            break;
+
+        writeAlways(jsonBuffer);
+        sent++;
+    }
+
+    if (sent > 0) {
+        pendingEventCount -= sent;
+        memmove(pendingEvents, &pendingEvents[sent], pendingEventCount * sizeof(pendingGeofenceEvent_t));
+    }
+}
+
+/// @brief Publishes the geofence enter, exit and dwell events of a location.
+/// The fences' state has already moved on, so the events are kept until
+/// they are published, rather than lost while the network is down.
+/// Called with the task mutex locked.
+static void publishGeofenceEvents(uLocation_t *location)
+{
+    geofenceEvent_t events[MAX_GEOFENCES];
+
+    int32_t count = checkGeofences(location->latitudeX1e7, location->longitudeX1e7, events);
+
+    int64_t timestamp = unixNetworkTime + (uPortGetTickTimeMs() / 1000);
+    for(int32_t i=0; i<count; i++) {
+        if (pendingEventCount == MAX_PENDING_GEOFENCE_EVENTS) {
+            writeWarn("Geofence %s event not published, dropping it", pendingEvents[0].event.name);
+            pendingEventCount--;
+            memmove(pendingEvents, &pendingEvents[1], pendingEventCount * sizeof(pendingGeofenceEvent_t));
+        }
+
+        pendingGeofenceEvent_t *pending = &pendingEvents[pendingEventCount++];
+        pending->event = events[i];
+        pending->timestamp = timestamp;
+        pending->latitudeX1e7 = location->latitudeX1e7;
+        pending->longitudeX1e7 = location->longitudeX1e7;
+    }
+
+    publishPendingGeofenceEvents();
+}
+
+/// @brief Publishes the track in as many segments as it needs. Called
+/// with the task mutex locked, the points are kept if publishing fails.
+static void uploadTrack(void)
+{
+    while (formatTrackSegment(trackBuffer, TRACK_MESSAGE_SIZE) > 0) {
+        if (sendMQTTMessage(trackTopicName, trackBuffer, U_MQTT_QOS_AT_LEAST_ONCE, false) != 0)
+            break;
+
+        writeAlways(trackBuffer);
+        commitTrackSegment();
+    }
+
+    trackUploadDue = false;
+}
+
+/// @brief Adds a fix to the track, and uploads the track when it is due
+static void recordTrack(uLocation_t *location)
+{
+    int64_t timestamp = unixNetworkTime + (uPortGetTickTimeMs() / 1000);
+    addTrackPoint(timestamp, location->latitudeX1e7, location->longitudeX1e7);
+
+    if (trackUploadDue || getTrackBufferPercent() >= TRACK_UPLOAD_PERCENT)
+        uploadTrack();
+}
+
+/// @brief Gets a location fix, on the long job thread as the fix can take
+/// minutes. Started by startGetLocation(), which sets gettingLocation.
+static void getLocation(void *pParams)
+{
+    U_PORT_MUTEX_LOCK(TASK_MUTEX);
+    beginTaskWork(taskConfig);
 
     uLocation_t location;   
-    gettingLocation = true;
+
+    if (!gnssPoweredOn)
+        powerOnGNSS();
 
     printDebug("Requesting location information...");
     int32_t errorCode = uLocationGet(gnssHandle, U_LOCATION_TYPE_GNSS,
                                          NULL, NULL, &location, keepGoing);
     if (errorCode == 0) {
-        publishLocation(location);
+        publishGeofenceEvents(&location);
+
+        if (trackUploadSecs > 0)
+            recordTrack(&location);
+
+        // with geofences or a track only the events and track segments
+        // are published, unless asked
+        if ((getGeofenceCount() == 0 && trackUploadSecs == 0) || publishRequested)
+            publishLocation(location);
     } else {
         if (errorCode == U_ERROR_COMMON_TIMEOUT)
             writeDebug("Timed out getting GNSS location");
@@ -181,17 +416,38 @@ static void getLocation(void *pParams)
             writeError("Failed to get GNSS location: %d", errorCode);
     }
 
-    gettingLocation = false;
+    atomic_set(&gettingLocation, 0);
+    publishRequested = false;
+    lastFixMs = uPortGetTickTimeMs();
+
+    // back off the fixes while the device isn't moving
+    if (isMotionGated()) {
+        if (atomic_get(&deviceMoving))
+            stationaryIntervalSecs = getTaskDwellTime(taskConfig);
+        else
+            stationaryIntervalSecs = MIN(stationaryIntervalSecs * 2, stationaryMaxSecs);
+
+        if (getNextFixSecs() >= GNSS_POWER_OFF_MIN_SECS)
+            powerOffGNSS();
+    }
 
     // reset the stop location indicator
     stopLocation = false;
 
+    endTaskWork(taskConfig);
     U_PORT_MUTEX_UNLOCK(TASK_MUTEX);
 }
 
 static void startGetLocation(void)
 {
-    RUN_FUNC(getLocation, LOCATION_TASK_STACK_SIZE, LOCATION_TASK_PRIORITY);
+    if (!atomic_cas(&gettingLocation, 0, 1)) {
+        printDebug("getLocation(): Already trying to get location...");
+        return;
+    }
+
+    RUN_LONG_FUNC(getLocation);
+    if (errorCode < 0)
+        atomic_set(&gettingLocation, 0);
 }
 
 static void queueHandler(void *pParam, size_t paramLengthBytes)
@@ -200,6 +456,8 @@ static void queueHandler(void *pParam, size_t paramLengthBytes)
 
     switch(qMsg->msgType) {
         case GET_LOCATION_NOW:
+            if (qMsg->msg.publishLocation)
+                publishRequested = true;
             startGetLocation();
             break;
 
@@ -217,34 +475,206 @@ static void queueHandler(void *pParam, size_t paramLengthBytes)
     }
 }
 
-// Signal Quality task loop for reading the RSRP and RSRQ values
-// and sending these values to the MQTT topic
-static void taskLoop(void *pParameters)
+/// @brief Queues a location fix
+/// @param publish Publish the location, even if there are geofences
+static int32_t queueLocation(bool publish)
 {
-    while(isNotExiting()) {
-        getLocation(NULL);
-        dwellTask(taskConfig, isNotExiting);
+    locationMsg_t qMsg;
+    qMsg.msgType = GET_LOCATION_NOW;
+    qMsg.msg.publishLocation = publish;
+
+    return sendAppTaskMessage(TASK_ID, &qMsg, sizeof(locationMsg_t));
+}
+
+// Location task job, run every dwell period on the worker pool
+static void taskJob(void *pParam, size_t paramLengthBytes)
+{
+    // the geofence events which couldn't be published at the last fix are
+    // tried again, as the fixes are far apart while the device is still
+    if (isNotExiting() && pendingEventCount > 0 && uPortMutexTryLock(TASK_MUTEX, 0) == 0) {
+        publishPendingGeofenceEvents();
+        uPortMutexUnlock(TASK_MUTEX);
     }
 
-    FINALIZE_TASK;
+    if (isNotExiting() && !atomic_get(&streaming) && isFixDue())
+        startGetLocation();
 }
 
-static int32_t initQueue()
+/// @brief Called by ubxlib when a streamed fix has finished
+static void streamFixCallback(uDeviceHandle_t devHandle, int32_t errorCode, const uLocation_t *pLocation)
+{
+    if (errorCode == 0 && pLocation != NULL) {
+        U_PORT_MUTEX_LOCK(streamMutex);
+        streamLocation = *pLocation;
+        streamFixMs = uPortGetTickTimeMs();
+        U_PORT_MUTEX_UNLOCK(streamMutex);
+    } else {
+        writeDebug("Streamed GNSS fix failed: %d", errorCode);
+    }
+
+    atomic_set(&streamFixPending, 0);
+}
+
+/// @brief Starts the next streamed fix, unless one is in progress
+static void startStreamFix(void)
+{
+    // a periodic fix may still be finishing when the stream starts
+    if (atomic_get(&gettingLocation))
+        return;
+
+    if (!gnssPoweredOn) {
+        if (uPortMutexTryLock(TASK_MUTEX, 0) != 0)
+            return;
+        powerOnGNSS();
+        uPortMutexUnlock(TASK_MUTEX);
+    }
+
+    if (!atomic_cas(&streamFixPending, 0, 1))
+        return;
+
+    int32_t errorCode = uLocationGetStart(gnssHandle, U_LOCATION_TYPE_GNSS, NULL, NULL, streamFixCallback);
+    if (errorCode != 0) {
+        writeDebug("Failed to start a streamed GNSS fix: %d", errorCode);
+        atomic_set(&streamFixPending, 0);
+    }
+}
+
+/// @brief Reads the accelerometer and tracks if the device is moving. The
+/// device is moving when any axis changes by more than the motion
+/// threshold, and stationary after no motion for the still time.
+static void motionJob(void *pParam, size_t paramLengthBytes)
 {
-    int32_t eventQueueHandle = uPortEventQueueOpen(&queueHandler,
-                    TASK_NAME,
-                    sizeof(locationMsg_t),
-                    LOCATION_QUEUE_STACK_SIZE,
-                    LOCATION_QUEUE_PRIORITY,
-                    LOCATION_QUEUE_SIZE);
+    int32_t accel[3];
+
+    if (!isNotExiting() || getAccelerometer(&accel[0], &accel[1], &accel[2]) != 0)
+        return;
+
+    // the threshold is in 0.01 m/s2, the accelerometer in milli m/s2
+    int32_t threshold = motionThreshold * 10;
+    int64_t now = uPortGetTickTimeMs();
+    for(int i=0; i<3; i++) {
+        int32_t change = accel[i] - lastAccel[i];
+        if (change > threshold || change < -threshold)
+            lastMotionMs = now;
 
-    if (eventQueueHandle < 0) {
-        writeFatal("Failed to create %s event queue %d", TASK_NAME, eventQueueHandle);
+        lastAccel[i] = accel[i];
     }
 
-    TASK_QUEUE = eventQueueHandle;
+    bool moving = (now - lastMotionMs) < (int64_t)stillTimeSecs * 1000;
+    bool wasMoving = atomic_set(&deviceMoving, moving);
+
+    if (moving && !wasMoving) {
+        writeLog("Motion detected, requesting a location fix");
+        queueLocation(false);
+    } else if (!moving && wasMoving) {
+        writeLog("Device stationary, backing off the location fixes");
+    }
+}
+
+/// @brief Uploads the track every TRACK_UPLOAD_INTERVAL seconds. If a
+/// fix is in progress the track is uploaded after it instead.
+static void trackJob(void *pParam, size_t paramLengthBytes)
+{
+    if (!isNotExiting())
+        return;
+
+    if (uPortMutexTryLock(TASK_MUTEX, 0) == 0) {
+        uploadTrack();
+        uPortMutexUnlock(TASK_MUTEX);
+    } else {
+        trackUploadDue = true;
+    }
+}
+
+static void startTrackUploads(void)
+{
+    if (trackUploadSecs > 0 && trackJobId < 0)
+        trackJobId = addPeriodicJob("Track", trackJob, trackUploadSecs * 1000);
+}
+
+static void stopTrackUploads(void)
+{
+    if (trackJobId >= 0) {
+        removePeriodicJob(trackJobId);
+        trackJobId = -1;
+    }
+}
+
+/// @brief Reads the track configuration, recording is on while the
+/// upload interval is set
+static void applyTrackConfig(void)
+{
+    int32_t uploadSecs = 0;
+    int32_t tolerance = TRACK_TOLERANCE_DEFAULT_METRES;
+
+    setIntParamFromConfig("TRACK_UPLOAD_INTERVAL", &uploadSecs);
+    setIntParamFromConfig("TRACK_TOLERANCE", &tolerance);
+    setTrackTolerance(tolerance);
 
-    return eventQueueHandle;
+    if (uploadSecs == trackUploadSecs)
+        return;
+
+    trackUploadSecs = uploadSecs;
+    if (trackUploadSecs == 0) {
+        writeLog("Location track recording off");
+        stopTrackUploads();
+    } else {
+        writeLog("Recording the location track, uploading every %d seconds", trackUploadSecs);
+        if (trackJobId >= 0)
+            setPeriodicJobPeriod(trackJobId, trackUploadSecs * 1000);
+        else if (getTaskState(TASK_ID) == TASK_STATE_RUNNING)
+            startTrackUploads();
+    }
+}
+
+/// @brief Reads the motion gating configuration
+static void applyMotionConfig(void)
+{
+    motionThreshold = MOTION_THRESHOLD_DEFAULT;
+    stillTimeSecs = STILL_TIME_DEFAULT_SECS;
+    stationaryMaxSecs = STATIONARY_MAX_DEFAULT_SECS;
+
+    setIntParamFromConfig("LOCATION_MOTION_THRESHOLD", &motionThreshold);
+    setIntParamFromConfig("LOCATION_STILL_TIME", &stillTimeSecs);
+    setIntParamFromConfig("LOCATION_STATIONARY_MAX", &stationaryMaxSecs);
+}
+
+/// @brief Starts checking for motion, if there is an accelerometer
+static void startMotionGating(void)
+{
+    int32_t x, y, z;
+
+    accelValid = (getAccelerometer(&x, &y, &z) == 0);
+    if (!accelValid) {
+        writeWarn("No accelerometer, the location fixes are not motion gated");
+        return;
+    }
+
+    lastAccel[0] = x;
+    lastAccel[1] = y;
+    lastAccel[2] = z;
+    lastMotionMs = uPortGetTickTimeMs();
+    atomic_set(&deviceMoving, 1);
+    stationaryIntervalSecs = getTaskDwellTime(taskConfig);
+
+    if (motionJobId < 0)
+        motionJobId = addPeriodicJob("Motion", motionJob, MOTION_CHECK_MS);
+}
+
+static void stopMotionGating(void)
+{
+    if (motionJobId >= 0) {
+        removePeriodicJob(motionJobId);
+        motionJobId = -1;
+    }
+}
+
+static int32_t initQueue()
+{
+    // task messages are handled on the shared worker pool
+    TASK_MSG_HANDLER = queueHandler;
+
+    return U_ERROR_COMMON_SUCCESS;
 }
 
 static int32_t startGNSS(void)
@@ -272,6 +702,16 @@ static int32_t initMutex()
     INIT_MUTEX;
 }
 
+static int32_t initStreamMutex()
+{
+    int32_t errorCode = uPortMutexCreate(&streamMutex);
+    if (errorCode != 0) {
+        writeFatal("Failed to create %s stream Mutex (%d).", TASK_NAME, errorCode);
+    }
+
+    return errorCode;
+}
+
 /* ----------------------------------------------------------------
  * PUBLIC FUNCTIONS
  * -------------------------------------------------------------- */
@@ -281,10 +721,50 @@ static int32_t initMutex()
 /// @return returns the errorCode of sending the message on the eventQueue
 int32_t queueLocationNow(commandParamsList_t *params)
 {
-    locationMsg_t qMsg;
-    qMsg.msgType = GET_LOCATION_NOW;
+    return queueLocation(true);
+}
 
-    return sendAppTaskMessage(TASK_ID, &qMsg, sizeof(locationMsg_t));
+/// @brief Adds or replaces a geofence and saves the geofences
+/// @param params ADD_GEOFENCE CIRCLE <name> <lat> <lon> <radius metres>, or
+/// ADD_GEOFENCE POLYGON <name> <lat> <lon> <lat> <lon> <lat> <lon> ...
+/// @return 0 on success, negative on failure
+int32_t addGeofenceCommand(commandParamsList_t *params)
+{
+    if (params == NULL)
+        return U_ERROR_COMMON_INVALID_PARAMETER;
+
+    int32_t errorCode = addGeofence(params->pNext);
+    if (errorCode == 0)
+        errorCode = saveGeofences();
+
+    return errorCode;
+}
+
+/// @brief Removes a geofence and saves the geofences
+/// @param params REMOVE_GEOFENCE <name>
+/// @return 0 on success, negative on failure
+int32_t removeGeofenceCommand(commandParamsList_t *params)
+{
+    if (params == NULL || params->pNext == NULL)
+        return U_ERROR_COMMON_INVALID_PARAMETER;
+
+    int32_t errorCode = removeGeofence(params->pNext->parameter);
+    if (errorCode == 0)
+        errorCode = saveGeofences();
+    else
+        writeWarn("Geofence '%s' not found", params->pNext->parameter);
+
+    return errorCode;
+}
+
+/// @brief Removes all the geofences, so every location is published again
+/// @param params Not used
+/// @return 0 on success, negative on failure
+int32_t clearGeofencesCommand(commandParamsList_t *params)
+{
+    clearGeofences();
+
+    return saveGeofences();
 }
 
 /// @brief Initialises the Signal Quality task
@@ -302,6 +782,7 @@ int32_t initLocationTask(taskConfig_t *config)
 
     writeLog("Initializing the %s task...", TASK_NAME);
     EXIT_ON_FAILURE(initMutex);
+    EXIT_ON_FAILURE(initStreamMutex);
     EXIT_ON_FAILURE(initQueue);
 
     result = startGNSS();
@@ -310,6 +791,18 @@ int32_t initLocationTask(taskConfig_t *config)
         return result;
     }
 
+    snprintf(geofenceTopicName, MAX_TOPIC_NAME_SIZE, "%s/%s", (const char *)gSerialNumber, GEOFENCE_TOPIC);
+    initGeofences();
+
+    snprintf(trackTopicName, MAX_TOPIC_NAME_SIZE, "%s/%s", (const char *)gSerialNumber, TRACK_TOPIC);
+    resetTrack(TRACK_TOLERANCE_DEFAULT_METRES);
+    applyTrackConfig();
+    registerConfigChangedCallback(TRACK_CONFIG_PREFIX, applyTrackConfig);
+
+    sensorsInit();
+    applyMotionConfig();
+    registerConfigChangedCallback(LOCATION_CONFIG_PREFIX, applyMotionConfig);
+
     char tp[MAX_TOPIC_NAME_SIZE];
     snprintf(tp, MAX_TOPIC_NAME_SIZE, "%sControl", TASK_NAME);
     subscribeToTopicAsync(tp, U_MQTT_QOS_AT_MOST_ONCE, callbacks, NUM_ELEMENTS(callbacks));
@@ -326,10 +819,81 @@ int32_t startLocationTaskLoop(commandParamsList_t *params)
     if (params != NULL)
         taskConfig->taskLoopDwellTime = getParamValue(params, 1, 5, 60, 30);
 
-    START_TASK_LOOP(LOCATION_TASK_STACK_SIZE, LOCATION_TASK_PRIORITY);
+    startMotionGating();
+    startTrackUploads();
+
+    START_TASK_JOB(taskJob);
 }
 
 int32_t stopLocationTaskLoop(commandParamsList_t *params)
 {
+    stopLocationStream();
+    stopMotionGating();
+    stopTrackUploads();
+
     STOP_TASK;
-}
\ No newline at end of file
+}
+
+/// @brief Returns the motion state from the motion gating
+/// @return MOTION_UNKNOWN if the location fixes aren't motion gated
+motionState_t getMotionState(void)
+{
+    if (taskConfig == NULL || !isMotionGated() || motionJobId < 0)
+        return MOTION_UNKNOWN;
+
+    return atomic_get(&deviceMoving) ? MOTION_MOVING : MOTION_STATIONARY;
+}
+
+/// @brief Starts the location stream, where fixes are made back to back
+/// instead of every dwell period, and the periodic fixes are stopped
+void startLocationStream(void)
+{
+    // the location task isn't running
+    if (streamMutex == NULL)
+        return;
+
+    U_PORT_MUTEX_LOCK(streamMutex);
+    streamFixMs = 0;
+    U_PORT_MUTEX_UNLOCK(streamMutex);
+
+    atomic_set(&streaming, 1);
+    writeLog("Location stream started");
+}
+
+/// @brief Stops the location stream, and goes back to the periodic fixes
+void stopLocationStream(void)
+{
+    if (!atomic_set(&streaming, 0))
+        return;
+
+    if (atomic_get(&streamFixPending)) {
+        uLocationGetStop(gnssHandle);
+        atomic_set(&streamFixPending, 0);
+    }
+
+    writeLog("Location stream stopped");
+}
+
+/// @brief Gets the latest streamed fix, and starts the next fix if the
+/// last one has finished
+/// @param pLocation Where to copy the fix to
+/// @param pFixMs Where to put the tick time of the fix
+/// @return true if there has been a fix since the stream started
+bool pollLocationStream(uLocation_t *pLocation, int64_t *pFixMs)
+{
+    bool valid;
+
+    if (streamMutex == NULL)
+        return false;
+
+    if (atomic_get(&streaming) && isNotExiting())
+        startStreamFix();
+
+    U_PORT_MUTEX_LOCK(streamMutex);
+    *pLocation = streamLocation;
+    *pFixMs = streamFixMs;
+    valid = streamFixMs > 0;
+    U_PORT_MUTEX_UNLOCK(streamMutex);
+
+    return valid;
+}
@@ -23,6 +23,15 @@
 #ifndef _LOCATION_TASK_H_
 #define _LOCATION_TASK_H_
 
+/* ----------------------------------------------------------------
+ * PUBLIC TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+typedef enum {
+    MOTION_UNKNOWN,                 // no accelerometer, or motion gating is off
+    MOTION_MOVING,
+    MOTION_STATIONARY
+} motionState_t;
+
 /* ----------------------------------------------------------------
  * COMMON TASK FUNCTIONS
  * -------------------------------------------------------------- */
@@ -34,6 +43,17 @@ int32_t stopLocationTaskLoop(commandParamsList_t *params);
  * PUBLIC TASK FUNCTIONS
  * -------------------------------------------------------------- */
 int32_t queueLocationNow(commandParamsList_t *params);
+int32_t addGeofenceCommand(commandParamsList_t *params);
+int32_t removeGeofenceCommand(commandParamsList_t *params);
+int32_t clearGeofencesCommand(commandParamsList_t *params);
+
+// the motion state from the accelerometer, for the adaptive reporting
+motionState_t getMotionState(void);
+
+// fixes back to back for the drive test, instead of every dwell period
+void startLocationStream(void);
+void stopLocationStream(void);
+bool pollLocationStream(uLocation_t *pLocation, int64_t *pFixMs);
 
 /* ----------------------------------------------------------------
  * QUEUE MESSAGE TYPE DEFINITIONS
@@ -50,6 +70,7 @@ typedef struct {
 
     union {
         const char *topicName;      // topic name to publish to
+        bool publishLocation;       // publish the location even if there are geofences
     } msg;
 } locationMsg_t;
 
@@ -23,6 +23,9 @@
 #include "common.h"
 #include "taskControl.h"
 #include "mqttTask.h"
+#include "taskProfile.h"
+#include "measurement.h"
+#include "dataBudget.h"
 
 /* ----------------------------------------------------------------
  * DEFINES
@@ -34,6 +37,15 @@
 #define MQTT_QUEUE_PRIORITY 5
 #define MQTT_QUEUE_SIZE 10
 
+// Room left in the queue for the other tasks by waitForMQTTQueueSpace(),
+// and how often it checks for room
+#define MQTT_QUEUE_RESERVE 2
+#define MQTT_QUEUE_POLL_MS 100
+
+// Messages held while publishing is deferred, the oldest are dropped
+// when it is full
+#define MQTT_DEFERRED_SIZE 32
+
 #define STRCOPYTO(x, y)         (failed ? true : ((x = uStrDup(y))==NULL) ? true : false)
 #define MEMCOPYTO(x, y, len)    (failed ? true : ((x = uMemDup(y, len))==NULL) ? true : false)
 
@@ -45,10 +57,27 @@
 
 #define MAX_TOPIC_CALLBACKS 50
 
+#define MEASUREMENT_JSON_SIZE 400
+
 #define TEMP_TOPIC_NAME_SIZE 150
 
+// Fallback wait times, the task is woken by wakeTask() when
+// the network becomes available or a downlink message arrives
+#define MQTT_NETWORK_WAIT_MS 30000
+#define MQTT_RETRY_WAIT_MS 5000
+
 #define MQTT_TYPE_NAME (mqttSN ? "MQTT-SN Gateway" : "MQTT Broker")
 
+#define DATA_USAGE_TOPIC "DataUsage"
+#define DATA_USAGE_JSON_SIZE 800
+
+// The estimated protocol overhead of a publish, for the data usage: the
+// MQTT PUBLISH header, topic and packet ID over TCP/IP (and a TLS record),
+// or the MQTT-SN PUBLISH header over UDP/IP
+#define TCP_IP_HEADER_SIZE 40
+#define TLS_RECORD_OVERHEAD 29
+#define MQTT_SN_PUBLISH_OVERHEAD (7 + 28)
+
 /* ----------------------------------------------------------------
  * COMMON TASK VARIABLES
  * -------------------------------------------------------------- */
@@ -80,6 +109,16 @@ static uMqttClientContext_t *pContext = NULL;
 static uSecurityTlsSettings_t tlsSettings = U_SECURITY_TLS_SETTINGS_DEFAULT;
 static uSecurityTlsCipherSuites_t cipherSuites;
 
+// copies of the connection and TLS configuration, which the client holds
+// on to while a commit can replace the configuration values
+static char brokerName[CONFIG_VALUE_SIZE];
+static char userName[CONFIG_VALUE_SIZE];
+static char password[CONFIG_VALUE_SIZE];
+static char clientId[CONFIG_VALUE_SIZE];
+static char clientCertName[CONFIG_VALUE_SIZE];
+static char clientKeyName[CONFIG_VALUE_SIZE];
+static char serverNameInd[CONFIG_VALUE_SIZE];
+
 static int32_t messagesToRead = 0;
 static char topicString[MAX_TOPIC_SIZE];
 static char *downlinkMessage;
@@ -87,11 +126,44 @@ static char *downlinkMessage;
 static int32_t topicCallbackCount = 0;
 static topicCallback_t *topicCallbackRegister[MAX_TOPIC_CALLBACKS];
 
-static char tempTopicName[TEMP_TOPIC_NAME_SIZE];
-
 static bool mqttSN = false;
 static mqttSNTopicNameNode_t *mqttSNTopicNameList = NULL;
 
+// Set when a committed configuration has changed the MQTT or security settings
+static bool reloadConfig = false;
+
+// The client was opened with TLS, for the data usage
+static bool tlsEnabled = false;
+
+static char dataUsageTopicName[MAX_TOPIC_NAME_SIZE];
+static char dataUsageJson[DATA_USAGE_JSON_SIZE];
+
+// Protects the client context while it is being re-opened
+static uPortMutexHandle_t clientMutex = NULL;
+
+// Subscriptions waiting for the MQTT client to be connected.
+// These are subscribed by the MQTT task itself once it is connected.
+static int32_t pendingSubscriptionCount = 0;
+static topicCallback_t *pendingSubscriptions[MAX_TOPIC_CALLBACKS];
+static uPortMutexHandle_t subscriptionMutex = NULL;
+
+// Messages sent while the modem is busy with a long running command, like
+// a network scan, which are queued to be published when it has finished
+static bool publishDeferred = false;
+static mqttMsg_t deferredMessages[MQTT_DEFERRED_SIZE];
+static int32_t deferredFirst = 0;
+static int32_t deferredCount = 0;
+static uPortMutexHandle_t deferredMutex = NULL;
+
+/* ----------------------------------------------------------------
+ * FUNCTION DECLARATIONS
+ * -------------------------------------------------------------- */
+static void reloadMQTTClient(void);
+static void subscribePendingTopics(void);
+static void freePendingSubscriptions(void);
+static void freeMQTTMessage(sendMQTTMsg_t *msg);
+static void dropMQTTMessage(sendMQTTMsg_t *msg);
+
 /* ----------------------------------------------------------------
  * STATIC FUNCTIONS
  * -------------------------------------------------------------- */
@@ -101,15 +173,49 @@ static bool isNotExiting(void)
     return !gExitApp && !exitTask;
 }
 
+/// @brief Estimates the bytes a publish adds to the payload on the link
+/// @param topicLength The length of the topic name
+/// @param payloadLength The length of the message
+/// @param QoS The QoS, a packet ID is added above QoS 0
+/// @return The estimated overhead in bytes
+static size_t getPublishOverhead(size_t topicLength, size_t payloadLength, uMqttQos_t QoS)
+{
+    if (mqttSN)
+        return MQTT_SN_PUBLISH_OVERHEAD;
+
+    // the remaining length is 1 to 4 bytes, 7 bits in each
+    size_t variableLength = 2 + topicLength + (QoS != U_MQTT_QOS_AT_MOST_ONCE ? 2 : 0);
+    size_t remainingLength = variableLength + payloadLength;
+    size_t fixedHeaderLength = 1 + (remainingLength < 128 ? 1 : remainingLength < 16384 ? 2 : 3);
+
+    return fixedHeaderLength + variableLength + TCP_IP_HEADER_SIZE + (tlsEnabled ? TLS_RECORD_OVERHEAD : 0);
+}
+
+/// @brief Finds the topic name of an MQTT-SN short name, for the data usage
+static const char *getSNTopicNameOf(const uMqttSnTopicName_t *snShortName)
+{
+    for(mqttSNTopicNameNode_t *node = mqttSNTopicNameList; node != NULL; node = node->next) {
+        if (memcmp(node->snShortName, snShortName, sizeof(uMqttSnTopicName_t)) == 0)
+            return node->topicName;
+    }
+
+    return "MQTT-SN";
+}
+
 /// @brief Send an MQTT Message - remember to FREE the msg memory!!!!
 /// @param msg The message to send.
 static void mqttSendMessage(sendMQTTMsg_t msg)
 {
-    if (!isNotExiting()) return;
+    if (!isNotExiting()) {
+        dropMQTTMessage(&msg);
+        return;
+    }
 
     int32_t errorCode = U_ERROR_COMMON_NOT_INITIALISED;
+    bool mqttConnected;
 
-    bool mqttConnected = uMqttClientIsConnected(pContext);
+    U_PORT_MUTEX_LOCK(clientMutex);
+    mqttConnected = uMqttClientIsConnected(pContext);
     if (pContext != NULL && mqttConnected && IS_NETWORK_AVAILABLE) {
         if (mqttSN) {
             errorCode = uMqttClientSnPublish(pContext, msg.topic.pShortName, msg.pMessage,
@@ -125,6 +231,10 @@ static void mqttSendMessage(sendMQTTMsg_t msg)
 
         if (errorCode == 0) {
             writeDebug("Published MQTT message");
+
+            const char *pTopicName = mqttSN ? getSNTopicNameOf(msg.topic.pShortName) : msg.topic.pTopicName;
+            size_t length = strlen(msg.pMessage);
+            recordDataUsage(pTopicName, length + getPublishOverhead(strlen(pTopicName), length, msg.QoS));
         } else {
             int32_t errValue = uMqttClientGetLastErrorCode(pContext);
             writeWarn("Failed to publish MQTT message, %s error: ", errValue);
@@ -134,13 +244,90 @@ static void mqttSendMessage(sendMQTTMsg_t msg)
         writeWarn("Network or MQTT connection not available, not publishing message");
     }
 
+    U_PORT_MUTEX_UNLOCK(clientMutex);
+
     gAppStatus = mqttConnected ? MQTT_CONNECTED : MQTT_DISCONNECTED;
 
-    uPortFree(msg.pMessage);
-    if (mqttSN)
-        uPortFree(msg.topic.pShortName);
+    if (errorCode == 0)
+        freeMQTTMessage(&msg);
     else
-        uPortFree(msg.topic.pTopicName);
+        dropMQTTMessage(&msg);
+}
+
+/// @brief Frees the memory of a message which was copied for the queue
+/// @param msg The message to free
+static void freeMQTTMessage(sendMQTTMsg_t *msg)
+{
+    if (mqttSN) {
+        uPortFree(msg->topic.pShortName);
+        msg->topic.pShortName = NULL;
+    } else {
+        uPortFree(msg->topic.pTopicName);
+        msg->topic.pTopicName = NULL;
+    }
+
+    uPortFree(msg->pMessage);
+    msg->pMessage = NULL;
+}
+
+/// @brief Frees a message which won't be published, and gives its bytes
+/// back to the data budget
+/// @param msg The message to drop
+static void dropMQTTMessage(sendMQTTMsg_t *msg)
+{
+    refundDataBudget(msg->budgetBytes);
+    msg->budgetBytes = 0;
+
+    freeMQTTMessage(msg);
+}
+
+/// @brief Holds a message until publishing is no longer deferred
+/// @param qMsg The queue message, which now belongs to the deferred queue
+static void deferMessage(mqttMsg_t *qMsg)
+{
+    U_PORT_MUTEX_LOCK(deferredMutex);
+
+    if (deferredCount == MQTT_DEFERRED_SIZE) {
+        writeWarn("Deferred MQTT messages full, dropping the oldest message");
+        dropMQTTMessage(&deferredMessages[deferredFirst].msg.message);
+        deferredFirst = (deferredFirst + 1) % MQTT_DEFERRED_SIZE;
+        deferredCount--;
+    }
+
+    deferredMessages[(deferredFirst + deferredCount) % MQTT_DEFERRED_SIZE] = *qMsg;
+    deferredCount++;
+
+    U_PORT_MUTEX_UNLOCK(deferredMutex);
+}
+
+/// @brief Queues the deferred messages for publishing, in the order they
+/// were sent. This waits for room in the queue rather than dropping them.
+static void flushDeferredMessages(void)
+{
+    int32_t flushed = 0;
+    int32_t dropped = 0;
+
+    U_PORT_MUTEX_LOCK(deferredMutex);
+
+    while (deferredCount > 0) {
+        mqttMsg_t *qMsg = &deferredMessages[deferredFirst];
+        qMsg->queuedCycles = k_cycle_get_32();
+
+        if (isNotExiting() && uPortEventQueueSend(TASK_QUEUE, qMsg, sizeof(mqttMsg_t)) == 0) {
+            flushed++;
+        } else {
+            dropMQTTMessage(&qMsg->msg.message);
+            dropped++;
+        }
+
+        deferredFirst = (deferredFirst + 1) % MQTT_DEFERRED_SIZE;
+        deferredCount--;
+    }
+
+    U_PORT_MUTEX_UNLOCK(deferredMutex);
+
+    if (flushed > 0 || dropped > 0)
+        writeLog("Published %d deferred MQTT message(s), %d dropped", flushed, dropped);
 }
 
 static void queueHandler(void *pParam, size_t paramLengthBytes)
@@ -149,6 +336,9 @@ static void queueHandler(void *pParam, size_t paramLengthBytes)
 
     mqttMsg_t *qMsg = (mqttMsg_t *) pParam;
 
+    uint32_t startCycles = k_cycle_get_32();
+    uint64_t startThreadCycles = getThreadCycles();
+
     switch(qMsg->msgType) {
         case SEND_MQTT_MESSAGE:
             mqttSendMessage(qMsg->msg.message);
@@ -158,6 +348,11 @@ static void queueHandler(void *pParam, size_t paramLengthBytes)
             writeLog("Unknown message type: %d", qMsg->msgType);
             break;
     }
+
+    recordTaskJob(TASK_NAME,
+                (uint32_t)k_cyc_to_us_floor64(startCycles - qMsg->queuedCycles),
+                (uint32_t)k_cyc_to_us_floor64(k_cycle_get_32() - startCycles),
+                (uint32_t)k_cyc_to_us_floor64(getThreadCycles() - startThreadCycles));
 }
 
 static void disconnectCallback(int32_t errorCode, void *param)
@@ -172,6 +367,7 @@ static void downlinkMessageCallback(int32_t msgCount, void *param)
 {
     printDebug("Got a downlink MQTT message notification: %d", msgCount);
     messagesToRead = msgCount;
+    wakeTask(MQTT_TASK);
 }
 
 static int32_t connectBroker(void)
@@ -179,10 +375,10 @@ static int32_t connectBroker(void)
     gAppStatus = MQTT_CONNECTING;
 
     uMqttClientConnection_t connection = U_MQTT_CLIENT_CONNECTION_DEFAULT;
-    connection.pBrokerNameStr = getConfig("MQTT_BROKER_NAME");
-    connection.pUserNameStr = getConfig("MQTT_USERNAME");
-    connection.pPasswordStr = getConfig("MQTT_PASSWORD");
-    connection.pClientIdStr = getConfig("MQTT_CLIENTID");
+    connection.pBrokerNameStr = getConfig("MQTT_BROKER_NAME", brokerName, sizeof(brokerName));
+    connection.pUserNameStr = getConfig("MQTT_USERNAME", userName, sizeof(userName));
+    connection.pPasswordStr = getConfig("MQTT_PASSWORD", password, sizeof(password));
+    connection.pClientIdStr = getConfig("MQTT_CLIENTID", clientId, sizeof(clientId));
 
     setBoolParamFromConfig("MQTT_TYPE", "MQTT-SN", &mqttSN);
     connection.mqttSn = mqttSN;
@@ -212,6 +408,7 @@ static int32_t connectBroker(void)
 
     writeLog("Connected to %s", MQTT_TYPE_NAME);
     gAppStatus = MQTT_CONNECTED;
+    startDataUsageSession();
 
     return 0;
 }
@@ -233,7 +430,16 @@ static int32_t disconnectBroker(void)
 /// @return True if we can keep dwelling, false otherwise
 static bool continueToDwell(void)
 {
-    return isNotExiting() && (messagesToRead == 0);
+    return isNotExiting() && (messagesToRead == 0) && !reloadConfig &&
+                (pendingSubscriptionCount == 0);
+}
+
+/// @brief Configuration changed callback for the MQTT_ and SECURITY_ keys
+static void configChanged(void)
+{
+    writeLog("MQTT configuration has changed, the client will reconnect");
+    reloadConfig = true;
+    wakeTask(MQTT_TASK);
 }
 
 static void freeCallbacks(void)
@@ -254,6 +460,20 @@ static void freeCallbacks(void)
     }
 }
 
+static void freeSNTopicNames(void)
+{
+    mqttSNTopicNameNode_t *node = mqttSNTopicNameList;
+    mqttSNTopicNameList = NULL;
+
+    while(node != NULL) {
+        mqttSNTopicNameNode_t *next = node->next;
+        uPortFree(node->topicName);
+        uPortFree(node->snShortName);
+        uPortFree(node);
+        node = next;
+    }
+}
+
 static bool getTopicNameFromSnTopicId(uint16_t id, char *topicName)
 {
     for(int i=0; i<topicCallbackCount; i++) {
@@ -379,17 +599,27 @@ static void taskLoop(void *pParameters)
     U_PORT_MUTEX_LOCK(TASK_MUTEX);
     while(isNotExiting())
     {
-        if (!uMqttClientIsConnected(pContext)) {
+        if (reloadConfig)
+            reloadMQTTClient();
+
+        if (pContext == NULL) {
+            // the client failed to re-open with the new configuration
+            waitForTaskEvent(taskConfig, MQTT_RETRY_WAIT_MS);
+            reloadConfig = true;
+        } else if (!uMqttClientIsConnected(pContext)) {
             gAppStatus = MQTT_DISCONNECTED;
             if (IS_NETWORK_AVAILABLE) {
                 writeLog("MQTT client disconnected, trying to connect...");
                 if (connectBroker() != U_ERROR_COMMON_SUCCESS)
-                    uPortTaskBlock(5000);
+                    waitForTaskEvent(taskConfig, MQTT_RETRY_WAIT_MS);
             } else {
                 writeDebug("Can't connect to %s, network is still not available...", MQTT_TYPE_NAME);
-                uPortTaskBlock(2000);
+                waitForTaskEvent(taskConfig, MQTT_NETWORK_WAIT_MS);
             }
         } else {
+            if (pendingSubscriptionCount > 0)
+                subscribePendingTopics();
+
             if (messagesToRead > 0)
                 readMessages();
 
@@ -398,10 +628,14 @@ static void taskLoop(void *pParameters)
     }
 
     // Application exiting, so disconnect from MQTT broker/SN gateway...
-    disconnectBroker();
-    uMqttClientClose(pContext);
+    if (pContext != NULL) {
+        disconnectBroker();
+        uMqttClientClose(pContext);
+    }
 
     freeCallbacks();
+    freePendingSubscriptions();
+    flushDeferredMessages();
     uPortFree(downlinkMessage);
     downlinkMessage = NULL;
 
@@ -432,6 +666,45 @@ static int32_t initMutex()
     INIT_MUTEX;
 }
 
+static int32_t initDeferredMutex()
+{
+    int32_t errorCode = uPortMutexCreate(&deferredMutex);
+    if (errorCode != 0) {
+        writeFatal("Failed to create %s deferred messages Mutex (%d).", TASK_NAME, errorCode);
+    }
+
+    return errorCode;
+}
+
+/// @brief The MQTT measurement sink, which publishes each measurement as
+/// JSON on its topic. Events are sent at least once.
+static void measurementSink(const measurement_t *pMeasurement)
+{
+    static char json[MEASUREMENT_JSON_SIZE];
+
+    if (pMeasurement->pTopicName == NULL || getMeasurementTransport(pMeasurement) != TRANSPORT_MQTT)
+        return;
+
+    if (formatMeasurementJson(pMeasurement, json, sizeof(json)) < 0) {
+        writeError("%s measurement too large for the MQTT message buffer", pMeasurement->pSource);
+        return;
+    }
+
+    sendMQTTMessage(pMeasurement->pTopicName, json,
+                    pMeasurement->reliable ? U_MQTT_QOS_AT_LEAST_ONCE : U_MQTT_QOS_AT_MOST_ONCE,
+                    false);
+}
+
+static int32_t initClientMutex()
+{
+    int32_t errorCode = uPortMutexCreate(&clientMutex);
+    if (errorCode != 0) {
+        writeFatal("Failed to create %s client Mutex (%d).", TASK_NAME, errorCode);
+    }
+
+    return errorCode;
+}
+
 /// @brief Register a callback based on the topic of the message
 /// @param topicName The topic of interest
 /// @param callbackFunction The callback functaion to call when we received a message
@@ -475,44 +748,15 @@ static int32_t registerTopicCallBack(topicCallback_t *topicCallback)
     return U_ERROR_COMMON_SUCCESS;
 }
 
-static void subscribeToTopic(void *pParam)
+static void freeTopicCallback(topicCallback_t *topicCallback)
 {
-    topicCallback_t *topicCallback = (topicCallback_t *)pParam;
-
-    printDebug("Subscribing to topic '%s'...", topicCallback->topicName);
-
-    // wait until the MQTT has been initialised...
-    while(!TASK_INITIALISED && !gExitApp) {
-        printDebug("Waiting for MQTT Task to be initialised...");
-        uPortTaskBlock(500);
-    }
-
-    // wait until the MQTT Task is up and running...
-    while(!isMutexLocked(TASK_MUTEX) && !gExitApp) {
-        printDebug("Waiting for MQTT Task to start...");
-        uPortTaskBlock(500);
-    }
-
-    printDebug("Finished waiting for MQTT task to start...");
-
-    // the MQTT task is running, but we might not be connected yet so this can fail
-    // U_ERROR_COMMON_NOT_INITIALISED is the error if the MQTT client isn't connected yet.
-    int32_t errorCode = U_ERROR_COMMON_NOT_INITIALISED;
-    while(errorCode == U_ERROR_COMMON_NOT_INITIALISED && !gExitApp) {
-        errorCode = registerTopicCallBack(topicCallback);
-        if(errorCode == U_ERROR_COMMON_NOT_INITIALISED) {
-            printDebug("Still waiting to subscribe to %s topic");
-            uPortTaskBlock(5000);
-        }
-    }
-
-    if (errorCode != 0 ) {
-        if (!gExitApp)
-            writeError("Subscribing a callback to topic %s failed with error code %d", topicCallback->topicName, errorCode);
-    
-        goto cleanUp;
-    }
+    uPortFree(topicCallback->topicName);
+    uPortFree(topicCallback->snShortName);
+    uPortFree(topicCallback);
+}
 
+static void printSubscribedCommands(topicCallback_t *topicCallback)
+{
     writeLog("Subscribed to callback topic: %s", topicCallback->topicName);
     if (topicCallback->numCallbacks > 0) {
         printLog("With these commands:");
@@ -522,9 +766,51 @@ static void subscribeToTopic(void *pParam)
     } else {
         printWarn("Warning - there are no commands to listen to on this subscription!");
     }
+}
 
-cleanUp:
-    uPortTaskDelete(NULL);
+/// @brief Subscribes the topics which were requested before the
+/// MQTT client was connected. Called from the MQTT task loop only.
+static void subscribePendingTopics(void)
+{
+    int32_t remaining = 0;
+
+    U_PORT_MUTEX_LOCK(subscriptionMutex);
+
+    for(int i=0; i<pendingSubscriptionCount; i++) {
+        topicCallback_t *topicCallback = pendingSubscriptions[i];
+
+        printDebug("Subscribing to topic '%s'...", topicCallback->topicName);
+
+        // U_ERROR_COMMON_NOT_INITIALISED is the error if the MQTT client
+        // isn't connected, so keep it pending until we are connected again
+        int32_t errorCode = registerTopicCallBack(topicCallback);
+        if (errorCode == U_ERROR_COMMON_NOT_INITIALISED) {
+            pendingSubscriptions[remaining++] = topicCallback;
+        } else if (errorCode != 0) {
+            writeError("Subscribing a callback to topic %s failed with error code %d", topicCallback->topicName, errorCode);
+            freeTopicCallback(topicCallback);
+        } else {
+            printSubscribedCommands(topicCallback);
+        }
+    }
+
+    pendingSubscriptionCount = remaining;
+
+    U_PORT_MUTEX_UNLOCK(subscriptionMutex);
+}
+
+static void freePendingSubscriptions(void)
+{
+    U_PORT_MUTEX_LOCK(subscriptionMutex);
+
+    for(int i=0; i<pendingSubscriptionCount; i++) {
+        freeTopicCallback(pendingSubscriptions[i]);
+        pendingSubscriptions[i] = NULL;
+    }
+
+    pendingSubscriptionCount = 0;
+
+    U_PORT_MUTEX_UNLOCK(subscriptionMutex);
 }
 
 static int32_t registerSNShortName(const char *topicName, uMqttSnTopicName_t **snShortName)
@@ -624,42 +910,104 @@ static void setSecuritySettings(void)
     }
     tlsSettings.cipherSuites = cipherSuites;
     
-    const char *client_name = getConfig("SECURITY_CLIENT_NAME");
-    tlsSettings.pClientCertificateName = client_name;
-
-    const char *client_key = getConfig("SECURITY_CLIENT_KEY");
-    tlsSettings.pClientPrivateKeyName = client_key;
-    
-    const char *server_name_ind = getConfig("SECURITY_SERVER_NAME_IND");
-    tlsSettings.pSni = server_name_ind;
+    tlsSettings.pClientCertificateName = getConfig("SECURITY_CLIENT_NAME", clientCertName, sizeof(clientCertName));
+    tlsSettings.pClientPrivateKeyName = getConfig("SECURITY_CLIENT_KEY", clientKeyName, sizeof(clientKeyName));
+    tlsSettings.pSni = getConfig("SECURITY_SERVER_NAME_IND", serverNameInd, sizeof(serverNameInd));
 }
 
-static int32_t initMQTTClient(void)
+static int32_t openMQTTClient(void)
 {
-    int32_t errorCode = U_ERROR_COMMON_SUCCESS;
-
-    downlinkMessage = pUPortMalloc(MAX_MESSAGE_SIZE);
-    if (downlinkMessage == NULL) {
-        writeFatal("Failed to allocate MQTT downlink message buffer");
-        errorCode = U_ERROR_COMMON_NO_MEMORY;
-        goto cleanUp;
-    }
-
     bool security = false;
     setBoolParamFromConfig("MQTT_SECURITY", "TRUE", &security);
+    tlsEnabled = security;
     if (security) {
         setSecuritySettings();
         pContext = pUMqttClientOpen(gDeviceHandle, &tlsSettings);
     }
     else
         pContext = pUMqttClientOpen(gDeviceHandle, NULL);
-    
+
     if (pContext == NULL) {
         writeFatal("Failed to open the MQTT client");
-        errorCode = U_ERROR_COMMON_NOT_RESPONDING;
+        return U_ERROR_COMMON_NOT_RESPONDING;
+    }
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Subscribes the registered topics again, after the client has
+/// been re-opened with a new configuration
+static void resubscribeTopics(void)
+{
+    for(int i=0; i<topicCallbackCount; i++) {
+        topicCallback_t *topicCallback = topicCallbackRegister[i];
+        int32_t errorCode;
+
+        if (mqttSN) {
+            if (topicCallback->snShortName == NULL) {
+                topicCallback->snShortName = (uMqttSnTopicName_t *)pUPortMalloc(sizeof(uMqttSnTopicName_t));
+                if (topicCallback->snShortName == NULL) {
+                    writeError("resubscribeTopics(): snShortName memory allocation");
+                    continue;
+                }
+            }
+
+            errorCode = uMqttClientSnSubscribeNormalTopic(pContext, topicCallback->topicName,
+                                                                    topicCallback->qos,
+                                                                    topicCallback->snShortName);
+        } else {
+            errorCode = uMqttClientSubscribe(pContext, topicCallback->topicName, topicCallback->qos);
+        }
+
+        if (errorCode < 0)
+            writeWarn("Failed to re-subscribe to topic %s: %d", topicCallback->topicName, errorCode);
+    }
+}
+
+/// @brief Closes the MQTT client and opens it again with the new
+/// configuration, then reconnects and re-subscribes the topics
+static void reloadMQTTClient(void)
+{
+    int32_t errorCode;
+    reloadConfig = false;
+
+    U_PORT_MUTEX_LOCK(clientMutex);
+
+    if (pContext != NULL) {
+        if (uMqttClientIsConnected(pContext))
+            disconnectBroker();
+
+        uMqttClientClose(pContext);
+        pContext = NULL;
+    }
+
+    // MQTT-SN short names belong to the old gateway connection
+    freeSNTopicNames();
+
+    errorCode = openMQTTClient();
+
+    U_PORT_MUTEX_UNLOCK(clientMutex);
+
+    if (errorCode < 0)
+        return;
+
+    if (IS_NETWORK_AVAILABLE && connectBroker() == U_ERROR_COMMON_SUCCESS)
+        resubscribeTopics();
+}
+
+static int32_t initMQTTClient(void)
+{
+    int32_t errorCode = U_ERROR_COMMON_SUCCESS;
+
+    downlinkMessage = pUPortMalloc(MAX_MESSAGE_SIZE);
+    if (downlinkMessage == NULL) {
+        writeFatal("Failed to allocate MQTT downlink message buffer");
+        errorCode = U_ERROR_COMMON_NO_MEMORY;
         goto cleanUp;
     }
 
+    errorCode = openMQTTClient();
+
 cleanUp:
     if (errorCode != 0) {
         uPortFree(downlinkMessage);
@@ -673,17 +1021,40 @@ cleanUp:
  * PUBLIC FUNCTIONS
  * -------------------------------------------------------------- */
 
-/// @brief Subscribes a callback function to a topic, waiting for the MQTT task to be online first
+/// @brief Creates the subscription mutex. The tasks subscribe from their
+/// initialisation, which runs in parallel and can be before the MQTT task
+/// is initialised, so this is done by startupFramework() before any task.
+/// @return 0 on success, negative on failure
+int32_t initMQTTSubscriptions(void)
+{
+    if (subscriptionMutex != NULL)
+        return U_ERROR_COMMON_SUCCESS;
+
+    int32_t errorCode = uPortMutexCreate(&subscriptionMutex);
+    if (errorCode != 0) {
+        writeFatal("Failed to create MQTT subscription Mutex (%d).", errorCode);
+    }
+
+    return errorCode;
+}
+
+/// @brief Subscribes a callback function to a topic. The subscription is
+/// made by the MQTT task as soon as the MQTT client is connected.
 /// @param taskTopicName The topic name to subscribe to. Appends the serial number
 /// @param qos The Quality of Service to use for the subscription
 /// @param callbacks The callbacks this topic is going to be used for
 int32_t subscribeToTopicAsync(const char *taskTopicName, uMqttQos_t qos, callbackCommand_t *callbacks, int32_t numCallbacks)
 {
     int32_t errorCode = U_ERROR_COMMON_SUCCESS;
-    uPortTaskHandle_t handle;
     topicCallback_t *topicCallbackInfo = NULL;
     char *topicName = NULL;
 
+    // the tasks subscribe in parallel as they are initialised
+    char tempTopicName[TEMP_TOPIC_NAME_SIZE];
+
+    if (subscriptionMutex == NULL)
+        return U_ERROR_COMMON_NOT_INITIALISED;
+
     topicCallbackInfo = (topicCallback_t *) pUPortMalloc(sizeof(topicCallback_t));
     if (topicCallbackInfo == NULL) {
         writeError("Failed to create topicCallback - not enough memory");
@@ -700,16 +1071,30 @@ int32_t subscribeToTopicAsync(const char *taskTopicName, uMqttQos_t qos, callbac
     }
 
     topicCallbackInfo->topicName = topicName;
+    topicCallbackInfo->snShortName = NULL;
     topicCallbackInfo->qos = qos;
     topicCallbackInfo->numCallbacks = numCallbacks;
     topicCallbackInfo->callbacks = callbacks;
 
-    errorCode = uPortTaskCreate(subscribeToTopic, NULL, 2048, (void *)topicCallbackInfo, 5, &handle);
+    U_PORT_MUTEX_LOCK(subscriptionMutex);
+    if (pendingSubscriptionCount < MAX_TOPIC_CALLBACKS) {
+        pendingSubscriptions[pendingSubscriptionCount] = topicCallbackInfo;
+        pendingSubscriptionCount++;
+    } else {
+        errorCode = U_ERROR_COMMON_NO_MEMORY;
+    }
+    U_PORT_MUTEX_UNLOCK(subscriptionMutex);
+
     if (errorCode != 0) {
         writeError("Can't start topic subscription on %s: %d", taskTopicName, errorCode);
         goto cleanUp;
     }
 
+    printDebug("Subscription to topic '%s' is pending...", topicName);
+
+    // the MQTT task will subscribe straight away if it is connected
+    wakeTask(MQTT_TASK);
+
 cleanUp:
     if (errorCode != 0) {
         uPortFree(topicCallbackInfo);
@@ -748,16 +1133,27 @@ int32_t sendMQTTMessage(const char *pTopicName, const char *pMessage, uMqttQos_t
 
     if (!isNotExiting()) return U_ERROR_COMMON_BUSY;
 
+    // the periodic telemetry is sent at QoS 0, and is dropped when the
+    // data budget runs low
+    size_t length = strlen(pMessage);
+    size_t bytes = length + getPublishOverhead(strlen(pTopicName), length, QoS);
+    if (!requestDataBudget(bytes, QoS == U_MQTT_QOS_AT_MOST_ONCE ? BUDGET_PRIORITY_LOW : BUDGET_PRIORITY_HIGH)) {
+        writeDebug("Not publishing MQTT message on %s, data budget low", pTopicName);
+        return U_ERROR_COMMON_TEMPORARY_FAILURE;
+    }
+
     int32_t errorCode = U_ERROR_COMMON_SUCCESS;
 
     mqttMsg_t qMsg;
     qMsg.msgType = SEND_MQTT_MESSAGE;
+    qMsg.queuedCycles = k_cycle_get_32();
 
     bool failed = false;
     failed = STRCOPYTO(qMsg.msg.message.pMessage, pMessage);
     if (!failed && mqttSN) {
         uMqttSnTopicName_t *snShortName;
-        if (getMqttSNTopicName(pTopicName, &snShortName) < 0) {
+        errorCode = getMqttSNTopicName(pTopicName, &snShortName);
+        if (errorCode < 0) {
             writeError("Not publishing MQTT-SN message, failed to get/register MQTT-SN Topic Name.");
             goto cleanUp;
         }
@@ -775,6 +1171,12 @@ int32_t sendMQTTMessage(const char *pTopicName, const char *pMessage, uMqttQos_t
 
     qMsg.msg.message.QoS = QoS;
     qMsg.msg.message.retain = retain;
+    qMsg.msg.message.budgetBytes = bytes;
+
+    if (publishDeferred) {
+        deferMessage(&qMsg);
+        return U_ERROR_COMMON_SUCCESS;
+    }
 
     errorCode = uPortEventQueueSendIrq(TASK_QUEUE, &qMsg, sizeof(mqttMsg_t));
     if (errorCode != 0) {
@@ -784,21 +1186,49 @@ int32_t sendMQTTMessage(const char *pTopicName, const char *pMessage, uMqttQos_t
 
 cleanUp:
     if (errorCode != 0) {
-        if (mqttSN) {
-            uPortFree(qMsg.msg.message.topic.pShortName);
-            qMsg.msg.message.topic.pShortName = NULL;
-        } else {
-            uPortFree(qMsg.msg.message.topic.pTopicName);
-            qMsg.msg.message.topic.pTopicName = NULL;
-        }
-
-        uPortFree(qMsg.msg.message.pMessage);
-        qMsg.msg.message.pMessage = NULL;
+        freeMQTTMessage(&qMsg.msg.message);
+        refundDataBudget(bytes);
     }
 
     return errorCode;
 }
 
+/// @brief Waits for room in the MQTT publish queue, so a job publishing a
+/// burst of messages doesn't fill it. Some room is always left for the
+/// other tasks, and the wait carries on while publishing is deferred.
+/// @param timeoutMs The longest time to wait
+/// @return true if there is room, false on timeout or exit
+bool waitForMQTTQueueSpace(int32_t timeoutMs)
+{
+    int64_t startMs = uPortGetTickTimeMs();
+
+    while (isNotExiting() && TASK_QUEUE >= 0) {
+        if (!publishDeferred && uPortEventQueueGetFree(TASK_QUEUE) > MQTT_QUEUE_RESERVE)
+            return true;
+
+        if (uPortGetTickTimeMs() - startMs >= timeoutMs)
+            break;
+
+        uPortTaskBlock(MQTT_QUEUE_POLL_MS);
+    }
+
+    return false;
+}
+
+/// @brief Defers publishing messages while the modem is busy with a long
+/// running command. Messages sent meanwhile are held, and are published in
+/// order when publishing is no longer deferred.
+/// @param defer true to hold the messages, false to publish them
+void setMQTTPublishDeferred(bool defer)
+{
+    if (deferredMutex == NULL)
+        return;
+
+    publishDeferred = defer;
+    if (!defer)
+        flushDeferredMessages();
+}
+
 /// @brief Initialises the MQTT task
 /// @param config The task configuration structure
 /// @return zero if successful, a negative number otherwise
@@ -812,9 +1242,16 @@ int32_t initMQTTTask(taskConfig_t *config)
 
     writeLog("Initializing the %s task...", TASK_NAME);
     EXIT_ON_FAILURE(initMutex);
+    EXIT_ON_FAILURE(initClientMutex);
+    EXIT_ON_FAILURE(initDeferredMutex);
     EXIT_ON_FAILURE(initQueue);
     EXIT_ON_FAILURE(initMQTTClient);
 
+    registerConfigChangedCallback("MQTT_", configChanged);
+    registerConfigChangedCallback("SECURITY_", configChanged);
+
+    registerMeasurementSink(TASK_NAME, measurementSink);
+
     return result;
 }
 
@@ -843,3 +1280,20 @@ int32_t stopMQTTTaskLoop(commandParamsList_t *params)
 {
     STOP_TASK;
 }
+
+/// @brief Publishes the uplink data usage on the <IMEI>/DataUsage topic
+/// @param params not used
+/// @return 0 on success, negative on failure
+int32_t publishDataUsage(commandParamsList_t *params)
+{
+    if (formatDataUsageJson(dataUsageJson, sizeof(dataUsageJson)) < 0) {
+        writeError("Data usage too large for the message buffer");
+        return U_ERROR_COMMON_NO_MEMORY;
+    }
+
+    writeLog("Data usage: %s", dataUsageJson);
+
+    snprintf(dataUsageTopicName, MAX_TOPIC_NAME_SIZE, "%s/%s", (const char *)gSerialNumber, DATA_USAGE_TOPIC);
+
+    return sendMQTTMessage(dataUsageTopicName, dataUsageJson, U_MQTT_QOS_AT_LEAST_ONCE, false);
+}
@@ -34,6 +34,18 @@ int32_t stopMQTTTaskLoop(commandParamsList_t *params);
  * -------------------------------------------------------------- */
 int32_t sendMQTTMessage(const char *pTopicName, const char *pMessage, uMqttQos_t QoS, bool retain);
 
+// wait for room in the publish queue before publishing a burst of messages
+bool waitForMQTTQueueSpace(int32_t timeoutMs);
+
+// hold messages while the modem is busy, and publish them afterwards
+void setMQTTPublishDeferred(bool defer);
+
+// publish the uplink data usage on the <IMEI>/DataUsage topic
+int32_t publishDataUsage(commandParamsList_t *params);
+
+// create the subscription list lock, before any task is initialised
+int32_t initMQTTSubscriptions(void);
+
 // subscribe a callback function to a topic
 int32_t subscribeToTopicAsync(const char *taskTopicName, uMqttQos_t qos, callbackCommand_t *callbacks, int32_t numCallbacks);
 
@@ -54,11 +66,13 @@ typedef struct SEND_MQTT_MESSAGE {
     char *pMessage;
     uMqttQos_t QoS;
     bool retain;
+    size_t budgetBytes;         // taken from the data budget, given back if not sent
 } sendMQTTMsg_t;
 
 /// @brief Queue message structure for send any type of message to the MQTT application task
 typedef struct MQTT_QUEUE_MESSAGE {
     mqttMsgType_t msgType;
+    uint32_t queuedCycles;      // cycle count when queued, for the task stats
 
     union {
         sendMQTTMsg_t message;
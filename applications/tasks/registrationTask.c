@@ -25,6 +25,8 @@
 #include "config.h"
 #include "registrationTask.h"
 #include "NTPClient.h"
+#include "radioCache.h"
+#include "cellScanTask.h"
 
 /* ----------------------------------------------------------------
  * DEFINES
@@ -34,9 +36,9 @@
 #define REG_TASK_STACK_SIZE 1024
 #define REG_TASK_PRIORITY 5
 
-#define REG_QUEUE_STACK_SIZE QUEUE_STACK_SIZE_DEFAULT
-#define REG_QUEUE_PRIORITY 5
-#define REG_QUEUE_SIZE 5
+
+// Fallback wait while the application is exiting, STOP_TASK wakes the task
+#define REG_EXIT_WAIT_MS 5000
 
 /* ----------------------------------------------------------------
  * TASK COMMON VARIABLES
@@ -67,6 +69,9 @@ static const uNetworkType_t gNetworkType = U_NETWORK_TYPE_CELL;
 // the UBXLIB uNetworkInterfaceUp() function
 static volatile int32_t networkUpCounter = 0;
 
+// The last registration status from the network status callback
+static uCellNetStatus_t lastCellStatus = U_CELL_NET_STATUS_UNKNOWN;
+
 // This is the list of 'internet restricted' APNs. Normal internet
 // communication on these APNs is not exercised, like requesting
 // the date/time from a NTP service.
@@ -85,35 +90,20 @@ bool gIsNetworkUp = false;
 /// The unix network time, which is retrieved after first registration
 extern int64_t unixNetworkTime;
 
-char pOperatorName[OPERATOR_NAME_SIZE] = "Unknown";
-int32_t operatorMcc = 0;
-int32_t operatorMnc = 0;
-
 /* ----------------------------------------------------------------
  * STATIC FUNCTIONS
  * -------------------------------------------------------------- */
 
-static void clearOperatorInfo(void)
-{
-    strncpy(pOperatorName, "Unknown", OPERATOR_NAME_SIZE);
-    operatorMcc = 0;
-    operatorMnc = 0;
-}
-
 /// @brief check if the application is exiting, or task stopping
 static bool isNotExiting(void)
 {
-    if (!gIsNetworkUp) {
-        clearOperatorInfo();
-    }
-
     return !gExitApp && !exitTask;
 }
 
 // This is here as it needs to be defined before the network cfg cell just below
 static bool keepGoing(void *pParam)
 {
-    if (gAppStatus == COPS_QUERY) {
+    if (isCellScanRunning()) {
         printInfo("Cancelling network scanning, network query requested");
         return false;
     }
@@ -129,22 +119,6 @@ static bool keepGoing(void *pParam)
     return keepGoing;
 }
 
-static int32_t getNetworkInfo(void)
-{
-    // request the PLMN / network operator information
-    int32_t errorCode = uCellNetGetOperatorStr(gDeviceHandle, pOperatorName, OPERATOR_NAME_SIZE);
-    if (errorCode < 0) {
-        writeWarn("Failed to get operator name: %d", errorCode);
-    } else {
-        errorCode = uCellNetGetMccMnc(gDeviceHandle, &operatorMcc, &operatorMnc);
-        if (errorCode < 0) {
-            writeWarn("Failed to get MCC/MNC: %d", errorCode);
-        }
-    }
-
-    return errorCode;
-}
-
 static void networkStatusCallback(uDeviceHandle_t devHandle,
                              uNetworkType_t netType,
                              bool isUp,
@@ -158,6 +132,7 @@ static void networkStatusCallback(uDeviceHandle_t devHandle,
     // count the number of times the network 'goes up'
     if (!gIsNetworkUp && isUp) {
         networkUpCounter++;
+        wakeTask(MQTT_TASK);
     }
 
     gIsNetworkUp = isUp;
@@ -165,7 +140,9 @@ static void networkStatusCallback(uDeviceHandle_t devHandle,
     uCellNetStatus_t cellStatus = (uCellNetStatus_t) pStatus->cell.status;
     if (isUp) {
         gAppStatus = REGISTERED;
-        getNetworkInfo();
+        // only read from the module again if the registration status has
+        // changed, eg home to roaming, as the operator may have changed
+        refreshOperatorInfo(cellStatus != lastCellStatus);
         writeLog("Network is Registered: %s", cellStatus == U_CELL_NET_STATUS_REGISTERED_ROAMING ? "Roaming" : "Home");
     } else {
         if (cellStatus == U_CELL_NET_STATUS_REGISTRATION_DENIED) {
@@ -176,8 +153,10 @@ static void networkStatusCallback(uDeviceHandle_t devHandle,
             writeLog("Network status unknown.");
         }
 
-        clearOperatorInfo();
+        clearRadioSnapshot();
     }
+
+    lastCellStatus = cellStatus;
 }
 
 static bool usingRestrictedAPN(void)
@@ -217,7 +196,7 @@ static void getNetworkOrNTPTime(void)
 
 static int32_t startNetworkRegistration(void)
 {
-    if (gAppStatus == COPS_QUERY) {
+    if (isCellScanRunning()) {
         printInfo("Not brining up the cellular network, running network query.");
         return U_ERROR_COMMON_NOT_SUPPORTED;
     }
@@ -241,9 +220,12 @@ static int32_t startNetworkRegistration(void)
     gIsNetworkUp = true;
     gAppStatus = REGISTERED;
     networkUpCounter=1;
+    wakeTask(MQTT_TASK);
 
-    getNetworkInfo();
-    writeLog("Connected to Cellular Network: %s (%03d%02d)", pOperatorName, operatorMcc, operatorMnc);
+    radioSnapshot_t radio;
+    refreshOperatorInfo(false);
+    getRadioSnapshot(&radio, RADIO_SNAPSHOT_CACHED_ONLY);
+    writeLog("Connected to Cellular Network: %s (%03d%02d)", radio.operatorName, radio.mcc, radio.mnc);
     return 0;
 }
 
@@ -260,6 +242,7 @@ static int32_t deRegisterFromNetwork(void)
     } else {
         writeLog("Deregistered from cellular network");
         gIsNetworkUp = false;
+        clearRadioSnapshot();
     }
 
     return errorCode;
@@ -299,11 +282,11 @@ static void taskLoop(void *pParameters)
             }
 
             dwellTask(taskConfig, isNotExiting);
+        } else {
+            // Just wait here until STOP_TASK wakes us up.
+            // No need to use the dwellTask()
+            waitForTaskEvent(taskConfig, REG_EXIT_WAIT_MS);
         }
-
-        // Just spin the task blocking here.
-        // No need to use the dwellTask()
-        uPortTaskBlock(50);
     }
 
     // we've been asked to exit the Network Manager, so go through
@@ -316,20 +299,10 @@ static void taskLoop(void *pParameters)
 
 static int32_t initQueue()
 {
-    int32_t eventQueueHandle = uPortEventQueueOpen(&queueHandler,
-                    TASK_NAME,
-                    sizeof(registrationMsg_t),
-                    REG_QUEUE_STACK_SIZE,
-                    REG_QUEUE_PRIORITY,
-                    REG_QUEUE_SIZE);
-
-    if (eventQueueHandle < 0) {
-        writeFatal("Failed to create %s event queue %d", TASK_NAME, eventQueueHandle);
-    }
-
-    TASK_QUEUE = eventQueueHandle;
+    // task messages are handled on the shared worker pool
+    TASK_MSG_HANDLER = queueHandler;
 
-    return eventQueueHandle;
+    return U_ERROR_COMMON_SUCCESS;
 }
 
 
@@ -26,6 +26,9 @@
 #include "sensorTask.h"
 #include "mqttTask.h"
 #include "sensors.h"
+#include "deadband.h"
+#include "vibration.h"
+#include "measurement.h"
 
 /* ----------------------------------------------------------------
  * DEFINES
@@ -33,15 +36,14 @@
 #define SENSOR_TOPIC "Sensors"
 #define SENSOR_DWELL_SECONDS 30
 
-// not all tasks will have a task loop if it only uses a queue
-#define SENSOR_TASK_STACK_SIZE (2 * 1024)
-#define SENSOR_TASK_PRIORITY 5
 
-#define SENSOR_QUEUE_STACK_SIZE QUEUE_STACK_SIZE_DEFAULT
-#define SENSOR_QUEUE_PRIORITY 5
-#define SENSOR_QUEUE_SIZE 1
-
-#define MQTT_MESSAGE_MAX_SIZE 200
+// The sensors are read at their own rates, off the publishing path. The
+// accelerometer uses its data ready interrupt, at the vibration capture
+// rate or this rate, and is only polled if the interrupt isn't available.
+#define ACCEL_SAMPLE_RATE_HZ 1
+#define ACCEL_POLL_MS 1000
+#define ENVIRONMENT_SAMPLE_MS 5000
+#define LIGHT_SAMPLE_MS 1000
 
 /* ----------------------------------------------------------------
  * TASK COMMON VARIABLES
@@ -54,7 +56,17 @@ static taskConfig_t *taskConfig = NULL;
  * -------------------------------------------------------------- */
 static char topicName[MAX_TOPIC_NAME_SIZE];
 
-static char buffer[MQTT_MESSAGE_MAX_SIZE];
+/// @brief the measurement being published, only used with the task mutex held
+static measurement_t measurement;
+
+/// @brief the vibration capture rate and shock threshold, VIBRATION_RATE 0 is off
+static int32_t vibrationRateHz = 0;
+static int32_t shockThreshold = VIBRATION_SHOCK_THRESHOLD_DEFAULT;
+
+/// @brief the periodic jobs which read the sensors without triggers
+static int32_t accelPollJobId = -1;
+static int32_t environmentJobId = -1;
+static int32_t lightJobId = -1;
 
 /// callback commands for incoming MQTT control messages
 static callbackCommand_t callbacks[] = {
@@ -63,6 +75,32 @@ static callbackCommand_t callbacks[] = {
     {"STOP_TASK", stopSensorTaskLoop}
 };
 
+/// @brief deadbands of the sensor values. The config units are 0.01 m/s2
+/// for the accelerometer, 0.1C, 0.1kPa and 1% for the temperature sensor
+/// and 1 lux for the light sensor. The values are in milli m/s2, milli C,
+/// Pa and milli %.
+static deadbandMetric_t accelMetrics[] = {
+    DEADBAND_METRIC("DEADBAND_SENSOR_ACCEL", 50, 0.1f),
+    DEADBAND_METRIC("DEADBAND_SENSOR_ACCEL", 50, 0.1f),
+    DEADBAND_METRIC("DEADBAND_SENSOR_ACCEL", 50, 0.1f)
+};
+
+static deadbandMetric_t tempMetrics[] = {
+    DEADBAND_METRIC("DEADBAND_SENSOR_TEMP", 5, 0.01f),
+    DEADBAND_METRIC("DEADBAND_SENSOR_PRESSURE", 1, 0.01f),
+    DEADBAND_METRIC("DEADBAND_SENSOR_HUMIDITY", 2, 0.001f)
+};
+
+static deadbandMetric_t lightMetrics[] = {
+    DEADBAND_METRIC("DEADBAND_SENSOR_LIGHT", 20, 1)
+};
+
+/// @brief each sensor is only published when it changes, or HEARTBEAT_SENSOR
+/// has passed, once HEARTBEAT_SENSOR is set
+static deadbandReporter_t accelReporter = DEADBAND_REPORTER("HEARTBEAT_SENSOR", accelMetrics);
+static deadbandReporter_t tempReporter = DEADBAND_REPORTER("HEARTBEAT_SENSOR", tempMetrics);
+static deadbandReporter_t lightReporter = DEADBAND_REPORTER("HEARTBEAT_SENSOR", lightMetrics);
+
 /* ----------------------------------------------------------------
  * STATIC FUNCTIONS
  * -------------------------------------------------------------- */
@@ -73,48 +111,146 @@ static bool isNotExiting(void)
     return !gExitApp && !exitTask;
 }
 
-static void publishAccel(void)
+static void publishAccel(bool force)
 {
-    float x,y,z;
-    getAccelerometer(&x, &y, &z);
-    snprintf(buffer, MQTT_MESSAGE_MAX_SIZE, "{\"Accellerometer\": {\"X\":\"%.2f\", \"Y\":\"%.2f\", \"Z\":\"%.2f\"}}", x, y, z);
-    sendMQTTMessage(topicName, buffer, U_MQTT_QOS_AT_MOST_ONCE, false);
-    writeAlways(buffer);
+    sensorReading_t reading;
+    if (!getSensorReading(SENSOR_ACCEL, &reading))
+        return;
+
+    int32_t x = reading.values[0];
+    int32_t y = reading.values[1];
+    int32_t z = reading.values[2];
+
+    float values[] = {x, y, z};
+    if (!force && !isReportDue(&accelReporter, values)) {
+        setReportSuppressed(&accelReporter);
+        return;
+    }
+
+    // the tilt of each axis, from the acceleration of gravity
+    int32_t px, py, pz;
+    getPosition(x, y, z, &px, &py, &pz);
 
-//    float px, py, pz;
-//    getPosition(x, y, z, &px, &py, &pz);
-//    snprintf(buffer, MQTT_MESSAGE_MAX_SIZE, "{\"Position\": {\"X\":\"%.2f\", \"Y\":\"%.2f\", \"Z\":\"%.2f\"}}", px, py, pz);
-//    sendMQTTMessage(topicName, buffer, U_MQTT_QOS_AT_MOST_ONCE, false);
-//    writeLog(buffer);
+    startMeasurement(&measurement, TASK_NAME, topicName, NULL);
+    addMeasurementField(&measurement, "Accellerometer", "X", MILLI_G(x), FIELD_MILLI_TEXT);
+    addMeasurementField(&measurement, "Accellerometer", "Y", MILLI_G(y), FIELD_MILLI_TEXT);
+    addMeasurementField(&measurement, "Accellerometer", "Z", MILLI_G(z), FIELD_MILLI_TEXT);
+    addMeasurementField(&measurement, "Position", "X", px, FIELD_MILLI_TEXT);
+    addMeasurementField(&measurement, "Position", "Y", py, FIELD_MILLI_TEXT);
+    addMeasurementField(&measurement, "Position", "Z", pz, FIELD_MILLI_TEXT);
+    publishMeasurement(&measurement);
+
+    setReported(&accelReporter, values);
 }
 
-static void publishTemp(void)
+static void publishTemp(bool force)
 {
-    float temp, pressure, humidity;
-    getTempSensor(&temp, &pressure, &humidity);
-    snprintf(buffer, MQTT_MESSAGE_MAX_SIZE,
-                "{\"Temperature\": {\"Temperature\":\"%.2f\", \"Pressure\":\"%.2f\", \"Humidity\":\"%.2f\"}}",
-                temp, pressure, humidity);
+    sensorReading_t reading;
+    if (!getSensorReading(SENSOR_ENVIRONMENT, &reading))
+        return;
+
+    int32_t temp = reading.values[0];
+    int32_t pressure = reading.values[1];
+    int32_t humidity = reading.values[2];
+
+    float values[] = {temp, pressure, humidity};
+    if (!force && !isReportDue(&tempReporter, values)) {
+        setReportSuppressed(&tempReporter);
+        return;
+    }
+
+    // the pressure is published in hPa, so Pa * 10 is milli hPa
+    startMeasurement(&measurement, TASK_NAME, topicName, NULL);
+    addMeasurementField(&measurement, "Temperature", "Temperature", temp, FIELD_MILLI_TEXT);
+    addMeasurementField(&measurement, "Temperature", "Pressure", pressure * 10, FIELD_MILLI_TEXT);
+    addMeasurementField(&measurement, "Temperature", "Humidity", humidity, FIELD_MILLI_TEXT);
+    publishMeasurement(&measurement);
 
-    sendMQTTMessage(topicName, buffer, U_MQTT_QOS_AT_MOST_ONCE, false);
-    writeAlways(buffer);
+    setReported(&tempReporter, values);
 }
 
-static void publishLight(void)
+static void publishLight(bool force)
 {
-    int32_t lux = getLightSensor();
-    snprintf(buffer, MQTT_MESSAGE_MAX_SIZE, "{\"Light\": {\"Lux\":\"%d\"}}", lux);
+    sensorReading_t reading;
+    if (!getSensorReading(SENSOR_LIGHT, &reading))
+        return;
 
-    sendMQTTMessage(topicName, buffer, U_MQTT_QOS_AT_MOST_ONCE, false);
-    writeAlways(buffer);
+    int32_t lux = reading.values[0];
+
+    float values[] = {lux};
+    if (!force && !isReportDue(&lightReporter, values)) {
+        setReportSuppressed(&lightReporter);
+        return;
+    }
+
+    startMeasurement(&measurement, TASK_NAME, topicName, NULL);
+    addMeasurementField(&measurement, "Light", "Lux", lux, FIELD_INT_TEXT);
+    publishMeasurement(&measurement);
+
+    setReported(&lightReporter, values);
+}
+
+/// @brief Publishes the vibration features since the last report, eg
+/// {"Vibration":{"Rate":100, "Samples":3000, "Dropped":0, "RMS": {"X":"0.12", ...},
+///  "Peak": {...}, "ZeroCrossings": {"X":210, ...}, "Shocks":1, "MaxShock":"14.20"}}
+/// The accelerations are in m/s2 with gravity removed.
+static void publishVibration(void)
+{
+    static const char *axisNames[] = {"X", "Y", "Z"};
+    vibrationFeatures_t features;
+
+    if (getVibrationFeatures(&features) == 0)
+        return;
+
+    startMeasurement(&measurement, TASK_NAME, topicName, "Vibration");
+    addMeasurementField(&measurement, NULL, "Rate", features.rateHz, FIELD_INT);
+    addMeasurementField(&measurement, NULL, "Samples", features.samples, FIELD_INT);
+    addMeasurementField(&measurement, NULL, "Dropped", features.dropped, FIELD_INT);
+    for(int i=0; i<3; i++)
+        addMeasurementField(&measurement, "RMS", axisNames[i], features.rms[i], FIELD_MILLI_TEXT);
+    for(int i=0; i<3; i++)
+        addMeasurementField(&measurement, "Peak", axisNames[i], features.peak[i], FIELD_MILLI_TEXT);
+    for(int i=0; i<3; i++)
+        addMeasurementField(&measurement, "ZeroCrossings", axisNames[i], features.zeroCrossings[i], FIELD_INT);
+    addMeasurementField(&measurement, NULL, "Shocks", features.shocks, FIELD_INT);
+    addMeasurementField(&measurement, NULL, "MaxShock", features.maxShock, FIELD_MILLI_TEXT);
+    publishMeasurement(&measurement);
+}
+
+/// @brief Publishes a shock as soon as it is detected. It is an event,
+/// so it is published reliably.
+/// @param magnitude The shock magnitude in milli m/s2
+static void publishShock(int32_t magnitude)
+{
+    startMeasurement(&measurement, TASK_NAME, topicName, NULL);
+    measurement.reliable = true;
+    addMeasurementField(&measurement, "Shock", "Magnitude", magnitude, FIELD_MILLI_TEXT);
+    publishMeasurement(&measurement);
+}
+
+/// @brief Queues a detected shock to be published by the task
+static void shockDetected(int32_t magnitude)
+{
+    sensorMsg_t qMsg;
+    qMsg.msgType = PUBLISH_SHOCK;
+    qMsg.msg.shockMagnitude = magnitude;
+
+    sendAppTaskMessage(TASK_ID, &qMsg, sizeof(sensorMsg_t));
 }
 
-static void publishSensors(void)
+/// @brief Publishes the sensor values which have changed, from the latest
+/// readings, so publishing never waits for the sensors
+/// @param force Publish all the sensor values, even if they haven't changed
+static void publishSensors(bool force)
 {
     U_PORT_MUTEX_LOCK(TASK_MUTEX);
-    publishAccel();
-    publishTemp();
-    publishLight();
+    beginTaskWork(taskConfig);
+    publishAccel(force);
+    publishTemp(force);
+    publishLight(force);
+    if (isVibrationCaptureRunning())
+        publishVibration();
+    endTaskWork(taskConfig);
     U_PORT_MUTEX_UNLOCK(TASK_MUTEX);
 }
 
@@ -125,7 +261,13 @@ static void queueHandler(void *pParam, size_t paramLengthBytes)
 
     switch(qMsg->msgType) {
         case GET_SENSORS_NOW:
-            publishSensors();
+            publishSensors(true);
+            break;
+
+        case PUBLISH_SHOCK:
+            U_PORT_MUTEX_LOCK(TASK_MUTEX);
+            publishShock(qMsg->msg.shockMagnitude);
+            U_PORT_MUTEX_UNLOCK(TASK_MUTEX);
             break;
 
         case SHUTDOWN_SENSOR_TASK:
@@ -138,38 +280,106 @@ static void queueHandler(void *pParam, size_t paramLengthBytes)
     }
 }
 
-// Task loop where the activity is made and the dwell time is taken
-static void taskLoop(void *pParameters)
+// Task job where the activity is made, run every dwell period on the worker pool
+static void taskJob(void *pParam, size_t paramLengthBytes)
 {
-    while(isNotExiting()) {
-        publishSensors();
-        dwellTask(taskConfig, isNotExiting);
-    }
-
-    FINALIZE_TASK;
+    if (isNotExiting())
+        publishSensors(false);
 }
 
 static int32_t initQueue()
 {
-    int32_t eventQueueHandle = uPortEventQueueOpen(&queueHandler,
-                    TASK_NAME,
-                    sizeof(sensorMsg_t),
-                    SENSOR_QUEUE_STACK_SIZE,
-                    SENSOR_QUEUE_PRIORITY,
-                    SENSOR_QUEUE_SIZE);
+    // task messages are handled on the shared worker pool
+    TASK_MSG_HANDLER = queueHandler;
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+static int32_t initMutex()
+{
+    INIT_MUTEX;
+}
+
+// Sensor sampling jobs, which store the readings for publishSensors()
+static void accelPollJob(void *pParam, size_t paramLengthBytes)
+{
+    int32_t x, y, z;
+    getAccelerometer(&x, &y, &z);
+}
 
-    if (eventQueueHandle < 0) {
-        writeFatal("Failed to create %s event queue %d", TASK_NAME, eventQueueHandle);
+static void environmentJob(void *pParam, size_t paramLengthBytes)
+{
+    int32_t temp, pressure, humidity;
+    getTempSensor(&temp, &pressure, &humidity);
+}
+
+static void lightJob(void *pParam, size_t paramLengthBytes)
+{
+    getLightSensor();
+}
+
+static void removeJob(int32_t *pJobId)
+{
+    if (*pJobId >= 0) {
+        removePeriodicJob(*pJobId);
+        *pJobId = -1;
     }
+}
 
-    TASK_QUEUE = eventQueueHandle;
+/// @brief Starts reading the accelerometer from its data ready interrupt,
+/// for the vibration capture if VIBRATION_RATE is set. It is polled if
+/// the interrupt can't be used.
+static void startAccelSampling(void)
+{
+    if (vibrationRateHz > 0 && startVibrationCapture(vibrationRateHz, shockThreshold, shockDetected) == 0)
+        return;
+
+    if (startAccelerometerStream(ACCEL_SAMPLE_RATE_HZ, NULL) == 0)
+        return;
 
-    return eventQueueHandle;
+    writeWarn("No accelerometer data ready interrupt, polling it every %d ms", ACCEL_POLL_MS);
+    if (accelPollJobId < 0)
+        accelPollJobId = addPeriodicJob("AccelSample", accelPollJob, ACCEL_POLL_MS);
 }
 
-static int32_t initMutex()
+static void stopAccelSampling(void)
 {
-    INIT_MUTEX;
+    stopVibrationCapture();
+    stopAccelerometerStream();
+    removeJob(&accelPollJobId);
+}
+
+static void startSampling(void)
+{
+    startAccelSampling();
+
+    if (environmentJobId < 0)
+        environmentJobId = addPeriodicJob("EnvSample", environmentJob, ENVIRONMENT_SAMPLE_MS);
+    if (lightJobId < 0)
+        lightJobId = addPeriodicJob("LightSample", lightJob, LIGHT_SAMPLE_MS);
+}
+
+static void stopSampling(void)
+{
+    stopAccelSampling();
+    removeJob(&environmentJobId);
+    removeJob(&lightJobId);
+}
+
+/// @brief Reads the vibration configuration, and restarts the capture
+/// with it if the task is running
+static void applyVibrationConfig(void)
+{
+    vibrationRateHz = 0;
+    shockThreshold = VIBRATION_SHOCK_THRESHOLD_DEFAULT;
+    setIntParamFromConfig("VIBRATION_RATE", &vibrationRateHz);
+    setIntParamFromConfig("VIBRATION_SHOCK_THRESHOLD", &shockThreshold);
+
+    taskState_t state = getTaskState(TASK_ID);
+    if (state == TASK_STATE_RUNNING || state == TASK_STATE_BUSY) {
+        stopAccelSampling();
+        startAccelSampling();
+    }
 }
 
 /* ----------------------------------------------------------------
@@ -203,6 +413,15 @@ int32_t initSensorTask(taskConfig_t *config)
     writeLog("Initializing the %s task...", TASK_NAME);
     EXIT_ON_FAILURE(initMutex);
     EXIT_ON_FAILURE(initQueue);
+    EXIT_ON_FAILURE(initVibration);
+
+    registerDeadbandReporter(&accelReporter);
+    registerDeadbandReporter(&tempReporter);
+    registerDeadbandReporter(&lightReporter);
+
+    setIntParamFromConfig("VIBRATION_RATE", &vibrationRateHz);
+    setIntParamFromConfig("VIBRATION_SHOCK_THRESHOLD", &shockThreshold);
+    registerConfigChangedCallback("VIBRATION_", applyVibrationConfig);
 
     char tp[MAX_TOPIC_NAME_SIZE];
     snprintf(tp, MAX_TOPIC_NAME_SIZE, "%sControl", TASK_NAME);
@@ -221,10 +440,13 @@ int32_t startSensorTaskLoop(commandParamsList_t *params)
         taskConfig->taskLoopDwellTime = getParamValue(params, 1, 5, 60, 30);
 
     sensorsInit();
-    START_TASK_LOOP(SENSOR_TASK_STACK_SIZE, SENSOR_TASK_PRIORITY);
+    startSampling();
+    START_TASK_JOB(taskJob);
 }
 
 int32_t stopSensorTaskLoop(commandParamsList_t *params)
 {
+    stopSampling();
+
     STOP_TASK;
 }
\ No newline at end of file
@@ -40,6 +40,7 @@ int32_t queueGetSensors(commandParamsList_t *params);
  * -------------------------------------------------------------- */
 typedef enum {
     GET_SENSORS_NOW,            // Get the sensor values now
+    PUBLISH_SHOCK,              // Publish a shock from the vibration capture
     SHUTDOWN_SENSOR_TASK,       // shuts down the 'task' by ending the mutex, queue and task.
 } sensorMsgType_t;
 
@@ -49,6 +50,7 @@ typedef struct {
 
     union {
         const char *topicName;      // topic name to publish to
+        int32_t shockMagnitude;     // PUBLISH_SHOCK: milli m/s2
     } msg;
 } sensorMsg_t;
 
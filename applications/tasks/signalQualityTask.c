@@ -24,18 +24,43 @@
 #include "taskControl.h"
 #include "signalQualityTask.h"
 #include "mqttTask.h"
+#include "radioCache.h"
+#include "sampleStats.h"
+#include "deadband.h"
 
 /* ----------------------------------------------------------------
  * DEFINES
  * -------------------------------------------------------------- */
-#define SIGNAL_QUALITY_TASK_STACK_SIZE 1024
-#define SIGNAL_QUALITY_TASK_PRIORITY 5
+#define JSON_STRING_LENGTH 640
 
-#define SIGNAL_QUALITY_QUEUE_STACK_SIZE QUEUE_STACK_SIZE_DEFAULT
-#define SIGNAL_QUALITY_QUEUE_PRIORITY 5
-#define SIGNAL_QUALITY_QUEUE_SIZE 5
+// A measurement requested within this time of the last one reuses the
+// cached radio parameters rather than reading them from the module again
+#define SIGNAL_QUALITY_MAX_AGE_MS 500
 
-#define JSON_STRING_LENGTH 300
+// Raw samples kept for the SEND_SAMPLES command
+#define SIGNAL_SAMPLE_BUFFER_SIZE 32
+#define SIGNAL_SAMPLES_PER_MESSAGE 8
+
+// Seconds between the statistics reports, 0 publishes every measurement
+#define SIGNAL_REPORT_INTERVAL_CONFIG "SIGNAL_REPORT_INTERVAL"
+#define SIGNAL_REPORT_INTERVAL_DEFAULT 60
+
+// Lowest value of each statistics histogram, which covers SAMPLE_STATS_BINS units
+#define RSRP_HISTOGRAM_MIN -140
+#define RSRQ_HISTOGRAM_MIN -40
+#define RSSI_HISTOGRAM_MIN -120
+#define SNR_HISTOGRAM_MIN -20
+
+/* ----------------------------------------------------------------
+ * TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+typedef struct {
+    int64_t timestamp;
+    int16_t rsrp;
+    int16_t rsrq;
+    int16_t rssi;
+    int16_t snr;
+} signalSample_t;
 
 /* ----------------------------------------------------------------
  * PUBLIC VARIABLES
@@ -44,9 +69,6 @@
 // This flag represents the module can hear the network signaling
 bool gIsNetworkSignalValid = false;
 
-extern char pOperatorName[OPERATOR_NAME_SIZE];
-extern int32_t operatorMcc, operatorMnc;
-
 /* ----------------------------------------------------------------
  * TASK COMMON VARIABLES
  * -------------------------------------------------------------- */
@@ -61,6 +83,8 @@ static char topicName[MAX_TOPIC_NAME_SIZE];
 /// callback commands for incoming MQTT control messages
 static callbackCommand_t callbacks[] = {
     {"MEASURE_NOW", queueMeasureNow},
+    {"SEND_STATS", queueSendSignalStats},
+    {"SEND_SAMPLES", queueSendSignalSamples},
     {"START_TASK", startSignalQualityTaskLoop},
     {"STOP_TASK", stopSignalQualityTaskLoop}
 };
@@ -68,6 +92,31 @@ static callbackCommand_t callbacks[] = {
 /// @brief buffer for the cell signal quality MQTT JSON message
 static char jsonBuffer[JSON_STRING_LENGTH];
 
+/// @brief ring buffer of the latest raw samples
+static signalSample_t samples[SIGNAL_SAMPLE_BUFFER_SIZE];
+static int32_t sampleHead = 0;
+static int32_t sampleCount = 0;
+
+/// @brief statistics of the samples since the last report
+static sampleStats_t rsrpStats;
+static sampleStats_t rsrqStats;
+static sampleStats_t rssiStats;
+static sampleStats_t snrStats;
+static int64_t statsStartMs = 0;
+
+static int32_t reportInterval = SIGNAL_REPORT_INTERVAL_DEFAULT;
+
+/// @brief deadbands of the reported values, in the order RSRP, RSRQ, RSSI, SNR
+static deadbandMetric_t signalMetrics[] = {
+    DEADBAND_METRIC("DEADBAND_SIGNAL_RSRP", 3, 1),
+    DEADBAND_METRIC("DEADBAND_SIGNAL_RSRQ", 2, 1),
+    DEADBAND_METRIC("DEADBAND_SIGNAL_RSSI", 3, 1),
+    DEADBAND_METRIC("DEADBAND_SIGNAL_SNR", 3, 1)
+};
+
+/// @brief skips reports which haven't changed, when HEARTBEAT_SIGNAL is set
+static deadbandReporter_t signalReporter = DEADBAND_REPORTER("HEARTBEAT_SIGNAL", signalMetrics);
+
 /* ----------------------------------------------------------------
  * STATIC FUNCTIONS
  * -------------------------------------------------------------- */
@@ -78,9 +127,170 @@ static bool isNotExiting(void)
     return !gExitApp && !exitTask;
 }
 
-static void measureSignalQuality(void)
+static void resetSignalStats(void)
+{
+    resetSampleStats(&rsrpStats, RSRP_HISTOGRAM_MIN);
+    resetSampleStats(&rsrqStats, RSRQ_HISTOGRAM_MIN);
+    resetSampleStats(&rssiStats, RSSI_HISTOGRAM_MIN);
+    resetSampleStats(&snrStats, SNR_HISTOGRAM_MIN);
+    statsStartMs = uPortGetTickTimeMs();
+}
+
+static void addSignalSample(radioSnapshot_t *radio, int64_t timestamp)
+{
+    signalSample_t *sample = &samples[sampleHead];
+    sample->timestamp = timestamp;
+    sample->rsrp = (int16_t)radio->rsrp;
+    sample->rsrq = (int16_t)radio->rsrq;
+    sample->rssi = (int16_t)radio->rssi;
+    sample->snr = (int16_t)radio->snr;
+
+    sampleHead = (sampleHead + 1) % SIGNAL_SAMPLE_BUFFER_SIZE;
+    if (sampleCount < SIGNAL_SAMPLE_BUFFER_SIZE)
+        sampleCount++;
+
+    addSampleToStats(&rsrpStats, radio->rsrp);
+    addSampleToStats(&rsrqStats, radio->rsrq);
+    addSampleToStats(&rssiStats, radio->rssi);
+    addSampleToStats(&snrStats, radio->snr);
+}
+
+/// @brief Publishes one raw measurement, used when the report interval is zero
+/// @param radio The measurement
+/// @param timestamp The time of the measurement
+/// @param force Publish even if the measurement is within the deadbands
+static void publishSignalSample(radioSnapshot_t *radio, int64_t timestamp, bool force)
+{
+    float values[] = {radio->rsrp, radio->rsrq, radio->rssi, radio->snr};
+    if (!force && !isReportDue(&signalReporter, values)) {
+        setReportSuppressed(&signalReporter);
+        return;
+    }
+
+    char format[] = "{" \
+        "\"Timestamp\":%" PRId64 ","    \
+        "\"CellQuality\":{"             \
+            "\"RSRP\":%d,"              \
+            "\"RSRQ\":%d,"              \
+            "\"RSSI\":%d,"              \
+            "\"SNR\":%d},"              \
+        "\"CellInfo\":{"                \
+            "\"RxQual\":%d,"            \
+            "\"CellID\":\"%d\","        \
+            "\"EARFCN\":\"%d\","        \
+            "\"PLMN\":\"%03d%02d\","    \
+            "\"Operator\":\"%s\"}"      \
+    "}";
+
+    snprintf(jsonBuffer, JSON_STRING_LENGTH, format, timestamp,
+                            radio->rsrp, radio->rsrq, radio->rssi, radio->snr, radio->rxQual,
+                            radio->cellId, radio->earfcn, radio->mcc, radio->mnc, radio->operatorName);
+    sendMQTTMessage(topicName, jsonBuffer, U_MQTT_QOS_AT_MOST_ONCE, false);
+    writeAlways(jsonBuffer);
+
+    setReported(&signalReporter, values);
+}
+
+/// @brief Publishes the statistics of the samples since the last report
+/// and starts the next reporting interval. Called with the task mutex locked.
+/// @param force Publish even if the means are within the deadbands of the
+/// last published means
+static void publishSignalStats(bool force)
+{
+    radioSnapshot_t radio;
+
+    if (rsrpStats.count == 0) {
+        writeDebug("No signal quality samples to report");
+        return;
+    }
+
+    float means[] = {
+        getStatsMeanX10(&rsrpStats) / 10.0f,
+        getStatsMeanX10(&rsrqStats) / 10.0f,
+        getStatsMeanX10(&rssiStats) / 10.0f,
+        getStatsMeanX10(&snrStats) / 10.0f
+    };
+
+    if (!force && !isReportDue(&signalReporter, means)) {
+        setReportSuppressed(&signalReporter);
+        resetSignalStats();
+        return;
+    }
+
+    int64_t timestamp = unixNetworkTime + (uPortGetTickTimeMs() / 1000);
+    int32_t period = (int32_t)((uPortGetTickTimeMs() - statsStartMs) / 1000);
+
+    int32_t len = snprintf(jsonBuffer, JSON_STRING_LENGTH,
+                    "{\"Timestamp\":%" PRId64 ",\"CellQualityStats\":{\"Samples\":%u,\"Period\":%d,",
+                    timestamp, rsrpStats.count, period);
+    len += formatSampleStats(jsonBuffer + len, JSON_STRING_LENGTH - len, "RSRP", &rsrpStats);
+    len += snprintf(jsonBuffer + len, JSON_STRING_LENGTH - len, ",");
+    len += formatSampleStats(jsonBuffer + len, JSON_STRING_LENGTH - len, "RSRQ", &rsrqStats);
+    len += snprintf(jsonBuffer + len, JSON_STRING_LENGTH - len, ",");
+    len += formatSampleStats(jsonBuffer + len, JSON_STRING_LENGTH - len, "RSSI", &rssiStats);
+    len += snprintf(jsonBuffer + len, JSON_STRING_LENGTH - len, ",");
+    len += formatSampleStats(jsonBuffer + len, JSON_STRING_LENGTH - len, "SNR", &snrStats);
+
+    // the cell info is from the latest snapshot, it doesn't need reading again
+    getRadioSnapshot(&radio, RADIO_SNAPSHOT_CACHED_ONLY);
+    snprintf(jsonBuffer + len, JSON_STRING_LENGTH - len,
+                    "},\"CellInfo\":{\"CellID\":\"%d\",\"EARFCN\":\"%d\",\"PLMN\":\"%03d%02d\",\"Operator\":\"%s\"}}",
+                    radio.cellId, radio.earfcn, radio.mcc, radio.mnc, radio.operatorName);
+
+    sendMQTTMessage(topicName, jsonBuffer, U_MQTT_QOS_AT_MOST_ONCE, false);
+    writeAlways(jsonBuffer);
+
+    setReported(&signalReporter, means);
+    resetSignalStats();
+}
+
+/// @brief Publishes the most recent raw samples from the sample buffer,
+/// SIGNAL_SAMPLES_PER_MESSAGE samples in each message, oldest first
+/// @param count The number of samples to publish
+static void publishSignalSamples(int32_t count)
+{
+    U_PORT_MUTEX_LOCK(TASK_MUTEX);
+    beginTaskWork(taskConfig);
+
+    if (count <= 0 || count > sampleCount)
+        count = sampleCount;
+
+    int32_t index = (sampleHead - count + SIGNAL_SAMPLE_BUFFER_SIZE) % SIGNAL_SAMPLE_BUFFER_SIZE;
+    while (count > 0) {
+        int32_t len = snprintf(jsonBuffer, JSON_STRING_LENGTH, "{\"CellQualitySamples\":[");
+
+        for(int i=0; i<SIGNAL_SAMPLES_PER_MESSAGE && count > 0; i++, count--) {
+            signalSample_t *sample = &samples[index];
+            len += snprintf(jsonBuffer + len, JSON_STRING_LENGTH - len, "%s[%" PRId64 ",%d,%d,%d,%d]",
+                            i == 0 ? "" : ",",
+                            sample->timestamp, sample->rsrp, sample->rsrq, sample->rssi, sample->snr);
+            index = (index + 1) % SIGNAL_SAMPLE_BUFFER_SIZE;
+        }
+
+        snprintf(jsonBuffer + len, JSON_STRING_LENGTH - len, "]}");
+        sendMQTTMessage(topicName, jsonBuffer, U_MQTT_QOS_AT_MOST_ONCE, false);
+        writeAlways(jsonBuffer);
+    }
+
+    endTaskWork(taskConfig);
+    U_PORT_MUTEX_UNLOCK(TASK_MUTEX);
+}
+
+static void sendSignalStatsNow(void)
+{
+    U_PORT_MUTEX_LOCK(TASK_MUTEX);
+    beginTaskWork(taskConfig);
+    publishSignalStats(true);
+    endTaskWork(taskConfig);
+    U_PORT_MUTEX_UNLOCK(TASK_MUTEX);
+}
+
+/// @brief Measures the signal quality and publishes it, or adds it to the statistics
+/// @param force Publish a raw measurement even if it is within the deadbands
+static void measureSignalQuality(bool force)
 {
     int32_t errorCode;
+    radioSnapshot_t radio;
 
     if (!gIsNetworkUp) {
         printDebug("measureSignalQuality(): Network is not attached.");
@@ -88,67 +298,77 @@ static void measureSignalQuality(void)
     }
 
     U_PORT_MUTEX_LOCK(TASK_MUTEX);
+    beginTaskWork(taskConfig);
 
     printDebug("Fetching signal quality measurements...");
     gAppStatus = START_SIGNAL_QUALITY;
 
-    char timestamp[TIMESTAMP_MAX_LENTH_BYTES];
-    getTimeStamp(timestamp);
-    errorCode = uCellInfoRefreshRadioParameters(gDeviceHandle);
+    errorCode = getRadioSnapshot(&radio, SIGNAL_QUALITY_MAX_AGE_MS);
 
     if (errorCode == 0) {
-        int32_t rsrp = uCellInfoGetRsrpDbm(gDeviceHandle);
-        int32_t rsrq = uCellInfoGetRsrqDb(gDeviceHandle);
-        int32_t rssi = uCellInfoGetRssiDbm(gDeviceHandle);
-        int32_t rxqual = uCellInfoGetRxQual(gDeviceHandle);
-        int32_t snr;
-        uCellInfoGetSnrDb(gDeviceHandle, &snr);
-        int32_t cellId = uCellInfoGetCellId(gDeviceHandle);
-        int32_t earfcn = uCellInfoGetEarfcn(gDeviceHandle);
-
-        char format[] = "{" \
-            "\"Timestamp\":%" PRId64 ","    \
-            "\"CellQuality\":{"             \
-                "\"RSRP\":%d,"              \
-                "\"RSRQ\":%d,"              \
-                "\"RSSI\":%d,"              \
-                "\"SNR\":%d},"              \
-            "\"CellInfo\":{"                \
-                "\"RxQual\":%d,"            \
-                "\"CellID\":\"%d\","        \
-                "\"EARFCN\":\"%d\","        \
-                "\"PLMN\":\"%03d%02d\","    \
-                "\"Operator\":\"%s\"}"      \
-        "}";
-
         // Checking if some radio parameters are not zero is a good way
         // to determine if the network is visible and useable.
         // See macro "IS_NETWORK_AVAILABLE"
-        gIsNetworkSignalValid = (rsrp != 0) && (rsrq != 2147483647);
+        bool wasSignalValid = gIsNetworkSignalValid;
+        gIsNetworkSignalValid = (radio.rsrp != 0) && (radio.rsrq != 2147483647);
 
-        snprintf(jsonBuffer, JSON_STRING_LENGTH, format, (unixNetworkTime + (uPortGetTickTimeMs() / 1000)), 
-                                rsrp, rsrq, rssi, snr, rxqual, 
-                                cellId, earfcn, operatorMcc, operatorMnc, pOperatorName);
-        sendMQTTMessage(topicName, jsonBuffer, U_MQTT_QOS_AT_MOST_ONCE, false);
-        writeAlways(jsonBuffer);
+        // let the MQTT task connect as soon as the network is useable
+        if (!wasSignalValid && gIsNetworkSignalValid)
+            wakeTask(MQTT_TASK);
+
+        if (gIsNetworkSignalValid) {
+            int64_t timestamp = unixNetworkTime + (uPortGetTickTimeMs() / 1000);
+            addSignalSample(&radio, timestamp);
+
+            if (reportInterval == 0)
+                publishSignalSample(&radio, timestamp, force);
+            else if (uPortGetTickTimeMs() - statsStartMs >= (int64_t)reportInterval * 1000)
+                publishSignalStats(false);
+        }
     } else {
         if (errorCode == U_CELL_ERROR_NOT_REGISTERED) {
             writeDebug("SignalQualityTask: Not registered");
+        } else if (errorCode == U_ERROR_COMMON_BUSY) {
+            writeDebug("SignalQualityTask: Modem busy, skipping this measurement");
         } else {
             writeWarn("Failed to read Radio Parameters %d", errorCode);
         }
     }
 
+    endTaskWork(taskConfig);
     U_PORT_MUTEX_UNLOCK(TASK_MUTEX);
 }
 
+/// @brief Reads the report interval from the configuration
+static void applyReportInterval(void)
+{
+    int32_t interval = SIGNAL_REPORT_INTERVAL_DEFAULT;
+    setIntParamFromConfig(SIGNAL_REPORT_INTERVAL_CONFIG, &interval);
+
+    if (interval != reportInterval) {
+        reportInterval = interval;
+        if (reportInterval == 0)
+            writeLog("Publishing every signal quality measurement");
+        else
+            writeLog("Publishing the signal quality statistics every %d seconds", reportInterval);
+    }
+}
+
 static void queueHandler(void *pParam, size_t paramLengthBytes)
 {
     signalQualityMsg_t *qMsg = (signalQualityMsg_t *) pParam;
 
     switch(qMsg->msgType) {
         case MEASURE_SIGNAL_QUALTY_NOW:
-            measureSignalQuality();
+            measureSignalQuality(true);
+            break;
+
+        case SEND_SIGNAL_QUALITY_STATS:
+            sendSignalStatsNow();
+            break;
+
+        case SEND_SIGNAL_QUALITY_SAMPLES:
+            publishSignalSamples(qMsg->msg.sampleCount);
             break;
 
         case SHUTDOWN_SIGNAL_QAULITY_TASK:
@@ -161,34 +381,20 @@ static void queueHandler(void *pParam, size_t paramLengthBytes)
     }
 }
 
-// Signal Quality task loop for reading the RSRP and RSRQ values
-// and sending these values to the MQTT topic
-static void taskLoop(void *pParameters)
+// Signal Quality task job, run every dwell period on the worker pool, for
+// reading the RSRP and RSRQ values and sending these values to the MQTT topic
+static void taskJob(void *pParam, size_t paramLengthBytes)
 {
-    while(isNotExiting()) {
-        measureSignalQuality();
-        dwellTask(taskConfig, isNotExiting);
-    }
-
-    FINALIZE_TASK;
+    if (isNotExiting())
+        measureSignalQuality(false);
 }
 
 static int32_t initQueue()
 {
-    int32_t eventQueueHandle = uPortEventQueueOpen(&queueHandler,
-                    TASK_NAME,
-                    sizeof(signalQualityMsg_t),
-                    SIGNAL_QUALITY_QUEUE_STACK_SIZE,
-                    SIGNAL_QUALITY_QUEUE_PRIORITY,
-                    SIGNAL_QUALITY_QUEUE_SIZE);
-
-    if (eventQueueHandle < 0) {
-        writeFatal("Failed to create %s event queue %d", TASK_NAME, eventQueueHandle);
-    }
+    // task messages are handled on the shared worker pool
+    TASK_MSG_HANDLER = queueHandler;
 
-    TASK_QUEUE = eventQueueHandle;
-
-    return eventQueueHandle;
+    return U_ERROR_COMMON_SUCCESS;
 }
 
 static int32_t initMutex()
@@ -210,6 +416,32 @@ int32_t queueMeasureNow(commandParamsList_t *params)
     return sendAppTaskMessage(TASK_ID, &qMsg, sizeof(signalQualityMsg_t));
 }
 
+/// @brief Queue publishing the signal quality statistics now, which also
+/// starts the next reporting interval
+/// @param params The parameters for this command
+/// @return returns the errorCode of sending the message on the eventQueue
+int32_t queueSendSignalStats(commandParamsList_t *params)
+{
+    signalQualityMsg_t qMsg;
+    qMsg.msgType = SEND_SIGNAL_QUALITY_STATS;
+
+    return sendAppTaskMessage(TASK_ID, &qMsg, sizeof(signalQualityMsg_t));
+}
+
+/// @brief Queue publishing the latest raw signal quality samples
+/// @param params [number of samples], default is all the buffered samples
+/// @return returns the errorCode of sending the message on the eventQueue
+int32_t queueSendSignalSamples(commandParamsList_t *params)
+{
+    signalQualityMsg_t qMsg;
+    qMsg.msgType = SEND_SIGNAL_QUALITY_SAMPLES;
+    qMsg.msg.sampleCount = SIGNAL_SAMPLE_BUFFER_SIZE;
+    if (params != NULL)
+        qMsg.msg.sampleCount = getParamValue(params, 1, 1, SIGNAL_SAMPLE_BUFFER_SIZE, SIGNAL_SAMPLE_BUFFER_SIZE);
+
+    return sendAppTaskMessage(TASK_ID, &qMsg, sizeof(signalQualityMsg_t));
+}
+
 /// @brief Initialises the Signal Quality task
 /// @param config The task configuration structure
 /// @return zero if successful, a negative number otherwise
@@ -227,6 +459,11 @@ int32_t initSignalQualityTask(taskConfig_t *config)
     EXIT_ON_FAILURE(initMutex);
     EXIT_ON_FAILURE(initQueue);
 
+    resetSignalStats();
+    applyReportInterval();
+    registerConfigChangedCallback(SIGNAL_REPORT_INTERVAL_CONFIG, applyReportInterval);
+    registerDeadbandReporter(&signalReporter);
+
     char tp[MAX_TOPIC_NAME_SIZE];
     snprintf(tp, MAX_TOPIC_NAME_SIZE, "%sControl", TASK_NAME);
     subscribeToTopicAsync(tp, U_MQTT_QOS_AT_MOST_ONCE, callbacks, NUM_ELEMENTS(callbacks));
@@ -241,9 +478,9 @@ int32_t startSignalQualityTaskLoop(commandParamsList_t *params)
     EXIT_IF_CANT_RUN_TASK;
 
     if (params != NULL)
-        taskConfig->taskLoopDwellTime = getParamValue(params, 1, 5, 60, 30);
+        taskConfig->taskLoopDwellTime = getParamValue(params, 1, TASK_DWELL_MIN_SECS, TASK_DWELL_MAX_SECS, 30);
 
-    START_TASK_LOOP(SIGNAL_QUALITY_TASK_STACK_SIZE, SIGNAL_QUALITY_TASK_PRIORITY);
+    START_TASK_JOB(taskJob);
 }
 
 int32_t stopSignalQualityTaskLoop(commandParamsList_t *params)
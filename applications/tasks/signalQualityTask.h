@@ -34,6 +34,8 @@ int32_t stopSignalQualityTaskLoop(commandParamsList_t *params);
  * PUBLIC TASK FUNCTIONS
  * -------------------------------------------------------------- */
 int32_t queueMeasureNow(commandParamsList_t *cmd);
+int32_t queueSendSignalStats(commandParamsList_t *params);
+int32_t queueSendSignalSamples(commandParamsList_t *params);
 
 /* ----------------------------------------------------------------
  * QUEUE MESSAGE TYPE DEFINITIONS
@@ -41,6 +43,8 @@ int32_t queueMeasureNow(commandParamsList_t *cmd);
 typedef enum {
     MEASURE_SIGNAL_QUALTY_NOW,      // performs a signal quality measurement now
     SHUTDOWN_SIGNAL_QAULITY_TASK,   // shuts down the 'task' by ending the mutex, queue and task.
+    SEND_SIGNAL_QUALITY_STATS,      // publishes the statistics since the last report now
+    SEND_SIGNAL_QUALITY_SAMPLES,    // publishes the latest raw samples
 } signalQualityMsgType_t;
 
 // Some message types are just a command, so they wont need a param/struct
@@ -49,6 +53,7 @@ typedef struct {
 
     union {
         const char *topicName;
+        int32_t sampleCount;
     } msg;
 } signalQualityMsg_t;
 
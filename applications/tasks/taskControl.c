@@ -18,6 +18,8 @@
  *  Task control functions - how the application initialises and runs the various tasks
  */
 
+#include <ctype.h>
+
 #include "common.h"
 #include "leds.h"
 #include "taskControl.h"
@@ -29,49 +31,81 @@
 #include "locationTask.h"
 #include "sensorTask.h"
 #include "exampleTask.h"
+#include "taskProfile.h"
+#include "driveTest.h"
+#include "adaptiveReporting.h"
 
 static void setRedLED(void *param);
 
+/* ----------------------------------------------------------------
+ * DEFINES
+ * -------------------------------------------------------------- */
+// Configuration key prefix for the task loop dwell times, e.g. TASK_DWELL_SIGNALQUALITY
+#define TASK_DWELL_CONFIG_PREFIX "TASK_DWELL_"
+#define TASK_DWELL_CONFIG_KEY_SIZE 40
+
+// Time between the "still waiting" logs for a task which is stopping.
+// Each task signals when it has stopped, so this doesn't delay the stop.
+#define TASK_STOP_WAIT_MS 1000
+
+// Time between the checks of the task initialisation state, in case an
+// initialisation finished signal was taken by another waiting thread
+#define TASK_INIT_WAIT_MS 1000
+
 /* ----------------------------------------------------------------
  * Task Runner Definitions for each appTask. These task runners 
  * define the application. Here we specify what tasks are to run, 
- * and what configuration they are to use
+ * and what configuration they are to use.
+ *
+ * The tasks are initialised in parallel on the worker pool. A task
+ * is only initialised after the tasks in its dependencies are.
+ * The tasks which subscribe to their control topic depend on MQTT.
  * -------------------------------------------------------------- */
 
 taskRunner_t taskRunners[] = {
     // Registration - Looks after the cellular registration process
-    {initNetworkRegistrationTask, startNetworkRegistrationTaskLoop, stopNetworkRegistrationTaskLoop, true,
+    {initNetworkRegistrationTask, startNetworkRegistrationTaskLoop, stopNetworkRegistrationTaskLoop, true, NO_TASK_DEPENDENCIES,
             {NETWORK_REG_TASK, "Registration", 30, false, BLANK_TASK_HANDLES, setRedLED}},
 
     // CellScan - Performs the +COPS=? Query for seeing what cells are available and publishes the results
-    {initCellScanTask, startCellScanTaskLoop, stopCellScanTask, false,
+    {initCellScanTask, startCellScanTaskLoop, stopCellScanTask, false, TASK_DEPENDENCY(MQTT_TASK),
             {CELL_SCAN_TASK, "CellScan", -1, false, BLANK_TASK_HANDLES, NULL}},
 
     // MQTT - Handles the MQTT broker connection, publishing messages and handling downlink messages
-    {initMQTTTask, startMQTTTaskLoop, stopMQTTTaskLoop, false,
+    {initMQTTTask, startMQTTTaskLoop, stopMQTTTaskLoop, false, NO_TASK_DEPENDENCIES,
             {MQTT_TASK, "MQTT", 30, false, BLANK_TASK_HANDLES, NULL}},
 
     // SignalQuality - Measures the Signal Quality and other network parameters and publishes the results
-    {initSignalQualityTask, startSignalQualityTaskLoop, stopSignalQualityTaskLoop, false,
+    {initSignalQualityTask, startSignalQualityTaskLoop, stopSignalQualityTaskLoop, false, TASK_DEPENDENCY(MQTT_TASK),
             {SIGNAL_QUALITY_TASK, "SignalQuality", 30, false, BLANK_TASK_HANDLES, NULL}},
 
     // LED - Handles the flashing of the LEDS depending on the AppStatus global variable
-    {initLEDTask, startLEDTaskLoop, stopLEDTaskLoop, false,
+    {initLEDTask, startLEDTaskLoop, stopLEDTaskLoop, false, NO_TASK_DEPENDENCIES,
             {LED_TASK, "LED", -1, false, BLANK_TASK_HANDLES, setRedLED}},
 
     // Example - Simple example task that does "nothing"
-    {initExampleTask, startExampleTaskLoop, stopExampleTaskLoop, false,
+    {initExampleTask, startExampleTaskLoop, stopExampleTaskLoop, false, TASK_DEPENDENCY(MQTT_TASK),
             {EXAMPLE_TASK, "Example", 30, false, BLANK_TASK_HANDLES, NULL}},
 
     // Location - Periodically gets the GNSS location of the device and publishes the results
-    {initLocationTask, startLocationTaskLoop, stopLocationTaskLoop, false,
+    {initLocationTask, startLocationTaskLoop, stopLocationTaskLoop, false, TASK_DEPENDENCY(MQTT_TASK),
             {LOCATION_TASK, "Location", 30, false, BLANK_TASK_HANDLES, NULL}},
 
     // Sensor - Measures the sensor parameters and publishes the results
-    {initSensorTask, startSensorTaskLoop, stopSensorTaskLoop, false,
+    {initSensorTask, startSensorTaskLoop, stopSensorTaskLoop, false, TASK_DEPENDENCY(MQTT_TASK),
             {SENSOR_TASK, "Sensor", 30, false, BLANK_TASK_HANDLES, NULL}}
 };
 
+/* ----------------------------------------------------------------
+ * STATIC VARIABLES
+ * -------------------------------------------------------------- */
+// Task initialisation state, as TASK_DEPENDENCY() bits
+static uPortMutexHandle_t taskInitMutex = NULL;
+static uPortSemaphoreHandle_t taskInitSemaphore = NULL;     // given each time a task initialisation finishes
+static uint32_t tasksInitQueued = 0;                        // queued on the worker pool, or finished
+static uint32_t tasksInitDone = 0;                          // finished, successfully or not
+static uint32_t tasksInitFailed = 0;
+
 /* ----------------------------------------------------------------
  * STATIC FUNCTIONS
  * -------------------------------------------------------------- */
@@ -90,7 +124,10 @@ static taskRunner_t *getTaskRunner(taskTypeId_t id)
     return NULL;
 }
 
-static taskConfig_t *getTaskConfig(taskTypeId_t id)
+/// @brief Returns the configuration of a task
+/// @param id The task ID
+/// @return The task configuration, or NULL if the task doesn't exist
+taskConfig_t *getTaskConfig(taskTypeId_t id)
 {
     taskRunner_t *runner = getTaskRunner(id);
     if (runner == NULL) return NULL;
@@ -98,23 +135,115 @@ static taskConfig_t *getTaskConfig(taskTypeId_t id)
     return &(runner->config);
 }
 
+/// @brief Returns the task loop dwell time, as adapted by the adaptive
+/// reporting if it is on
+/// @param taskConfig The task configuration
+/// @return The dwell time in seconds
+int32_t getTaskDwellTime(taskConfig_t *taskConfig)
+{
+    int32_t adapted = (int32_t)atomic_get(&taskConfig->adaptedDwellTime);
+
+    return adapted > 0 ? adapted : taskConfig->taskLoopDwellTime;
+}
+
+/// @brief Sets the adapted dwell time of a task, and the period of its
+/// periodic job if it is running
+/// @param id The task ID
+/// @param seconds The adapted dwell time, 0 to go back to the task's own
+void setAdaptedTaskDwellTime(taskTypeId_t id, int32_t seconds)
+{
+    taskConfig_t *taskConfig = getTaskConfig(id);
+    if (taskConfig == NULL || taskConfig->taskLoopDwellTime < 0)
+        return;
+
+    if ((int32_t)atomic_set(&taskConfig->adaptedDwellTime, seconds) == seconds)
+        return;
+
+    // a task loop picks up the new dwell time on its next dwell
+    if (taskConfig->handles.periodicJob >= 0)
+        setPeriodicJobPeriod(taskConfig->handles.periodicJob, getTaskDwellTime(taskConfig) * 1000);
+}
+
+/// @brief Sets the task loop dwell times from the TASK_DWELL_<NAME> configuration keys
+static void applyTaskDwellTimes(void)
+{
+    char key[TASK_DWELL_CONFIG_KEY_SIZE];
+
+    for(int i=0; i<NUM_ELEMENTS(taskRunners); i++) {
+        taskConfig_t *taskConfig = &taskRunners[i].config;
+
+        // tasks without a dwell time don't have a timed task loop
+        if (taskConfig->taskLoopDwellTime < 0)
+            continue;
+
+        snprintf(key, sizeof(key), "%s%s", TASK_DWELL_CONFIG_PREFIX, taskConfig->name);
+        for(char *c = key; *c != 0; c++)
+            *c = toupper((unsigned char)*c);
+
+        int32_t dwellTime;
+        if (isConfigPresent(key) && setIntParamFromConfig(key, &dwellTime)) {
+            taskConfig->taskLoopDwellTime = dwellTime;
+            writeLog("%s task dwell time set from configuration to %d seconds", taskConfig->name, dwellTime);
+
+            if (taskConfig->handles.periodicJob >= 0)
+                setPeriodicJobPeriod(taskConfig->handles.periodicJob, getTaskDwellTime(taskConfig) * 1000);
+        }
+    }
+}
+
+/// @brief Checks if the task loop, periodic job or some work is still running
+static bool isTaskActive(taskConfig_t *taskConfig)
+{
+    taskState_t state = TASK_STATE;
+
+    return state == TASK_STATE_RUNNING || state == TASK_STATE_BUSY || state == TASK_STATE_STOPPING;
+}
+
+/// @brief Blocks until the task is no longer active. The task gives its
+/// stopped semaphore when it stops, so this wakes straight away.
+/// @param taskConfig The task configuration to wait for
+static void waitForTaskStoppedSignal(taskConfig_t *taskConfig)
+{
+    while(isTaskActive(taskConfig)) {
+        printDebug("...still waiting for %s task to finish", taskConfig->name);
+        if (taskConfig->handles.stoppedSemaphore != NULL)
+            uPortSemaphoreTryTake(taskConfig->handles.stoppedSemaphore, TASK_STOP_WAIT_MS);
+        else
+            uPortTaskBlock(TASK_STOP_WAIT_MS);
+    }
+}
+
 /// @brief Blocking function while waiting for the task to finish
-/// @param taskConfig The task Configuration to wait for
+/// @param id The task to wait for
 static bool waitForTaskToStop(taskTypeId_t id)
 {
-    taskRunner_t *taskRunner = getTaskRunner(id);
-    if (taskRunner == NULL) {
+    taskConfig_t *taskConfig = getTaskConfig(id);
+    if (taskConfig == NULL) {
         writeFatal("Failed to find task %d", id);
         return false;
     }
 
-    while(isMutexLocked(taskRunner->config.handles.mutexHandle)) {
-        writeInfo("Waiting for %s task to stop...", taskRunner->config.name);
-        uPortTaskBlock(2000);
-    }
+    writeInfo("Waiting for %s task to stop...", taskConfig->name);
+    waitForTaskStoppedSignal(taskConfig);
 
     return true;
+}
+
+static void giveTaskStopped(taskConfig_t *taskConfig)
+{
+    if (taskConfig->handles.stoppedSemaphore != NULL)
+        uPortSemaphoreGive(taskConfig->handles.stoppedSemaphore);
+}
 
+/// @brief Stops the app tasks which are running as periodic jobs, as these
+///        don't have a loop which exits when the application is exiting
+static void stopPeriodicTasks(void)
+{
+    for(int i=0; i<NUM_ELEMENTS(taskRunners); i++) {
+        taskRunner_t *taskRunner = &taskRunners[i];
+        if (!taskRunner->explicit_stop && taskRunner->config.handles.periodicJob >= 0)
+            taskRunner->stopFunc(NULL);
+    }
 }
 
 static bool stopTask(taskTypeId_t id)
@@ -134,32 +263,142 @@ static bool stopTask(taskTypeId_t id)
     return true;
 }
 
-/* ----------------------------------------------------------------
- * PUBLIC FUNCTIONS
- * -------------------------------------------------------------- */
+static void initTaskJob(void *pParam, size_t paramLengthBytes);
 
-/// @brief Checks the "isTaskRunningxxxx()" functions and returns when the tasks have all stopped.
-void waitForAllTasksToStop()
+static bool isTaskInitPending(taskTypeId_t id)
 {
-    bool stillWaiting;
+    bool pending;
 
-    writeLog("Waiting for app tasks to stop... This can take sometime if waiting for AT commands to timeout...");
-    do
-    {
-        stillWaiting = false;
+    if (taskInitMutex == NULL)
+        return false;
+
+    U_PORT_MUTEX_LOCK(taskInitMutex);
+    pending = (tasksInitDone & TASK_DEPENDENCY(id)) == 0;
+    U_PORT_MUTEX_UNLOCK(taskInitMutex);
+
+    return pending;
+}
 
+/// @brief Queues the initialisation of the tasks which have all their
+/// dependencies initialised. A task which depends on a failed task fails too.
+/// The initialisations run in parallel, so the registries they use (config
+/// changed callbacks, deadband reporters, measurement sinks, subscriptions)
+/// lock, and their locks are created by startupFramework() beforehand.
+static void queueReadyTaskInits(void)
+{
+    bool failed = false;
+    bool changed;
+
+    U_PORT_MUTEX_LOCK(taskInitMutex);
+    do {
+        changed = false;
         for(int i=0; i<NUM_ELEMENTS(taskRunners); i++) {
-            taskRunner_t *taskRunner = &taskRunners[i];
-            if (!taskRunner->explicit_stop && isMutexLocked(taskRunner->config.handles.mutexHandle)) {
-                printDebug("...still waiting for %s task to finish", taskRunner->config.name);
-                stillWaiting = true;
+            taskRunner_t *runner = &taskRunners[i];
+            uint32_t taskBit = TASK_DEPENDENCY(runner->config.id);
+
+            if ((tasksInitQueued & taskBit) != 0)
+                continue;
+
+            if (gExitApp || (runner->dependencies & tasksInitFailed) != 0) {
+                if (!gExitApp)
+                    writeFatal("* Not initialising the %s task as a task it depends on failed", runner->config.name);
+
+                tasksInitQueued |= taskBit;
+                tasksInitDone |= taskBit;
+                tasksInitFailed |= taskBit;
+                changed = true;
+                continue;
+            }
+
+            if ((runner->dependencies & ~tasksInitDone) != 0)
+                continue;
+
+            tasksInitQueued |= taskBit;
+            int32_t errorCode = submitJob(runner->config.name, initTaskJob, &runner->config.id, sizeof(taskTypeId_t));
+            if (errorCode < 0) {
+                writeFatal("* Failed to queue the %s task initialisation (%d)", runner->config.name, errorCode);
+                tasksInitDone |= taskBit;
+                tasksInitFailed |= taskBit;
+                failed = true;
+                changed = true;
             }
         }
+    } while (changed);
+    U_PORT_MUTEX_UNLOCK(taskInitMutex);
+
+    if (failed) {
+        gExitApp = true;
+        wakeAllTasks();
+        uPortSemaphoreGive(taskInitSemaphore);
+    }
+}
 
-        uPortTaskBlock(100);
+/// @brief Worker pool job which initialises one task, then queues
+/// the initialisation of any tasks which were waiting for it
+static void initTaskJob(void *pParam, size_t paramLengthBytes)
+{
+    taskTypeId_t id = *(taskTypeId_t *)pParam;
+    int64_t startTime = uPortGetTickTimeMs();
+
+    int32_t errorCode = initSingleTask(id);
+    if (errorCode == 0)
+        writeLog("%s task initialised in %d ms", getTaskConfig(id)->name, (int32_t)(uPortGetTickTimeMs() - startTime));
+
+    U_PORT_MUTEX_LOCK(taskInitMutex);
+    tasksInitDone |= TASK_DEPENDENCY(id);
+    if (errorCode < 0)
+        tasksInitFailed |= TASK_DEPENDENCY(id);
+    U_PORT_MUTEX_UNLOCK(taskInitMutex);
+
+    if (errorCode < 0) {
+        gExitApp = true;
+        wakeAllTasks();
+    }
+
+    uPortSemaphoreGive(taskInitSemaphore);
+    queueReadyTaskInits();
+}
+
+/// @brief Waits for the task initialisations which are in progress, so
+/// the tasks aren't stopped while they are still being initialised
+static void waitForAllTaskInits(void)
+{
+    bool stillWaiting;
+
+    if (taskInitMutex == NULL)
+        return;
+
+    do {
+        U_PORT_MUTEX_LOCK(taskInitMutex);
+        stillWaiting = (tasksInitQueued & ~tasksInitDone) != 0;
+        U_PORT_MUTEX_UNLOCK(taskInitMutex);
+
+        if (stillWaiting) {
+            printDebug("...still waiting for the task initialisations to finish");
+            uPortSemaphoreTryTake(taskInitSemaphore, TASK_INIT_WAIT_MS);
+        }
     } while (stillWaiting);
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Checks the "isTaskRunningxxxx()" functions and returns when the tasks have all stopped.
+void waitForAllTasksToStop()
+{
+    writeLog("Waiting for app tasks to stop... This can take sometime if waiting for AT commands to timeout...");
+    waitForAllTaskInits();
+    stopPeriodicTasks();
+    stopTaskStats(NULL);
+
+    for(int i=0; i<NUM_ELEMENTS(taskRunners); i++) {
+        if (!taskRunners[i].explicit_stop)
+            waitForTaskStoppedSignal(&taskRunners[i].config);
+    }
 
     writeLog("All tasks have now finished...");
+    logTaskStats();
 }
 
 void stopAndWait(taskTypeId_t id)
@@ -179,7 +418,19 @@ int32_t initSingleTask(taskTypeId_t id)
     taskConfig_t *taskConfig = &taskRunner->config;
 
     if (!taskConfig->initialised) {
-        int32_t errorCode = taskRunner->initFunc(taskConfig);
+        int32_t errorCode = uPortSemaphoreCreate(&taskConfig->handles.wakeSemaphore, 0, 1);
+        if (errorCode < 0) {
+            writeFatal("* Failed to create the %s task wake semaphore (%d)", taskConfig->name, errorCode);
+            return errorCode;
+        }
+
+        errorCode = uPortSemaphoreCreate(&taskConfig->handles.stoppedSemaphore, 0, 1);
+        if (errorCode < 0) {
+            writeFatal("* Failed to create the %s task stopped semaphore (%d)", taskConfig->name, errorCode);
+            return errorCode;
+        }
+
+        errorCode = taskRunner->initFunc(taskConfig);
         if (errorCode < 0) {
             writeFatal("* Failed to initialise the %s task (%d)", taskConfig->name, errorCode);
             return errorCode;
@@ -193,20 +444,73 @@ int32_t initSingleTask(taskTypeId_t id)
     return U_ERROR_COMMON_SUCCESS;
 }
 
+/// @brief Starts initialising the tasks in parallel on the worker pool, in
+/// the order of their dependencies. This doesn't wait for the tasks to be
+/// initialised, runTask() and waitForTaskInit() wait for each task.
+/// @return 0 on success, negative on failure
 int32_t initTasks()
 {
     int32_t errorCode = U_ERROR_COMMON_SUCCESS;
-    taskRunner_t *runner = taskRunners;
 
-    for(int i=0; i<NUM_ELEMENTS(taskRunners); i++) {
-        errorCode = initSingleTask(runner->config.id);
-        if (errorCode < 0)
-            break;
+    if (taskInitSemaphore == NULL) {
+        errorCode = uPortSemaphoreCreate(&taskInitSemaphore, 0, 1);
+        if (errorCode < 0) {
+            writeFatal("* Failed to create the task initialised semaphore (%d)", errorCode);
+            return errorCode;
+        }
+    }
 
-        runner++;
+    if (taskInitMutex == NULL) {
+        errorCode = uPortMutexCreate(&taskInitMutex);
+        if (errorCode < 0) {
+            writeFatal("* Failed to create the task initialisation mutex (%d)", errorCode);
+            return errorCode;
+        }
     }
 
-    return errorCode;
+    errorCode = initTaskProfile();
+    if (errorCode < 0)
+        return errorCode;
+
+    errorCode = initDriveTest();
+    if (errorCode < 0)
+        return errorCode;
+
+    errorCode = initAdaptiveReporting();
+    if (errorCode < 0)
+        return errorCode;
+
+    applyTaskDwellTimes();
+    registerConfigChangedCallback(TASK_DWELL_CONFIG_PREFIX, applyTaskDwellTimes);
+
+    // tasks which are already initialised, like the LED task, aren't queued
+    U_PORT_MUTEX_LOCK(taskInitMutex);
+    for(int i=0; i<NUM_ELEMENTS(taskRunners); i++) {
+        if (taskRunners[i].config.initialised) {
+            tasksInitQueued |= TASK_DEPENDENCY(taskRunners[i].config.id);
+            tasksInitDone |= TASK_DEPENDENCY(taskRunners[i].config.id);
+        }
+    }
+    U_PORT_MUTEX_UNLOCK(taskInitMutex);
+
+    queueReadyTaskInits();
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Waits for a task's initialisation to finish
+/// @param id The task ID
+/// @return 0 if the task is initialised, negative if it failed or isn't being initialised
+int32_t waitForTaskInit(taskTypeId_t id)
+{
+    taskConfig_t *taskConfig = getTaskConfig(id);
+    if (taskConfig == NULL)
+        return U_ERROR_COMMON_NOT_FOUND;
+
+    while (!taskConfig->initialised && isTaskInitPending(id))
+        uPortSemaphoreTryTake(taskInitSemaphore, TASK_INIT_WAIT_MS);
+
+    return taskConfig->initialised ? U_ERROR_COMMON_SUCCESS : U_ERROR_COMMON_NOT_INITIALISED;
 }
 
 int32_t runTask(taskTypeId_t id)
@@ -217,10 +521,17 @@ int32_t runTask(taskTypeId_t id)
     if (runner == NULL) {
         printError("Failed to get task runner for task ID #%d, not running task", id);
         gExitApp = true;
+        wakeAllTasks();
         return -1;
     }
 
-    int32_t errorCode = runner->startFunc(NULL);
+    int32_t errorCode = waitForTaskInit(id);
+    if (errorCode < 0) {
+        printError("Task %s is not initialised, not running task", runner->config.name);
+        return errorCode;
+    }
+
+    errorCode = runner->startFunc(NULL);
     if (errorCode < 0) {
         printError("Failed to start task %s, error: %d", runner->config.name, errorCode);
     }
@@ -228,26 +539,169 @@ int32_t runTask(taskTypeId_t id)
     return errorCode;
 }
 
-/// @brief Waits for a period of time and exits if the task is requested to exit/stop
+/// @brief Waits for a period of time and exits if the task is requested to exit/stop.
+/// The task is woken by wakeTask(), so there is no polling while dwelling.
 /// @param taskConfig The task configuration that holds the dwell time
 /// @param exitFunc The function that checks if the task should exit/stop
 void dwellTask(taskConfig_t *taskConfig, bool (*canDoDwell)(void))
 {
-    // Always do a task block to give other tasks a run
-    uPortTaskBlock(100);
+    int32_t dwellTime = getTaskDwellTime(taskConfig);
+    writeDebug("%s dwelling for %d seconds...", taskConfig->name, dwellTime);
 
-    writeDebug("%s dwelling for %d seconds...", taskConfig->name, taskConfig->taskLoopDwellTime);
+    int32_t dwellTimeMs = dwellTime * 1000;
+    int32_t startTime = uPortGetTickTimeMs();
+    int32_t remainingMs = dwellTimeMs;
 
-    // multiply by 10 as the TaskBlock is 100ms
-    int32_t count = taskConfig->taskLoopDwellTime * 10;
-    int i = 0;
-    do {
-        uPortTaskBlock(100);
-        i++;
-    } while (canDoDwell() && i < count);
+    while (canDoDwell() && remainingMs > 0) {
+        waitForTaskEvent(taskConfig, remainingMs);
+        remainingMs = dwellTimeMs - (uPortGetTickTimeMs() - startTime);
+    }
+}
+
+/// @brief Blocks the task until it is woken by wakeTask(), or the timeout
+/// @param taskConfig The task configuration that holds the wake semaphore
+/// @param timeoutMs The maximum time to wait in milliseconds
+void waitForTaskEvent(taskConfig_t *taskConfig, int32_t timeoutMs)
+{
+    if (taskConfig->handles.wakeSemaphore != NULL)
+        uPortSemaphoreTryTake(taskConfig->handles.wakeSemaphore, timeoutMs);
+    else
+        uPortTaskBlock(timeoutMs);
 }
 
-/// @brief Sends a task a message via its event queue
+/// @brief Wakes the task if it is dwelling, so that it checks its state again
+/// @param id The TaskId (based on the taskTypeId_t)
+void wakeTask(taskTypeId_t id)
+{
+    taskConfig_t *taskConfig = getTaskConfig(id);
+    if (taskConfig != NULL && taskConfig->handles.wakeSemaphore != NULL)
+        uPortSemaphoreGive(taskConfig->handles.wakeSemaphore);
+}
+
+/// @brief Wakes all the tasks, used when the application is exiting
+void wakeAllTasks(void)
+{
+    for(int i=0; i<NUM_ELEMENTS(taskRunners); i++) {
+        if (taskRunners[i].config.handles.wakeSemaphore != NULL)
+            uPortSemaphoreGive(taskRunners[i].config.handles.wakeSemaphore);
+    }
+}
+
+/// @brief Sets the task as stopped and signals anyone waiting for it to stop.
+/// Called by FINALIZE_TASK when the task loop has finished.
+/// @param taskConfig The task configuration
+void signalTaskStopped(taskConfig_t *taskConfig)
+{
+    atomic_set(&taskConfig->state, TASK_STATE_STOPPED);
+    giveTaskStopped(taskConfig);
+}
+
+/// @brief Returns the current state of a task
+/// @param id The task ID
+/// @return The task state, TASK_STATE_INIT if the task doesn't exist
+taskState_t getTaskState(taskTypeId_t id)
+{
+    taskConfig_t *taskConfig = getTaskConfig(id);
+    if (taskConfig == NULL)
+        return TASK_STATE_INIT;
+
+    return TASK_STATE;
+}
+
+/// @brief Marks the task as busy handling a message or a periodic job run.
+/// Called with the task mutex locked, so only one piece of work is busy.
+/// @param taskConfig The task configuration
+void beginTaskWork(taskConfig_t *taskConfig)
+{
+    atomic_set(&taskConfig->state, TASK_STATE_BUSY);
+}
+
+/// @brief Marks the task's work as finished. The task goes back to running
+/// if its periodic job is still running, otherwise it is stopped, and a
+/// stop requested while it was busy is completed.
+/// @param taskConfig The task configuration
+void endTaskWork(taskConfig_t *taskConfig)
+{
+    bool jobRunning = taskConfig->handles.periodicJob >= 0;
+
+    if (atomic_cas(&taskConfig->state, TASK_STATE_BUSY, jobRunning ? TASK_STATE_RUNNING : TASK_STATE_STOPPED)) {
+        if (!jobRunning)
+            giveTaskStopped(taskConfig);
+
+        return;
+    }
+
+    if (atomic_cas(&taskConfig->state, TASK_STATE_STOPPING, TASK_STATE_STOPPED))
+        giveTaskStopped(taskConfig);
+}
+
+/// @brief Moves the task to stopping. A task without a loop which isn't busy
+/// is stopped straight away, otherwise FINALIZE_TASK or endTaskWork()
+/// completes the stop.
+/// @param taskConfig The task configuration
+void requestTaskStop(taskConfig_t *taskConfig)
+{
+    bool hasLoop = taskConfig->handles.taskHandle != NULL;
+
+    while(true) {
+        atomic_val_t state = atomic_get(&taskConfig->state);
+
+        if (state == TASK_STATE_BUSY || (state == TASK_STATE_RUNNING && hasLoop)) {
+            if (atomic_cas(&taskConfig->state, state, TASK_STATE_STOPPING))
+                return;
+        } else if (state == TASK_STATE_RUNNING) {
+            if (atomic_cas(&taskConfig->state, state, TASK_STATE_STOPPED)) {
+                giveTaskStopped(taskConfig);
+                return;
+            }
+        } else {
+            return;
+        }
+    }
+}
+
+/// @brief Starts the task 'loop' as a periodic job on the worker pool,
+///        which runs every taskLoopDwellTime seconds
+/// @param taskConfig The task configuration
+/// @param jobFunc The job function which does one iteration of the task
+/// @return 0 on success, negative on failure
+int32_t startTaskJob(taskConfig_t *taskConfig, workerJobFunc_t jobFunc)
+{
+    int32_t dwellTime = getTaskDwellTime(taskConfig);
+    int32_t jobId = addPeriodicJob(taskConfig->name, jobFunc, dwellTime * 1000);
+    if (jobId < 0) {
+        writeError("Failed to start the %s Task (%d).", taskConfig->name, jobId);
+        return jobId;
+    }
+
+    taskConfig->handles.periodicJob = jobId;
+    atomic_cas(&taskConfig->state, TASK_STATE_INIT, TASK_STATE_RUNNING);
+    atomic_cas(&taskConfig->state, TASK_STATE_STOPPED, TASK_STATE_RUNNING);
+    writeLog("Started %s task, running every %d seconds", taskConfig->name, dwellTime);
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Stops the task periodic job, if it is running. This is the
+///        equivalent of FINALIZE_TASK for tasks without a loop thread,
+///        requestTaskStop() then sets the task as stopped.
+/// @param taskConfig The task configuration
+void stopTaskJob(taskConfig_t *taskConfig)
+{
+    if (taskConfig->handles.periodicJob < 0)
+        return;
+
+    removePeriodicJob(taskConfig->handles.periodicJob);
+    taskConfig->handles.periodicJob = -1;
+
+    writeDebug("%s task periodic job has stopped", taskConfig->name);
+    if (taskConfig->taskStoppedCallback != NULL) {
+        writeDebug("Running %s task stopped callback...", taskConfig->name);
+        taskConfig->taskStoppedCallback(NULL);
+    }
+}
+
+/// @brief Sends a task a message via the worker pool, or its own event queue
 /// @param taskId The TaskId (based on the taskTypeId_t)
 /// @param message pointer to the message to send
 /// @param msgSize the size of the message to send
@@ -262,11 +716,20 @@ int32_t sendAppTaskMessage(int32_t taskId, void *pMessage, size_t msgSize)
 
     // if the mutex or queue handle is not valid, don't queue a message
     if (!taskConfig->initialised) {
-        printError("%s queue/task is not initialised, not queueing command", taskConfig->name);
+        if (isTaskInitPending(taskId))
+            printDebug("%s task is still initialising, not queueing command", taskConfig->name);
+        else
+            printError("%s queue/task is not initialised, not queueing command", taskConfig->name);
+
         return U_ERROR_COMMON_NOT_INITIALISED;
     }
 
-    int32_t errorCode = uPortEventQueueSendIrq(taskConfig->handles.eventQueueHandle, pMessage, msgSize);
+    int32_t errorCode;
+    if (taskConfig->handles.messageHandler != NULL)
+        errorCode = submitJob(taskConfig->name, taskConfig->handles.messageHandler, pMessage, msgSize);
+    else
+        errorCode = uPortEventQueueSendIrq(taskConfig->handles.eventQueueHandle, pMessage, msgSize);
+
     if (errorCode < 0) {
         // this is a debug message because this will only error if there is no room on the queue, but that
         // isn't an error, it's just what can happen.
@@ -26,7 +26,11 @@
 /* ----------------------------------------------------------------
  * DEFINITIONS
  * -------------------------------------------------------------- */
-#define BLANK_TASK_HANDLES {NULL, NULL, U_ERROR_COMMON_UNKNOWN}
+#define BLANK_TASK_HANDLES {NULL, NULL, U_ERROR_COMMON_UNKNOWN, NULL, NULL, NULL, -1}
+
+// Task initialisation dependencies, eg TASK_DEPENDENCY(MQTT_TASK) | TASK_DEPENDENCY(NETWORK_REG_TASK)
+#define TASK_DEPENDENCY(id) (1U << (id))
+#define NO_TASK_DEPENDENCIES 0
 
 #define EXIT_ON_FAILURE(x)      result = x(); if (result < 0) return result
 #define CLEANUP_ON_ERROR(x)     if (errorCode == 0)     \
@@ -37,8 +41,12 @@
 #define TASK_MUTEX  taskConfig->handles.mutexHandle
 #define TASK_HANDLE taskConfig->handles.taskHandle
 #define TASK_QUEUE  taskConfig->handles.eventQueueHandle
+#define TASK_WAKE   taskConfig->handles.wakeSemaphore
+#define TASK_MSG_HANDLER taskConfig->handles.messageHandler
+#define TASK_JOB    taskConfig->handles.periodicJob
 #define TASK_NAME   taskConfig->name
 #define TASK_ID     taskConfig->id
+#define TASK_STATE  ((taskState_t)atomic_get(&taskConfig->state))
 
 #define TASK_INITIALISED        ((taskConfig != NULL) && taskConfig->initialised)
 
@@ -49,7 +57,7 @@
                                             TASK_NAME);                                                 \
                                     return U_ERROR_COMMON_NOT_INITIALISED;                              \
                                 }                                                                       \
-                                if (TASK_HANDLE != NULL) {                                              \
+                                if (TASK_HANDLE != NULL || TASK_JOB >= 0) {                             \
                                     writeWarn("%s task is already running, not starting again.",        \
                                             TASK_NAME);                                                 \
                                     return U_ERROR_COMMON_SUCCESS;                                      \
@@ -72,6 +80,9 @@
                                 }                                                                       \
                                 exitTask = true;                                                        \
                                 writeLog("Stop %s task requested...", taskConfig->name);                \
+                                wakeTask(TASK_ID);                                                      \
+                                stopTaskJob(taskConfig);                                                \
+                                requestTaskStop(taskConfig);                                            \
                                 return U_ERROR_COMMON_SUCCESS;
 
 #define INIT_MUTEX              int32_t errorCode = uPortMutexCreate(&TASK_MUTEX);                      \
@@ -81,29 +92,40 @@
                                 }                                                                       \
                                 return errorCode;
 
-#define RUN_FUNC(func, stackSize, priority)                                                             \
-                                uPortTaskHandle_t taskHandle;                                           \
-                                int32_t errorCode = uPortTaskCreate(runTaskAndDelete, TASK_NAME,        \
-                                            stackSize, func, priority, &taskHandle);                    \
+#define RUN_FUNC(func)                                                                                  \
+                                int32_t errorCode = runFunctionJob(TASK_NAME, func);                    \
+                                if (errorCode < 0) {                                                    \
+                                    writeError("Failed to start %s task function: %d",                  \
+                                            TASK_NAME, errorCode); }
+
+#define RUN_LONG_FUNC(func)                                                                             \
+                                int32_t errorCode = runLongFunctionJob(TASK_NAME, func);                \
                                 if (errorCode < 0) {                                                    \
                                     writeError("Failed to start %s task function: %d",                  \
                                             TASK_NAME, errorCode); }
 
 #define START_TASK_LOOP(stackSize, priority)                                                            \
+                                atomic_set(&taskConfig->state, TASK_STATE_RUNNING);                     \
                                 int32_t errorCode = uPortTaskCreate(runTaskAndDelete, TASK_NAME,        \
                                             stackSize, taskLoop, priority, &TASK_HANDLE);               \
                                 if (errorCode != 0) {                                                   \
+                                    atomic_set(&taskConfig->state, TASK_STATE_STOPPED);                 \
                                     writeError("Failed to start the %s Task (%d).",                     \
                                             TASK_NAME, errorCode);                                      \
                                 }                                                                       \
                                 return errorCode;
 
+#define START_TASK_JOB(func)                                                                            \
+                                exitTask = false;                                                       \
+                                return startTaskJob(taskConfig, func);
+
 #define FINALIZE_TASK           writeDebug("%s task loop has stopped", TASK_NAME);                      \
                                 if (taskConfig->taskStoppedCallback != NULL) {                          \
                                         writeDebug("Running %s task stopped callback...", TASK_NAME);   \
                                         taskConfig->taskStoppedCallback(NULL);                          \
                                 }                                                                       \
-                                TASK_HANDLE = NULL;
+                                TASK_HANDLE = NULL;                                                     \
+                                signalTaskStopped(taskConfig);
 
 /* ----------------------------------------------------------------
  * PUBLIC TYPE DEFINITIONS
@@ -113,8 +135,22 @@ typedef struct TaskHandles {
     uPortTaskHandle_t taskHandle;
     uPortMutexHandle_t mutexHandle;
     int32_t eventQueueHandle;
+    uPortSemaphoreHandle_t wakeSemaphore;   // given to wake the task from its dwell
+    uPortSemaphoreHandle_t stoppedSemaphore;// given when the task stops or finishes its work
+    workerJobFunc_t messageHandler;         // task messages are run on the worker pool
+    int32_t periodicJob;                    // worker pool periodic job ID, or -1
 } taskHandles_t;
 
+/// The state of a task, which is changed atomically so it can be
+/// checked from any thread without locking the task
+typedef enum {
+    TASK_STATE_INIT = 0,        // not started yet
+    TASK_STATE_RUNNING,         // task loop or periodic job is running
+    TASK_STATE_BUSY,            // handling a message or a periodic job run
+    TASK_STATE_STOPPING,        // stop requested, the loop or work is finishing
+    TASK_STATE_STOPPED
+} taskState_t;
+
 /// Callback for setting what happens after the task has stopped
 typedef void (*taskStoppedCallback_t)(void *);
 
@@ -125,6 +161,8 @@ typedef struct TaskConfig {
     bool initialised;
     taskHandles_t handles;
     taskStoppedCallback_t taskStoppedCallback;
+    atomic_t state;             // taskState_t
+    atomic_t adaptedDwellTime;  // seconds, set by the adaptive reporting, 0 to use taskLoopDwellTime
 } taskConfig_t;
 
 typedef int32_t (*taskInit_t)(taskConfig_t *taskConfig);
@@ -136,6 +174,7 @@ typedef struct TaskRunner {
     taskStart_t startFunc;
     taskStop_t stopFunc;
     bool explicit_stop;
+    uint32_t dependencies;      // TASK_DEPENDENCY() bits of the tasks which must be initialised first
     taskConfig_t config;
 } taskRunner_t;
 
@@ -145,9 +184,29 @@ typedef struct TaskRunner {
 int32_t initTasks();
 int32_t initSingleTask(taskTypeId_t id);
 
+int32_t waitForTaskInit(taskTypeId_t id);
+
 int32_t runTask(taskTypeId_t id);
+taskConfig_t *getTaskConfig(taskTypeId_t id);
+
+// the dwell time in seconds, adapted by the adaptive reporting
+int32_t getTaskDwellTime(taskConfig_t *taskConfig);
+void setAdaptedTaskDwellTime(taskTypeId_t id, int32_t seconds);
 
 void dwellTask(taskConfig_t *taskConfig, bool (*exitFunc)(void));
+void waitForTaskEvent(taskConfig_t *taskConfig, int32_t timeoutMs);
+
+void wakeTask(taskTypeId_t id);
+void wakeAllTasks(void);
+void signalTaskStopped(taskConfig_t *taskConfig);
+
+taskState_t getTaskState(taskTypeId_t id);
+void beginTaskWork(taskConfig_t *taskConfig);
+void endTaskWork(taskConfig_t *taskConfig);
+void requestTaskStop(taskConfig_t *taskConfig);
+
+int32_t startTaskJob(taskConfig_t *taskConfig, workerJobFunc_t jobFunc);
+void stopTaskJob(taskConfig_t *taskConfig);
 
 void stopAndWait(taskTypeId_t id);
 void waitForAllTasksToStop(void);
@@ -0,0 +1,377 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Per task runtime profiling. For each task this collects the CPU time
+ * used, the latency from a message/job being queued to it being handled
+ * and the free stack of the task's own threads, so the stack sizes can
+ * be set from real data and CPU hogs can be found.
+ *
+ * Needs CONFIG_THREAD_RUNTIME_STATS and CONFIG_THREAD_STACK_INFO.
+ *
+ */
+
+#include "common.h"
+#include "taskControl.h"
+#include "taskProfile.h"
+#include "mqttTask.h"
+#include "adaptiveReporting.h"
+
+/* ----------------------------------------------------------------
+ * DEFINES
+ * -------------------------------------------------------------- */
+#define TASK_STATS_TOPIC "TaskStats"
+#define TASK_STATS_JSON_SIZE 1536
+#define TASK_STATS_ENTRY_SIZE 220
+
+#define TASK_STATS_INTERVAL_DEFAULT 300
+
+/* ----------------------------------------------------------------
+ * TYPE DEFINITIONS
+ * -------------------------------------------------------------- */
+typedef struct {
+    uint32_t jobCount;
+    uint64_t cpuUs;
+    uint64_t busyUs;
+    uint64_t latencyTotalUs;
+    uint32_t latencyMaxUs;
+} taskStats_t;
+
+/// A snapshot of one task's stats, including its own threads
+typedef struct {
+    const char *name;
+    int32_t dwellTime;
+    taskStats_t jobs;
+    uint32_t threadCpuMs;
+    int32_t stackFree;
+    int32_t queueStackFree;
+} taskStatsSnapshot_t;
+
+/* ----------------------------------------------------------------
+ * STATIC VARIABLES
+ * -------------------------------------------------------------- */
+static taskStats_t taskStats[MAX_TASKS];
+static uPortMutexHandle_t statsMutex = NULL;
+
+/// @brief protects the JSON buffer, which the stats job and the TASK_STATS
+/// command both publish from, and the periodic stats job
+static uPortMutexHandle_t publishMutex = NULL;
+static int32_t statsJobId = -1;
+
+static char topicName[MAX_TOPIC_NAME_SIZE];
+static char jsonBuffer[TASK_STATS_JSON_SIZE];
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+static int32_t getTaskIdFromName(const char *name)
+{
+    for(int id=0; id<MAX_TASKS; id++) {
+        taskConfig_t *taskConfig = getTaskConfig(id);
+        if (taskConfig != NULL && (taskConfig->name == name || strcmp(taskConfig->name, name) == 0))
+            return id;
+    }
+
+    return U_ERROR_COMMON_NOT_FOUND;
+}
+
+static uint32_t getThreadCpuMs(uPortTaskHandle_t handle)
+{
+    k_thread_runtime_stats_t stats;
+    if (handle == NULL || k_thread_runtime_stats_get((k_tid_t)handle, &stats) != 0)
+        return 0;
+
+    return (uint32_t)(k_cyc_to_us_floor64(stats.execution_cycles) / 1000);
+}
+
+static bool getSnapshot(taskTypeId_t id, taskStatsSnapshot_t *snapshot)
+{
+    taskConfig_t *taskConfig = getTaskConfig(id);
+    if (taskConfig == NULL || !taskConfig->initialised)
+        return false;
+
+    snapshot->name = taskConfig->name;
+    snapshot->dwellTime = getTaskDwellTime(taskConfig);
+
+    U_PORT_MUTEX_LOCK(statsMutex);
+    snapshot->jobs = taskStats[id];
+    U_PORT_MUTEX_UNLOCK(statsMutex);
+
+    snapshot->threadCpuMs = getThreadCpuMs(TASK_HANDLE);
+    snapshot->stackFree = TASK_HANDLE != NULL ? uPortTaskStackMinFree(TASK_HANDLE) : -1;
+    snapshot->queueStackFree = TASK_QUEUE >= 0 ? uPortEventQueueStackMinFree(TASK_QUEUE) : -1;
+
+    return true;
+}
+
+static uint32_t getCpuMs(taskStatsSnapshot_t *snapshot)
+{
+    return (uint32_t)(snapshot->jobs.cpuUs / 1000) + snapshot->threadCpuMs;
+}
+
+static uint32_t getAverageLatencyUs(taskStatsSnapshot_t *snapshot)
+{
+    if (snapshot->jobs.jobCount == 0)
+        return 0;
+
+    return (uint32_t)(snapshot->jobs.latencyTotalUs / snapshot->jobs.jobCount);
+}
+
+static void statsJob(void *pParam, size_t paramLengthBytes)
+{
+    publishTaskStats(NULL);
+}
+
+/// @brief Starts the periodic stats publish, or changes its interval.
+/// Called with the publish mutex held.
+static int32_t setStatsInterval(int32_t interval)
+{
+    if (statsJobId >= 0)
+        return setPeriodicJobPeriod(statsJobId, interval * 1000);
+
+    statsJobId = addPeriodicJob("TaskStats", statsJob, interval * 1000);
+    if (statsJobId < 0) {
+        writeWarn("Failed to start the periodic task stats (%d)", statsJobId);
+        int32_t errorCode = statsJobId;
+        statsJobId = -1;
+        return errorCode;
+    }
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Stops the periodic stats publish. Called with the publish mutex held.
+static int32_t clearStatsInterval(void)
+{
+    if (statsJobId < 0)
+        return U_ERROR_COMMON_SUCCESS;
+
+    int32_t errorCode = removePeriodicJob(statsJobId);
+    statsJobId = -1;
+
+    return errorCode;
+}
+
+/// @brief Starts, changes or stops the periodic stats publish from the
+/// APP_STATS_INTERVAL configuration
+static void applyStatsIntervalConfig(void)
+{
+    int32_t interval = 0;
+    if (isConfigPresent("APP_STATS_INTERVAL"))
+        setIntParamFromConfig("APP_STATS_INTERVAL", &interval);
+
+    U_PORT_MUTEX_LOCK(publishMutex);
+    if (interval > 0)
+        setStatsInterval(interval);
+    else
+        clearStatsInterval();
+    U_PORT_MUTEX_UNLOCK(publishMutex);
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Starts collecting the task job timings, and starts the periodic
+/// stats publish if APP_STATS_INTERVAL is configured
+/// @return 0 on success, negative on failure
+int32_t initTaskProfile(void)
+{
+    if (statsMutex == NULL) {
+        int32_t errorCode = uPortMutexCreate(&statsMutex);
+        if (errorCode != 0) {
+            writeFatal("Failed to create the task stats mutex (%d)", errorCode);
+            return errorCode;
+        }
+
+        errorCode = uPortMutexCreate(&publishMutex);
+        if (errorCode != 0) {
+            writeFatal("Failed to create the task stats publish mutex (%d)", errorCode);
+            return errorCode;
+        }
+
+        registerConfigChangedCallback("APP_STATS_INTERVAL", applyStatsIntervalConfig);
+    }
+
+    snprintf(topicName, MAX_TOPIC_NAME_SIZE, "%s/%s", (const char *)gSerialNumber, TASK_STATS_TOPIC);
+    setWorkerJobStatsCallback(recordTaskJob);
+
+    applyStatsIntervalConfig();
+
+    return U_ERROR_COMMON_SUCCESS;
+}
+
+/// @brief Records the timings of one job/message handled for a task
+/// @param name The task name
+/// @param latencyUs Time from the job/message being queued to it starting
+/// @param runUs Wall clock time the job took
+/// @param cpuUs CPU time used by the job
+void recordTaskJob(const char *name, uint32_t latencyUs, uint32_t runUs, uint32_t cpuUs)
+{
+    int32_t id = getTaskIdFromName(name);
+    if (id < 0 || statsMutex == NULL)
+        return;
+
+    U_PORT_MUTEX_LOCK(statsMutex);
+    taskStats_t *stats = &taskStats[id];
+    stats->jobCount++;
+    stats->cpuUs += cpuUs;
+    stats->busyUs += runUs;
+    stats->latencyTotalUs += latencyUs;
+    if (latencyUs > stats->latencyMaxUs)
+        stats->latencyMaxUs = latencyUs;
+    U_PORT_MUTEX_UNLOCK(statsMutex);
+}
+
+/// @brief Writes the task stats to the log
+void logTaskStats(void)
+{
+    taskStatsSnapshot_t snapshot;
+    char entry[TASK_STATS_ENTRY_SIZE];
+
+    writeLog("Task stats: name, dwell s, CPU ms, jobs, busy ms, latency avg/max us, stack free, queue stack free");
+    for(int id=0; id<MAX_TASKS; id++) {
+        if (!getSnapshot(id, &snapshot))
+            continue;
+
+        writeLog("Task stats: %s, %d, %u, %u, %u, %u/%u, %d, %d", snapshot.name,
+                    snapshot.dwellTime,
+                    getCpuMs(&snapshot),
+                    snapshot.jobs.jobCount,
+                    (uint32_t)(snapshot.jobs.busyUs / 1000),
+                    getAverageLatencyUs(&snapshot),
+                    snapshot.jobs.latencyMaxUs,
+                    snapshot.stackFree,
+                    snapshot.queueStackFree);
+    }
+
+    writeLog("Task stats: worker pool stack free %d", getWorkerPoolStackMinFree());
+
+    if (formatAdaptiveReportingJson(entry, sizeof(entry)) > 0)
+        writeLog("Task stats: %s", entry);
+}
+
+/// @brief Publishes the task stats and writes them to the log
+/// @param params not used
+/// @return 0 on success, negative on failure
+int32_t publishTaskStats(commandParamsList_t *params)
+{
+    taskStatsSnapshot_t snapshot;
+    char entry[TASK_STATS_ENTRY_SIZE];
+    bool first = true;
+    int32_t errorCode;
+
+    if (publishMutex == NULL)
+        return U_ERROR_COMMON_NOT_INITIALISED;
+
+    logTaskStats();
+
+    U_PORT_MUTEX_LOCK(publishMutex);
+
+    int32_t len = snprintf(jsonBuffer, TASK_STATS_JSON_SIZE,
+                    "{\"Timestamp\":%" PRId64 ",\"WorkerStackFree\":%d,\"Tasks\":[",
+                    (unixNetworkTime + (uPortGetTickTimeMs() / 1000)),
+                    getWorkerPoolStackMinFree());
+
+    for(int id=0; id<MAX_TASKS; id++) {
+        if (!getSnapshot(id, &snapshot))
+            continue;
+
+        int32_t entryLen = snprintf(entry, sizeof(entry),
+                    "%s{\"Name\":\"%s\",\"DwellS\":%d,\"CPUms\":%u,\"Jobs\":%u,\"BusyMs\":%u,"
+                    "\"LatAvgUs\":%u,\"LatMaxUs\":%u,\"StackFree\":%d,\"QueueStackFree\":%d}",
+                    first ? "" : ",",
+                    snapshot.name,
+                    snapshot.dwellTime,
+                    getCpuMs(&snapshot),
+                    snapshot.jobs.jobCount,
+                    (uint32_t)(snapshot.jobs.busyUs / 1000),
+                    getAverageLatencyUs(&snapshot),
+                    snapshot.jobs.latencyMaxUs,
+                    snapshot.stackFree,
+                    snapshot.queueStackFree);
+
+        if (len + entryLen + 3 > TASK_STATS_JSON_SIZE) {
+            writeWarn("Task stats message is full, not all tasks are published");
+            break;
+        }
+
+        strcpy(jsonBuffer + len, entry);
+        len += entryLen;
+        first = false;
+    }
+
+    strcpy(jsonBuffer + len, "]");
+    len++;
+
+    // the adaptive reporting decision, if it fits
+    if (formatAdaptiveReportingJson(entry, sizeof(entry)) > 0 && len + strlen(entry) + 3 <= TASK_STATS_JSON_SIZE) {
+        jsonBuffer[len++] = ',';
+        strcpy(jsonBuffer + len, entry);
+        len += strlen(entry);
+    }
+
+    strcpy(jsonBuffer + len, "}");
+
+    errorCode = sendMQTTMessage(topicName, jsonBuffer, U_MQTT_QOS_AT_MOST_ONCE, false);
+
+    U_PORT_MUTEX_UNLOCK(publishMutex);
+
+    return errorCode;
+}
+
+/// @brief Starts publishing the task stats periodically
+/// @param params [interval seconds]
+/// @return 0 on success, negative on failure
+int32_t startTaskStats(commandParamsList_t *params)
+{
+    int32_t interval = TASK_STATS_INTERVAL_DEFAULT;
+    int32_t errorCode;
+
+    if (params != NULL)
+        interval = getParamValue(params, 1, 10, 3600, TASK_STATS_INTERVAL_DEFAULT);
+
+    if (publishMutex == NULL)
+        return U_ERROR_COMMON_NOT_INITIALISED;
+
+    U_PORT_MUTEX_LOCK(publishMutex);
+    errorCode = setStatsInterval(interval);
+    U_PORT_MUTEX_UNLOCK(publishMutex);
+
+    if (errorCode == 0)
+        writeLog("Publishing task stats every %d seconds", interval);
+
+    return errorCode;
+}
+
+/// @brief Stops publishing the task stats periodically
+/// @param params not used
+/// @return 0 on success, negative on failure
+int32_t stopTaskStats(commandParamsList_t *params)
+{
+    int32_t errorCode;
+
+    if (publishMutex == NULL)
+        return U_ERROR_COMMON_NOT_INITIALISED;
+
+    U_PORT_MUTEX_LOCK(publishMutex);
+    errorCode = clearStatsInterval();
+    U_PORT_MUTEX_UNLOCK(publishMutex);
+
+    return errorCode;
+}
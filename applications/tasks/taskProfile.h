@@ -0,0 +1,60 @@
+/*
+ * Copyright 2022 u-blox
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * Per task runtime profiling header
+ *
+ */
+
+#ifndef _TASK_PROFILE_H_
+#define _TASK_PROFILE_H_
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+/// @brief Starts collecting the task job timings, and starts the periodic
+/// stats publish if APP_STATS_INTERVAL is configured
+/// @return 0 on success, negative on failure
+int32_t initTaskProfile(void);
+
+/// @brief Records the timings of one job/message handled for a task
+/// @param name The task name
+/// @param latencyUs Time from the job/message being queued to it starting
+/// @param runUs Wall clock time the job took
+/// @param cpuUs CPU time used by the job
+void recordTaskJob(const char *name, uint32_t latencyUs, uint32_t runUs, uint32_t cpuUs);
+
+/// @brief Writes the task stats to the log
+void logTaskStats(void);
+
+/// @brief Publishes the task stats and writes them to the log
+/// @param params not used
+/// @return 0 on success, negative on failure
+int32_t publishTaskStats(commandParamsList_t *params);
+
+/// @brief Starts publishing the task stats periodically
+/// @param params [interval seconds]
+/// @return 0 on success, negative on failure
+int32_t startTaskStats(commandParamsList_t *params);
+
+/// @brief Stops publishing the task stats periodically
+/// @param params not used
+/// @return 0 on success, negative on failure
+int32_t stopTaskStats(commandParamsList_t *params);
+
+#endif